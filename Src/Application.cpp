@@ -4,10 +4,15 @@
 #include "Solver.h"
 #include "Threading.h"
 #include "BarnesHutTree.h"
+#include "SnapshotFile.h"
+#include "Scenario.h"
+#include "Profiler.h"
 
+#include <algorithm>
 #include <iostream>
 #include <functional>
 #include <chrono>
+#include <cstdio>
 #include <fstream>
 
 // TODOs:
@@ -19,6 +24,18 @@
 // Collision
 // Video
 
+static constexpr const char* cSnapshotFileName = "snapshot.glxs";
+// Chrome trace written when profiling stops
+static constexpr const char* cProfileFileName = "profile.json";
+static constexpr const char* cTrajectoryFileName = "trajectory.glxt";
+static constexpr int32_t cTrajectoryFrameInterval = 10;
+// Initialized galaxies, Reset with unchanged settings restores them instead of a new setup
+static constexpr const char* cInitialConditionsCacheDir = "Cache";
+// Tracers are drawn as average dust particles
+static const float3 cTracerColor = { 1.0f, 0.95f, 0.8f };
+static constexpr float cTracerSize = 5.75f;
+static constexpr float cTracerMagnitude = 0.0175f;
+
 Application* Application::instance = nullptr;
 
 Application application;
@@ -31,6 +48,8 @@ Application::Application()
 
 Application::~Application()
 {
+    // The solver thread and the tasks of its graph use the pool and the staged snapshots
+    StopSolver();
     ThreadPool::Destroy();
 }
 
@@ -50,17 +69,25 @@ int Application::Run(int argc, char **argv)
     cSecondsPerTimeUnit = static_cast<float>(std::sqrt(cKiloParsec * cKiloParsec * cKiloParsec / (cMassUnit * cG)));
     cMillionYearsPerTimeUnit = cSecondsPerTimeUnit / 3600.0f / 24.0f / 365.0f / 1e+6f;
 
-    deltaTime = 0.00000005f;
+    deltaTime = cDefaultDeltaTime;
     deltaTimeYears = deltaTime * cMillionYearsPerTimeUnit * 1e6f;
 
     saveToFiles = false;
 
-    srand(static_cast<uint32_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+    // A new galaxy on every start, the seed slider brings a galaxy back
+    model.seed = static_cast<uint32_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
 
     width = cWindowWidth;
     height = cWindowHeight;
 
     glutInit(&argc, argv);
+
+    // glutInit removes its own options, what is left is an optional .glx scenario
+    if (argc > 1)
+    {
+        scenarioFile = argv[1];
+    }
+
     glutInitWindowSize(width, height);
     glutInitWindowPosition(300, 150);
 
@@ -100,9 +127,23 @@ int Application::Run(int argc, char **argv)
     ui.ReadonlyFloat("Timestep", &deltaTime, 8);
     ui.ReadonlyFloat("Timestep, yrs", &deltaTimeYears);
     ui.ReadonlyFloat("Simulation time, mln yrs", &simulationTimeMillionYears);
-    ui.ReadonlyInt("Number of time steps", &numSteps);
-    ui.ReadonlyFloat("Build tree time, ms", &timings.buildTreeTimeMsecs, 1);
-    ui.ReadonlyFloat("Solving time, ms", &timings.solvingTimeMsecs, 1);
+    ui.ReadonlyInt("Number of time steps", &simulation.GetStepCount());
+    ui.ReadonlyFloat("Build tree time, ms", &simulation.GetTimings().buildTreeTimeMsecs, 1);
+    ui.ReadonlyFloat("Solving time, ms", &simulation.GetTimings().solvingTimeMsecs, 1);
+    ui.ReadonlyFloat("Halo time, ms", &simulation.GetTimings().externalTimeMsecs, 1);
+    ui.ReadonlyFloat("Live halo time, ms", &simulation.GetTimings().liveHaloTimeMsecs, 1);
+    ui.ReadonlyFloat("Tracers time, ms", &simulation.GetTimings().tracersTimeMsecs, 1);
+    ui.SliderFloat("Opening angle", &uiParameters.treeAccuracy.openingAngle, 0.1f, 1.5f, 0.05f);
+    ui.Text("Softening kernel", SofteningPolicy::cName);
+    ui.SliderFloat("Softening, kpc", &uiParameters.softening, 0.0f, 1.0f, 0.0001f);
+    ui.Checkbox("Count interactions", &uiParameters.countInteractions);
+    ui.ReadonlyFloat("Interactions per particle", &walkInteractions, 1);
+    ui.ReadonlyFloat("Node visits per particle", &walkNodeVisits, 1);
+    ui.Text("Interactions histogram", walkHistogram);
+    ui.ReadonlyFloat("Integration time, ms", &simulation.GetTimings().integrationTimeMsecs, 1);
+    ui.Checkbox("Reorder particles", &uiParameters.reorderParticles);
+    ui.ReadonlyFloat("Reorder time, ms", &simulation.GetTimings().reorderTimeMsecs, 1);
+    ui.Checkbox("Save trajectory", &saveToFiles);
     ui.Group("Rendering");
     ui.ReadonlyFloat("Camera distance, kpc", &orbit.GetDistance());
     ui.Checkbox("Render points", &renderParams.renderPoints, "m");
@@ -134,9 +175,14 @@ int Application::Run(int argc, char **argv)
     ui.SliderFloat("Disk radius", &model.diskRadius, 0.01f, 10000.0f, 0.01f);
     ui.SliderFloat("Bulge radius", &model.bulgeRadius, 0.01f, 10000.0f, 0.01f);
     ui.SliderFloat("Halo radius", &model.haloRadius, 0.01f, 10000.0f, 0.01f);
+    ui.Combo("Halo model", reinterpret_cast<uint32_t*>(&model.haloModel), "Plummer,Hernquist,NFW,Isothermal,Kuzmin");
+    ui.SliderFloat("Halo mass", &model.haloMass, 0.0f, 10000.0f, 1.0f);
+    ui.SliderUint("Halo particles", &model.haloParticlesCount);
+    ui.SliderUint("Tracers", &model.tracerParticlesCount);
     ui.SliderFloat("Disk thickness", &model.diskThickness, 0.0f, 100.0f, 0.01f);
     ui.SliderFloat("Black hole mass", &model.blackHoleMass, 1.0f, 10000.0f, 10.0f);
-    ui.Checkbox("Dark matter", &simulationParams.darkMatter, "d");
+    ui.SliderUint("Seed", &model.seed);
+    ui.Checkbox("Dark matter", &uiParameters.darkMatter, "d");
 
     ui.Button("Apply", [](void*) 
     {
@@ -147,76 +193,421 @@ int Application::Run(int argc, char **argv)
         Application::GetInstance().Reset();
     }, "F5");
 
+    ui.Button("Save snapshot", [](void*) 
+    {
+        Application::GetInstance().SaveSnapshot();
+    }, "F6");
+
+    ui.Button("Load snapshot", [](void*) 
+    {
+        Application::GetInstance().LoadSnapshot();
+    }, "F7");
+
+    ui.Button("Start/stop profiling", [](void*) 
+    {
+        Application::GetInstance().ToggleProfiling();
+    }, "F8");
+
     glutMainLoop();
 
     return 0;
 }
 
 void Application::Reset()
+{
+    StopSolver();
+
+    // The scenario file is read again on every reset so that it can be edited while running
+    Scenario scenario;
+    std::string error;
+    if (!scenarioFile.empty() && LoadScenario(scenarioFile, scenario, error))
+    {
+        deltaTime = scenario.deltaTime;
+        deltaTimeYears = deltaTime * cMillionYearsPerTimeUnit * 1e6f;
+        saveToFiles = scenario.saveFrames;
+    }
+    else
+    {
+        if (!error.empty())
+        {
+            std::cout << error << std::endl;
+        }
+        scenario = MakeScenario(model, deltaTime);
+    }
+
+    simulation.ResetCached(scenario, cInitialConditionsCacheDir);
+    AttachSimulation();
+
+    StartSolver();
+}
+
+void Application::SaveSnapshot()
+{
+    // The universe must not change while it is written
+    StopSolver();
+
+    if (!simulation.SaveSnapshot(cSnapshotFileName, deltaTime))
+    {
+        std::cout << "Can't write " << cSnapshotFileName << std::endl;
+    }
+
+    StartSolver();
+}
+
+void Application::ToggleProfiling()
+{
+    if (!Profiler::IsEnabled())
+    {
+        Profiler::Clear();
+        Profiler::SetEnabled(true);
+        return;
+    }
+
+    // The tracks must not be written while they are read
+    StopSolver();
+    Profiler::SetEnabled(false);
+
+    if (!Profiler::WriteChromeTrace(cProfileFileName))
+    {
+        std::cout << "Can't write " << cProfileFileName << std::endl;
+    }
+
+    StartSolver();
+}
+
+void Application::LoadSnapshot()
+{
+    SnapshotView snapshot;
+    if (!snapshot.Open(cSnapshotFileName))
+    {
+        std::cout << "Can't load " << cSnapshotFileName << ": " << snapshot.GetError() << std::endl;
+        return;
+    }
+
+    StopSolver();
+
+    if (simulation.Restore(snapshot))
+    {
+        deltaTime = snapshot.GetHeader().deltaTime;
+        deltaTimeYears = deltaTime * cMillionYearsPerTimeUnit * 1e6f;
+        AttachSimulation();
+    }
+    else
+    {
+        std::cout << cSnapshotFileName << " has no particle state" << std::endl;
+    }
+
+    StartSolver();
+}
+
+void Application::StopSolver()
 {
     if (started)
     {
         started = false;
         solverThread.join();
+        // The publication of the last step may still be running
+        simulation.GetSolver().Synchronize();
     }
-    started = true;
-
-    universe = std::make_unique<Universe>(GLX_UNIVERSE_SIZE);
-    universe->CreateGalaxy({}, model);
-    totalParticlesCount = static_cast<int32_t>(universe->GetParticlesCount());
-
-    solverBruteforce = std::make_unique<BruteforceSolver>(*universe);
-    solverBarneshut = std::make_unique<BarnesHutSolver>(*universe);
 
-    solver = &*solverBarneshut;
+    // The next universe may have a different number of particles
+    if (trajectory.IsOpen())
+    {
+        trajectory.Close();
+    }
+}
 
-    solver->Inititalize(deltaTime);
-    solver->SolveForces();
+void Application::AttachSimulation()
+{
+    // Solvers are new after Reset and Restore
+    totalParticlesCount = static_cast<int32_t>(simulation.GetUniverse().GetParticlesCount());
+    // A snapshot brings its own parameters
+    uiParameters = simulation.GetParameters();
+
+    // Appearance doesn't change while the solver runs
+    drawnGalaxies.clear();
+    for (const auto& galaxy : simulation.GetUniverse().GetGalaxies())
+    {
+        DrawnGalaxy drawn;
+        drawn.particles.resize(galaxy.GetParticlesCount());
+        for (const auto& particle : galaxy.GetParticles())
+        {
+            drawn.particles[particle.id] = particle;
+        }
+        for (uint32_t i = 0; i < drawn.particles.size(); ++i)
+        {
+            drawn.particlesByType[drawn.particles[i].type].push_back(i);
+        }
+        drawnGalaxies.push_back(std::move(drawn));
+    }
 
-    for (auto& galaxy : universe->GetGalaxies())
+    // The brute force solver has no step graph, the solver thread publishes its steps
+    BarnesHutSolver* solverBarneshut = simulation.GetBarnesHutSolver();
+    if (!solverBarneshut)
     {
-        galaxy.SetRadialVelocitiesFromForce();
+        return;
     }
 
+    TaskGraph& stepGraph = solverBarneshut->GetStepGraph();
+    TaskGraph::TaskId stage = stepGraph.AddTask("StageSnapshot", [this]() 
+    { 
+        StageSnapshot(snapshotStages[TaskGraph::GetTaskStep() & 1]); 
+    });
+    TaskGraph::TaskId publish = stepGraph.AddTask("PublishSnapshot", [this]() 
+    { 
+        PublishSnapshot(snapshotStages[TaskGraph::GetTaskStep() & 1]); 
+    }, TaskGraph::Affinity::Background);
+    stepGraph.AddDependency(stage, solverBarneshut->GetStepTasks().integrate);
+    stepGraph.AddDependency(publish, stage);
+}
+
+void Application::StartSolver()
+{
+    started = true;
+
+    StageSnapshot(snapshotStages[0]);
+    PublishSnapshot(snapshotStages[0]);
+
     solverThread = std::thread([this]() 
     {     
+        Profiler::SetThreadName("Solver");
         while (started)
         {
-            solver->Solve(deltaTime);
-            simulationTime += deltaTime;
-            ++numSteps;
+            simulation.Step(deltaTime);
+            if (!simulation.GetBarnesHutSolver())
+            {
+                StageSnapshot(snapshotStages[0]);
+                PublishSnapshot(snapshotStages[0]);
+            }
+            SaveTrajectoryFrame();
         }
     });
 }
 
-static void DrawBarnesHutTree(const BarnesHutTree& node)
+void Application::SaveTrajectoryFrame()
 {
-	float3 p = node.point;
-	float l = node.length;
+    // Runs on the solver thread
+    if (!saveToFiles)
+    {
+        if (trajectory.IsOpen())
+        {
+            trajectory.Close();
+        }
+        return;
+    }
 
-	glBegin(GL_LINE_STRIP);
-		glColor3f(0.0f, 1.0f, 0.0f);
+    if (!trajectory.IsOpen() && 
+        !trajectory.Open(cTrajectoryFileName, simulation.GetUniverse().GetParticlesCount(), TrajectoryWriter::Options()))
+    {
+        std::cout << "Can't create " << cTrajectoryFileName << std::endl;
+        saveToFiles = false;
+        return;
+    }
+
+    if (simulation.GetStepCount() % cTrajectoryFrameInterval == 0)
+    {
+        trajectory.WriteFrame(simulation.GetUniverse(), simulation.GetStepCount(), simulation.GetTime());
+    }
+}
+
+static void CollectTreeCells(const BarnesHutTree& node, std::vector<TreeCell>& cells)
+{
+    cells.push_back({ node.GetPoint(), node.GetLength() });
+
+    if (!node.IsLeaf())
+    {
+        for (size_t i = 0; i < 8; i++)
+        {
+            CollectTreeCells(node[i], cells);
+        }
+    }
+}
+
+void Application::StageSnapshot(SnapshotStage& stage)
+{
+    // Runs on the solver thread between steps
+    Universe& universe = simulation.GetUniverse();
+
+    stage.positions.resize(universe.GetParticlesCount());
+    stage.slots.resize(universe.GetParticlesCount());
+
+    size_t offset = 0;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        const auto& particles = galaxy.GetParticles();
+        float3* positions = stage.positions.data() + offset;
+        uint32_t* slots = stage.slots.data() + offset;
+        const uint32_t first = static_cast<uint32_t>(offset);
+
+        // The renderer draws the particles in the order of their ids
+        ThreadPool().Dispatch([&](uint32_t i) 
+        { 
+            positions[i] = particles[i].position;
+            slots[i] = first + particles[i].id;
+        }, static_cast<uint32_t>(particles.size()), std::max(static_cast<uint32_t>(particles.size() / ThreadPool::GetThreadCount()), 1u));
+
+        offset += particles.size();
+    }
 
-		glVertex3f(p.m_x, p.m_y, 0.0f);
-		glVertex3f(p.m_x + l, p.m_y, 0.0f);
-		glVertex3f(p.m_x + l, p.m_y + l, 0.0f);
-		glVertex3f(p.m_x, p.m_y + l, 0.0f);
-		glVertex3f(p.m_x, p.m_y, 0.0f);
-	glEnd();
+    stage.tracerPositions.resize(universe.GetTracersCount());
+
+    offset = 0;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        const auto& tracers = galaxy.GetTracers();
+        float3* positions = stage.tracerPositions.data() + offset;
+
+        ThreadPool().Dispatch([&](uint32_t i) 
+        { 
+            positions[i] = tracers[i].position;
+        }, static_cast<uint32_t>(tracers.size()), std::max(static_cast<uint32_t>(tracers.size() / ThreadPool::GetThreadCount()), 1u));
+
+        offset += tracers.size();
+    }
+
+    stage.walkStatistics = simulation.GetSolver().GetWalkStatistics();
+
+    // Only the Barnes-Hut solver has a tree
+    const BarnesHutSolver* solverBarneshut = simulation.GetBarnesHutSolver();
+    stage.treeCells.clear();
+    if (renderParams.renderTree && solverBarneshut)
+    {
+        CollectTreeCells(solverBarneshut->GetBarnesHutTree(), stage.treeCells);
+    }
+}
+
+void Application::PublishSnapshot(SnapshotStage& stage)
+{
+    // Runs in the background while the solver goes on, must not use ThreadPool
+    FrameSnapshot& snapshot = snapshots.GetWriteBuffer();
+
+    snapshot.positions.resize(stage.positions.size());
+    for (size_t i = 0; i < stage.positions.size(); ++i)
+    {
+        snapshot.positions[stage.slots[i]] = stage.positions[i];
+    }
+
+    // The stage is filled again from scratch, the buffers are traded instead of copied
+    snapshot.tracerPositions.swap(stage.tracerPositions);
+    snapshot.treeCells.swap(stage.treeCells);
+    snapshot.walkStatistics = stage.walkStatistics;
+
+    snapshots.Publish();
+}
+
+static void DrawBarnesHutTree(const std::vector<TreeCell>& cells)
+{
+    glColor3f(0.0f, 1.0f, 0.0f);
+
+    for (const auto& cell : cells)
+    {
+        float3 p = cell.point;
+        float l = cell.length;
+
+        glBegin(GL_LINE_STRIP);
+            glVertex3f(p.m_x, p.m_y, 0.0f);
+            glVertex3f(p.m_x + l, p.m_y, 0.0f);
+            glVertex3f(p.m_x + l, p.m_y + l, 0.0f);
+            glVertex3f(p.m_x, p.m_y + l, 0.0f);
+            glVertex3f(p.m_x, p.m_y, 0.0f);
+        glEnd();
+    }
+}
+
+static void Plot(const std::vector<float> x, const std::vector<float> y, float xscale, float yscale)
+{
+    assert(x.size() == y.size());
+
+    float minValue = std::numeric_limits<float>::max();
+    float maxValue = std::numeric_limits<float>::min();
+
+    for (const auto& value : y)
+    {
+        minValue = std::min(value, minValue);
+        maxValue = std::max(value, maxValue);
+    }
+
+    glDisable(GL_BLEND);
+    glDisable(GL_TEXTURE_2D);
+    glBegin(GL_LINE_STRIP);
+    glColor3f(1.0f, 1.0f, 1.0f);
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        float color = (y[i] - minValue) / (maxValue - minValue);
+        color = 0.2f * (1.0f - color) + color;
+        glColor3f(color, color, color);
+        glVertex3f(x[i] * xscale, y[i] * yscale, 0.0f);
+    }
+
+    glEnd();
+}
 
-	if (!node.isLeaf)
+static void PlotPotential(const Halo& halo)
+{
+    const size_t count = 1000;
+    const float step = 2.0f * halo.GetRadius() / (count - 1);
+
+    std::vector<float> r(count), field(count), potential(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        r[i] = i * step;
+        potential[i] = halo.GetPotential(r[i]);
+    }
+    halo.GetAccelerations(r.data(), field.data(), count);
+
+    //Plot(r, rho, 1.0f, 1000.0f);
+    Plot(r, field, 1.0f, 10.0f);
+    Plot(r, potential, 1.0f, 10.0f);
+
+	/*float x = rmin;
+
+	glDisable(GL_BLEND);
+	glDisable(GL_TEXTURE_2D);
+
+	glBegin(GL_LINE_STRIP);
+
+	float scale = 10.0f / potentialMin;
+	for (int i = 0; i < N; i++)
 	{
-		for (int i = 0; i < 4; i++)
-		{
-            DrawBarnesHutTree(*node.children[i]);
-		}
+		float p = potential[i];
+		float ps = scale * p;
+		float dpi = 1.0f / (potentialMax - potentialMin);
+		glColor3f((0.5f*p - potentialMin) * dpi, 1.0f - (p - potentialMin) * dpi, 0.0f);
+		glVertex3f(x + i * h, -ps, 0.0f);
 	}
+	glEnd();*/
+}
+
+void Application::UpdateWalkReadouts(const WalkStatistics& statistics)
+{
+    const double walks = static_cast<double>((std::max)(statistics.walks, uint64_t(1)));
+    walkInteractions = static_cast<float>(statistics.GetInteractions() / walks);
+    walkNodeVisits = static_cast<float>(statistics.nodes / walks);
+
+    // Share of the particles per binary order of magnitude of their interactions
+    size_t length = 0;
+    walkHistogram[0] = '\0';
+    for (uint32_t i = 0; i < WalkStatistics::cHistogramBins && statistics.walks > 0; ++i)
+    {
+        if (statistics.interactionsHistogram[i] == 0 || length >= sizeof(walkHistogram))
+        {
+            continue;
+        }
+        const int written = std::snprintf(walkHistogram + length, sizeof(walkHistogram) - length, "%s%llu+ %.0f%%", 
+            length > 0 ? ", " : "", (1ull << i) - 1, 100.0 * statistics.interactionsHistogram[i] / walks);
+        length += written > 0 ? static_cast<size_t>(written) : 0;
+    }
 }
 
 void Application::OnDraw()
 {
     ++frameCounter;
 
+    const FrameSnapshot& snapshot = snapshots.Acquire();
+    Universe& universe = simulation.GetUniverse();
+
+    UpdateWalkReadouts(snapshot.walkStatistics);
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glLoadIdentity();
@@ -231,21 +622,35 @@ void Application::OnDraw()
     float3 v1 = float3(modelview[0], modelview[4], modelview[8]);
     float3 v2 = float3(modelview[1], modelview[5], modelview[9]);
 
-    if (renderParams.renderPoints)
+    if (snapshot.positions.size() != universe.GetParticlesCount() || snapshot.tracerPositions.size() != universe.GetTracersCount())
+    {
+        // Nothing published for the current universe yet
+    }
+    else if (renderParams.renderPoints)
     {
         glBegin(GL_POINTS);
         //glColor3f(renderParams.brightness, renderParams.brightness, renderParams.brightness);
-        for (auto& galaxy : universe->GetGalaxies())
+        size_t offset = 0;
+        for (const auto& galaxy : drawnGalaxies)
         {
-            for (auto& particle : galaxy.GetParticles())
+            const auto& particles = galaxy.particles;
+            for (size_t i = 0; i < particles.size(); ++i)
             {
+                const Particle& particle = particles[i];
                 if (!particle.active)
                 {
                     continue;
                 }
+                const float3& position = snapshot.positions[offset + i];
                 glColor3f(particle.color.m_x, particle.color.m_y, particle.color.m_z);
-                glVertex3f(particle.position.m_x, particle.position.m_y, particle.position.m_z);
+                glVertex3f(position.m_x, position.m_y, position.m_z);
             }
+            offset += particles.size();
+        }
+        glColor3f(cTracerColor.m_x, cTracerColor.m_y, cTracerColor.m_z);
+        for (const float3& position : snapshot.tracerPositions)
+        {
+            glVertex3f(position.m_x, position.m_y, position.m_z);
         }
         glEnd();
     }
@@ -256,30 +661,36 @@ void Application::OnDraw()
         glDisable(GL_DEPTH_TEST);
         //glDisable(GL_ALPHA_TEST);
 
-        for (auto& galaxy : universe->GetGalaxies())
+        size_t offset = 0;
+        for (const auto& galaxy : drawnGalaxies)
         {
-            for (auto& particlesByImage : galaxy.GetParticlesByImage())
+            const auto& particles = galaxy.particles;
+            const float3* positions = snapshot.positions.data() + offset;
+            offset += particles.size();
+
+            for (auto& particlesByType : galaxy.particlesByType)
             {
-                assert(particlesByImage.first);
-                glBindTexture(GL_TEXTURE_2D, particlesByImage.first->GetTextureId());
+                const Image& image = GetImageLoader().GetImage(particlesByType.first == ParticleType::Dust ? "Dust1" : "Star");
+                glBindTexture(GL_TEXTURE_2D, image.GetTextureId());
 
                 glBegin(GL_QUADS);
 
-                for (const auto* p : particlesByImage.second)
+                for (uint32_t index : particlesByType.second)
                 {
-                    assert(p);
-                    const Particle& particle = *p;
+                    assert(index < particles.size());
+                    const Particle& particle = particles[index];
                     if (!particle.active)
                     {
                         continue;
                     }
 
+                    const float3& position = positions[index];
                     float s = 0.5f * particle.size * renderParams.particlesSizeScale;
 
-                    float3 p1 = particle.position - v1 * s - v2 * s;
-                    float3 p2 = particle.position - v1 * s + v2 * s;
-                    float3 p3 = particle.position + v1 * s + v2 * s;
-                    float3 p4 = particle.position + v1 * s - v2 * s;
+                    float3 p1 = position - v1 * s - v2 * s;
+                    float3 p2 = position - v1 * s + v2 * s;
+                    float3 p3 = position + v1 * s + v2 * s;
+                    float3 p4 = position + v1 * s - v2 * s;
 
                     float magnitude = particle.magnitude * renderParams.brightness;
                     // Квадрат расстояние до частицы от наблюдателя
@@ -308,23 +719,45 @@ void Application::OnDraw()
             }
         }
 
+        // Tracers all look like average dust
+        const Image& dust = GetImageLoader().GetImage("Dust1");
+        glBindTexture(GL_TEXTURE_2D, dust.GetTextureId());
+
+        const float s = 0.5f * cTracerSize * renderParams.particlesSizeScale;
+        const float magnitude = cTracerMagnitude * renderParams.brightness;
+        glColor3f(cTracerColor.m_x * magnitude, cTracerColor.m_y * magnitude, cTracerColor.m_z * magnitude);
+
+        glBegin(GL_QUADS);
+        for (const float3& position : snapshot.tracerPositions)
+        {
+            float3 p1 = position - v1 * s - v2 * s;
+            float3 p2 = position - v1 * s + v2 * s;
+            float3 p3 = position + v1 * s + v2 * s;
+            float3 p4 = position + v1 * s - v2 * s;
+
+            glTexCoord2f(0.0f, 1.0f); glVertex3f(p1.m_x, p1.m_y, p1.m_z);
+            glTexCoord2f(0.0f, 0.0f); glVertex3f(p2.m_x, p2.m_y, p2.m_z);
+            glTexCoord2f(1.0f, 0.0f); glVertex3f(p3.m_x, p3.m_y, p3.m_z);
+            glTexCoord2f(1.0f, 1.0f); glVertex3f(p4.m_x, p4.m_y, p4.m_z);
+        }
+        glEnd();
+
         glDisable(GL_TEXTURE_2D);
         glDisable(GL_BLEND);
     }
 
     if (renderParams.renderTree)
     {   
-        std::lock_guard<std::mutex> lock(solverBarneshut->GetTreeMutex());
-        DrawBarnesHutTree(solverBarneshut->GetBarnesHutTree());
+        DrawBarnesHutTree(snapshot.treeCells);
     }
 
     glPopMatrix();
 
     if (renderParams.plotFunctions)
     {
-        for (auto& galaxy : universe->GetGalaxies())
+        for (auto& galaxy : universe.GetGalaxies())
         {
-            galaxy.GetHalo().PlotPotential();
+            PlotPotential(galaxy.GetHalo());
         }
     }
 
@@ -359,7 +792,10 @@ void Application::OnIdle()
         fpsTimer = 0.0f;
     }
 
-    simulationTimeMillionYears = simulationTime * cMillionYearsPerTimeUnit;
+    simulationTimeMillionYears = simulation.GetTime() * cMillionYearsPerTimeUnit;
+
+    // The UI doesn't tell which values it changed, the solver thread takes them before its next step
+    simulation.RequestParameters(uiParameters);
 
     orbit.Update(time);
 
@@ -487,178 +923,3 @@ void Application::OnKeyboardSpecialFunc(unsigned char key, int x, int y)
 {
     ui.OnSpecialFunc(key, x, y);
 }
-
-void getLexem(char *line, char *lexem, int &i)
-{
-    // Пропуск пробелов
-    char c = line[i];
-    while (c == 32 || c == '\t') c = line[++i];
-
-    if (c == 0)
-    {
-        lexem[0] = 0;
-        return;
-    }
-
-    // Проверяем разделители
-    if (c == '=' || c == ',')
-    {
-        i++;
-        lexem[0] = c;
-        lexem[1] = 0;
-    }
-    else
-    {
-        // Выделение лексемы
-        int j = 0;
-        // Считываем буквы, цифры, прочерки, точки и минусы
-        while ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
-            c == '.' || c == '_' || c == '-')
-        {
-            lexem[j++] = c;
-            c = line[++i];
-        }
-        lexem[j] = 0;
-    }
-}
-
-bool readModelFromGlxFile(char* fname)
-{
-    // Открываем файл
-    //FILE *f = fopen(fname, "r");
-    //if (f == NULL)
-    //    perror("Error opening file");
-
-    //char line[256];
-    //char lexem[64];
-    //Galaxy *galaxy;
-    //int i, j;
-    //char c;
-    //int linecount = 0;
-    //float value;
-
-    //while (feof(f) == 0)
-    //{
-    //    fgets(line, 255, f);
-    //    linecount++;
-
-    //    // Пропускаем коммент и пустые строки
-    //    if (line[0] == '#' || line[0] == 10 || line[0] == 13)
-    //        continue;
-
-    //    if (strncmp(line, "[GALAXY]", 8) == 0)
-    //    {
-    //        if (!universe)
-    //        {
-    //            universe = new Universe(universeSize);
-    //        }
-
-    //        galaxy = new Galaxy();
-    //        universe->CreateGalaxy(galaxy);
-    //    }
-    //    else
-    //    {
-    //        c = 1;
-    //        i = 0;
-    //        while (true)
-    //        {
-    //            // Обработка лексем
-
-    //            char varname[64];
-    //            getLexem(line, varname, i);
-    //            if (varname[0] == 0)
-    //                break;
-
-    //            getLexem(line, lexem, i);
-    //            if (lexem[0] != '=')
-    //            {
-    //                printf("Строка %d: ожидалось '='.", linecount);
-    //                return false;
-    //            }
-
-    //            getLexem(line, lexem, i);
-
-    //            value = atof(lexem);
-
-
-    //            if (strcmp(varname, "DT") == 0)
-    //            {
-    //                DT = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "SAVE_FRAMES") == 0)
-    //            {
-    //                saveToFiles = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "UNIVERSE_SIZE") == 0)
-    //            {
-    //                universeSize = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_BULGE_NUM") == 0)
-    //            {
-    //                galaxy->numBulgeStars = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_DISK_NUM") == 0)
-    //            {
-    //                galaxy->numDiskStars = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_DISK_RADIUS") == 0)
-    //            {
-    //                galaxy->diskRadius = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_BULGE_RADIUS") == 0)
-    //            {
-    //                galaxy->bulgeRadius = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_HALO_RADIUS") == 0)
-    //            {
-    //                galaxy->haloRadius = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_DISK_THICKNESS") == 0)
-    //            {
-    //                galaxy->diskThickness = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_STAR_MASS") == 0)
-    //            {
-    //                galaxy->starMass = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_BULGE_MASS") == 0)
-    //            {
-    //                galaxy->bulgeMass = value;
-    //                break;
-    //            }
-    //            else if (strcmp(varname, "GLX_HALO_MASS") == 0)
-    //            {
-    //                galaxy->haloMass = value;
-    //                break;
-    //            }
-    //            else break;
-
-
-
-    //        }
-
-
-
-
-
-    //    }
-
-
-    //}
-
-
-
-    //fclose(f);
-
-    return true;
-}
\ No newline at end of file
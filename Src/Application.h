@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <memory>
 #include <algorithm>
@@ -10,12 +11,12 @@
 #include "Orbit.h"
 #include "Math.h"
 #include "UIOverlay.h"
+#include "FrameSnapshot.h"
+#include "Simulation.h"
+#include "TripleBuffer.h"
+#include "TrajectoryFile.h"
 
 class ImageLoader;
-class Universe;
-class BruteforceSolver;
-class BarnesHutSolver;
-class Solver;
 
 class Application
 {
@@ -37,31 +38,38 @@ public:
     void OnKeyboardSpecialFunc(unsigned char key, int x, int y); 
 
     ImageLoader& GetImageLoader() { return *imageLoader; }
-    Universe& GetUniverse() { return *universe; }
+    Simulation& GetSimulation() { return simulation; }
     
     uint32_t GetWidth() const { return width; }
     uint32_t GetHeight() const { return height; }
 
     static Application& GetInstance() { assert(instance);  return *instance; }
 
-    struct SimulationParameters
-    {
-        bool darkMatter = false;
-    };
-
-    const SimulationParameters& GetSimulationParamaters() const { return simulationParams; }
+    void Reset();
+    void SaveSnapshot();
+    void LoadSnapshot();
+    void ToggleProfiling();
+    void UpdateWalkReadouts(const WalkStatistics& statistics);
 
-    struct Timings
+private:
+    // Solver state copied after a step for the publication, which may run in the background
+    struct SnapshotStage
     {
-        float buildTreeTimeMsecs = 0.0f;
-        float solvingTimeMsecs = 0.0f;
+        // Positions of the particles in their current order and the indices they are drawn at
+        std::vector<float3> positions;
+        std::vector<uint32_t> slots;
+        std::vector<float3> tracerPositions;
+        std::vector<TreeCell> treeCells;
+        WalkStatistics walkStatistics;
     };
 
-    Timings& GetTimings() { return timings; }
-
-    void Reset();
+    void AttachSimulation();
+    void StopSolver();
+    void StartSolver();
+    void StageSnapshot(SnapshotStage& stage);
+    void PublishSnapshot(SnapshotStage& stage);
+    void SaveTrajectoryFrame();
 
-private:
     uint32_t width = 0;
     uint32_t height = 0;
 
@@ -70,29 +78,49 @@ private:
 
     float deltaTime = 0.0f;
     float deltaTimeYears = 0.0f;
-    float simulationTime = 0.0f;
     float simulationTimeMillionYears = 0.0f;
 
     float lastFps = 0.0f;
-    int32_t numSteps = 0;
     int32_t totalParticlesCount = 0;
 
+    // Tree walk work of the last published step, per particle
+    float walkInteractions = 0.0f;
+    float walkNodeVisits = 0.0f;
+    char walkHistogram[256] = {};
+
     uint32_t frameCounter = 0;
 
     bool started = false;
-    bool saveToFiles = false;
+    // Switched by the UI, read by the solver thread
+    std::atomic<bool> saveToFiles{ false };
 
     UIOverlay ui;
 
     std::unique_ptr<ImageLoader> imageLoader;
-    std::unique_ptr<Universe> universe;
-    std::unique_ptr<BruteforceSolver> solverBruteforce;
-    std::unique_ptr<BarnesHutSolver> solverBarneshut;
 
-    Solver* solver = nullptr;
+    Simulation simulation;
+    // Edited by the UI, handed to the simulation every frame, see Simulation::RequestParameters
+    SimulationParameters uiParameters;
 
     std::thread solverThread;
 
+    // Written by the solver thread while saveToFiles is on
+    TrajectoryWriter trajectory;
+
+    // Handoff of solver state to the renderer
+    TripleBuffer<FrameSnapshot> snapshots;
+    // By step parity, see TaskGraph
+    SnapshotStage snapshotStages[2];
+
+    // Appearance of the particles in the order of their ids, the solver reorders the particles themselves
+    struct DrawnGalaxy
+    {
+        std::vector<Particle> particles;
+        std::unordered_map<ParticleType, std::vector<uint32_t>> particlesByType;
+    };
+
+    std::vector<DrawnGalaxy> drawnGalaxies;
+
     struct InputState
     {
         uint32_t buttons = 0;
@@ -108,7 +136,8 @@ private:
 
     struct RenderParameters
     {
-        bool renderTree = false;
+        // Read by the solver thread as well
+        std::atomic<bool> renderTree{ false };
         bool renderPoints = false;
         bool plotFunctions = false;
         float brightness = 1.0f;
@@ -116,9 +145,9 @@ private:
 
     } renderParams;
 
-    SimulationParameters simulationParams;
     GalaxyParameters model;
-    Timings timings;
+    // Used instead of the model when given on the command line
+    std::string scenarioFile;
 
     static Application* instance;
 };
\ No newline at end of file
@@ -1,16 +1,21 @@
 #include "BarnesHutTree.h"
 
 #include "Galaxy.h"
+#include "GravityKernels.h"
 #include "Math.h"
+#include "Constants.h"
+
+#include <algorithm>
+#include <cassert>
 
 static constexpr uint32_t cMaxTreeLevel = 50;
 
 BarnesHutTree::BarnesHutTree(const float3 &point, float length)
     : point(point),
     length(length),
+    totalMass(0.0f),
     isLeaf(true),
-    particle_(nullptr),
-    totalMass(0.0f)
+    body_(nullptr)
 {
     oppositePoint = point + float3{ length };
 }
@@ -18,12 +23,23 @@ BarnesHutTree::BarnesHutTree(const float3 &point, float length)
 void BarnesHutTree::Reset()
 {
     isLeaf = true;
-    particle_ = nullptr;
+    body_ = nullptr;
+    moreBodies.clear();
+}
+
+void BarnesHutTree::Insert(const Particle &p, float softening)
+{
+    Insert(p.position, p.mass, softening, &p);
+}
+
+void BarnesHutTree::Insert(const float3 &position, float mass, float softening, const void *body, uint32_t level)
+{
+    InsertBody(position, mass, softening, body, accuracy.leafCapacity, level);
 }
 
-void BarnesHutTree::Insert(const Particle &p, uint32_t level)
+void BarnesHutTree::InsertBody(const float3 &position, float mass, float softening, const void *body, uint32_t leafCapacity, uint32_t level)
 {
-    if (!Contains(p))
+    if (!Contains(position))
     {
         return;
     }
@@ -36,10 +52,25 @@ void BarnesHutTree::Insert(const Particle &p, uint32_t level)
     if (isLeaf)
     {
         // Если узел - лист
-        if (!particle_)
+        if (!body_)
         {
             // И пустой, то вставляем в него частицу
-            particle_ = &p;
+            body_ = body;
+            bodyPosition = position;
+            bodyMass = mass;
+            bodySoftening = softening;
+            return;
+        }
+        else if (1 + moreBodies.size() < leafCapacity)
+        {
+            // Лист вмещает еще одну частицу, центр масс ведется со второй
+            if (moreBodies.empty())
+            {
+                totalMass = bodyMass;
+                massCenter = bodyPosition;
+            }
+            AddMass(position, mass);
+            moreBodies.push_back({ body, position, mass, softening });
             return;
         }
         else
@@ -52,126 +83,373 @@ void BarnesHutTree::Insert(const Particle &p, uint32_t level)
                 // Размеры потомков в половину меньше
                 float nl = 0.5f * length;
 
-                float x = point.m_x + nl;
-                float y = point.m_y + nl;
-
-                float3 np1(x, point.m_y, 0.0f);
-                float3 np2(x, y, 0.0f);
-                float3 np3(point.m_x, y, 0.0f);
-
-                children[0] = std::make_unique<BarnesHutTree>(point, nl);
-                children[1] = std::make_unique<BarnesHutTree>(np1, nl);
-                children[2] = std::make_unique<BarnesHutTree>(np2, nl);
-                children[3] = std::make_unique<BarnesHutTree>(np3, nl);
+                for (int i = 0; i < 8; i++)
+                {
+                    float3 np(point.m_x + (i & 1 ? nl : 0.0f), point.m_y + (i & 2 ? nl : 0.0f), point.m_z + (i & 4 ? nl : 0.0f));
+                    children[i] = std::make_unique<BarnesHutTree>(np, nl);
+                }
             }
             else
             {
                 // Иначе сбрасываем их
-                children[0]->Reset();
-                children[1]->Reset();
-                children[2]->Reset();
-                children[3]->Reset();
+                for (int i = 0; i < 8; i++)
+                {
+                    children[i]->Reset();
+                }
             }
 
             // Далее вставляем в нужный потомок частицу которая была в текущем узле
-            for (int i = 0; i < 4; i++)
+            for (int i = 0; i < 8; i++)
             {
-                if (children[i]->Contains(*particle_))
+                if (children[i]->Contains(bodyPosition))
                 {
-                    children[i]->Insert(*particle_, level + 1);
+                    children[i]->InsertBody(bodyPosition, bodyMass, bodySoftening, body_, leafCapacity, level + 1);
                     break;
                 }
             }
+            for (const LeafBody& leafBody : moreBodies)
+            {
+                for (int i = 0; i < 8; i++)
+                {
+                    if (children[i]->Contains(leafBody.position))
+                    {
+                        children[i]->InsertBody(leafBody.position, leafBody.mass, leafBody.softening, leafBody.body, leafCapacity, level + 1);
+                        break;
+                    }
+                }
+            }
 
             // И новую частицу
-            for (int i = 0; i < 4; i++)
+            for (int i = 0; i < 8; i++)
             {
-                if (children[i]->Contains(p))
+                if (children[i]->Contains(position))
                 {
-                    children[i]->Insert(p, level + 1);
+                    children[i]->InsertBody(position, mass, softening, body, leafCapacity, level + 1);
                     break;
                 }
             }
 
-            // Суммарная масса узла
-            totalMass = particle_->mass + p.mass;
+            if (moreBodies.empty())
+            {
+                // Суммарная масса узла
+                totalMass = bodyMass + mass;
 
-            // Центр тяжести
-            massCenter = p.position.scaleR(p.mass);
-            massCenter.addScaled(particle_->position, particle_->mass);
-            massCenter *= 1.0f / totalMass;
+                // Центр тяжести
+                massCenter = position.scaleR(mass);
+                massCenter.addScaled(bodyPosition, bodyMass);
+                massCenter *= 1.0f / totalMass;
+            }
+            else
+            {
+                // Масса частиц листа уже учтена
+                AddMass(position, mass);
+                moreBodies.clear();
+            }
         }
     }
     else
     {
         // Если это внутренний узел
-
-        // Обновляем суммарную массу добавлением к ней массы новой частицы
-        float total = totalMass + p.mass;
-
-        // Также обновляем центр масс
-        massCenter *= totalMass;
-        massCenter.addScaled(p.position, p.mass);
-        massCenter *= 1.0f / total;
-        totalMass = total;
+        AddMass(position, mass);
 
         // Рекурсивно вставляем в нужный потомок частицу
-        for (int i = 0; i < 4; i++)
+        for (int i = 0; i < 8; i++)
         {
-            if (children[i]->Contains(p))
+            if (children[i]->Contains(position))
             {
-                children[i]->Insert(p, level + 1);
+                children[i]->InsertBody(position, mass, softening, body, leafCapacity, level + 1);
                 break;
             }
         }
     }
 }
 
-bool BarnesHutTree::Contains(const Particle &p) const
+void BarnesHutTree::AddMass(const float3 &position, float mass)
 {
-    float3 v = p.position;
-    if (v.m_x >= point.m_x && v.m_x <= oppositePoint.m_x &&
-        v.m_y >= point.m_y && v.m_y <= oppositePoint.m_y)
-        return true;
+    // Обновляем суммарную массу добавлением к ней массы новой частицы
+    float total = totalMass + mass;
 
+    // Также обновляем центр масс
+    massCenter *= totalMass;
+    massCenter.addScaled(position, mass);
+    massCenter *= 1.0f / total;
+    totalMass = total;
+}
+
+bool BarnesHutTree::HoldsBody(const WalkNode &node, const void *body) const
+{
+    for (uint32_t i = node.first; i < node.first + node.count; i++)
+    {
+        if (walkBodies[i].body == body)
+        {
+            return true;
+        }
+    }
     return false;
 }
 
-float3 BarnesHutTree::ComputeAcceleration(const Particle &particle, float softFactor) const
+// Adds the moment of a point mass at offset from the mass center
+static void AddQuadrupole(float quadrupole[6], const float3 &offset, float mass)
 {
-    float3 acceleration = {};
+    const float x = offset.m_x;
+    const float y = offset.m_y;
+    const float z = offset.m_z;
+    const float r2 = x * x + y * y + z * z;
+    quadrupole[0] += mass * (3.0f * x * x - r2);
+    quadrupole[1] += mass * (3.0f * y * y - r2);
+    quadrupole[2] += mass * (3.0f * z * z - r2);
+    quadrupole[3] += mass * 3.0f * x * y;
+    quadrupole[4] += mass * 3.0f * x * z;
+    quadrupole[5] += mass * 3.0f * y * z;
+}
+
+void BarnesHutTree::ComputeMoments()
+{
+    std::fill(quadrupole, quadrupole + 6, 0.0f);
 
-    if (isLeaf && particle_)
+    if (isLeaf)
     {
-        if (particle_ != &particle)
+        // A leaf with a single body is never approximated
+        if (!moreBodies.empty())
         {
-            acceleration = GravityAcceleration(particle_->position - particle.position, particle_->mass, softFactor);
+            AddQuadrupole(quadrupole, bodyPosition - massCenter, bodyMass);
+            for (const LeafBody& leafBody : moreBodies)
+            {
+                AddQuadrupole(quadrupole, leafBody.position - massCenter, leafBody.mass);
+            }
         }
+        return;
     }
-    else if (!isLeaf)
+
+    // Parallel axis theorem over the children
+    for (int i = 0; i < 8; i++)
     {
-        // Если это внутренний узел
+        BarnesHutTree& child = *children[i];
+        if (child.isLeaf && !child.body_)
+        {
+            continue;
+        }
 
-        // Находим расстояние от частицы до центра масс этого узла
-        float3 vec = massCenter - particle.position;
-        float r = vec.norm();
+        child.ComputeMoments();
+        const bool single = child.isLeaf && child.moreBodies.empty();
+        AddQuadrupole(quadrupole, (single ? child.bodyPosition : child.massCenter) - massCenter, single ? child.bodyMass : child.totalMass);
+        for (int j = 0; j < 6; j++)
+        {
+            quadrupole[j] += child.quadrupole[j];
+        }
+    }
+}
 
-        // Находим соотношение размера узла к расстоянию
-        float theta = length / r;
+void BarnesHutTree::Pack()
+{
+    static_assert(sizeof(WalkNode) == 32, "Two walk nodes are meant to fill a cache line");
 
-        if (theta < 0.7f)
+    const bool quadrupoles = accuracy.multipoleOrder == MultipoleOrder::Quadrupole;
+    if (quadrupoles)
+    {
+        ComputeMoments();
+    }
+
+    // Nodes in the order of the walk nodes, the children of a node are appended when it's packed
+    std::vector<const BarnesHutTree*> nodes;
+    nodes.reserve(walkNodes.size());
+    nodes.push_back(this);
+
+    walkNodes.clear();
+    walkBodies.clear();
+    walkQuadrupoles.clear();
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        const BarnesHutTree& node = *nodes[i];
+
+        WalkNode walkNode = {};
+        walkNode.massCenter = node.massCenter;
+        walkNode.mass = node.totalMass;
+        walkNode.length = node.length;
+        walkNode.isLeaf = node.isLeaf;
+
+        if (node.isLeaf)
         {
-            acceleration = GravityAcceleration(vec, totalMass, softFactor, r);
+            assert(node.moreBodies.size() < UINT16_MAX);
+            walkNode.first = static_cast<uint32_t>(walkBodies.size());
+            if (node.body_)
+            {
+                walkBodies.push_back({ node.bodyPosition, node.bodyMass, node.bodySoftening, node.body_ });
+                for (const LeafBody& leafBody : node.moreBodies)
+                {
+                    walkBodies.push_back({ leafBody.position, leafBody.mass, leafBody.softening, leafBody.body });
+                }
+            }
+            if (node.body_ && node.moreBodies.empty())
+            {
+                // The mass center is kept from the second body on
+                walkNode.massCenter = node.bodyPosition;
+                walkNode.mass = node.bodyMass;
+            }
+            walkNode.count = static_cast<uint16_t>(walkBodies.size() - walkNode.first);
         }
         else
         {
-            // Если частица близко к узлу рекурсивно считаем силу с потомками
-            for (int i = 0; i < 4; i++)
+            walkNode.first = static_cast<uint32_t>(nodes.size());
+            for (int j = 0; j < 8; j++)
             {
-                acceleration += children[i]->ComputeAcceleration(particle, softFactor);
+                // Плоский диск оставляет половину октантов пустыми
+                const BarnesHutTree& child = *node.children[j];
+                if (!child.isLeaf || child.body_)
+                {
+                    nodes.push_back(&child);
+                }
             }
+            walkNode.count = static_cast<uint16_t>(nodes.size() - walkNode.first);
+        }
+
+        walkNodes.push_back(walkNode);
+        if (quadrupoles)
+        {
+            WalkQuadrupole quadrupole;
+            std::copy(node.quadrupole, node.quadrupole + 6, quadrupole.q);
+            walkQuadrupoles.push_back(quadrupole);
         }
     }
+}
 
+bool BarnesHutTree::Contains(const float3 &position) const
+{
+    const float3& v = position;
+    if (v.m_x >= point.m_x && v.m_x <= oppositePoint.m_x &&
+        v.m_y >= point.m_y && v.m_y <= oppositePoint.m_y &&
+        v.m_z >= point.m_z && v.m_z <= oppositePoint.m_z)
+        return true;
+
+    return false;
+}
+
+float3 BarnesHutTree::ComputeAcceleration(const Particle &particle, float softFactor) const
+{
+    return ComputeAcceleration(particle.position, &particle, softFactor);
+}
+
+float3 BarnesHutTree::ComputeAcceleration(const float3 &position, const void *body, float softFactor) const
+{
+    WalkCounters counters;
+    return Walk<false>(position, body, softFactor, nullptr, counters);
+}
+
+float3 BarnesHutTree::ComputeAcceleration(const float3 &position, const void *body, float softFactor, float &potential) const
+{
+    potential = 0.0f;
+    WalkCounters counters;
+    return Walk<false>(position, body, softFactor, &potential, counters);
+}
+
+float3 BarnesHutTree::ComputeAcceleration(const float3 &position, const void *body, float softFactor, float *potential, WalkCounters *counters) const
+{
+    if (potential)
+    {
+        *potential = 0.0f;
+    }
+    if (!counters)
+    {
+        WalkCounters unused;
+        return Walk<false>(position, body, softFactor, potential, unused);
+    }
+    return Walk<true>(position, body, softFactor, potential, *counters);
+}
+
+template <bool Counting>
+float3 BarnesHutTree::Walk(const float3 &position, const void *body, float softFactor, float *potential, WalkCounters &counters) const
+{
+    assert(!walkNodes.empty());
+
+    // The walk only gathers the sources, the kernels evaluate them at once. Every thread has a list of its own.
+    static thread_local InteractionList list;
+    list.Clear();
+
+    const float openingAngle2 = accuracy.openingAngle * accuracy.openingAngle;
+    if (accuracy.multipoleOrder == MultipoleOrder::Quadrupole)
+    {
+        Gather<Counting, true>(0, position, body, openingAngle2, list, counters);
+    }
+    else
+    {
+        Gather<Counting, false>(0, position, body, openingAngle2, list, counters);
+    }
+    list.Pad();
+
+    const GravityKernels& kernels = GetGravityKernels();
+    float3 acceleration = {};
+    kernels.points(list, position, softFactor, acceleration, potential);
+    if (list.cells > 0)
+    {
+        const GravityKernels::Kernel cells = accuracy.multipoleOrder == MultipoleOrder::Quadrupole ? kernels.cells : kernels.monopoles;
+        cells(list, position, softFactor, acceleration, potential);
+    }
     return acceleration;
 }
+
+template <bool Counting, bool Quadrupole>
+void BarnesHutTree::Gather(uint32_t index, const float3 &position, const void *body, float openingAngle2, InteractionList &list, WalkCounters &counters) const
+{
+    if (Counting)
+    {
+        ++counters.nodes;
+    }
+
+    const WalkNode& node = walkNodes[index];
+    if (node.count == 0)
+    {
+        return;
+    }
+
+    if (!node.isLeaf || node.count > 1)
+    {
+        // Если это внутренний узел или лист с несколькими частицами
+
+        // Соотношение размера узла к расстоянию до центра масс сравнивается в квадратах
+        float3 vec = node.massCenter - position;
+        const bool far = node.length * node.length < openingAngle2 * vec.normSq();
+
+        // Частицы листа не действуют сами на себя
+        if (far && !(node.isLeaf && HoldsBody(node, body)))
+        {
+            if (Counting)
+            {
+                ++counters.cells;
+            }
+            if (Quadrupole)
+            {
+                list.AddCell(node.massCenter, node.mass, walkQuadrupoles[index].q);
+            }
+            else
+            {
+                list.AddCell(node.massCenter, node.mass);
+            }
+            return;
+        }
+    }
+
+    if (node.isLeaf)
+    {
+        for (uint32_t i = node.first; i < node.first + node.count; i++)
+        {
+            const WalkBody& other = walkBodies[i];
+            if (other.body == body)
+            {
+                continue;
+            }
+            if (Counting)
+            {
+                ++counters.bodies;
+            }
+            list.AddPoint(other.position, other.mass, other.softening);
+        }
+    }
+    else
+    {
+        // Если частица близко к узлу рекурсивно собираем потомков
+        for (uint32_t i = node.first; i < node.first + node.count; i++)
+        {
+            Gather<Counting, Quadrupole>(i, position, body, openingAngle2, list, counters);
+        }
+    }
+}
@@ -1,20 +1,74 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 #include "float3.h"
+#include "Utils.h"
 
 struct Particle;
+struct InteractionList;
+
+/** Work of one tree walk. */
+struct WalkCounters
+{
+    // Nodes the walk has entered
+    uint32_t nodes = 0;
+    // Interactions with the mass centers of cells
+    uint32_t cells = 0;
+    // Interactions with single bodies in leaves
+    uint32_t bodies = 0;
+};
+
+enum class MultipoleOrder : uint32_t
+{
+    // Cells act as point masses at their mass centers
+    Monopole,
+    // Also with their quadrupole moments about the mass centers, the dipole moments vanish there
+    Quadrupole
+};
+
+/** Tradeoff of the tree between speed and force error, see the accuracy mode of GalaxyBenchmark. */
+struct TreeAccuracy
+{
+    // Cells seen at a smaller angle, their size over the distance to their mass center, act as a whole
+    float openingAngle = 0.7f;
+    // Bodies a leaf holds before it's split
+    uint32_t leafCapacity = 1;
+    MultipoleOrder multipoleOrder = MultipoleOrder::Monopole;
+};
 
 class BarnesHutTree
 {
 public:
     BarnesHutTree(const float3 &point, float length);
 
-    void Insert(const Particle &p, uint32_t level = 0);
+    void Insert(const Particle &p, float softening);
+    /**
+        Inserts a body, which is identified by its address. softening applies to the
+        interactions with the body itself, the larger of it and the softening of the receiver.
+    */
+    void Insert(const float3 &position, float mass, float softening, const void *body, uint32_t level = 0);
+    /**
+        Packs the tree into the walk nodes after all bodies are inserted, with the quadrupole
+        moments if the accuracy has them. The walks read the packed nodes only.
+    */
+    void Pack();
+
     float3 ComputeAcceleration(const Particle &particle, float soft) const;
+    /** Acceleration at position, the body is excluded from the sources. */
+    float3 ComputeAcceleration(const float3 &position, const void *body, float soft) const;
+    /** The same, also accumulates the potential at position of the same sources. */
+    float3 ComputeAcceleration(const float3 &position, const void *body, float soft, float &potential) const;
+    /** The same, potential and counters are optional and left untouched if null. */
+    float3 ComputeAcceleration(const float3 &position, const void *body, float soft, float *potential, WalkCounters *counters) const;
     void Reset();
 
+    /** Accuracy of the tree, set on the root before the bodies are inserted. */
+    void SetAccuracy(const TreeAccuracy &accuracy_) { accuracy = accuracy_; }
+    const TreeAccuracy& GetAccuracy() const { return accuracy; }
+
     const float3& GetPoint() const { return point; }
     float GetLength() const { return length; }
     bool IsLeaf() const { return isLeaf; }
@@ -22,7 +76,55 @@ public:
     const BarnesHutTree& operator[](size_t i) const { return *children[i]; }
 
 private:
-    bool inline Contains(const Particle &p) const;
+    // Bodies of a leaf besides the first one
+    struct LeafBody
+    {
+        const void *body;
+        float3 position;
+        float mass;
+        float softening;
+    };
+
+    /**
+        Node of the packed tree, two per cache line. Non-empty children of a node follow each
+        other, so the first one's index is enough. Sibling groups are stored breadth first,
+        the levels the walks of all particles pass are at the start.
+    */
+    struct alignas(32) WalkNode
+    {
+        float3 massCenter;
+        float  mass;
+        float  length;
+        // First child node, or first body of a leaf
+        uint32_t first;
+        uint16_t count;
+        uint16_t isLeaf;
+    };
+
+    struct WalkBody
+    {
+        float3 position;
+        float  mass;
+        float  softening;
+        const void *body;
+    };
+
+    // Traceless quadrupole moment of a walk node, xx, yy, zz, xy, xz, yz
+    struct WalkQuadrupole
+    {
+        float q[6];
+    };
+
+    bool inline Contains(const float3 &position) const;
+    void InsertBody(const float3 &position, float mass, float softening, const void *body, uint32_t leafCapacity, uint32_t level);
+    void AddMass(const float3 &position, float mass);
+    void ComputeMoments();
+    bool HoldsBody(const WalkNode &node, const void *body) const;
+
+    template <bool Counting, bool Quadrupole>
+    void Gather(uint32_t index, const float3 &position, const void *body, float openingAngle2, InteractionList &list, WalkCounters &counters) const;
+    template <bool Counting>
+    float3 Walk(const float3 &position, const void *body, float soft, float *potential, WalkCounters &counters) const;
 
     float3 point;
     float3 oppositePoint;
@@ -31,9 +133,23 @@ private:
     float3 massCenter;
     bool   isLeaf;
 
-    std::unique_ptr<BarnesHutTree> children[4];
+    // Octants, bit 0 of the index selects the upper half along x, bit 1 along y and bit 2 along z
+    std::unique_ptr<BarnesHutTree> children[8];
+
+    // Body of a leaf
+    const void *body_ = nullptr;
+    float3 bodyPosition;
+    float  bodyMass;
+    float  bodySoftening;
+    std::vector<LeafBody> moreBodies;
 
-    const Particle *particle_ = nullptr;
+    // Traceless quadrupole moment about the mass center, xx, yy, zz, xy, xz, yz
+    float quadrupole[6] = {};
 
-    friend void DrawBarnesHutTree(const BarnesHutTree& node);
+    // Used on the root only
+    TreeAccuracy accuracy;
+    std::vector<WalkNode, AlignedAllocator<WalkNode, 64>> walkNodes;
+    std::vector<WalkBody> walkBodies;
+    // Per walk node, empty for monopoles
+    std::vector<WalkQuadrupole> walkQuadrupoles;
 };
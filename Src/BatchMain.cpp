@@ -0,0 +1,712 @@
+#include "Simulation.h"
+#include "SnapshotFile.h"
+#include "Scenario.h"
+#include "CheckpointWriter.h"
+#include "TrajectoryFile.h"
+#include "GravityKernels.h"
+#include "Threading.h"
+#include "Constants.h"
+#include "Utils.h"
+#include "Profiler.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <fstream>
+#include <string>
+#include <thread>
+
+/*
+Headless batch runner. Runs the simulation core at full speed without a window,
+suitable for compute nodes.
+*/
+
+struct BatchOptions
+{
+    GalaxyParameters model;
+    Simulation::SolverType solverType = Simulation::SolverType::BarnesHut;
+    SimulationParameters parameters;
+    float deltaTime = cDefaultDeltaTime;
+    float universeSize = GLX_UNIVERSE_SIZE;
+    // Whether to override the values of the scenario
+    bool deltaTimeSet = false;
+    bool universeSizeSet = false;
+    bool seedSet = false;
+    std::string scenarioFile;
+    std::string cacheDir;
+    uint32_t steps = 1000;
+    uint32_t threads = 0;
+    // The best the CPU runs unless set
+    KernelIsa kernels = KernelIsa::Scalar;
+    bool kernelsSet = false;
+    std::string outputDir;
+    uint32_t outputEvery = 0;
+    uint32_t reportEvery = 100;
+    uint32_t checkpointEvery = 0;
+    std::string checkpointFile = "checkpoint.glxs";
+    uint32_t checkpointBuffers = 2;
+    CheckpointWriter::Overflow checkpointOverflow = CheckpointWriter::Overflow::Block;
+    std::string restartFile;
+    std::string trajectoryFile;
+    uint32_t trajectoryEvery = 0;
+    TrajectoryWriter::Options trajectory;
+    std::string profileFile;
+};
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: GalaxyBatch [options]\n"
+        "\n"
+        "Run:\n"
+        "  --steps N              number of time steps (1000)\n"
+        "  --dt T                 time step in model units\n"
+        "  --solver NAME          barneshut or bruteforce (barneshut)\n"
+        "  --dark-matter          apply dark matter halo force\n"
+        "  --softening S          softening length of the stars, kpc (0.0005), the kernel is\n"
+        "                         chosen at compile time, see Softening.h\n"
+        "  --halo-softening S     softening of live halo particles, kpc (0.1)\n"
+        "  --halo-step-interval N live halo particles are kicked every N steps (4)\n"
+        "  --diagnostics-every K  energies, momenta and virial ratio every K steps (0)\n"
+        "  --count-interactions   count the tree walk work, reported per particle and\n"
+        "                         as histograms of the last step\n"
+        "  --opening-angle A      cells seen at a smaller angle act as a whole (0.7)\n"
+        "  --leaf-size N          bodies a tree leaf holds before it's split (1)\n"
+        "  --quadrupole           cells act with their quadrupole moments too\n"
+        "  --reorder-interval N   sort the particles along a Morton curve every N steps,\n"
+        "                         0 - when their order has decayed (0)\n"
+        "  --no-reorder           keep the particles in the order of creation\n"
+        "  --threads N            worker threads (hardware concurrency)\n"
+        "  --kernels NAME         gravity kernels, scalar, sse4, avx2 or avx512, results\n"
+        "                         differ between them in the last bits (the best the\n"
+        "                         CPU runs)\n"
+        "  --seed N               random seed of the galaxies, the same seed gives the\n"
+        "                         same galaxies with any thread count (1)\n"
+        "  --universe-size S      size of the simulation box, kpc\n"
+        "  --scenario F           galaxies, time step and universe size from a .glx file,\n"
+        "                         --dt and --universe-size override the file\n"
+        "  --ic-cache DIR         keep initialized galaxies in DIR and reuse them when\n"
+        "                         the model, seed, time step and solver are the same\n"
+        "\n"
+        "Model of the single galaxy when there is no scenario:\n"
+        "  --mass M               total galaxy mass, 10^10 solar masses\n"
+        "  --disk-mass-ratio R    disk to total mass ratio\n"
+        "  --disk-particles N\n"
+        "  --bulge-particles N\n"
+        "  --disk-radius R\n"
+        "  --bulge-radius R\n"
+        "  --halo-radius R\n"
+        "  --halo-model NAME      plummer, hernquist, nfw, isothermal or kuzmin (plummer)\n"
+        "  --halo-mass M          halo mass, the mass scale for nfw and isothermal\n"
+        "  --halo-particles N     sample the halo as N live particles instead of the\n"
+        "                         analytic force, not for kuzmin (0)\n"
+        "  --tracers N            massless tracers distributed like the particles (0)\n"
+        "  --disk-thickness T\n"
+        "  --black-hole-mass M    black hole mass in particle masses\n"
+        "\n"
+        "Output:\n"
+        "  --output-dir DIR       directory for frame files (must exist)\n"
+        "  --output-every N       write a frame every N steps (0 - never)\n"
+        "  --report-every N       print progress every N steps (100)\n"
+        "  --trajectory F         compressed trajectory file\n"
+        "  --trajectory-every N   write a trajectory frame every N steps\n"
+        "  --trajectory-bits B    position quantization bits, 1..24 (16)\n"
+        "  --keyframe-interval K  frames between trajectory keyframes (32)\n"
+        "  --profile F            profile the phases, print their statistics and write\n"
+        "                         a Chrome trace (chrome://tracing, Perfetto) to F\n"
+        "\n"
+        "Checkpoints:\n"
+        "  --checkpoint-every N   write a snapshot every N steps (0 - never)\n"
+        "  --checkpoint-file F    snapshot file name (checkpoint.glxs)\n"
+        "  --checkpoint-buffers N staging buffers, each holds a whole snapshot (2)\n"
+        "  --checkpoint-overflow P block or skip, what to do when the disk can't keep\n"
+        "                         up and all buffers are busy (block)\n"
+        "  --restart F            continue the run stored in snapshot F, model options,\n"
+        "                         --dt, softenings, tree accuracy and reordering are\n"
+        "                         taken from the snapshot\n";
+}
+
+static bool ParseUint(const char* value, uint32_t& result)
+{
+    if (!value)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    unsigned long parsed = std::strtoul(value, &end, 10);
+    if (end == value || *end != 0)
+    {
+        return false;
+    }
+    result = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+static bool ParseFloat(const char* value, float& result)
+{
+    if (!value)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    result = std::strtof(value, &end);
+    return end != value && *end == 0;
+}
+
+static bool ParseArguments(int argc, char** argv, BatchOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool ok = true;
+        bool hasValue = true;
+
+        if (!std::strcmp(arg, "--steps"))                   ok = ParseUint(value, options.steps);
+        else if (!std::strcmp(arg, "--dt"))                 ok = options.deltaTimeSet = ParseFloat(value, options.deltaTime);
+        else if (!std::strcmp(arg, "--threads"))            ok = ParseUint(value, options.threads);
+        else if (!std::strcmp(arg, "--seed"))               ok = options.seedSet = ParseUint(value, options.model.seed);
+        else if (!std::strcmp(arg, "--universe-size"))      ok = options.universeSizeSet = ParseFloat(value, options.universeSize);
+        else if (!std::strcmp(arg, "--mass"))               ok = ParseFloat(value, options.model.mass);
+        else if (!std::strcmp(arg, "--disk-mass-ratio"))    ok = ParseFloat(value, options.model.diskMassRatio);
+        else if (!std::strcmp(arg, "--disk-particles"))     ok = ParseUint(value, options.model.diskParticlesCount);
+        else if (!std::strcmp(arg, "--bulge-particles"))    ok = ParseUint(value, options.model.bulgeParticlesCount);
+        else if (!std::strcmp(arg, "--disk-radius"))        ok = ParseFloat(value, options.model.diskRadius);
+        else if (!std::strcmp(arg, "--bulge-radius"))       ok = ParseFloat(value, options.model.bulgeRadius);
+        else if (!std::strcmp(arg, "--halo-radius"))        ok = ParseFloat(value, options.model.haloRadius);
+        else if (!std::strcmp(arg, "--halo-mass"))          ok = ParseFloat(value, options.model.haloMass);
+        else if (!std::strcmp(arg, "--halo-model"))         ok = value && FindHaloModel(value, options.model.haloModel);
+        else if (!std::strcmp(arg, "--halo-particles"))     ok = ParseUint(value, options.model.haloParticlesCount);
+        else if (!std::strcmp(arg, "--tracers"))            ok = ParseUint(value, options.model.tracerParticlesCount);
+        else if (!std::strcmp(arg, "--softening"))          ok = ParseFloat(value, options.parameters.softening) && options.parameters.softening >= 0.0f;
+        else if (!std::strcmp(arg, "--halo-softening"))     ok = ParseFloat(value, options.parameters.haloSoftening) && options.parameters.haloSoftening >= 0.0f;
+        else if (!std::strcmp(arg, "--halo-step-interval")) ok = ParseUint(value, options.parameters.haloStepInterval) && options.parameters.haloStepInterval > 0;
+        else if (!std::strcmp(arg, "--diagnostics-every"))  ok = ParseUint(value, options.parameters.diagnosticsInterval);
+        else if (!std::strcmp(arg, "--opening-angle"))      ok = ParseFloat(value, options.parameters.treeAccuracy.openingAngle) && options.parameters.treeAccuracy.openingAngle > 0.0f;
+        else if (!std::strcmp(arg, "--leaf-size"))          ok = ParseUint(value, options.parameters.treeAccuracy.leafCapacity) && options.parameters.treeAccuracy.leafCapacity > 0;
+        else if (!std::strcmp(arg, "--reorder-interval"))   ok = ParseUint(value, options.parameters.reorderInterval);
+        else if (!std::strcmp(arg, "--disk-thickness"))     ok = ParseFloat(value, options.model.diskThickness);
+        else if (!std::strcmp(arg, "--black-hole-mass"))    ok = ParseFloat(value, options.model.blackHoleMass);
+        else if (!std::strcmp(arg, "--output-every"))       ok = ParseUint(value, options.outputEvery);
+        else if (!std::strcmp(arg, "--report-every"))       ok = ParseUint(value, options.reportEvery);
+        else if (!std::strcmp(arg, "--checkpoint-every"))   ok = ParseUint(value, options.checkpointEvery);
+        else if (!std::strcmp(arg, "--trajectory-every"))   ok = ParseUint(value, options.trajectoryEvery);
+        else if (!std::strcmp(arg, "--trajectory-bits"))    ok = ParseUint(value, options.trajectory.positionBits) && options.trajectory.positionBits >= 1 && options.trajectory.positionBits <= 24;
+        else if (!std::strcmp(arg, "--keyframe-interval"))  ok = ParseUint(value, options.trajectory.keyframeInterval) && options.trajectory.keyframeInterval > 0;
+        else if (!std::strcmp(arg, "--checkpoint-buffers")) ok = ParseUint(value, options.checkpointBuffers) && options.checkpointBuffers > 0;
+        else if (!std::strcmp(arg, "--output-dir"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.outputDir = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--scenario"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.scenarioFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--trajectory"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.trajectoryFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--checkpoint-file"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.checkpointFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--checkpoint-overflow"))
+        {
+            ok = value != nullptr;
+            if (ok && !std::strcmp(value, "block"))
+            {
+                options.checkpointOverflow = CheckpointWriter::Overflow::Block;
+            }
+            else if (ok && !std::strcmp(value, "skip"))
+            {
+                options.checkpointOverflow = CheckpointWriter::Overflow::Skip;
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+        else if (!std::strcmp(arg, "--kernels"))
+        {
+            ok = value != nullptr && ParseKernelIsa(value, options.kernels);
+            options.kernelsSet = true;
+        }
+        else if (!std::strcmp(arg, "--ic-cache"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.cacheDir = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--profile"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.profileFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--restart"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.restartFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--solver"))
+        {
+            ok = value != nullptr;
+            if (ok && !std::strcmp(value, "barneshut"))
+            {
+                options.solverType = Simulation::SolverType::BarnesHut;
+            }
+            else if (ok && !std::strcmp(value, "bruteforce"))
+            {
+                options.solverType = Simulation::SolverType::Bruteforce;
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+        else if (!std::strcmp(arg, "--dark-matter"))
+        {
+            options.parameters.darkMatter = true;
+            hasValue = false;
+        }
+        else if (!std::strcmp(arg, "--count-interactions"))
+        {
+            options.parameters.countInteractions = true;
+            hasValue = false;
+        }
+        else if (!std::strcmp(arg, "--quadrupole"))
+        {
+            options.parameters.treeAccuracy.multipoleOrder = MultipoleOrder::Quadrupole;
+            hasValue = false;
+        }
+        else if (!std::strcmp(arg, "--no-reorder"))
+        {
+            options.parameters.reorderParticles = false;
+            hasValue = false;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Invalid value for " << arg << std::endl;
+            return false;
+        }
+
+        if (hasValue)
+        {
+            ++i;
+        }
+    }
+
+    if (options.outputEvery > 0 && options.outputDir.empty())
+    {
+        std::cerr << "--output-every requires --output-dir" << std::endl;
+        return false;
+    }
+
+    if (options.model.haloParticlesCount > 0 && (options.model.haloMass <= 0.0f || GetHaloProfile(options.model.haloModel).disk))
+    {
+        std::cerr << "--halo-particles needs a spherical halo model with a positive mass" << std::endl;
+        return false;
+    }
+
+    if (options.trajectoryFile.empty() != (options.trajectoryEvery == 0))
+    {
+        std::cerr << "--trajectory and --trajectory-every go together" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+static void PrintHistogram(const char* title, const std::array<uint64_t, WalkStatistics::cHistogramBins>& histogram, uint64_t total)
+{
+    std::cout << title << std::endl;
+    for (uint32_t i = 0; i < WalkStatistics::cHistogramBins; ++i)
+    {
+        if (histogram[i] == 0)
+        {
+            continue;
+        }
+        const uint64_t first = (1ull << i) - 1;
+        const uint64_t last = (1ull << (i + 1)) - 2;
+        const double percent = 100.0 * histogram[i] / total;
+
+        char line[128];
+        std::snprintf(line, sizeof(line), "  %8llu..%-8llu %10llu %6.2f%% ", static_cast<unsigned long long>(first), 
+            static_cast<unsigned long long>(last), static_cast<unsigned long long>(histogram[i]), percent);
+        std::cout << line << std::string(static_cast<size_t>(percent * 0.5 + 0.5), '#') << std::endl;
+    }
+}
+
+static void PrintWalkStatistics(const WalkStatistics& statistics)
+{
+    if (statistics.walks == 0)
+    {
+        return;
+    }
+
+    std::cout << "Tree walks of the last step: " << statistics.walks 
+        << ", interactions " << statistics.GetInteractions() 
+        << " (cells " << statistics.cells << ", bodies " << statistics.bodies << ")"
+        << ", node visits " << statistics.nodes 
+        << ", largest walk " << statistics.maxInteractions << " interactions" << std::endl;
+
+    PrintHistogram("Interactions per particle:", statistics.interactionsHistogram, statistics.walks);
+    PrintHistogram("Node visits per particle:", statistics.nodesHistogram, statistics.walks);
+}
+
+static bool WriteFrame(const std::string& dir, int32_t step, float time, Universe& universe)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "frame_%08d.txt", step);
+
+    std::ofstream file(dir + "/" + name);
+    if (!file)
+    {
+        return false;
+    }
+
+    file << "# step " << step << " time " << time << " particles " << universe.GetParticlesCount() << "\n";
+    // Lines are in the order of the particle ids, which the reorders of the particles keep
+    std::vector<const Particle*> byId;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        byId.resize(galaxy.GetParticlesCount());
+        for (const auto& particle : galaxy.GetParticles())
+        {
+            byId[particle.id] = &particle;
+        }
+        for (const Particle* particle : byId)
+        {
+            file << particle->position.m_x << ' ' << particle->position.m_y << ' ' << particle->position.m_z << '\n';
+        }
+    }
+
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char* argv[])
+{
+    BatchOptions options;
+
+    if (argc > 1 && (!std::strcmp(argv[1], "--help") || !std::strcmp(argv[1], "-h")))
+    {
+        PrintUsage();
+        return 0;
+    }
+
+    if (!ParseArguments(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    Profiler::SetEnabled(!options.profileFile.empty());
+    Profiler::SetThreadName("Main");
+
+    if (options.kernelsSet && !SelectGravityKernels(options.kernels))
+    {
+        std::cerr << "The CPU doesn't run the " << GetKernelIsaName(options.kernels) << " kernels" << std::endl;
+        return 1;
+    }
+
+    ThreadPool::Create(options.threads > 0 ? options.threads : std::thread::hardware_concurrency());
+
+    Simulation simulation;
+    simulation.SetSolverType(options.solverType);
+    simulation.GetParameters() = options.parameters;
+
+    Timer<> setupTimer;
+    if (options.restartFile.empty())
+    {
+        Scenario scenario = MakeScenario(options.model, options.deltaTime, options.universeSize);
+
+        if (!options.scenarioFile.empty())
+        {
+            std::string error;
+            if (!LoadScenario(options.scenarioFile, scenario, error))
+            {
+                std::cerr << error << std::endl;
+                ThreadPool::Destroy();
+                return 1;
+            }
+
+            scenario.deltaTime = options.deltaTimeSet ? options.deltaTime : scenario.deltaTime;
+            scenario.universeSize = options.universeSizeSet ? options.universeSize : scenario.universeSize;
+            options.deltaTime = scenario.deltaTime;
+
+            for (auto& galaxy : scenario.galaxies)
+            {
+                galaxy.parameters.seed = options.seedSet ? options.model.seed : galaxy.parameters.seed;
+            }
+
+            std::cout << "Scenario " << options.scenarioFile << ", galaxies: " << scenario.galaxies.size() << std::endl;
+        }
+
+        if (options.cacheDir.empty())
+        {
+            simulation.Reset(scenario);
+        }
+        else if (simulation.ResetCached(scenario, options.cacheDir))
+        {
+            std::cout << "Initial conditions from " << options.cacheDir << std::endl;
+        }
+    }
+    else
+    {
+        SnapshotView snapshot;
+        if (!snapshot.Open(options.restartFile))
+        {
+            std::cerr << "Can't load " << options.restartFile << ": " << snapshot.GetError() << std::endl;
+            ThreadPool::Destroy();
+            return 1;
+        }
+        if (!simulation.Restore(snapshot))
+        {
+            std::cerr << options.restartFile << " has no particle state" << std::endl;
+            ThreadPool::Destroy();
+            return 1;
+        }
+        // Same step as the original run, otherwise the restart is not exact
+        options.deltaTime = snapshot.GetHeader().deltaTime;
+
+        std::cout << "Restarted from " << options.restartFile << " at step " << simulation.GetStepCount() << std::endl;
+    }
+
+    std::cout << "Particles: " << simulation.GetUniverse().GetParticlesCount() 
+        << ", halo particles: " << simulation.GetUniverse().GetHaloParticlesCount()
+        << ", tracers: " << simulation.GetUniverse().GetTracersCount()
+        << ", threads: " << ThreadPool::GetThreadCount() 
+        << ", kernels: " << GetKernelIsaName(GetGravityKernels().isa)
+        << ", softening: " << SofteningPolicy::cName << " " << simulation.GetParameters().softening << " kpc"
+        << ", setup: " << setupTimer.GetPassedTime() << " s" << std::endl;
+
+    int result = 0;
+
+    std::unique_ptr<CheckpointWriter> checkpointWriter;
+    if (options.checkpointEvery > 0)
+    {
+        checkpointWriter = std::make_unique<CheckpointWriter>(options.checkpointBuffers, options.checkpointOverflow);
+    }
+    float checkpointCopyMsecs = 0.0f;
+
+    TrajectoryWriter trajectoryWriter;
+    if (!options.trajectoryFile.empty() && 
+        !trajectoryWriter.Open(options.trajectoryFile, simulation.GetUniverse().GetParticlesCount(), options.trajectory))
+    {
+        std::cerr << "Can't create " << options.trajectoryFile << std::endl;
+        ThreadPool::Destroy();
+        return 1;
+    }
+    float trajectoryMsecs = 0.0f;
+
+    // Energy of the first diagnostics, the reference of the energy drift
+    bool hasInitialEnergy = false;
+    double initialEnergy = 0.0;
+    double maxEnergyDrift = 0.0;
+
+    Timer<> runTimer;
+    for (uint32_t i = 0; i < options.steps; ++i)
+    {
+        simulation.Step(options.deltaTime);
+
+        const int32_t step = simulation.GetStepCount();
+
+        if (options.outputEvery > 0 && step % options.outputEvery == 0)
+        {
+            if (!WriteFrame(options.outputDir, step, simulation.GetTime(), simulation.GetUniverse()))
+            {
+                std::cerr << "Can't write frame to " << options.outputDir << std::endl;
+                result = 1;
+                break;
+            }
+        }
+
+        if (trajectoryWriter.IsOpen() && step % options.trajectoryEvery == 0)
+        {
+            Timer<std::milli> timer(&trajectoryMsecs);
+            if (!trajectoryWriter.WriteFrame(simulation.GetUniverse(), step, simulation.GetTime()))
+            {
+                std::cerr << "Can't write to " << options.trajectoryFile << std::endl;
+                result = 1;
+                break;
+            }
+        }
+
+        if (checkpointWriter && step % options.checkpointEvery == 0)
+        {
+            if (checkpointWriter->GetFailedCount() > 0)
+            {
+                std::cerr << checkpointWriter->GetLastError() << std::endl;
+                result = 1;
+                break;
+            }
+
+            // Only the copy is paid here, the file is written in the background
+            Timer<std::milli> timer(&checkpointCopyMsecs);
+            checkpointWriter->Submit(options.checkpointFile, simulation.GetUniverse(), 
+                simulation.GetParameters(), simulation.GetTime(), simulation.GetStepCount(), options.deltaTime);
+        }
+
+        // The diagnostics are reduced in the background while the frames are written
+        if (simulation.GetSolver().HasNewDiagnostics())
+        {
+            const Diagnostics& diagnostics = simulation.GetSolver().GetDiagnostics();
+            const double energy = diagnostics.GetTotalEnergy();
+            if (!hasInitialEnergy)
+            {
+                hasInitialEnergy = true;
+                initialEnergy = energy;
+            }
+            const double drift = initialEnergy != 0.0 ? (energy - initialEnergy) / std::abs(initialEnergy) : 0.0;
+            maxEnergyDrift = (std::max)(maxEnergyDrift, std::abs(drift));
+
+            std::cout << "Diagnostics at step " << diagnostics.step 
+                << ": E " << energy << " (drift " << drift << ")"
+                << ", K " << diagnostics.kineticEnergy 
+                << ", W " << diagnostics.potentialEnergy 
+                << ", W halos " << diagnostics.externalEnergy 
+                << ", 2K/|W| " << diagnostics.GetVirialRatio()
+                << ", P (" << diagnostics.linearMomentum.m_x << ", " << diagnostics.linearMomentum.m_y << ", " << diagnostics.linearMomentum.m_z << ")"
+                << ", L (" << diagnostics.angularMomentum.m_x << ", " << diagnostics.angularMomentum.m_y << ", " << diagnostics.angularMomentum.m_z << ")"
+                << ", " << simulation.GetTimings().diagnosticsTimeMsecs << " ms" << std::endl;
+        }
+
+        if (options.reportEvery > 0 && step % options.reportEvery == 0)
+        {
+            const Timings& timings = simulation.GetTimings();
+            std::cout << "Step " << step 
+                << ", build tree " << timings.buildTreeTimeMsecs << " ms"
+                << ", forces " << timings.solvingTimeMsecs << " ms"
+                << ", halos " << timings.externalTimeMsecs << " ms";
+            if (simulation.GetUniverse().GetHaloParticlesCount() > 0)
+            {
+                std::cout << ", live halos " << timings.liveHaloTimeMsecs << " ms";
+            }
+            if (simulation.GetUniverse().GetTracersCount() > 0)
+            {
+                std::cout << ", tracers " << timings.tracersTimeMsecs << " ms";
+            }
+            std::cout
+                << ", integration " << timings.integrationTimeMsecs << " ms";
+            if (checkpointWriter)
+            {
+                std::cout << ", checkpoint copy " << checkpointCopyMsecs << " ms";
+            }
+            if (trajectoryWriter.IsOpen())
+            {
+                std::cout << ", trajectory frame " << trajectoryMsecs << " ms";
+            }
+            const WalkStatistics& walks = simulation.GetSolver().GetWalkStatistics();
+            if (walks.walks > 0)
+            {
+                std::cout << ", per particle " << static_cast<double>(walks.nodes) / walks.walks << " nodes, " 
+                    << static_cast<double>(walks.cells) / walks.walks << " cells, " 
+                    << static_cast<double>(walks.bodies) / walks.walks << " bodies";
+            }
+            std::cout << ", " << (i + 1) / runTimer.GetPassedTime() << " steps/s" << std::endl;
+        }
+    }
+
+    if (trajectoryWriter.IsOpen())
+    {
+        const uint64_t rawSize = simulation.GetUniverse().GetParticlesCount() * sizeof(float) * 3;
+        const uint64_t frames = trajectoryWriter.GetFrameCount();
+        const uint64_t size = trajectoryWriter.GetSize();
+
+        if (!trajectoryWriter.Close())
+        {
+            std::cerr << "Can't write to " << options.trajectoryFile << std::endl;
+            result = 1;
+        }
+        else if (frames > 0)
+        {
+            std::cout << "Trajectory " << size << " bytes, " << static_cast<double>(rawSize * frames) / size << "x smaller than raw floats" << std::endl;
+        }
+    }
+
+    if (checkpointWriter)
+    {
+        checkpointWriter->Flush();
+
+        std::cout << "Checkpoints written " << checkpointWriter->GetWrittenCount() 
+            << ", skipped " << checkpointWriter->GetSkippedCount() << std::endl;
+
+        if (checkpointWriter->GetFailedCount() > 0)
+        {
+            std::cerr << checkpointWriter->GetLastError() << std::endl;
+            result = 1;
+        }
+    }
+
+    std::cout << "Done " << simulation.GetStepCount() << " steps in " << runTimer.GetPassedTime() << " s" << std::endl;
+    if (simulation.GetReorderCount() > 0)
+    {
+        std::cout << "Particles reordered " << simulation.GetReorderCount() << " times, the last check took " 
+            << simulation.GetTimings().reorderTimeMsecs << " ms" << std::endl;
+    }
+    if (hasInitialEnergy)
+    {
+        std::cout << "Largest relative energy drift " << maxEnergyDrift << std::endl;
+    }
+
+    if (options.parameters.countInteractions)
+    {
+        PrintWalkStatistics(simulation.GetSolver().GetWalkStatistics());
+    }
+
+    if (!options.profileFile.empty())
+    {
+        // Zones of all threads, the worker zones of a phase show its load balance
+        std::cout << "Profile, ms:" << std::endl;
+        for (const auto& zone : Profiler::GetStatistics())
+        {
+            char line[256];
+            std::snprintf(line, sizeof(line), "  %-24s count %8llu, total %10.1f, mean %8.3f, p50 %8.3f, p90 %8.3f, p99 %8.3f, max %8.3f",
+                zone.name.c_str(), static_cast<unsigned long long>(zone.count), zone.totalMsecs, 
+                zone.meanMsecs, zone.p50Msecs, zone.p90Msecs, zone.p99Msecs, zone.maxMsecs);
+            std::cout << line << std::endl;
+        }
+
+        if (!Profiler::WriteChromeTrace(options.profileFile))
+        {
+            std::cerr << "Can't write " << options.profileFile << std::endl;
+            result = 1;
+        }
+    }
+
+    ThreadPool::Destroy();
+
+    return result;
+}
@@ -0,0 +1,1139 @@
+#include "Simulation.h"
+#include "BarnesHutTree.h"
+#include "GravityKernels.h"
+#include "Galaxy.h"
+#include "Threading.h"
+#include "Constants.h"
+#include "Utils.h"
+#include "Multigrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Benchmark of the simulation stages on fixed-seed galaxies. Every configuration is stepped
+a number of times, the per-step timings of the solver give one sample of every stage per
+step. Reports the median and the median absolute deviation of the samples, the yardstick
+of performance changes, and optionally writes them as JSON for regression tracking.
+
+The accuracy mode sweeps the settings of the tree instead. The tree forces of all particles
+are timed for every combination of opening angle, leaf size and multipole order, and the
+forces of evenly spaced sample particles are compared with direct summation in double
+precision, to choose the fastest settings within an error budget.
+
+The kernels mode checks the gravity kernels of every instruction set the CPU runs on random
+interaction lists against a double precision evaluation, and times them.
+
+The multigrid mode solves Poisson problems with a known solution on 2D and 3D grids of sizes
+of 2^k + 1 and of even and odd other sizes, which coarsen differently, and times the solves.
+*/
+
+// Particles walked per dispatched block in the accuracy mode
+static constexpr uint32_t cAccuracyBlockSize = 256;
+
+// Random interaction lists of the kernels mode, of up to the sizes walks gather
+static constexpr uint32_t cKernelLists = 256;
+static constexpr uint32_t cKernelListPoints = 256;
+static constexpr uint32_t cKernelListCells = 128;
+// A walk evaluates a list while it's cached, so are the timed ones
+static constexpr uint32_t cKernelRepeats = 16;
+// Largest relative error the kernels may have, far below the errors of the tree
+static constexpr double cKernelTolerance = 1e-4;
+
+// Grids of the multigrid mode, of 2^k + 1 points and others
+static const uint32_t cMultigridSizes2d[] = { 17, 100, 129, 200, 301 };
+static const uint32_t cMultigridSizes3d[] = { 33, 40, 51 };
+// Largest error of a solution in units of the discretization error, step^2, and the tolerance
+static constexpr double cMultigridErrorFactor = 2.0;
+
+struct BenchmarkOptions
+{
+    std::vector<uint32_t> sizes = { 10000, 100000, 1000000 };
+    bool plummer = true;
+    bool disk = true;
+    uint32_t steps = 7;
+    uint32_t threads = 0;
+    uint32_t seed = 1;
+    uint32_t dispatches = 1000;
+    std::string jsonFile;
+
+    bool accuracy = false;
+    std::vector<float> openingAngles = { 0.3f, 0.5f, 0.7f, 0.9f, 1.1f };
+    std::vector<uint32_t> leafSizes = { 1, 4, 16 };
+    std::vector<MultipoleOrder> multipoleOrders = { MultipoleOrder::Monopole, MultipoleOrder::Quadrupole };
+    uint32_t samples = 1000;
+
+    bool kernels = false;
+    bool multigrid = false;
+};
+
+/** Median and median absolute deviation of samples. */
+struct SampleStatistics
+{
+    double median = 0.0;
+    double mad = 0.0;
+};
+
+struct StageResult
+{
+    const char* name;
+    SampleStatistics msecs;
+};
+
+struct ConfigurationResult
+{
+    std::string configuration;
+    uint32_t particles = 0;
+    float setupSecs = 0.0f;
+    uint64_t interactionsPerStep = 0;
+    std::vector<StageResult> stages;
+};
+
+struct AccuracyRun
+{
+    TreeAccuracy accuracy;
+    // Relative errors of the sample forces
+    double rmsError = 0.0;
+    double p99Error = 0.0;
+    SampleStatistics buildMsecs;
+    SampleStatistics forceMsecs;
+    double interactionsPerParticle = 0.0;
+};
+
+struct AccuracyResult
+{
+    std::string configuration;
+    uint32_t particles = 0;
+    uint32_t samples = 0;
+    std::vector<AccuracyRun> runs;
+};
+
+struct KernelRun
+{
+    KernelIsa isa;
+    bool supported = false;
+    // Largest relative errors against the double precision evaluation
+    double accelerationError = 0.0;
+    double potentialError = 0.0;
+    SampleStatistics msecs;
+};
+
+struct KernelResult
+{
+    uint64_t interactions = 0;
+    std::vector<KernelRun> runs;
+};
+
+struct MultigridRun
+{
+    uint32_t dimensions = 0;
+    uint32_t size = 0;
+    uint32_t levels = 0;
+    uint32_t cycles = 0;
+    bool converged = false;
+    float residual = 0.0f;
+    float tolerance = 0.0f;
+    // Largest error against the exact solution, and what it may be
+    double maxError = 0.0;
+    double errorBound = 0.0;
+    SampleStatistics msecs;
+};
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: GalaxyBenchmark [options]\n"
+        "\n"
+        "  --sizes N,N,...        particle counts (10000,100000,1000000), up to 10000000\n"
+        "  --config NAME          plummer, disk or all (all)\n"
+        "  --steps N              timed steps per configuration, one sample each (7)\n"
+        "  --threads N            worker threads (hardware concurrency)\n"
+        "  --seed N               random seed of the galaxies (1)\n"
+        "  --dispatches N         empty dispatches timed for the dispatch overhead (1000)\n"
+        "  --json F               write the results to F\n"
+        "\n"
+        "Accuracy mode, timings of all tree forces with errors against direct summation:\n"
+        "  --accuracy             sweep the tree settings, --steps sets the timed passes\n"
+        "  --opening-angles A,... opening angles (0.3,0.5,0.7,0.9,1.1)\n"
+        "  --leaf-sizes N,...     bodies a leaf holds before it's split (1,4,16)\n"
+        "  --multipoles NAME,...  monopole, quadrupole (monopole,quadrupole)\n"
+        "  --samples N            particles compared with direct summation (1000)\n"
+        "\n"
+        "Kernels mode, the gravity kernels checked against double precision and timed:\n"
+        "  --kernels              check every instruction set the CPU runs, fails past an error\n"
+        "                         of 1e-4, --steps sets the timed passes\n"
+        "\n"
+        "Multigrid mode, Poisson problems with a known solution solved and timed:\n"
+        "  --multigrid            fails if a solve doesn't converge or misses the solution by more\n"
+        "                         than twice the discretization error and the tolerance, --steps\n"
+        "                         sets the timed solves\n";
+}
+
+static bool ParseUint(const char* value, uint32_t& result)
+{
+    if (!value)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    unsigned long parsed = std::strtoul(value, &end, 10);
+    if (end == value || *end != 0)
+    {
+        return false;
+    }
+    result = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+static bool ParseFloat(const char* value, float& result)
+{
+    if (!value)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    result = std::strtof(value, &end);
+    return end != value && *end == 0;
+}
+
+static bool ParseMultipoleOrder(const char* value, MultipoleOrder& result)
+{
+    if (!std::strcmp(value, "monopole"))
+    {
+        result = MultipoleOrder::Monopole;
+        return true;
+    }
+    if (!std::strcmp(value, "quadrupole"))
+    {
+        result = MultipoleOrder::Quadrupole;
+        return true;
+    }
+    return false;
+}
+
+/** Comma separated list, every item is parsed and checked by parse. */
+template <typename T, typename Parse>
+static bool ParseList(const char* value, std::vector<T>& items, const Parse& parse)
+{
+    if (!value)
+    {
+        return false;
+    }
+
+    items.clear();
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        T parsed;
+        if (!parse(item.c_str(), parsed))
+        {
+            return false;
+        }
+        items.push_back(parsed);
+    }
+    return !items.empty();
+}
+
+static bool ParseArguments(int argc, char** argv, BenchmarkOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool ok = true;
+
+        if (!std::strcmp(arg, "--sizes"))
+        {
+            ok = ParseList(value, options.sizes, [](const char* item, uint32_t& size) { return ParseUint(item, size) && size >= 2; });
+        }
+        else if (!std::strcmp(arg, "--opening-angles"))
+        {
+            ok = ParseList(value, options.openingAngles, [](const char* item, float& angle) { return ParseFloat(item, angle) && angle > 0.0f; });
+        }
+        else if (!std::strcmp(arg, "--leaf-sizes"))
+        {
+            ok = ParseList(value, options.leafSizes, [](const char* item, uint32_t& size) { return ParseUint(item, size) && size > 0; });
+        }
+        else if (!std::strcmp(arg, "--multipoles"))         ok = ParseList(value, options.multipoleOrders, ParseMultipoleOrder);
+        else if (!std::strcmp(arg, "--steps"))              ok = ParseUint(value, options.steps) && options.steps > 0;
+        else if (!std::strcmp(arg, "--threads"))            ok = ParseUint(value, options.threads);
+        else if (!std::strcmp(arg, "--seed"))               ok = ParseUint(value, options.seed);
+        else if (!std::strcmp(arg, "--dispatches"))         ok = ParseUint(value, options.dispatches) && options.dispatches > 0;
+        else if (!std::strcmp(arg, "--samples"))            ok = ParseUint(value, options.samples) && options.samples > 0;
+        else if (!std::strcmp(arg, "--accuracy"))
+        {
+            options.accuracy = true;
+            continue;
+        }
+        else if (!std::strcmp(arg, "--kernels"))
+        {
+            options.kernels = true;
+            continue;
+        }
+        else if (!std::strcmp(arg, "--multigrid"))
+        {
+            options.multigrid = true;
+            continue;
+        }
+        else if (!std::strcmp(arg, "--json"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.jsonFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--config"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.plummer = !std::strcmp(value, "plummer") || !std::strcmp(value, "all");
+                options.disk = !std::strcmp(value, "disk") || !std::strcmp(value, "all");
+                ok = options.plummer || options.disk;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Invalid value for " << arg << std::endl;
+            return false;
+        }
+
+        ++i;
+    }
+
+    return true;
+}
+
+static SampleStatistics GetStatistics(std::vector<double> samples)
+{
+    auto median = [](std::vector<double>& values)
+    {
+        std::sort(values.begin(), values.end());
+        const size_t middle = values.size() / 2;
+        return values.size() % 2 ? values[middle] : 0.5 * (values[middle - 1] + values[middle]);
+    };
+
+    SampleStatistics statistics;
+    statistics.median = median(samples);
+    for (double& sample : samples)
+    {
+        sample = std::abs(sample - statistics.median);
+    }
+    statistics.mad = median(samples);
+    return statistics;
+}
+
+/** Galaxy of the configuration: all particles in a Plummer sphere or in an exponential disk. */
+static GalaxyParameters MakeModel(bool plummer, uint32_t particles, uint32_t seed)
+{
+    GalaxyParameters model;
+    // The black hole is one of the particles
+    model.bulgeParticlesCount = plummer ? particles - 1 : 0;
+    model.diskParticlesCount = plummer ? 0 : particles - 1;
+    model.seed = seed;
+    return model;
+}
+
+static ConfigurationResult RunConfiguration(bool plummer, uint32_t particles, const BenchmarkOptions& options)
+{
+    ConfigurationResult result;
+    result.configuration = plummer ? "plummer" : "disk";
+    result.particles = particles;
+
+    Simulation simulation;
+
+    Timer<> setupTimer;
+    simulation.Reset(MakeModel(plummer, particles, options.seed), cDefaultDeltaTime);
+    result.setupSecs = setupTimer.GetPassedTime();
+
+    // The interactions are counted in a step of their own, counting slows down the walk
+    simulation.GetParameters().countInteractions = true;
+    simulation.Step(cDefaultDeltaTime);
+    result.interactionsPerStep = simulation.GetSolver().GetWalkStatistics().GetInteractions();
+    simulation.GetParameters().countInteractions = false;
+
+    std::vector<double> buildTree, forces, integration, step;
+    for (uint32_t i = 0; i < options.steps; ++i)
+    {
+        Timer<std::milli> timer;
+        simulation.Step(cDefaultDeltaTime);
+        step.push_back(timer.GetPassedTime());
+
+        const Timings& timings = simulation.GetTimings();
+        buildTree.push_back(timings.buildTreeTimeMsecs);
+        forces.push_back(timings.solvingTimeMsecs);
+        integration.push_back(timings.integrationTimeMsecs);
+    }
+
+    result.stages.push_back({ "BuildTree", GetStatistics(buildTree) });
+    result.stages.push_back({ "ComputeAcceleration", GetStatistics(forces) });
+    result.stages.push_back({ "Integrate", GetStatistics(integration) });
+    result.stages.push_back({ "Step", GetStatistics(step) });
+    return result;
+}
+
+static const char* GetMultipoleOrderName(MultipoleOrder order)
+{
+    return order == MultipoleOrder::Quadrupole ? "quadrupole" : "monopole";
+}
+
+static AccuracyResult RunAccuracy(bool plummer, uint32_t particles, const BenchmarkOptions& options)
+{
+    AccuracyResult result;
+    result.configuration = plummer ? "plummer" : "disk";
+    result.particles = particles;
+
+    Simulation simulation;
+    simulation.Reset(MakeModel(plummer, particles, options.seed), cDefaultDeltaTime);
+    Universe& universe = simulation.GetUniverse();
+
+    std::vector<const Particle*> bodies;
+    for (const auto& galaxy : universe.GetGalaxies())
+    {
+        for (const auto& particle : galaxy.GetParticles())
+        {
+            bodies.push_back(&particle);
+        }
+    }
+    const uint32_t count = static_cast<uint32_t>(bodies.size());
+
+    // Particles are generated by component, so evenly spaced samples cover all of them
+    result.samples = (std::min)(options.samples, count);
+    std::vector<uint32_t> samples(result.samples);
+    for (uint32_t i = 0; i < result.samples; ++i)
+    {
+        samples[i] = static_cast<uint32_t>(static_cast<uint64_t>(i) * count / result.samples);
+    }
+
+    // Reference with the softening of the tree
+    const double softening = simulation.GetParameters().softening;
+    std::vector<double> exact(3 * result.samples);
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        const Particle& particle = *bodies[samples[i]];
+        double sum[3] = {};
+        for (const Particle* other : bodies)
+        {
+            if (other == &particle)
+            {
+                continue;
+            }
+            const double dx = static_cast<double>(other->position.m_x) - particle.position.m_x;
+            const double dy = static_cast<double>(other->position.m_y) - particle.position.m_y;
+            const double dz = static_cast<double>(other->position.m_z) - particle.position.m_z;
+            const double scale = other->mass * SofteningPolicy::Force(dx * dx + dy * dy + dz * dz, softening);
+            sum[0] += dx * scale;
+            sum[1] += dy * scale;
+            sum[2] += dz * scale;
+        }
+        std::copy(sum, sum + 3, &exact[3 * i]);
+    }, result.samples, 1);
+
+    BarnesHutTree tree(float3(-universe.GetSize() * 0.5f), universe.GetSize());
+    std::vector<float3> accelerations(count);
+
+    for (MultipoleOrder order : options.multipoleOrders)
+    {
+        for (uint32_t leafSize : options.leafSizes)
+        {
+            for (float openingAngle : options.openingAngles)
+            {
+                AccuracyRun run;
+                run.accuracy.openingAngle = openingAngle;
+                run.accuracy.leafCapacity = leafSize;
+                run.accuracy.multipoleOrder = order;
+                tree.SetAccuracy(run.accuracy);
+
+                std::vector<double> build, force;
+                for (uint32_t pass = 0; pass < options.steps; ++pass)
+                {
+                    Timer<std::milli> buildTimer;
+                    tree.Reset();
+                    for (const Particle* particle : bodies)
+                    {
+                        tree.Insert(*particle, static_cast<float>(softening));
+                    }
+                    tree.Pack();
+                    build.push_back(buildTimer.GetPassedTime());
+
+                    Timer<std::milli> forceTimer;
+                    ThreadPool().Dispatch([&](uint32_t i)
+                    {
+                        accelerations[i] = tree.ComputeAcceleration(*bodies[i], static_cast<float>(softening));
+                    }, count, cAccuracyBlockSize);
+                    force.push_back(forceTimer.GetPassedTime());
+                }
+                run.buildMsecs = GetStatistics(build);
+                run.forceMsecs = GetStatistics(force);
+
+                std::vector<double> errors(result.samples);
+                double squares = 0.0;
+                uint64_t interactions = 0;
+                for (uint32_t i = 0; i < result.samples; ++i)
+                {
+                    const float3& a = accelerations[samples[i]];
+                    const double* e = &exact[3 * i];
+                    const double dx = a.m_x - e[0];
+                    const double dy = a.m_y - e[1];
+                    const double dz = a.m_z - e[2];
+                    errors[i] = std::sqrt((dx * dx + dy * dy + dz * dz) / (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]));
+                    squares += errors[i] * errors[i];
+
+                    WalkCounters counters;
+                    const Particle& particle = *bodies[samples[i]];
+                    tree.ComputeAcceleration(particle.position, &particle, static_cast<float>(softening), nullptr, &counters);
+                    interactions += counters.cells + counters.bodies;
+                }
+                std::sort(errors.begin(), errors.end());
+
+                // Nearest rank
+                const size_t rank = static_cast<size_t>(std::ceil(0.99 * errors.size()));
+                run.rmsError = std::sqrt(squares / result.samples);
+                run.p99Error = errors[(std::max)(rank, static_cast<size_t>(1)) - 1];
+                run.interactionsPerParticle = static_cast<double>(interactions) / result.samples;
+                result.runs.push_back(run);
+            }
+        }
+    }
+
+    return result;
+}
+
+static void PrintAccuracyResult(const AccuracyResult& result)
+{
+    std::cout << result.configuration << ", " << result.particles << " particles, " << result.samples << " samples" << std::endl;
+    std::cout << "  angle  leaf  multipole     RMS error  p99 error   build ms   force ms  us/particle  interactions" << std::endl;
+
+    for (const auto& run : result.runs)
+    {
+        char line[256];
+        std::snprintf(line, sizeof(line), "  %5.2f  %4u  %-10s  %10.3e %10.3e %10.3f %10.3f %12.4f %13.1f",
+            run.accuracy.openingAngle, run.accuracy.leafCapacity, GetMultipoleOrderName(run.accuracy.multipoleOrder),
+            run.rmsError, run.p99Error, run.buildMsecs.median, run.forceMsecs.median,
+            run.forceMsecs.median * 1e3 / result.particles, run.interactionsPerParticle);
+        std::cout << line << std::endl;
+    }
+}
+
+/** Random interaction list about position, cells are farther than the points as in walks. */
+static void MakeInteractionList(CounterRandom& random, const float3& position, InteractionList& list)
+{
+    list.Clear();
+
+    const uint32_t points = 1 + random.NextUint() % cKernelListPoints;
+    for (uint32_t i = 0; i < points; ++i)
+    {
+        const float3 offset(random.Range(-1.0f, 1.0f), random.Range(-1.0f, 1.0f), random.Range(-1.0f, 1.0f));
+        list.AddPoint(position + offset, random.Range(0.0f, 1.0f), random.Next() < 0.5f ? 0.0f : random.Range(0.0f, 0.1f));
+    }
+
+    const uint32_t cells = random.NextUint() % (cKernelListCells + 1);
+    for (uint32_t i = 0; i < cells; ++i)
+    {
+        float3 direction(random.Range(-1.0f, 1.0f), random.Range(-1.0f, 1.0f), random.Range(-1.0f, 1.0f));
+        direction *= random.Range(2.0f, 8.0f) / (std::max)(direction.norm(), 1e-3f);
+
+        // Symmetric and traceless as the moments of a cell of unit size
+        const float mass = random.Range(1.0f, 100.0f);
+        float quadrupole[6];
+        for (float& moment : quadrupole)
+        {
+            moment = mass * random.Range(-0.5f, 0.5f);
+        }
+        quadrupole[2] = -quadrupole[0] - quadrupole[1];
+        list.AddCell(position + direction, mass, quadrupole);
+    }
+
+    list.Pad();
+}
+
+/**
+    Acceleration and potential of a list in double precision, with the softening policy of the
+    kernels. The cells act as monopoles unless quadrupoles is set.
+*/
+static void EvaluateInteractionList(const InteractionList& list, const float3& position, float softening, bool quadrupoles, double acceleration[3], double& potential)
+{
+    acceleration[0] = acceleration[1] = acceleration[2] = 0.0;
+    potential = 0.0;
+
+    for (size_t i = 0; i < list.points; ++i)
+    {
+        const double x = static_cast<double>(list.pointX[i]) - position.m_x;
+        const double y = static_cast<double>(list.pointY[i]) - position.m_y;
+        const double z = static_cast<double>(list.pointZ[i]) - position.m_z;
+        const double r2 = x * x + y * y + z * z;
+        const double soft = (std::max)(softening, list.pointSoftening[i]);
+        const double factor = list.pointMass[i] * SofteningPolicy::Force(r2, soft);
+        acceleration[0] += x * factor;
+        acceleration[1] += y * factor;
+        acceleration[2] += z * factor;
+        potential -= list.pointMass[i] * SofteningPolicy::Potential(r2, soft);
+    }
+
+    for (size_t i = 0; i < list.cells; ++i)
+    {
+        const double x = static_cast<double>(list.cellX[i]) - position.m_x;
+        const double y = static_cast<double>(list.cellY[i]) - position.m_y;
+        const double z = static_cast<double>(list.cellZ[i]) - position.m_z;
+        const double r2 = x * x + y * y + z * z;
+        const double r = std::sqrt(r2);
+        const double factor = list.cellMass[i] * SofteningPolicy::Force(r2, static_cast<double>(softening));
+        if (!quadrupoles)
+        {
+            acceleration[0] += x * factor;
+            acceleration[1] += y * factor;
+            acceleration[2] += z * factor;
+            potential -= list.cellMass[i] * SofteningPolicy::Potential(r2, static_cast<double>(softening));
+            continue;
+        }
+
+        double q[6];
+        for (int j = 0; j < 6; ++j)
+        {
+            q[j] = list.cellQuadrupole[j][i];
+        }
+        const double qx = q[0] * x + q[3] * y + q[4] * z;
+        const double qy = q[3] * x + q[1] * y + q[5] * z;
+        const double qz = q[4] * x + q[5] * y + q[2] * z;
+        const double vqv = qx * x + qy * y + qz * z;
+        const double invR5 = 1.0 / (r2 * r2 * r);
+        const double radial = factor + 2.5 * vqv / r2 * invR5;
+        acceleration[0] += x * radial - qx * invR5;
+        acceleration[1] += y * radial - qy * invR5;
+        acceleration[2] += z * radial - qz * invR5;
+        potential -= list.cellMass[i] * SofteningPolicy::Potential(r2, static_cast<double>(softening)) + 0.5 * vqv * invR5;
+    }
+}
+
+static KernelResult RunKernels(const BenchmarkOptions& options)
+{
+    KernelResult result;
+
+    CounterRandom random(options.seed, 0, 0);
+    std::vector<InteractionList> lists(cKernelLists);
+    std::vector<float3> positions(cKernelLists);
+    // Acceleration and potential of every list with the cells as monopoles, then with quadrupoles
+    std::vector<double> exact(8 * cKernelLists);
+    for (uint32_t i = 0; i < cKernelLists; ++i)
+    {
+        positions[i] = float3(random.Range(-10.0f, 10.0f), random.Range(-10.0f, 10.0f), random.Range(-10.0f, 10.0f));
+        MakeInteractionList(random, positions[i], lists[i]);
+        EvaluateInteractionList(lists[i], positions[i], cDefaultSoftening, false, &exact[8 * i], exact[8 * i + 3]);
+        EvaluateInteractionList(lists[i], positions[i], cDefaultSoftening, true, &exact[8 * i + 4], exact[8 * i + 7]);
+        result.interactions += cKernelRepeats * (lists[i].points + lists[i].cells);
+    }
+
+    for (uint32_t isa = 0; isa < static_cast<uint32_t>(KernelIsa::Count); ++isa)
+    {
+        KernelRun run;
+        run.isa = static_cast<KernelIsa>(isa);
+        run.supported = IsKernelIsaSupported(run.isa);
+        if (!run.supported)
+        {
+            result.runs.push_back(run);
+            continue;
+        }
+        const GravityKernels& kernels = GetGravityKernels(run.isa);
+
+        for (uint32_t i = 0; i < 2 * cKernelLists; ++i)
+        {
+            const uint32_t list = i / 2;
+            const GravityKernels::Kernel cells = i % 2 ? kernels.cells : kernels.monopoles;
+            float3 acceleration;
+            float potential = 0.0f;
+            kernels.points(lists[list], positions[list], cDefaultSoftening, acceleration, &potential);
+            if (lists[list].cells)
+            {
+                cells(lists[list], positions[list], cDefaultSoftening, acceleration, &potential);
+            }
+
+            const double* e = &exact[4 * i];
+            const double dx = acceleration.m_x - e[0];
+            const double dy = acceleration.m_y - e[1];
+            const double dz = acceleration.m_z - e[2];
+            run.accelerationError = (std::max)(run.accelerationError, std::sqrt((dx * dx + dy * dy + dz * dz) / (e[0] * e[0] + e[1] * e[1] + e[2] * e[2])));
+            run.potentialError = (std::max)(run.potentialError, std::abs(potential - e[3]) / std::abs(e[3]));
+        }
+
+        // Forces only, as the steps compute them
+        std::vector<double> passes;
+        float3 sink;
+        for (uint32_t pass = 0; pass < options.steps; ++pass)
+        {
+            Timer<std::milli> timer;
+            for (uint32_t i = 0; i < cKernelLists; ++i)
+            {
+                for (uint32_t repeat = 0; repeat < cKernelRepeats; ++repeat)
+                {
+                    kernels.points(lists[i], positions[i], cDefaultSoftening, sink, nullptr);
+                    if (lists[i].cells)
+                    {
+                        kernels.cells(lists[i], positions[i], cDefaultSoftening, sink, nullptr);
+                    }
+                }
+            }
+            passes.push_back(timer.GetPassedTime());
+        }
+        run.msecs = GetStatistics(passes);
+        // Keeps the timed evaluations from being optimized away
+        if (!std::isfinite(sink.m_x))
+        {
+            std::cout << "  non-finite forces" << std::endl;
+        }
+        result.runs.push_back(run);
+    }
+
+    return result;
+}
+
+static bool IsKernelRunAccurate(const KernelRun& run)
+{
+    return run.accelerationError <= cKernelTolerance && run.potentialError <= cKernelTolerance;
+}
+
+static void PrintKernelResult(const KernelResult& result)
+{
+    std::cout << "Kernels, " << cKernelLists << " lists, " << result.interactions << " interactions per pass" << std::endl;
+    std::cout << "  kernels  acceleration error  potential error    pass ms  interactions/s" << std::endl;
+
+    for (const auto& run : result.runs)
+    {
+        char line[256];
+        if (!run.supported)
+        {
+            std::snprintf(line, sizeof(line), "  %-7s  not supported", GetKernelIsaName(run.isa));
+        }
+        else
+        {
+            const double seconds = run.msecs.median * 1e-3;
+            std::snprintf(line, sizeof(line), "  %-7s  %18.3e %16.3e %10.3f %15.4g%s",
+                GetKernelIsaName(run.isa), run.accelerationError, run.potentialError, run.msecs.median,
+                seconds > 0.0 ? result.interactions / seconds : 0.0, IsKernelRunAccurate(run) ? "" : "  FAILED");
+        }
+        std::cout << line << std::endl;
+    }
+}
+
+/**
+    Solves laplace(u) = f on [-1, 1]^dimensions for u = sin(pi x') sin(pi y') [sin(pi z')] + x y,
+    with x' = (x + 1) / 2, whose boundary values come from the harmonic x y.
+*/
+static MultigridRun RunMultigrid(uint32_t dimensions, uint32_t size, const BenchmarkOptions& options)
+{
+    const double pi = 3.14159265358979323846;
+    const float min = -1.0f;
+    const float max = 1.0f;
+
+    MultigridRun run;
+    run.dimensions = dimensions;
+    run.size = size;
+
+    MultigridPoisson solver(dimensions, size, min, max);
+    run.levels = solver.GetLevelCount();
+
+    std::vector<double> exact(solver.GetPointCount());
+    std::vector<float> boundary(solver.GetPointCount());
+    std::vector<float> f(solver.GetPointCount());
+    const double step = static_cast<double>(max - min) / (size - 1);
+    const double k = pi / (max - min);
+    for (size_t i = 0; i < exact.size(); ++i)
+    {
+        const size_t ix = i % size;
+        const size_t iy = (i / size) % size;
+        const size_t iz = i / (static_cast<size_t>(size) * size);
+        const double x = min + ix * step;
+        const double y = min + iy * step;
+        const double z = min + iz * step;
+
+        double wave = std::sin(k * (x - min)) * std::sin(k * (y - min));
+        if (dimensions == 3)
+        {
+            wave *= std::sin(k * (z - min));
+        }
+        exact[i] = wave + x * y;
+        f[i] = static_cast<float>(-(dimensions * k * k) * wave);
+
+        const bool onBoundary = ix == 0 || ix == size - 1 || iy == 0 || iy == size - 1 || 
+            (dimensions == 3 && (iz == 0 || iz == size - 1));
+        boundary[i] = onBoundary ? static_cast<float>(exact[i]) : 0.0f;
+    }
+
+    std::vector<float> u = boundary;
+    run.converged = solver.Solve(u, f);
+    run.cycles = solver.GetCycleCount();
+    run.residual = solver.GetResidual();
+    run.tolerance = solver.GetTolerance();
+    for (size_t i = 0; i < u.size(); ++i)
+    {
+        run.maxError = (std::max)(run.maxError, std::abs(u[i] - exact[i]));
+    }
+    // The errors of the discretization and of the solve
+    run.errorBound = cMultigridErrorFactor * (step * step + run.tolerance);
+
+    std::vector<double> passes;
+    for (uint32_t pass = 0; pass < options.steps; ++pass)
+    {
+        u = boundary;
+        Timer<std::milli> timer;
+        solver.Solve(u, f);
+        passes.push_back(timer.GetPassedTime());
+    }
+    run.msecs = GetStatistics(passes);
+
+    return run;
+}
+
+static bool IsMultigridRunAccurate(const MultigridRun& run)
+{
+    return run.converged && run.maxError <= run.errorBound;
+}
+
+static void PrintMultigridResult(const std::vector<MultigridRun>& runs)
+{
+    std::cout << "Multigrid" << std::endl;
+    std::cout << "  grid        levels  cycles    residual   tolerance   max error       bound    solve ms" << std::endl;
+
+    for (const auto& run : runs)
+    {
+        char grid[32];
+        std::snprintf(grid, sizeof(grid), "%u^%u", run.size, run.dimensions);
+        char line[256];
+        std::snprintf(line, sizeof(line), "  %-10s %7u %7u %11.3e %11.3e %11.3e %11.3e %11.3f%s",
+            grid, run.levels, run.cycles, run.residual, run.tolerance, run.maxError, run.errorBound, run.msecs.median,
+            IsMultigridRunAccurate(run) ? "" : (run.converged ? "  FAILED" : "  NOT CONVERGED"));
+        std::cout << line << std::endl;
+    }
+}
+
+/** Cost of a dispatch of an empty kernel with a block per thread, in microseconds. */
+static SampleStatistics MeasureDispatch(uint32_t dispatches)
+{
+    const uint32_t count = ThreadPool::GetThreadCount();
+    std::vector<uint32_t> sink(count);
+
+    std::vector<double> samples;
+    samples.reserve(dispatches);
+    for (uint32_t i = 0; i < dispatches; ++i)
+    {
+        Timer<std::micro> timer;
+        ThreadPool().Dispatch([&](uint32_t index) { ++sink[index]; }, count, 1);
+        samples.push_back(timer.GetPassedTime());
+    }
+    return GetStatistics(samples);
+}
+
+static void PrintResult(const ConfigurationResult& result)
+{
+    std::cout << result.configuration << ", " << result.particles << " particles, setup " << result.setupSecs << " s, "
+        << result.interactionsPerStep << " interactions per step" << std::endl;
+
+    for (const auto& stage : result.stages)
+    {
+        const double seconds = stage.msecs.median * 1e-3;
+        char line[256];
+        std::snprintf(line, sizeof(line), "  %-20s median %10.3f ms, MAD %8.3f ms, %10.4g particles/s",
+            stage.name, stage.msecs.median, stage.msecs.mad, seconds > 0.0 ? result.particles / seconds : 0.0);
+        std::cout << line;
+        if (!std::strcmp(stage.name, "ComputeAcceleration") && seconds > 0.0)
+        {
+            std::snprintf(line, sizeof(line), ", %10.4g interactions/s", result.interactionsPerStep / seconds);
+            std::cout << line;
+        }
+        std::cout << std::endl;
+    }
+}
+
+static bool WriteJson(const std::string& filename, const BenchmarkOptions& options, const std::vector<ConfigurationResult>& results, const SampleStatistics& dispatch)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    file.precision(6);
+    file << "{\n";
+    file << "  \"threads\": " << ThreadPool::GetThreadCount() << ",\n";
+    file << "  \"steps\": " << options.steps << ",\n";
+    file << "  \"seed\": " << options.seed << ",\n";
+    file << "  \"dispatch\": { \"medianUsecs\": " << dispatch.median << ", \"madUsecs\": " << dispatch.mad << " },\n";
+    file << "  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const ConfigurationResult& result = results[i];
+        file << (i > 0 ? ",\n" : "\n");
+        file << "    { \"configuration\": \"" << result.configuration << "\", \"particles\": " << result.particles
+            << ", \"setupSecs\": " << result.setupSecs << ", \"interactionsPerStep\": " << result.interactionsPerStep << ", \"stages\": {";
+
+        for (size_t j = 0; j < result.stages.size(); ++j)
+        {
+            const StageResult& stage = result.stages[j];
+            const double seconds = stage.msecs.median * 1e-3;
+            file << (j > 0 ? ",\n" : "\n");
+            file << "      \"" << stage.name << "\": { \"medianMsecs\": " << stage.msecs.median << ", \"madMsecs\": " << stage.msecs.mad
+                << ", \"particlesPerSecond\": " << (seconds > 0.0 ? result.particles / seconds : 0.0);
+            if (!std::strcmp(stage.name, "ComputeAcceleration"))
+            {
+                file << ", \"interactionsPerSecond\": " << (seconds > 0.0 ? result.interactionsPerStep / seconds : 0.0);
+            }
+            file << " }";
+        }
+        file << "\n    } }";
+    }
+
+    file << "\n  ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+static bool WriteAccuracyJson(const std::string& filename, const BenchmarkOptions& options, const std::vector<AccuracyResult>& results)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    file.precision(6);
+    file << "{\n";
+    file << "  \"threads\": " << ThreadPool::GetThreadCount() << ",\n";
+    file << "  \"passes\": " << options.steps << ",\n";
+    file << "  \"seed\": " << options.seed << ",\n";
+    file << "  \"accuracy\": [";
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const AccuracyResult& result = results[i];
+        file << (i > 0 ? ",\n" : "\n");
+        file << "    { \"configuration\": \"" << result.configuration << "\", \"particles\": " << result.particles
+            << ", \"samples\": " << result.samples << ", \"runs\": [";
+
+        for (size_t j = 0; j < result.runs.size(); ++j)
+        {
+            const AccuracyRun& run = result.runs[j];
+            file << (j > 0 ? ",\n" : "\n");
+            file << "      { \"openingAngle\": " << run.accuracy.openingAngle << ", \"leafSize\": " << run.accuracy.leafCapacity
+                << ", \"multipoleOrder\": \"" << GetMultipoleOrderName(run.accuracy.multipoleOrder) << "\""
+                << ", \"rmsError\": " << run.rmsError << ", \"p99Error\": " << run.p99Error
+                << ", \"buildMedianMsecs\": " << run.buildMsecs.median << ", \"buildMadMsecs\": " << run.buildMsecs.mad
+                << ", \"forceMedianMsecs\": " << run.forceMsecs.median << ", \"forceMadMsecs\": " << run.forceMsecs.mad
+                << ", \"interactionsPerParticle\": " << run.interactionsPerParticle << " }";
+        }
+        file << "\n    ] }";
+    }
+
+    file << "\n  ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+static bool WriteKernelJson(const std::string& filename, const BenchmarkOptions& options, const KernelResult& result)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    file.precision(6);
+    file << "{\n";
+    file << "  \"passes\": " << options.steps << ",\n";
+    file << "  \"seed\": " << options.seed << ",\n";
+    file << "  \"interactionsPerPass\": " << result.interactions << ",\n";
+    file << "  \"kernels\": [";
+
+    bool first = true;
+    for (const KernelRun& run : result.runs)
+    {
+        if (!run.supported)
+        {
+            continue;
+        }
+        const double seconds = run.msecs.median * 1e-3;
+        file << (first ? "\n" : ",\n");
+        first = false;
+        file << "    { \"isa\": \"" << GetKernelIsaName(run.isa) << "\", \"accelerationError\": " << run.accelerationError
+            << ", \"potentialError\": " << run.potentialError
+            << ", \"passMedianMsecs\": " << run.msecs.median << ", \"passMadMsecs\": " << run.msecs.mad
+            << ", \"interactionsPerSecond\": " << (seconds > 0.0 ? result.interactions / seconds : 0.0) << " }";
+    }
+
+    file << "\n  ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+static bool WriteMultigridJson(const std::string& filename, const BenchmarkOptions& options, const std::vector<MultigridRun>& runs)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    file.precision(6);
+    file << "{\n";
+    file << "  \"threads\": " << ThreadPool::GetThreadCount() << ",\n";
+    file << "  \"passes\": " << options.steps << ",\n";
+    file << "  \"multigrid\": [";
+
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        const MultigridRun& run = runs[i];
+        file << (i > 0 ? ",\n" : "\n");
+        file << "    { \"dimensions\": " << run.dimensions << ", \"size\": " << run.size << ", \"levels\": " << run.levels
+            << ", \"cycles\": " << run.cycles << ", \"converged\": " << (run.converged ? "true" : "false")
+            << ", \"residual\": " << run.residual << ", \"tolerance\": " << run.tolerance
+            << ", \"maxError\": " << run.maxError << ", \"errorBound\": " << run.errorBound
+            << ", \"solveMedianMsecs\": " << run.msecs.median << ", \"solveMadMsecs\": " << run.msecs.mad << " }";
+    }
+
+    file << "\n  ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && (!std::strcmp(argv[1], "--help") || !std::strcmp(argv[1], "-h")))
+    {
+        PrintUsage();
+        return 0;
+    }
+
+    BenchmarkOptions options;
+    if (!ParseArguments(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    ThreadPool::Create(options.threads > 0 ? options.threads : std::thread::hardware_concurrency());
+    std::cout << "Threads: " << ThreadPool::GetThreadCount() << ", timed steps: " << options.steps << std::endl;
+
+    if (options.kernels)
+    {
+        const KernelResult result = RunKernels(options);
+        PrintKernelResult(result);
+
+        int exitCode = 0;
+        for (const auto& run : result.runs)
+        {
+            if (run.supported && !IsKernelRunAccurate(run))
+            {
+                exitCode = 1;
+            }
+        }
+        if (!options.jsonFile.empty() && !WriteKernelJson(options.jsonFile, options, result))
+        {
+            std::cerr << "Can't write " << options.jsonFile << std::endl;
+            exitCode = 1;
+        }
+
+        ThreadPool::Destroy();
+
+        return exitCode;
+    }
+
+    if (options.multigrid)
+    {
+        std::vector<MultigridRun> runs;
+        for (uint32_t size : cMultigridSizes2d)
+        {
+            runs.push_back(RunMultigrid(2, size, options));
+        }
+        for (uint32_t size : cMultigridSizes3d)
+        {
+            runs.push_back(RunMultigrid(3, size, options));
+        }
+        PrintMultigridResult(runs);
+
+        int exitCode = 0;
+        for (const auto& run : runs)
+        {
+            if (!IsMultigridRunAccurate(run))
+            {
+                exitCode = 1;
+            }
+        }
+        if (!options.jsonFile.empty() && !WriteMultigridJson(options.jsonFile, options, runs))
+        {
+            std::cerr << "Can't write " << options.jsonFile << std::endl;
+            exitCode = 1;
+        }
+
+        ThreadPool::Destroy();
+
+        return exitCode;
+    }
+
+    if (options.accuracy)
+    {
+        std::vector<AccuracyResult> results;
+        for (uint32_t size : options.sizes)
+        {
+            for (bool plummer : { true, false })
+            {
+                if (plummer ? !options.plummer : !options.disk)
+                {
+                    continue;
+                }
+                results.push_back(RunAccuracy(plummer, size, options));
+                PrintAccuracyResult(results.back());
+            }
+        }
+
+        int result = 0;
+        if (!options.jsonFile.empty() && !WriteAccuracyJson(options.jsonFile, options, results))
+        {
+            std::cerr << "Can't write " << options.jsonFile << std::endl;
+            result = 1;
+        }
+
+        ThreadPool::Destroy();
+
+        return result;
+    }
+
+    const SampleStatistics dispatch = MeasureDispatch(options.dispatches);
+    std::cout << "Dispatch of an empty kernel: median " << dispatch.median << " us, MAD " << dispatch.mad << " us" << std::endl;
+
+    std::vector<ConfigurationResult> results;
+    for (uint32_t size : options.sizes)
+    {
+        for (bool plummer : { true, false })
+        {
+            if (plummer ? !options.plummer : !options.disk)
+            {
+                continue;
+            }
+            results.push_back(RunConfiguration(plummer, size, options));
+            PrintResult(results.back());
+        }
+    }
+
+    int result = 0;
+    if (!options.jsonFile.empty() && !WriteJson(options.jsonFile, options, results, dispatch))
+    {
+        std::cerr << "Can't write " << options.jsonFile << std::endl;
+        result = 1;
+    }
+
+    ThreadPool::Destroy();
+
+    return result;
+}
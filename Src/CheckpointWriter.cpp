@@ -0,0 +1,286 @@
+#include "CheckpointWriter.h"
+#include "SnapshotFile.h"
+#include "Threading.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Size of a single write call, a multiple of the snapshot block alignment
+static constexpr uint64_t cWriteChunkSize = 2048 * cSnapshotBlockAlignment;
+// Particles packed by a single kernel invocation
+static constexpr uint64_t cPackChunkSize = 64 * 1024;
+
+#ifdef _WIN32
+
+static bool WriteFileAtomically(const std::string& filename, const uint8_t* data, uint64_t size, std::string& error)
+{
+    const std::string temporary = filename + ".tmp";
+
+    HANDLE file = CreateFileA(temporary.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        error = "Can't create " + temporary;
+        return false;
+    }
+
+    bool ok = true;
+    for (uint64_t offset = 0; ok && offset < size; offset += cWriteChunkSize)
+    {
+        const DWORD chunk = static_cast<DWORD>(std::min(cWriteChunkSize, size - offset));
+        DWORD written = 0;
+        ok = WriteFile(file, data + offset, chunk, &written, nullptr) && written == chunk;
+    }
+
+    ok = ok && FlushFileBuffers(file);
+    ok = CloseHandle(file) && ok;
+
+    if (!ok)
+    {
+        DeleteFileA(temporary.c_str());
+        error = "Can't write " + temporary;
+        return false;
+    }
+
+    if (!MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        DeleteFileA(temporary.c_str());
+        error = "Can't replace " + filename;
+        return false;
+    }
+
+    return true;
+}
+
+#else
+
+static bool WriteFileAtomically(const std::string& filename, const uint8_t* data, uint64_t size, std::string& error)
+{
+    const std::string temporary = filename + ".tmp";
+
+    int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+    {
+        error = "Can't create " + temporary;
+        return false;
+    }
+
+    bool ok = true;
+    uint64_t offset = 0;
+    while (ok && offset < size)
+    {
+        const size_t chunk = static_cast<size_t>(std::min(cWriteChunkSize, size - offset));
+        const ssize_t written = write(file, data + offset, chunk);
+        ok = written > 0;
+        offset += ok ? static_cast<uint64_t>(written) : 0;
+    }
+
+    ok = ok && fsync(file) == 0;
+    ok = close(file) == 0 && ok;
+
+    if (!ok)
+    {
+        unlink(temporary.c_str());
+        error = "Can't write " + temporary;
+        return false;
+    }
+
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        error = "Can't replace " + filename;
+        return false;
+    }
+
+    // Make the rename itself durable
+    const size_t slash = filename.find_last_of('/');
+    const std::string directory = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+    int directoryFile = open(directory.c_str(), O_RDONLY);
+    if (directoryFile >= 0)
+    {
+        fsync(directoryFile);
+        close(directoryFile);
+    }
+
+    return true;
+}
+
+#endif
+
+CheckpointWriter::CheckpointWriter(uint32_t stagingBufferCount, Overflow overflow)
+    : overflow(overflow)
+{
+    assert(stagingBufferCount > 0);
+
+    for (uint32_t i = 0; i < stagingBufferCount; ++i)
+    {
+        freeBuffers.push_back(std::make_unique<Staging>());
+    }
+
+    worker = std::thread([this]() 
+    { 
+        Profiler::SetThreadName("Checkpoint writer");
+        Worker(); 
+    });
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminate = true;
+    }
+    signal.notify_all();
+    worker.join();
+}
+
+bool CheckpointWriter::Submit(const std::string& filename, const Universe& universe, const SimulationParameters& parameters, double time, uint64_t stepCount, float deltaTime)
+{
+    PROFILE_ZONE("CheckpointCopy");
+
+    std::unique_ptr<Staging> staging;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeBuffers.empty())
+        {
+            if (overflow == Overflow::Skip)
+            {
+                ++skipped;
+                return false;
+            }
+            done.wait(lock, [&]() { return !freeBuffers.empty(); });
+        }
+        staging = std::move(freeBuffers.back());
+        freeBuffers.pop_back();
+    }
+
+    const SnapshotLayout layout = MakeSnapshotLayout(universe, parameters, time, stepCount, deltaTime);
+
+    std::vector<uint8_t> prefix;
+    StoreSnapshotPrefix(layout, prefix);
+
+    // Keeps the capacity of the previous checkpoint, so steady state doesn't allocate
+    staging->filename = filename;
+    staging->bytes.resize(static_cast<size_t>(layout.fileSize));
+    uint8_t* bytes = staging->bytes.data();
+
+    std::memcpy(bytes, prefix.data(), prefix.size());
+
+    // Padding after every block, the buffer may hold an older checkpoint
+    for (size_t i = 0; i < layout.blocks.size(); ++i)
+    {
+        const uint64_t end = layout.blocks[i].offset + layout.blocks[i].size;
+        const uint64_t next = i + 1 < layout.blocks.size() ? layout.blocks[i + 1].offset : layout.fileSize;
+        std::memset(bytes + end, 0, static_cast<size_t>(next - end));
+    }
+
+    // Halo and tracer blocks may be longer or shorter than the particle blocks, chunks past their end are empty
+    const uint64_t maxCount = std::max({ layout.header.particleCount, layout.header.haloParticleCount, layout.header.tracerCount });
+    const uint64_t chunksPerBlock = std::max((maxCount + cPackChunkSize - 1) / cPackChunkSize, uint64_t(1));
+
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        const SnapshotBlock& block = layout.blocks[i / chunksPerBlock];
+        const uint64_t elementCount = block.size / block.elementSize;
+        const uint64_t first = (i % chunksPerBlock) * cPackChunkSize;
+        if (first >= elementCount)
+        {
+            return;
+        }
+        const uint64_t count = std::min(cPackChunkSize, elementCount - first);
+
+        StoreSnapshotBlock(universe, block.id, first, count, bytes + block.offset + first * block.elementSize);
+
+    }, static_cast<uint32_t>(layout.blocks.size() * chunksPerBlock), 1);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(staging));
+    }
+    signal.notify_one();
+
+    return true;
+}
+
+void CheckpointWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return pending.empty() && writing == 0; });
+}
+
+uint32_t CheckpointWriter::GetWrittenCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return written;
+}
+
+uint32_t CheckpointWriter::GetSkippedCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return skipped;
+}
+
+uint32_t CheckpointWriter::GetFailedCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return failed;
+}
+
+std::string CheckpointWriter::GetLastError() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return lastError;
+}
+
+void CheckpointWriter::Worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        signal.wait(lock, [&]() { return terminate || !pending.empty(); });
+
+        if (pending.empty())
+        {
+            break;  // terminating and nothing left to write
+        }
+
+        std::unique_ptr<Staging> staging = std::move(pending.front());
+        pending.pop_front();
+        ++writing;
+
+        lock.unlock();
+        std::string error;
+        bool ok;
+        {
+            PROFILE_ZONE("CheckpointWrite");
+            ok = WriteFileAtomically(staging->filename, staging->bytes.data(), staging->bytes.size(), error);
+        }
+        lock.lock();
+
+        if (ok)
+        {
+            ++written;
+        }
+        else
+        {
+            ++failed;
+            lastError = error;
+        }
+
+        --writing;
+        freeBuffers.push_back(std::move(staging));
+        done.notify_all();
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Universe;
+struct SimulationParameters;
+
+/**
+    Writes snapshots in the background.
+
+    Submit packs the universe into a staging buffer with ThreadPool and returns, a worker thread
+    then writes the buffer to a temporary file in large chunks, syncs it to disk and renames it
+    over the target, so a crash never leaves a torn checkpoint behind.
+
+    Memory is bounded by the number of staging buffers. When all of them are still waiting for
+    the disk the overflow policy decides whether Submit waits or drops the checkpoint.
+*/
+class CheckpointWriter
+{
+public:
+    enum class Overflow
+    {
+        // Wait for a free staging buffer
+        Block,
+        // Drop the checkpoint
+        Skip
+    };
+
+    CheckpointWriter(uint32_t stagingBufferCount = 2, Overflow overflow = Overflow::Block);
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    /** Copies the state and queues it for writing. Returns false if the checkpoint was dropped. */
+    bool Submit(const std::string& filename, const Universe& universe, const SimulationParameters& parameters, double time, uint64_t stepCount, float deltaTime);
+
+    /** Waits until all queued checkpoints are on disk. */
+    void Flush();
+
+    uint32_t GetWrittenCount() const;
+    uint32_t GetSkippedCount() const;
+    uint32_t GetFailedCount() const;
+    std::string GetLastError() const;
+
+private:
+    struct Staging
+    {
+        std::string filename;
+        std::vector<uint8_t> bytes;
+    };
+
+    void Worker();
+
+    const Overflow overflow;
+
+    mutable std::mutex mutex;
+    // Signals the worker about new jobs
+    std::condition_variable signal;
+    // Signals producers about free buffers and finished jobs
+    std::condition_variable done;
+
+    std::vector<std::unique_ptr<Staging>> freeBuffers;
+    std::deque<std::unique_ptr<Staging>> pending;
+    uint32_t writing = 0;
+    bool terminate = false;
+
+    uint32_t written = 0;
+    uint32_t skipped = 0;
+    uint32_t failed = 0;
+    std::string lastError;
+
+    std::thread worker;
+};
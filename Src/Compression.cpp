@@ -0,0 +1,190 @@
+#include "Compression.h"
+
+#include <cstring>
+
+static constexpr size_t cMinMatch = 4;
+static constexpr size_t cMaxOffset = 65535;
+static constexpr uint32_t cHashBits = 14;
+
+static inline uint32_t Read32(const uint8_t* data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - cHashBits);
+}
+
+static void WriteLength(size_t length, std::vector<uint8_t>& destination)
+{
+    // Length continues while bytes are 255
+    while (length >= 255)
+    {
+        destination.push_back(255);
+        length -= 255;
+    }
+    destination.push_back(static_cast<uint8_t>(length));
+}
+
+static bool ReadLength(const uint8_t*& source, const uint8_t* end, size_t& length)
+{
+    uint8_t byte;
+    do
+    {
+        if (source == end)
+        {
+            return false;
+        }
+        byte = *source++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static void WriteSequence(const uint8_t* literals, size_t literalCount, size_t matchLength, size_t offset, std::vector<uint8_t>& destination)
+{
+    const size_t matchCode = matchLength > 0 ? matchLength - cMinMatch : 0;
+
+    uint8_t token = static_cast<uint8_t>((literalCount < 15 ? literalCount : 15) << 4);
+    token |= static_cast<uint8_t>(matchCode < 15 ? matchCode : 15);
+    destination.push_back(token);
+
+    if (literalCount >= 15)
+    {
+        WriteLength(literalCount - 15, destination);
+    }
+    destination.insert(destination.end(), literals, literals + literalCount);
+
+    if (matchLength == 0)
+    {
+        return;  // last sequence
+    }
+
+    destination.push_back(static_cast<uint8_t>(offset & 0xFF));
+    destination.push_back(static_cast<uint8_t>(offset >> 8));
+
+    if (matchCode >= 15)
+    {
+        WriteLength(matchCode - 15, destination);
+    }
+}
+
+void CompressLZ(const uint8_t* source, size_t size, std::vector<uint8_t>& destination)
+{
+    std::vector<int64_t> table(size_t(1) << cHashBits, -1);
+
+    size_t anchor = 0;
+    size_t i = 0;
+
+    while (size >= cMinMatch && i <= size - cMinMatch)
+    {
+        const uint32_t sequence = Read32(source + i);
+        const uint32_t hash = Hash(sequence);
+        const int64_t candidate = table[hash];
+        table[hash] = static_cast<int64_t>(i);
+
+        if (candidate < 0 || i - candidate > cMaxOffset || Read32(source + candidate) != sequence)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t length = cMinMatch;
+        while (i + length < size && source[candidate + length] == source[i + length])
+        {
+            ++length;
+        }
+
+        WriteSequence(source + anchor, i - anchor, length, i - static_cast<size_t>(candidate), destination);
+
+        i += length;
+        anchor = i;
+    }
+
+    WriteSequence(source + anchor, size - anchor, 0, 0, destination);
+}
+
+bool DecompressLZ(const uint8_t* source, size_t size, uint8_t* destination, size_t destinationSize)
+{
+    const uint8_t* end = source + size;
+    size_t written = 0;
+
+    while (source < end)
+    {
+        const uint8_t token = *source++;
+
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !ReadLength(source, end, literalCount))
+        {
+            return false;
+        }
+        if (literalCount > static_cast<size_t>(end - source) || literalCount > destinationSize - written)
+        {
+            return false;
+        }
+        std::memcpy(destination + written, source, literalCount);
+        source += literalCount;
+        written += literalCount;
+
+        if (source == end)
+        {
+            break;  // last sequence has no match
+        }
+
+        if (end - source < 2)
+        {
+            return false;
+        }
+        const size_t offset = source[0] | (source[1] << 8);
+        source += 2;
+
+        size_t length = token & 0x0F;
+        if (length == 15 && !ReadLength(source, end, length))
+        {
+            return false;
+        }
+        length += cMinMatch;
+
+        if (offset == 0 || offset > written || length > destinationSize - written)
+        {
+            return false;
+        }
+
+        // Byte by byte, the match may overlap its own output
+        const uint8_t* match = destination + written - offset;
+        for (size_t k = 0; k < length; ++k)
+        {
+            destination[written + k] = match[k];
+        }
+        written += length;
+    }
+
+    return written == destinationSize;
+}
+
+void ShuffleBytes(const uint8_t* source, size_t count, size_t elementSize, uint8_t* destination)
+{
+    for (size_t b = 0; b < elementSize; ++b)
+    {
+        uint8_t* plane = destination + b * count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            plane[i] = source[i * elementSize + b];
+        }
+    }
+}
+
+void UnshuffleBytes(const uint8_t* source, size_t count, size_t elementSize, uint8_t* destination)
+{
+    for (size_t b = 0; b < elementSize; ++b)
+    {
+        const uint8_t* plane = source + b * count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            destination[i * elementSize + b] = plane[i];
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+Byte-oriented LZ77 coder in the spirit of LZ4: sequences of literals followed by a match
+within the previous 64 KiB. Fast on both ends and good at the long zero runs that byte
+shuffling produces, no entropy stage.
+*/
+
+/** Appends the compressed form of source to destination. */
+void CompressLZ(const uint8_t* source, size_t size, std::vector<uint8_t>& destination);
+
+/** Decompresses exactly destinationSize bytes, returns false on corrupt input. */
+bool DecompressLZ(const uint8_t* source, size_t size, uint8_t* destination, size_t destinationSize);
+
+/** Splits count elements of elementSize bytes into elementSize planes of equal bytes. */
+void ShuffleBytes(const uint8_t* source, size_t count, size_t elementSize, uint8_t* destination);
+void UnshuffleBytes(const uint8_t* source, size_t count, size_t elementSize, uint8_t* destination);
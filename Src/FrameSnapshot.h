@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+#include "float3.h"
+#include "Solver.h"
+
+/** Cell of the Barnes-Hut tree as seen by the renderer. */
+struct TreeCell
+{
+    float3 point;
+    float length;
+};
+
+/** Immutable state of the simulation published by the solver thread once per step. */
+struct FrameSnapshot
+{
+    // Positions of the particles of all galaxies in galaxy order
+    std::vector<float3> positions;
+    // Positions of the tracers of all galaxies in galaxy order
+    std::vector<float3> tracerPositions;
+    // Cells of the tree, filled only when tree rendering is on
+    std::vector<TreeCell> treeCells;
+    // Work of the tree walks of the step
+    WalkStatistics walkStatistics;
+};
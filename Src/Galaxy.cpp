@@ -1,13 +1,11 @@
 ﻿#include "Galaxy.h"
 
 #include <string.h>
-#include <gl\glut.h>
-#include <Windows.h>
+#include <cassert>
 
-#include "Application.h"
 #include "Constants.h"
-#include "Image.h"
 #include "Math.h"
+#include "Threading.h"
 
 int curLayer = 0;
 
@@ -17,25 +15,24 @@ void Particle::SetMass(float mass)
     inverseMass = 1.0f / mass;
 }
 
-static void SortParticlesByImages(const std::vector<Particle>& particles, std::unordered_map<const Image*, std::vector<const Particle*>>& image_to_particles)
+static void SortParticlesByType(const std::vector<Particle>& particles, std::unordered_map<ParticleType, std::vector<uint32_t>>& type_to_particles)
 {
-    image_to_particles.clear();
-    for (const auto& particle : particles)
+    type_to_particles.clear();
+    for (size_t i = 0; i < particles.size(); ++i)
     {
-        assert(particle.image);
-        image_to_particles[particle.image].push_back(&particle);
+        type_to_particles[particles[i].type].push_back(static_cast<uint32_t>(i));
     }
 }
 
-static Particle CreateStar()
+static Particle CreateStar(CounterRandom& random)
 {
     Particle particle;
 
-    particle.size = RAND_RANGE(0.1f, 0.4f);
-    particle.magnitude = RAND_RANGE(0.2f, 0.3f);
+    particle.size = random.Range(0.1f, 0.4f);
+    particle.magnitude = random.Range(0.2f, 0.3f);
 
-    int k = rand() % 3;
-    float rnd = RAND();
+    int k = random.NextUint() % 3;
+    float rnd = random.Next();
 
     switch (k)
     {
@@ -50,21 +47,21 @@ static Particle CreateStar()
         break;
     }
 
-    particle.image = &Application::GetInstance().GetImageLoader().GetImage("Star");
+    particle.type = ParticleType::Star;
 
     return particle;
 }
 
-static Particle CreateDust()
+static Particle CreateDust(CounterRandom& random)
 {
     Particle particle;
 
-    particle.size = RAND_RANGE(4.0f, 7.5f);
-    particle.magnitude = RAND_RANGE(0.015f, 0.02f);
+    particle.size = random.Range(4.0f, 7.5f);
+    particle.magnitude = random.Range(0.015f, 0.02f);
     //particle->size = 15;
     //particle.magnitude = 1;
 
-    int k = rand() % 3;
+    int k = random.NextUint() % 3;
     k = 1;
 
     if (k == 0)
@@ -76,92 +73,128 @@ static Particle CreateDust()
         particle.color = { 1.0f, 0.95f, 0.8f };
     }
 
-    particle.image = &Application::GetInstance().GetImageLoader().GetImage("Dust1");
+    particle.type = ParticleType::Dust;
 
     return particle;
 }
 
-static Particle CreateH2()
+// Plummer profile of the radius in units of the bulge or disk radius
+static const InverseCdfTable& GetRadiusTable()
 {
-    Particle particle;
-
-    particle.size = RAND_RANGE(0.2f, 0.6f);
-    particle.magnitude = RAND_RANGE(0.0f, 1.0f);
+    static const PlummerModel plummer;
+    static const InverseCdfTable table(0.0f, 1.0f, [](float x) { return plummer.GetDensity(x); });
+    return table;
+}
 
-    particle.color = { 1.0f, 0.6f, 0.6f };
+static float3 SampleBulgePosition(const GalaxyParameters& parameters, CounterRandom& random)
+{
+    float3 spherical = RandomUniformSpherical(0.0f, parameters.bulgeRadius, random);
+    spherical.m_x = GetRadiusTable().Sample(random.Next()) * parameters.bulgeRadius;
+    return SphericalToCartesian(spherical);
+}
 
-    particle.userData = rand() % 2;
+static float3 SampleDiskPosition(const GalaxyParameters& parameters, CounterRandom& random)
+{
+    float3 cylindrical = RandomUniformCylindrical(0.0f, parameters.diskRadius, parameters.diskThickness, random);
+    cylindrical.m_x = GetRadiusTable().Sample(random.Next()) * parameters.diskRadius;
+    return CylindricalToCartesian(cylindrical);
+}
 
-    return particle;
+Galaxy::Galaxy(const float3& position, const GalaxyParameters& parameters, uint32_t index)
+    : position(position)
+    , parameters(parameters)
+    , halo(parameters.haloModel, parameters.haloMass, parameters.haloRadius)
+{
+    Create(index);
+    CreateHaloParticles(index);
+    CreateTracers(index);
+    SortParticlesByType(particles, typeToParticles);
 }
 
-Galaxy::Galaxy(const float3& position, const GalaxyParameters& parameters)
+Galaxy::Galaxy(const float3& position, const GalaxyParameters& parameters, std::vector<Particle>&& particles, 
+    std::vector<HaloParticle>&& haloParticles, std::vector<TracerParticle>&& tracers)
     : position(position)
     , parameters(parameters)
-    , halo(0.0f, 2.0f * parameters.haloRadius, parameters.haloRadius)
+    , particles(std::move(particles))
+    , haloParticles(std::move(haloParticles))
+    , tracers(std::move(tracers))
+    , halo(parameters.haloModel, parameters.haloMass, parameters.haloRadius)
 {
-    Create();
-    SortParticlesByImages(particles, imageToParticles);
+    SortParticlesByType(this->particles, typeToParticles);
 }
 
 void Galaxy::SetRadialVelocitiesFromForce()
 {
+    // Other galaxies pull the whole galaxy along with its black hole, only the rest holds the orbits
+    const float3 centerAcceleration = particles[0].force * particles[0].inverseMass;
+
     for (size_t i = 1; i < particles.size(); ++i)
     {
-        float3 relativePos = particles[i].position - position;
+        float3 relativePos = particles[i].position - particles[0].position;
         float3 v = {relativePos.m_y, -relativePos.m_x, 0.0f};
         v.normalize();
 
+        float3 force = particles[i].force;
+        force.addScaled(centerAcceleration, -particles[i].mass);
+
         //float radialFromHalo = RadialVelocity(halo.GetForce(relativePos.norm()), particles[i].mass, relativePos.norm());
-        float radial = RadialVelocity(particles[i].force.norm(), particles[i].mass, relativePos.norm());
+        float radial = RadialVelocity(force.norm(), particles[i].mass, relativePos.norm());
         v *= radial;// + radialFromHalo;
         //float d = 0.1 * v.norm();
         //v += lpVec3(d * RAND_RANGE(-1.0f, 1.0f), d * RAND_RANGE(-1.0f, 1.0f), d * RAND_RANGE(-1.0f, 1.0f));
 
-        particles[i].linearVelocity = v;//{0,0,0};
+        particles[i].linearVelocity = v + velocity;
+
+    }
+
+    particles[0].linearVelocity = velocity;
 
+    // The halo has its own velocities, it only moves along with the galaxy
+    for (auto& particle : haloParticles)
+    {
+        particle.linearVelocity += velocity;
     }
 }
 
-void Galaxy::Create()
+void Galaxy::Create(uint32_t index)
 {
-    particles.reserve(parameters.bulgeParticlesCount + parameters.diskParticlesCount);
+    const uint32_t bulgeCount = parameters.bulgeParticlesCount;
+    const uint32_t diskCount = parameters.diskParticlesCount;
+
+    particles.resize(bulgeCount + diskCount);
 
     assert(parameters.diskMassRatio > 0.0f && parameters.diskMassRatio < 1.0f);
 
-    const float bulgeParticleMass = (1.0f - parameters.diskMassRatio) * parameters.mass / parameters.bulgeParticlesCount;
-    const float diskParticleMass = parameters.diskMassRatio * parameters.mass / parameters.diskParticlesCount;
+    const float bulgeParticleMass = (1.0f - parameters.diskMassRatio) * parameters.mass / bulgeCount;
+    const float diskParticleMass = parameters.diskMassRatio * parameters.mass / diskCount;
 
-    const float dustRatio = 0.1f;
+    // Tracers are the dust of a galaxy that has them
+    const float dustRatio = parameters.tracerParticlesCount > 0 ? 0.0f : 0.1f;
 
-    uint32_t numDusts = static_cast<uint32_t>(parameters.bulgeParticlesCount * dustRatio);
+    const uint32_t bulgeDusts = static_cast<uint32_t>(bulgeCount * dustRatio);
+    const uint32_t diskDusts = static_cast<uint32_t>(diskCount * dustRatio);
 
-    PlummerModel plummer;
-    
-    for (uint32_t i = 0; i < parameters.bulgeParticlesCount; ++i)
+    // Every particle has its own generator, the result doesn't depend on the thread count
+    ThreadPool().Dispatch([&](uint32_t i)
     {
-        Particle particle = i < numDusts ? CreateDust() : CreateStar();
-        particle.SetMass(bulgeParticleMass);
-        float3 spherical = RandomUniformSpherical(0.0f, parameters.bulgeRadius);
-        float r = SampleDistribution(0.0f, 1.0f, plummer.GetDensity(0.0f), [&plummer](float x) { return plummer.GetDensity(x); }) / 1.0f;
-        spherical.m_x = r * parameters.bulgeRadius;
-        particle.position = position + SphericalToCartesian(spherical);
-        particles.push_back(particle);
-    }
+        CounterRandom random(parameters.seed, index, i);
 
-    numDusts = static_cast<uint32_t>(parameters.diskParticlesCount * dustRatio);
-
-    for (uint32_t i = 0; i < parameters.diskParticlesCount; i++)
-    {
-        Particle particle = i < numDusts ? CreateDust() : CreateStar();
-        particle.SetMass(diskParticleMass);
-        float3 cylindrical = RandomUniformCylindrical(0.0f, parameters.diskRadius, parameters.diskThickness);
-        float r = SampleDistribution(0.0f, 1.0f, plummer.GetDensity(0.0f), [&plummer](float x) { return plummer.GetDensity(x); }) / 1.0f;
-        cylindrical.m_x = r * parameters.diskRadius;
-        float3 relativePos = CylindricalToCartesian(cylindrical);
-        particle.position = position + relativePos;
-        particles.push_back(particle);
-    }
+        if (i < bulgeCount)
+        {
+            Particle particle = i < bulgeDusts ? CreateDust(random) : CreateStar(random);
+            particle.SetMass(bulgeParticleMass);
+            particle.position = position + SampleBulgePosition(parameters, random);
+            particles[i] = particle;
+        }
+        else
+        {
+            Particle particle = i - bulgeCount < diskDusts ? CreateDust(random) : CreateStar(random);
+            particle.SetMass(diskParticleMass);
+            particle.position = position + SampleDiskPosition(parameters, random);
+            particles[i] = particle;
+        }
+        particles[i].id = i;
+    }, bulgeCount + diskCount, 1024);
 
     particles[0].position = position;
     particles[0].movable = false;
@@ -186,6 +219,276 @@ void Galaxy::Create()
     //}
 }
 
+// Live halos are truncated at this many halo radii
+static constexpr float cLiveHaloExtent = 5.0f;
+// Intervals of the velocity dispersion table
+static constexpr uint32_t cDispersionIntervals = 1024;
+
+/**
+    Samples the halo profile with equal mass particles. Radii follow the enclosed mass of the
+    truncated profile, velocities are isotropic Gaussians with the dispersion of the Jeans
+    equation, limited to the escape velocity so that the halo stays bound.
+*/
+void Galaxy::CreateHaloParticles(uint32_t index)
+{
+    // The Kuzmin disk is no spherical distribution, it stays analytic like a massless halo
+    const uint32_t count = parameters.haloParticlesCount;
+    if (count == 0 || parameters.haloMass <= 0.0f || GetHaloProfile(parameters.haloModel).disk)
+    {
+        return;
+    }
+
+    const float rmax = cLiveHaloExtent * parameters.haloRadius;
+
+    // Enclosed mass of a spherical profile is a r^2 with G = 1
+    auto enclosedMass = [this](float r) { return halo.GetAcceleration(r) * r * r; };
+    auto massDensity = [&](float r)
+    {
+        const float h = 1e-3f * parameters.haloRadius;
+        const float r0 = (std::max)(r - h, 0.0f);
+        return (enclosedMass(r + h) - enclosedMass(r0)) / (r + h - r0);
+    };
+
+    const InverseCdfTable radiusTable(0.0f, rmax, massDensity);
+    const float totalMass = enclosedMass(rmax);
+
+    // Isotropic Jeans equation with zero pressure at the truncation radius:
+    // rho sigma^2 (r) is the integral of rho a from r to rmax, rho is proportional to dM/dr / r^2
+    std::vector<float> dispersion(cDispersionIntervals + 1);
+    const double step = static_cast<double>(rmax) / cDispersionIntervals;
+    double pressure = 0.0;
+    double previous = 0.0;
+    for (uint32_t i = cDispersionIntervals; i > 0; --i)
+    {
+        const float r = static_cast<float>(i * step);
+        const double density = massDensity(r) / (static_cast<double>(r) * r);
+        const double integrand = density * halo.GetAcceleration(r);
+        pressure += i < cDispersionIntervals ? 0.5 * step * (integrand + previous) : 0.0;
+        previous = integrand;
+        dispersion[i] = density > 0.0 ? static_cast<float>(std::sqrt(pressure / density)) : 0.0f;
+    }
+    dispersion[0] = dispersion[1];
+
+    const float edgePotential = halo.GetPotential(rmax);
+
+    haloParticles.resize(count);
+
+    // Streams after those of the galaxy particles
+    const uint64_t firstStream = static_cast<uint64_t>(parameters.bulgeParticlesCount) + parameters.diskParticlesCount;
+
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        CounterRandom random(parameters.seed, index, firstStream + i);
+
+        const float r = radiusTable.Sample(random.Next());
+        const float cosTheta = random.Range(-1.0f, 1.0f);
+        const float sinTheta = std::sqrt((std::max)(1.0f - cosTheta * cosTheta, 0.0f));
+        const float phi = 2.0f * PI * random.Next();
+
+        const float t = r / rmax * cDispersionIntervals;
+        const size_t k = (std::min)(static_cast<size_t>(t), static_cast<size_t>(cDispersionIntervals - 1));
+        const float sigma = lerp(dispersion[k], dispersion[k + 1], t - k);
+
+        // Box-Muller, 1 - u is never zero
+        float3 velocity;
+        for (float* component : { &velocity.m_x, &velocity.m_y, &velocity.m_z })
+        {
+            const float u = 1.0f - random.Next();
+            *component = sigma * std::sqrt(-2.0f * std::log(u)) * std::cos(2.0f * PI * random.Next());
+        }
+
+        // Escape velocity of the truncated halo, its potential outside rmax is that of a point mass
+        const float escape = std::sqrt((std::max)(2.0f * (edgePotential - halo.GetPotential(r) + totalMass / rmax), 0.0f));
+        const float speed = velocity.norm();
+        if (speed > 0.95f * escape)
+        {
+            velocity *= 0.95f * escape / speed;
+        }
+
+        HaloParticle& particle = haloParticles[i];
+        particle.position = position + float3(r * sinTheta * std::cos(phi), r * sinTheta * std::sin(phi), r * cosTheta);
+        particle.linearVelocity = velocity;
+        particle.mass = totalMass / count;
+    }, count, 1024);
+}
+
+void Galaxy::CreateTracers(uint32_t index)
+{
+    const uint32_t count = parameters.tracerParticlesCount;
+    const uint32_t bulgeCount = parameters.bulgeParticlesCount;
+    const uint32_t diskCount = parameters.diskParticlesCount;
+
+    // Split between the bulge and the disk like the particles
+    const uint32_t bulgeTracers = static_cast<uint32_t>(static_cast<uint64_t>(count) * bulgeCount / (std::max)(bulgeCount + diskCount, 1u));
+
+    tracers.resize(count);
+
+    // Streams after those of the particles and the halo
+    const uint64_t firstStream = static_cast<uint64_t>(bulgeCount) + diskCount + parameters.haloParticlesCount;
+
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        CounterRandom random(parameters.seed, index, firstStream + i);
+
+        TracerParticle& tracer = tracers[i];
+        tracer.position = position + (i < bulgeTracers ? SampleBulgePosition(parameters, random) : SampleDiskPosition(parameters, random));
+        tracer.linearVelocity = {};
+    }, count, 1024);
+}
+
+void Galaxy::SetTracerVelocities(const std::function<float3(const float3&)>& field)
+{
+    // The same circular orbits about the black hole as the particles have
+    const float3 center = particles[0].position;
+    const float3 centerAcceleration = particles[0].force * particles[0].inverseMass;
+
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        TracerParticle& tracer = tracers[i];
+
+        float3 relativePos = tracer.position - center;
+        float3 v = { relativePos.m_y, -relativePos.m_x, 0.0f };
+        v.normalize();
+
+        float3 acceleration = field(tracer.position) - centerAcceleration;
+        v *= std::sqrt(acceleration.norm() * relativePos.norm());
+
+        tracer.linearVelocity = v + velocity;
+    }, static_cast<uint32_t>(tracers.size()), 1024);
+}
+
+// Particles of a block of the disorder measure and the key computation
+static constexpr uint32_t cReorderBlockSize = 4096;
+
+/** Sorts runs of the values in parallel, then merges the runs pairwise, a dispatch per round. */
+template <typename T>
+static void SortParallel(std::vector<T>& values)
+{
+    const size_t count = values.size();
+    const size_t runs = (std::max)(ThreadPool::GetThreadCount(), 1u);
+    const size_t runLength = (count + runs - 1) / runs;
+    if (runLength == 0)
+    {
+        return;
+    }
+
+    ThreadPool().Dispatch([&](uint32_t run)
+    {
+        const size_t first = (std::min)(run * runLength, count);
+        const size_t last = (std::min)(first + runLength, count);
+        std::sort(values.begin() + first, values.begin() + last);
+    }, static_cast<uint32_t>(runs), 1);
+
+    std::vector<T> merged(count);
+    for (size_t width = runLength; width < count; width *= 2)
+    {
+        const size_t merges = (count + 2 * width - 1) / (2 * width);
+        ThreadPool().Dispatch([&](uint32_t merge)
+        {
+            const size_t first = merge * 2 * width;
+            const size_t middle = (std::min)(first + width, count);
+            const size_t last = (std::min)(first + 2 * width, count);
+            std::merge(values.begin() + first, values.begin() + middle, values.begin() + middle, values.begin() + last, merged.begin() + first);
+        }, static_cast<uint32_t>(merges), 1);
+        values.swap(merged);
+    }
+}
+
+/**
+    Sorts the elements from first on by their Morton keys. Equal keys keep their order, so the
+    result doesn't depend on the thread count.
+*/
+template <typename Element>
+static void SortAlongCurve(std::vector<Element>& elements, size_t first, const float3& origin, float size)
+{
+    if (elements.size() < first + 2)
+    {
+        return;
+    }
+
+    const uint32_t count = static_cast<uint32_t>(elements.size() - first);
+    std::vector<std::pair<uint64_t, uint32_t>> keys(count);
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        keys[i] = { GetMortonKey(elements[first + i].position, origin, size), i };
+    }, count, cReorderBlockSize);
+
+    SortParallel(keys);
+
+    std::vector<Element> sorted(elements.size());
+    std::copy(elements.begin(), elements.begin() + first, sorted.begin());
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        sorted[first + i] = elements[first + keys[i].second];
+    }, count, cReorderBlockSize);
+    elements.swap(sorted);
+}
+
+/**
+    Pairs of the positions in [first, last] next to each other whose keys shifted by shift
+    descend, position(i) gives the position of element i.
+*/
+template <typename Position>
+static uint32_t CountCurveDescents(const Position& position, uint32_t first, uint32_t last, const float3& origin, float size, uint32_t shift)
+{
+    uint32_t descents = 0;
+    uint64_t previous = GetMortonKey(position(first), origin, size) >> shift;
+    for (uint32_t i = first + 1; i <= last; ++i)
+    {
+        const uint64_t key = GetMortonKey(position(i), origin, size) >> shift;
+        descents += key < previous;
+        previous = key;
+    }
+    return descents;
+}
+
+float Galaxy::MeasureDisorder(const float3& origin, float size, uint32_t level) const
+{
+    // The black hole is never moved, the pairs start after it
+    if (particles.size() < 3)
+    {
+        return 0.0f;
+    }
+
+    const uint32_t shift = 3 * (cMortonBits - (std::min)(level, cMortonBits));
+    const uint32_t pairs = static_cast<uint32_t>(particles.size() - 2);
+    const uint32_t blocks = (pairs + cReorderBlockSize - 1) / cReorderBlockSize;
+
+    // Counts are integers, the measure doesn't depend on the thread count
+    std::vector<uint32_t> descents(blocks, 0);
+    ThreadPool().Dispatch([&](uint32_t block)
+    {
+        const uint32_t first = block * cReorderBlockSize + 1;
+        const uint32_t last = (std::min)(first + cReorderBlockSize, pairs + 1);
+        descents[block] = CountCurveDescents([&](uint32_t i) { return particles[i].position; }, first, last, origin, size, shift);
+    }, blocks, 1);
+
+    return static_cast<float>(std::accumulate(descents.begin(), descents.end(), 0ull)) / pairs;
+}
+
+float MeasureCurveDisorder(const std::vector<float3>& positions, const float3& origin, float size, uint32_t level)
+{
+    if (positions.size() < 3)
+    {
+        return 0.0f;
+    }
+
+    const uint32_t shift = 3 * (cMortonBits - (std::min)(level, cMortonBits));
+    const uint32_t pairs = static_cast<uint32_t>(positions.size() - 2);
+    const uint32_t descents = CountCurveDescents([&](uint32_t i) { return positions[i]; }, 1, pairs + 1, origin, size, shift);
+    return static_cast<float>(descents) / pairs;
+}
+
+void Galaxy::ReorderParticles(const float3& origin, float size)
+{
+    SortAlongCurve(particles, 1, origin, size);
+    SortAlongCurve(haloParticles, 0, origin, size);
+    SortAlongCurve(tracers, 0, origin, size);
+
+    // Draw lists hold indices
+    SortParticlesByType(particles, typeToParticles);
+}
+
 void Galaxy::Update(float dt)
 {
     //position = particles[0]->position;
@@ -247,7 +550,15 @@ Galaxy& Universe::CreateGalaxy()
 
 Galaxy& Universe::CreateGalaxy(const float3& position, const GalaxyParameters& parameters = {})
 {
-    Galaxy galaxy(position, parameters);
+    Galaxy galaxy(position, parameters, static_cast<uint32_t>(galaxies.size()));
+    galaxies.push_back(std::move(galaxy));
+    return galaxies.back();
+}
+
+Galaxy& Universe::CreateGalaxy(const float3& position, const GalaxyParameters& parameters, std::vector<Particle>&& particles, 
+    std::vector<HaloParticle>&& haloParticles, std::vector<TracerParticle>&& tracers)
+{
+    Galaxy galaxy(position, parameters, std::move(particles), std::move(haloParticles), std::move(tracers));
     galaxies.push_back(std::move(galaxy));
     return galaxies.back();
 }
@@ -1,6 +1,7 @@
 ﻿#pragma once
 
 #include <vector>
+#include <functional>
 #include <memory>
 #include <unordered_map>
 #include <numeric>
@@ -9,7 +10,13 @@
 #include "SphericalModel.h"
 #include "Constants.h"
 
-struct Image;
+/** Kind of particle, decides how the particle is drawn. */
+enum class ParticleType : uint8_t
+{
+    Star,
+    Dust,
+    H2
+};
 
 struct Particle
 {
@@ -24,6 +31,8 @@ struct Particle
 
     float mass = 1.0f;
     float inverseMass = 1.0f;
+    // Potential by the other particles, computed on diagnostics steps only
+    float potential = 0.0f;
 
     bool movable = true;
 
@@ -33,15 +42,39 @@ struct Particle
     float magnitude = 1.0f;
     float size = 1.0f;
 
-    const Image* image;
+    ParticleType type = ParticleType::Star;
 
     bool doubleDrawing = false;
 
     int	userData = 0;
 
+    // Index of the particle at creation, kept when the particles are reordered
+    uint32_t id = 0;
+
     void SetMass(float mass);
 };
 
+/**
+    Particle of a live dark matter halo. Halos take many heavy particles that are never drawn,
+    so only the state of the motion is stored.
+*/
+struct HaloParticle
+{
+    float3 position;
+    float3 linearVelocity;
+    float mass;
+};
+
+/**
+    Massless particle moved by the field of the particles without acting on anything, drawn as
+    dust. Tracers are only walked through the tree, they cost no tree nodes and no interactions.
+*/
+struct TracerParticle
+{
+    float3 position;
+    float3 linearVelocity;
+};
+
 struct GalaxyParameters
 {
     uint32_t diskParticlesCount = GLX_DISK_NUM;
@@ -52,35 +85,88 @@ struct GalaxyParameters
     float diskMassRatio = GLX_DISK_MASS_RATIO;
     float bulgeRadius = GLX_BULGE_RADIUS;
     float haloRadius = GLX_HALO_RADIUS;
+    HaloModelType haloModel = HaloModelType::Plummer;
+    float haloMass = GLX_HALO_MASS;
+    // Particles of a live halo, which replaces the analytic halo force if not zero
+    uint32_t haloParticlesCount = 0;
+    // Massless dust distributed like the particles, all particles are stars then
+    uint32_t tracerParticlesCount = 0;
     float blackHoleMass = 1.0f;
+    // Particles of a galaxy depend only on the seed and the galaxy index in the universe
+    uint32_t seed = 1;
 };
 
 class Galaxy
 {
 public:
-    Galaxy(const float3& position = {}, const GalaxyParameters& parameters = {});
+    Galaxy(const float3& position = {}, const GalaxyParameters& parameters = {}, uint32_t index = 0);
+    /** Galaxy with already generated particles, e.g. restored from a snapshot. */
+    Galaxy(const float3& position, const GalaxyParameters& parameters, std::vector<Particle>&& particles, 
+        std::vector<HaloParticle>&& haloParticles = {}, std::vector<TracerParticle>&& tracers = {});
 
     void Update(float dt);
 
     std::vector<Particle>& GetParticles() { return particles; }
-    const std::unordered_map<const Image*, std::vector<const Particle*>> GetParticlesByImage() const { return imageToParticles; }
-    const SphericalModel& GetHalo() const { return halo; }
+    const std::vector<Particle>& GetParticles() const { return particles; }
+    const float3& GetPosition() const { return position; }
+    /** Current position of the black hole, the galaxy moves with it. */
+    const float3& GetCenter() const { return particles.front().position; }
+    /** Bulk velocity added to the particles by SetRadialVelocitiesFromForce. */
+    void SetVelocity(const float3& value) { velocity = value; }
+    const float3& GetVelocity() const { return velocity; }
+    const GalaxyParameters& GetParameters() const { return parameters; }
+    const std::unordered_map<ParticleType, std::vector<uint32_t>>& GetParticlesByType() const { return typeToParticles; }
+    const Halo& GetHalo() const { return halo; }
     size_t GetParticlesCount() const { return particles.size(); }
 
+    /** Particles of the live halo, empty if the halo is analytic. */
+    std::vector<HaloParticle>& GetHaloParticles() { return haloParticles; }
+    const std::vector<HaloParticle>& GetHaloParticles() const { return haloParticles; }
+    bool HasLiveHalo() const { return !haloParticles.empty(); }
+
+    std::vector<TracerParticle>& GetTracers() { return tracers; }
+    const std::vector<TracerParticle>& GetTracers() const { return tracers; }
+
     void SetRadialVelocitiesFromForce();
+    /** Circular velocities of the tracers in the acceleration field, after SetRadialVelocitiesFromForce. */
+    void SetTracerVelocities(const std::function<float3(const float3&)>& field);
+
+    /**
+        Fraction of the particles next to each other in memory whose cells at the level of the
+        Morton curve through the cube are out of the curve order, zero after ReorderParticles.
+    */
+    float MeasureDisorder(const float3& origin, float size, uint32_t level) const;
+    /**
+        Sorts the particles, the live halo and the tracers along the Morton curve through the
+        cube, the black hole stays first. The draw lists follow, particle ids are kept.
+    */
+    void ReorderParticles(const float3& origin, float size);
 
 private:
-    void Create();
+    void Create(uint32_t index);
+    void CreateHaloParticles(uint32_t index);
+    void CreateTracers(uint32_t index);
 
     float3 position;
+    float3 velocity = {};
     GalaxyParameters parameters;
 
     std::vector<Particle> particles;
-    std::unordered_map<const Image*, std::vector<const Particle*>> imageToParticles;
+    // Indices of particles of each type, used as draw lists
+    std::unordered_map<ParticleType, std::vector<uint32_t>> typeToParticles;
+
+    std::vector<HaloParticle> haloParticles;
+    std::vector<TracerParticle> tracers;
 
-    SphericalModel halo;
+    Halo halo;
 };
 
+/**
+    Galaxy::MeasureDisorder of the particles of a galaxy from a copy of their positions, on the
+    calling thread, e.g. in the background while the particles move on.
+*/
+float MeasureCurveDisorder(const std::vector<float3>& positions, const float3& origin, float size, uint32_t level);
+
 class Universe
 {
 public:
@@ -88,15 +174,28 @@ public:
 
     Galaxy& CreateGalaxy();
     Galaxy& CreateGalaxy(const float3& position, const GalaxyParameters& parameters);
+    Galaxy& CreateGalaxy(const float3& position, const GalaxyParameters& parameters, std::vector<Particle>&& particles, 
+        std::vector<HaloParticle>&& haloParticles = {}, std::vector<TracerParticle>&& tracers = {});
 
     float GetSize() const { return size; }
     std::vector<Galaxy>& GetGalaxies() { return galaxies; }
+    const std::vector<Galaxy>& GetGalaxies() const { return galaxies; }
 
     size_t GetParticlesCount() const
     {
         return std::accumulate(galaxies.begin(), galaxies.end(), 0ull, [](size_t sum, const Galaxy& galaxy) { return sum + galaxy.GetParticlesCount(); });
     }
 
+    size_t GetHaloParticlesCount() const
+    {
+        return std::accumulate(galaxies.begin(), galaxies.end(), 0ull, [](size_t sum, const Galaxy& galaxy) { return sum + galaxy.GetHaloParticles().size(); });
+    }
+
+    size_t GetTracersCount() const
+    {
+        return std::accumulate(galaxies.begin(), galaxies.end(), 0ull, [](size_t sum, const Galaxy& galaxy) { return sum + galaxy.GetTracers().size(); });
+    }
+
 private:
     float size;
     std::vector<Galaxy> galaxies;
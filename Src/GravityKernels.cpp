@@ -0,0 +1,294 @@
+#include "GravityKernels.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GLX_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// Entries a list starts with, a walk rarely needs more
+static constexpr size_t cInitialListSize = 1024;
+
+void InteractionList::GrowPoints()
+{
+    const size_t size = (std::max)(2 * pointX.size(), cInitialListSize);
+    for (Array* array : { &pointX, &pointY, &pointZ, &pointMass, &pointSoftening })
+    {
+        array->resize(size);
+    }
+}
+
+void InteractionList::GrowCells()
+{
+    const size_t size = (std::max)(2 * cellX.size(), cInitialListSize);
+    for (Array* array : { &cellX, &cellY, &cellZ, &cellMass })
+    {
+        array->resize(size);
+    }
+    for (Array& array : cellQuadrupole)
+    {
+        array.resize(size);
+    }
+}
+
+void InteractionList::Pad()
+{
+    // Sizes are multiples of the width, so the padding always fits. Copies of the last entry
+    // are as far as it is, which keeps the unsoftened quadrupole terms finite.
+    for (size_t i = points; i < GetPadded(points); i++)
+    {
+        pointX[i] = pointX[points - 1];
+        pointY[i] = pointY[points - 1];
+        pointZ[i] = pointZ[points - 1];
+        pointMass[i] = 0.0f;
+        pointSoftening[i] = pointSoftening[points - 1];
+    }
+    for (size_t i = cells; i < GetPadded(cells); i++)
+    {
+        cellX[i] = cellX[cells - 1];
+        cellY[i] = cellY[cells - 1];
+        cellZ[i] = cellZ[cells - 1];
+        cellMass[i] = 0.0f;
+        for (Array& array : cellQuadrupole)
+        {
+            array[i] = 0.0f;
+        }
+    }
+}
+
+template <typename Softening>
+static void AddPointsScalar(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    for (size_t i = 0; i < list.points; i++)
+    {
+        const float x = list.pointX[i] - position.m_x;
+        const float y = list.pointY[i] - position.m_y;
+        const float z = list.pointZ[i] - position.m_z;
+        const float mass = list.pointMass[i];
+        const float r2 = x * x + y * y + z * z;
+        const float soft = (std::max)(softening, list.pointSoftening[i]);
+        const float factor = mass * Softening::Force(r2, soft);
+
+        acceleration.m_x += x * factor;
+        acceleration.m_y += y * factor;
+        acceleration.m_z += z * factor;
+        if (potential)
+        {
+            *potential -= mass * Softening::Potential(r2, soft);
+        }
+    }
+}
+
+template <typename Softening, bool Quadrupole>
+static void AddCellsScalar(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    for (size_t i = 0; i < list.cells; i++)
+    {
+        const float x = list.cellX[i] - position.m_x;
+        const float y = list.cellY[i] - position.m_y;
+        const float z = list.cellZ[i] - position.m_z;
+        const float mass = list.cellMass[i];
+        const float r2 = x * x + y * y + z * z;
+        const float factor = mass * Softening::Force(r2, softening);
+
+        // Without the quadrupole moments a cell acts with its softened monopole alone
+        if (!Quadrupole)
+        {
+            acceleration.m_x += x * factor;
+            acceleration.m_y += y * factor;
+            acceleration.m_z += z * factor;
+            if (potential)
+            {
+                *potential -= mass * Softening::Potential(r2, softening);
+            }
+            continue;
+        }
+
+        const float r = std::sqrt(r2);
+
+        const float qxx = list.cellQuadrupole[0][i];
+        const float qyy = list.cellQuadrupole[1][i];
+        const float qzz = list.cellQuadrupole[2][i];
+        const float qxy = list.cellQuadrupole[3][i];
+        const float qxz = list.cellQuadrupole[4][i];
+        const float qyz = list.cellQuadrupole[5][i];
+        const float qx = qxx * x + qxy * y + qxz * z;
+        const float qy = qxy * x + qyy * y + qyz * z;
+        const float qz = qxz * x + qyz * y + qzz * z;
+        const float vqv = qx * x + qy * y + qz * z;
+        const float invR5 = 1.0f / (r2 * r2 * r);
+        const float radial = factor + 2.5f * vqv / r2 * invR5;
+
+        acceleration.m_x += x * radial - qx * invR5;
+        acceleration.m_y += y * radial - qy * invR5;
+        acceleration.m_z += z * radial - qz * invR5;
+        if (potential)
+        {
+            *potential -= mass * Softening::Potential(r2, softening) + 0.5f * vqv * invR5;
+        }
+    }
+}
+
+static const GravityKernels cScalarKernels = { KernelIsa::Scalar, AddPointsScalar<SofteningPolicy>, AddCellsScalar<SofteningPolicy, false>, AddCellsScalar<SofteningPolicy, true> };
+
+static const char* const cKernelIsaNames[] = { "scalar", "sse4", "avx2", "avx512" };
+
+const char* GetKernelIsaName(KernelIsa isa)
+{
+    return isa < KernelIsa::Count ? cKernelIsaNames[static_cast<uint32_t>(isa)] : "unknown";
+}
+
+bool ParseKernelIsa(const char* name, KernelIsa& isa)
+{
+    for (uint32_t i = 0; i < static_cast<uint32_t>(KernelIsa::Count); i++)
+    {
+        const char* known = cKernelIsaNames[i];
+        size_t j = 0;
+        while (name[j] && known[j] && std::tolower(static_cast<unsigned char>(name[j])) == known[j])
+        {
+            ++j;
+        }
+        if (!name[j] && !known[j])
+        {
+            isa = static_cast<KernelIsa>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+struct CpuFeatures
+{
+    bool sse41 = false;
+    bool avx2 = false;
+    bool avx512 = false;
+};
+
+#ifdef GLX_X86
+static void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t registers[4])
+{
+#ifdef _MSC_VER
+    int values[4];
+    __cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+    std::memcpy(registers, values, sizeof(values));
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Register states the OS saves on context switches
+static uint64_t GetEnabledStates()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return static_cast<uint64_t>(high) << 32 | low;
+#endif
+}
+#endif
+
+static CpuFeatures DetectCpuFeatures()
+{
+    CpuFeatures features;
+#ifdef GLX_X86
+    uint32_t registers[4];
+    Cpuid(0, 0, registers);
+    const uint32_t maxLeaf = registers[0];
+    if (maxLeaf < 1)
+    {
+        return features;
+    }
+
+    Cpuid(1, 0, registers);
+    const uint32_t ecx = registers[2];
+    features.sse41 = (ecx & 1u << 19) != 0;
+
+    const bool osxsave = (ecx & 1u << 27) != 0;
+    const bool avx = (ecx & 1u << 28) != 0;
+    const bool fma = (ecx & 1u << 12) != 0;
+    if (!osxsave || !avx || maxLeaf < 7)
+    {
+        return features;
+    }
+
+    // XMM and YMM states, then opmask and the upper ZMM states
+    const uint64_t states = GetEnabledStates();
+    const bool ymmStates = (states & 0x6) == 0x6;
+    const bool zmmStates = (states & 0xE6) == 0xE6;
+
+    Cpuid(7, 0, registers);
+    const uint32_t ebx = registers[1];
+    features.avx2 = ymmStates && fma && (ebx & 1u << 5) != 0;
+    features.avx512 = features.avx2 && zmmStates && (ebx & 1u << 16) != 0;
+#endif
+    return features;
+}
+
+static const GravityKernels* FindGravityKernels(KernelIsa isa)
+{
+    static const CpuFeatures features = DetectCpuFeatures();
+
+    switch (isa)
+    {
+    case KernelIsa::Scalar: return &cScalarKernels;
+    case KernelIsa::SSE4:   return features.sse41 ? GetSSE4GravityKernels() : nullptr;
+    case KernelIsa::AVX2:   return features.avx2 ? GetAVX2GravityKernels() : nullptr;
+    case KernelIsa::AVX512: return features.avx512 ? GetAVX512GravityKernels() : nullptr;
+    default:                return nullptr;
+    }
+}
+
+bool IsKernelIsaSupported(KernelIsa isa)
+{
+    return FindGravityKernels(isa) != nullptr;
+}
+
+const GravityKernels& GetGravityKernels(KernelIsa isa)
+{
+    const GravityKernels* kernels = FindGravityKernels(isa);
+    assert(kernels);
+    return kernels ? *kernels : cScalarKernels;
+}
+
+static const GravityKernels*& GetSelectedKernels()
+{
+    static const GravityKernels* selected = []()
+    {
+        for (uint32_t i = static_cast<uint32_t>(KernelIsa::Count); i-- > 0;)
+        {
+            if (const GravityKernels* kernels = FindGravityKernels(static_cast<KernelIsa>(i)))
+            {
+                return kernels;
+            }
+        }
+        return &cScalarKernels;
+    }();
+    return selected;
+}
+
+const GravityKernels& GetGravityKernels()
+{
+    return *GetSelectedKernels();
+}
+
+bool SelectGravityKernels(KernelIsa isa)
+{
+    const GravityKernels* kernels = FindGravityKernels(isa);
+    if (!kernels)
+    {
+        return false;
+    }
+    GetSelectedKernels() = kernels;
+    return true;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "float3.h"
+#include "Softening.h"
+#include "Utils.h"
+
+/** Instruction sets of the gravity kernels, the later ones are the faster. */
+enum class KernelIsa : uint32_t
+{
+    Scalar,
+    SSE4,
+    AVX2,
+    AVX512,
+    Count
+};
+
+/**
+    Sources of the gravity at one point in structure of arrays, gathered by a tree walk and
+    evaluated at once by the kernels. Arrays hold a multiple of cKernelWidth entries, Pad fills
+    them up with massless copies of the last entry, so the kernels have no remainder loops.
+*/
+struct InteractionList
+{
+    // Lanes of the widest kernel
+    static constexpr size_t cKernelWidth = 16;
+
+    using Array = std::vector<float, AlignedAllocator<float, 64>>;
+
+    // Point masses, the single bodies of the leaves, each with its softening
+    Array pointX, pointY, pointZ, pointMass, pointSoftening;
+    size_t points = 0;
+
+    // Cells at their mass centers, softened by the receiver only. The traceless quadrupole
+    // moments about the mass centers, xx, yy, zz, xy, xz, yz, are only set for the cell kernels.
+    Array cellX, cellY, cellZ, cellMass;
+    Array cellQuadrupole[6];
+    size_t cells = 0;
+
+    void Clear()
+    {
+        points = 0;
+        cells = 0;
+    }
+
+    void AddPoint(const float3& position, float mass, float softening)
+    {
+        if (points == pointX.size())
+        {
+            GrowPoints();
+        }
+        pointX[points] = position.m_x;
+        pointY[points] = position.m_y;
+        pointZ[points] = position.m_z;
+        pointMass[points] = mass;
+        pointSoftening[points] = softening;
+        ++points;
+    }
+
+    void AddCell(const float3& position, float mass)
+    {
+        if (cells == cellX.size())
+        {
+            GrowCells();
+        }
+        cellX[cells] = position.m_x;
+        cellY[cells] = position.m_y;
+        cellZ[cells] = position.m_z;
+        cellMass[cells] = mass;
+        ++cells;
+    }
+
+    void AddCell(const float3& position, float mass, const float quadrupole[6])
+    {
+        if (cells == cellX.size())
+        {
+            GrowCells();
+        }
+        cellX[cells] = position.m_x;
+        cellY[cells] = position.m_y;
+        cellZ[cells] = position.m_z;
+        cellMass[cells] = mass;
+        for (int i = 0; i < 6; i++)
+        {
+            cellQuadrupole[i][cells] = quadrupole[i];
+        }
+        ++cells;
+    }
+
+    void Pad();
+
+    static size_t GetPadded(size_t count) { return (count + cKernelWidth - 1) / cKernelWidth * cKernelWidth; }
+
+private:
+    void GrowPoints();
+    void GrowCells();
+};
+
+/**
+    Kernels of one instruction set. They add the acceleration at position by the sources of a
+    padded list and, if potential isn't null, their potential. softening is the least softening
+    of the point masses. With the policy of the build, as in GravityAcceleration, it softens
+    the points and the monopoles of the cells but not their quadrupole terms. The vector
+    kernels take exact square roots for the points, the near field, and reciprocal square
+    roots refined by a Newton step for the cells, the far field, of either multipole order.
+    Every kernel sums in its own lane order, so the instruction sets differ in the last bits.
+*/
+struct GravityKernels
+{
+    using Kernel = void (*)(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential);
+
+    KernelIsa isa;
+    Kernel points;
+    // Cells as monopoles, their quadrupole moments are not read
+    Kernel monopoles;
+    // Cells with their quadrupole moments
+    Kernel cells;
+};
+
+const char* GetKernelIsaName(KernelIsa isa);
+/** Instruction set by its name as GetKernelIsaName gives it, case insensitive. */
+bool ParseKernelIsa(const char* name, KernelIsa& isa);
+
+/** Whether the kernels of the instruction set are built in and the CPU and the OS run them. */
+bool IsKernelIsaSupported(KernelIsa isa);
+/** Kernels of a supported instruction set. */
+const GravityKernels& GetGravityKernels(KernelIsa isa);
+
+/** Kernels the tree walks use, of the best supported instruction set unless selected otherwise. */
+const GravityKernels& GetGravityKernels();
+/**
+    Makes the tree walks use the kernels of an instruction set, e.g. to reproduce a run made on
+    another CPU. Must not be called while forces are computed, false if it's unsupported.
+*/
+bool SelectGravityKernels(KernelIsa isa);
+
+// Kernel tables of the instruction set files, null if the compiler can't build them
+const GravityKernels* GetSSE4GravityKernels();
+const GravityKernels* GetAVX2GravityKernels();
+const GravityKernels* GetAVX512GravityKernels();
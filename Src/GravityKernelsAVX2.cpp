@@ -0,0 +1,246 @@
+#include "GravityKernels.h"
+
+#include <cfloat>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GLX_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+#ifdef GLX_AVX2_KERNELS
+
+// Functions using the instructions are compiled for them, whatever the flags of the file
+#if defined(__GNUC__) || defined(__clang__)
+#define GLX_TARGET __attribute__((target("avx2,fma")))
+#else
+#define GLX_TARGET
+#endif
+
+// Reciprocal square root refined by a Newton step, y (1.5 - 0.5 x y^2), about 22 bits exact
+GLX_TARGET static inline __m256 ReciprocalSqrt(__m256 x)
+{
+    const __m256 y = _mm256_rsqrt_ps(x);
+    const __m256 halfX = _mm256_mul_ps(_mm256_set1_ps(0.5f), x);
+    return _mm256_mul_ps(y, _mm256_fnmadd_ps(halfX, _mm256_mul_ps(y, y), _mm256_set1_ps(1.5f)));
+}
+
+// Exact for the near field, which decides close encounters and the time symmetry, the estimate for the far one
+template <bool Exact>
+GLX_TARGET static inline __m256 InverseSqrt(__m256 x)
+{
+    return Exact ? _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(x)) : ReciprocalSqrt(x);
+}
+
+// Reciprocal refined by a Newton step, y (2 - x y)
+GLX_TARGET static inline __m256 Reciprocal(__m256 x)
+{
+    const __m256 y = _mm256_rcp_ps(x);
+    return _mm256_mul_ps(y, _mm256_fnmadd_ps(x, y, _mm256_set1_ps(2.0f)));
+}
+
+GLX_TARGET static inline float Sum(__m256 value)
+{
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, value);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+/*
+Softening policies of Softening.h, factor is Force and inverse is Potential of the policy at
+the squared distances r2 with the softening lengths.
+*/
+template <bool Exact>
+GLX_TARGET static inline void Soften(NoSoftening, __m256 r2, __m256 /*softening*/, __m256& factor, __m256& inverse)
+{
+    inverse = InverseSqrt<Exact>(_mm256_max_ps(r2, _mm256_set1_ps(FLT_MIN)));
+    factor = _mm256_mul_ps(_mm256_mul_ps(inverse, inverse), inverse);
+}
+
+template <bool Exact>
+GLX_TARGET static inline void Soften(PlummerSoftening, __m256 r2, __m256 softening, __m256& factor, __m256& inverse)
+{
+    inverse = InverseSqrt<Exact>(_mm256_fmadd_ps(softening, softening, r2));
+    factor = _mm256_mul_ps(_mm256_mul_ps(inverse, inverse), inverse);
+}
+
+// The pieces of the spline and the Newtonian gravity are all evaluated, every lane selects its own
+template <bool Exact>
+GLX_TARGET static inline void Soften(SplineSoftening, __m256 r2, __m256 softening, __m256& factor, __m256& inverse)
+{
+    const __m256 h = _mm256_mul_ps(_mm256_set1_ps(SplineSoftening::cScale), softening);
+    const __m256 invR = InverseSqrt<Exact>(_mm256_max_ps(r2, _mm256_set1_ps(FLT_MIN)));
+    const __m256 invH = Reciprocal(_mm256_max_ps(h, _mm256_set1_ps(FLT_MIN)));
+    const __m256 u = _mm256_mul_ps(_mm256_mul_ps(r2, invR), invH);
+    const __m256 u2 = _mm256_mul_ps(u, u);
+    const __m256 invH3 = _mm256_mul_ps(_mm256_mul_ps(invH, invH), invH);
+    // 1 / u as h / r
+    const __m256 invU = _mm256_mul_ps(h, invR);
+    const __m256 invU3 = _mm256_mul_ps(_mm256_mul_ps(invU, invU), invU);
+
+    // Polynomials of SplineSoftening in Horner form
+    const __m256 innerForce = _mm256_fmadd_ps(u2, _mm256_fmadd_ps(_mm256_set1_ps(32.0f), u, _mm256_set1_ps(-38.4f)), _mm256_set1_ps(10.666666666667f));
+    const __m256 outerForcePolynomial = _mm256_fmadd_ps(u, _mm256_fmadd_ps(u, _mm256_fnmadd_ps(_mm256_set1_ps(10.666666666667f), u, _mm256_set1_ps(38.4f)), _mm256_set1_ps(-48.0f)), _mm256_set1_ps(21.333333333333f));
+    const __m256 outerForce = _mm256_fnmadd_ps(_mm256_set1_ps(0.066666666667f), invU3, outerForcePolynomial);
+    const __m256 innerPotential = _mm256_fnmadd_ps(u2, _mm256_fmadd_ps(u2, _mm256_fmadd_ps(_mm256_set1_ps(6.4f), u, _mm256_set1_ps(-9.6f)), _mm256_set1_ps(5.333333333333f)), _mm256_set1_ps(2.8f));
+    const __m256 outerPotentialPolynomial = _mm256_fmadd_ps(u, _mm256_fmadd_ps(u, _mm256_fnmadd_ps(_mm256_set1_ps(2.133333333333f), u, _mm256_set1_ps(9.6f)), _mm256_set1_ps(-16.0f)), _mm256_set1_ps(10.666666666667f));
+    const __m256 outerPotential = _mm256_fnmadd_ps(u2, outerPotentialPolynomial, _mm256_fnmadd_ps(_mm256_set1_ps(0.066666666667f), invU, _mm256_set1_ps(3.2f)));
+
+    const __m256 inner = _mm256_cmp_ps(u, _mm256_set1_ps(0.5f), _CMP_LT_OQ);
+    const __m256 spline = _mm256_cmp_ps(u, _mm256_set1_ps(1.0f), _CMP_LT_OQ);
+    const __m256 splineFactor = _mm256_mul_ps(invH3, _mm256_blendv_ps(outerForce, innerForce, inner));
+    const __m256 splineInverse = _mm256_mul_ps(invH, _mm256_blendv_ps(outerPotential, innerPotential, inner));
+    factor = _mm256_blendv_ps(_mm256_mul_ps(_mm256_mul_ps(invR, invR), invR), splineFactor, spline);
+    inverse = _mm256_blendv_ps(invR, splineInverse, spline);
+}
+
+template <typename Softening, bool WithPotential>
+GLX_TARGET static void AddPoints(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    const __m256 px = _mm256_set1_ps(position.m_x);
+    const __m256 py = _mm256_set1_ps(position.m_y);
+    const __m256 pz = _mm256_set1_ps(position.m_z);
+    const __m256 soft = _mm256_set1_ps(softening);
+
+    __m256 ax = _mm256_setzero_ps();
+    __m256 ay = _mm256_setzero_ps();
+    __m256 az = _mm256_setzero_ps();
+    __m256 sum = _mm256_setzero_ps();
+
+    const size_t count = InteractionList::GetPadded(list.points);
+    for (size_t i = 0; i < count; i += 8)
+    {
+        const __m256 x = _mm256_sub_ps(_mm256_load_ps(list.pointX.data() + i), px);
+        const __m256 y = _mm256_sub_ps(_mm256_load_ps(list.pointY.data() + i), py);
+        const __m256 z = _mm256_sub_ps(_mm256_load_ps(list.pointZ.data() + i), pz);
+        const __m256 mass = _mm256_load_ps(list.pointMass.data() + i);
+        const __m256 s = _mm256_max_ps(soft, _mm256_load_ps(list.pointSoftening.data() + i));
+
+        const __m256 r2 = _mm256_fmadd_ps(z, z, _mm256_fmadd_ps(y, y, _mm256_mul_ps(x, x)));
+        __m256 factor, inverse;
+        Soften<true>(Softening(), r2, s, factor, inverse);
+        factor = _mm256_mul_ps(mass, factor);
+
+        ax = _mm256_fmadd_ps(x, factor, ax);
+        ay = _mm256_fmadd_ps(y, factor, ay);
+        az = _mm256_fmadd_ps(z, factor, az);
+        if (WithPotential)
+        {
+            sum = _mm256_fmadd_ps(mass, inverse, sum);
+        }
+    }
+
+    acceleration.m_x += Sum(ax);
+    acceleration.m_y += Sum(ay);
+    acceleration.m_z += Sum(az);
+    if (WithPotential)
+    {
+        *potential -= Sum(sum);
+    }
+}
+
+template <typename Softening, bool WithPotential, bool Quadrupole>
+GLX_TARGET static void AddCells(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    const __m256 px = _mm256_set1_ps(position.m_x);
+    const __m256 py = _mm256_set1_ps(position.m_y);
+    const __m256 pz = _mm256_set1_ps(position.m_z);
+    const __m256 soft = _mm256_set1_ps(softening);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 fiveHalves = _mm256_set1_ps(2.5f);
+
+    __m256 ax = _mm256_setzero_ps();
+    __m256 ay = _mm256_setzero_ps();
+    __m256 az = _mm256_setzero_ps();
+    __m256 sum = _mm256_setzero_ps();
+
+    const size_t count = InteractionList::GetPadded(list.cells);
+    for (size_t i = 0; i < count; i += 8)
+    {
+        const __m256 x = _mm256_sub_ps(_mm256_load_ps(list.cellX.data() + i), px);
+        const __m256 y = _mm256_sub_ps(_mm256_load_ps(list.cellY.data() + i), py);
+        const __m256 z = _mm256_sub_ps(_mm256_load_ps(list.cellZ.data() + i), pz);
+        const __m256 mass = _mm256_load_ps(list.cellMass.data() + i);
+
+        const __m256 r2 = _mm256_fmadd_ps(z, z, _mm256_fmadd_ps(y, y, _mm256_mul_ps(x, x)));
+        __m256 factor, inverse;
+        Soften<false>(Softening(), r2, soft, factor, inverse);
+        factor = _mm256_mul_ps(mass, factor);
+
+        // Without the quadrupole moments a cell acts with its softened monopole alone
+        if (!Quadrupole)
+        {
+            ax = _mm256_fmadd_ps(x, factor, ax);
+            ay = _mm256_fmadd_ps(y, factor, ay);
+            az = _mm256_fmadd_ps(z, factor, az);
+            if (WithPotential)
+            {
+                sum = _mm256_fmadd_ps(mass, inverse, sum);
+            }
+            continue;
+        }
+
+        const __m256 invR = InverseSqrt<false>(_mm256_max_ps(r2, _mm256_set1_ps(FLT_MIN)));
+
+        const __m256 qxx = _mm256_load_ps(list.cellQuadrupole[0].data() + i);
+        const __m256 qyy = _mm256_load_ps(list.cellQuadrupole[1].data() + i);
+        const __m256 qzz = _mm256_load_ps(list.cellQuadrupole[2].data() + i);
+        const __m256 qxy = _mm256_load_ps(list.cellQuadrupole[3].data() + i);
+        const __m256 qxz = _mm256_load_ps(list.cellQuadrupole[4].data() + i);
+        const __m256 qyz = _mm256_load_ps(list.cellQuadrupole[5].data() + i);
+        const __m256 qx = _mm256_fmadd_ps(qxz, z, _mm256_fmadd_ps(qxy, y, _mm256_mul_ps(qxx, x)));
+        const __m256 qy = _mm256_fmadd_ps(qyz, z, _mm256_fmadd_ps(qyy, y, _mm256_mul_ps(qxy, x)));
+        const __m256 qz = _mm256_fmadd_ps(qzz, z, _mm256_fmadd_ps(qyz, y, _mm256_mul_ps(qxz, x)));
+        const __m256 vqv = _mm256_fmadd_ps(qz, z, _mm256_fmadd_ps(qy, y, _mm256_mul_ps(qx, x)));
+
+        const __m256 invR2 = _mm256_mul_ps(invR, invR);
+        const __m256 invR5 = _mm256_mul_ps(_mm256_mul_ps(invR2, invR2), invR);
+        const __m256 radial = _mm256_fmadd_ps(_mm256_mul_ps(fiveHalves, vqv), _mm256_mul_ps(invR2, invR5), factor);
+
+        ax = _mm256_add_ps(ax, _mm256_fmsub_ps(x, radial, _mm256_mul_ps(qx, invR5)));
+        ay = _mm256_add_ps(ay, _mm256_fmsub_ps(y, radial, _mm256_mul_ps(qy, invR5)));
+        az = _mm256_add_ps(az, _mm256_fmsub_ps(z, radial, _mm256_mul_ps(qz, invR5)));
+        if (WithPotential)
+        {
+            sum = _mm256_add_ps(sum, _mm256_fmadd_ps(_mm256_mul_ps(half, vqv), invR5, _mm256_mul_ps(mass, inverse)));
+        }
+    }
+
+    acceleration.m_x += Sum(ax);
+    acceleration.m_y += Sum(ay);
+    acceleration.m_z += Sum(az);
+    if (WithPotential)
+    {
+        *potential -= Sum(sum);
+    }
+}
+
+static void AddPointsAVX2(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddPoints<SofteningPolicy, true>(list, position, softening, acceleration, potential) : AddPoints<SofteningPolicy, false>(list, position, softening, acceleration, potential);
+}
+
+static void AddMonopolesAVX2(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddCells<SofteningPolicy, true, false>(list, position, softening, acceleration, potential) : AddCells<SofteningPolicy, false, false>(list, position, softening, acceleration, potential);
+}
+
+static void AddCellsAVX2(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddCells<SofteningPolicy, true, true>(list, position, softening, acceleration, potential) : AddCells<SofteningPolicy, false, true>(list, position, softening, acceleration, potential);
+}
+
+static const GravityKernels cAVX2Kernels = { KernelIsa::AVX2, AddPointsAVX2, AddMonopolesAVX2, AddCellsAVX2 };
+
+const GravityKernels* GetAVX2GravityKernels()
+{
+    return &cAVX2Kernels;
+}
+
+#else
+
+const GravityKernels* GetAVX2GravityKernels()
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,251 @@
+#include "GravityKernels.h"
+
+#include <cfloat>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GLX_AVX512_KERNELS
+#include <immintrin.h>
+#endif
+
+#ifdef GLX_AVX512_KERNELS
+
+// Functions using the instructions are compiled for them, whatever the flags of the file
+#if defined(__GNUC__) || defined(__clang__)
+#define GLX_TARGET __attribute__((target("avx512f")))
+#else
+#define GLX_TARGET
+#endif
+
+// Reciprocal square root refined by a Newton step, y (1.5 - 0.5 x y^2), nearly exact after the 14 bits of the estimate
+GLX_TARGET static inline __m512 ReciprocalSqrt(__m512 x)
+{
+    const __m512 y = _mm512_rsqrt14_ps(x);
+    const __m512 halfX = _mm512_mul_ps(_mm512_set1_ps(0.5f), x);
+    return _mm512_mul_ps(y, _mm512_fnmadd_ps(halfX, _mm512_mul_ps(y, y), _mm512_set1_ps(1.5f)));
+}
+
+// Exact for the near field, which decides close encounters and the time symmetry, the estimate for the far one
+template <bool Exact>
+GLX_TARGET static inline __m512 InverseSqrt(__m512 x)
+{
+    return Exact ? _mm512_div_ps(_mm512_set1_ps(1.0f), _mm512_sqrt_ps(x)) : ReciprocalSqrt(x);
+}
+
+// Reciprocal refined by a Newton step, y (2 - x y)
+GLX_TARGET static inline __m512 Reciprocal(__m512 x)
+{
+    const __m512 y = _mm512_rcp14_ps(x);
+    return _mm512_mul_ps(y, _mm512_fnmadd_ps(x, y, _mm512_set1_ps(2.0f)));
+}
+
+GLX_TARGET static inline float Sum(__m512 value)
+{
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, value);
+    float sums[8];
+    for (int i = 0; i < 8; i++)
+    {
+        sums[i] = lanes[2 * i] + lanes[2 * i + 1];
+    }
+    return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+}
+
+/*
+Softening policies of Softening.h, factor is Force and inverse is Potential of the policy at
+the squared distances r2 with the softening lengths.
+*/
+template <bool Exact>
+GLX_TARGET static inline void Soften(NoSoftening, __m512 r2, __m512 /*softening*/, __m512& factor, __m512& inverse)
+{
+    inverse = InverseSqrt<Exact>(_mm512_max_ps(r2, _mm512_set1_ps(FLT_MIN)));
+    factor = _mm512_mul_ps(_mm512_mul_ps(inverse, inverse), inverse);
+}
+
+template <bool Exact>
+GLX_TARGET static inline void Soften(PlummerSoftening, __m512 r2, __m512 softening, __m512& factor, __m512& inverse)
+{
+    inverse = InverseSqrt<Exact>(_mm512_fmadd_ps(softening, softening, r2));
+    factor = _mm512_mul_ps(_mm512_mul_ps(inverse, inverse), inverse);
+}
+
+// The pieces of the spline and the Newtonian gravity are all evaluated, every lane selects its own
+template <bool Exact>
+GLX_TARGET static inline void Soften(SplineSoftening, __m512 r2, __m512 softening, __m512& factor, __m512& inverse)
+{
+    const __m512 h = _mm512_mul_ps(_mm512_set1_ps(SplineSoftening::cScale), softening);
+    const __m512 invR = InverseSqrt<Exact>(_mm512_max_ps(r2, _mm512_set1_ps(FLT_MIN)));
+    const __m512 invH = Reciprocal(_mm512_max_ps(h, _mm512_set1_ps(FLT_MIN)));
+    const __m512 u = _mm512_mul_ps(_mm512_mul_ps(r2, invR), invH);
+    const __m512 u2 = _mm512_mul_ps(u, u);
+    const __m512 invH3 = _mm512_mul_ps(_mm512_mul_ps(invH, invH), invH);
+    // 1 / u as h / r
+    const __m512 invU = _mm512_mul_ps(h, invR);
+    const __m512 invU3 = _mm512_mul_ps(_mm512_mul_ps(invU, invU), invU);
+
+    // Polynomials of SplineSoftening in Horner form
+    const __m512 innerForce = _mm512_fmadd_ps(u2, _mm512_fmadd_ps(_mm512_set1_ps(32.0f), u, _mm512_set1_ps(-38.4f)), _mm512_set1_ps(10.666666666667f));
+    const __m512 outerForcePolynomial = _mm512_fmadd_ps(u, _mm512_fmadd_ps(u, _mm512_fnmadd_ps(_mm512_set1_ps(10.666666666667f), u, _mm512_set1_ps(38.4f)), _mm512_set1_ps(-48.0f)), _mm512_set1_ps(21.333333333333f));
+    const __m512 outerForce = _mm512_fnmadd_ps(_mm512_set1_ps(0.066666666667f), invU3, outerForcePolynomial);
+    const __m512 innerPotential = _mm512_fnmadd_ps(u2, _mm512_fmadd_ps(u2, _mm512_fmadd_ps(_mm512_set1_ps(6.4f), u, _mm512_set1_ps(-9.6f)), _mm512_set1_ps(5.333333333333f)), _mm512_set1_ps(2.8f));
+    const __m512 outerPotentialPolynomial = _mm512_fmadd_ps(u, _mm512_fmadd_ps(u, _mm512_fnmadd_ps(_mm512_set1_ps(2.133333333333f), u, _mm512_set1_ps(9.6f)), _mm512_set1_ps(-16.0f)), _mm512_set1_ps(10.666666666667f));
+    const __m512 outerPotential = _mm512_fnmadd_ps(u2, outerPotentialPolynomial, _mm512_fnmadd_ps(_mm512_set1_ps(0.066666666667f), invU, _mm512_set1_ps(3.2f)));
+
+    const __mmask16 inner = _mm512_cmp_ps_mask(u, _mm512_set1_ps(0.5f), _CMP_LT_OQ);
+    const __mmask16 spline = _mm512_cmp_ps_mask(u, _mm512_set1_ps(1.0f), _CMP_LT_OQ);
+    const __m512 splineFactor = _mm512_mul_ps(invH3, _mm512_mask_blend_ps(inner, outerForce, innerForce));
+    const __m512 splineInverse = _mm512_mul_ps(invH, _mm512_mask_blend_ps(inner, outerPotential, innerPotential));
+    factor = _mm512_mask_blend_ps(spline, _mm512_mul_ps(_mm512_mul_ps(invR, invR), invR), splineFactor);
+    inverse = _mm512_mask_blend_ps(spline, invR, splineInverse);
+}
+
+template <typename Softening, bool WithPotential>
+GLX_TARGET static void AddPoints(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    const __m512 px = _mm512_set1_ps(position.m_x);
+    const __m512 py = _mm512_set1_ps(position.m_y);
+    const __m512 pz = _mm512_set1_ps(position.m_z);
+    const __m512 soft = _mm512_set1_ps(softening);
+
+    __m512 ax = _mm512_setzero_ps();
+    __m512 ay = _mm512_setzero_ps();
+    __m512 az = _mm512_setzero_ps();
+    __m512 sum = _mm512_setzero_ps();
+
+    const size_t count = InteractionList::GetPadded(list.points);
+    for (size_t i = 0; i < count; i += 16)
+    {
+        const __m512 x = _mm512_sub_ps(_mm512_load_ps(list.pointX.data() + i), px);
+        const __m512 y = _mm512_sub_ps(_mm512_load_ps(list.pointY.data() + i), py);
+        const __m512 z = _mm512_sub_ps(_mm512_load_ps(list.pointZ.data() + i), pz);
+        const __m512 mass = _mm512_load_ps(list.pointMass.data() + i);
+        const __m512 s = _mm512_max_ps(soft, _mm512_load_ps(list.pointSoftening.data() + i));
+
+        const __m512 r2 = _mm512_fmadd_ps(z, z, _mm512_fmadd_ps(y, y, _mm512_mul_ps(x, x)));
+        __m512 factor, inverse;
+        Soften<true>(Softening(), r2, s, factor, inverse);
+        factor = _mm512_mul_ps(mass, factor);
+
+        ax = _mm512_fmadd_ps(x, factor, ax);
+        ay = _mm512_fmadd_ps(y, factor, ay);
+        az = _mm512_fmadd_ps(z, factor, az);
+        if (WithPotential)
+        {
+            sum = _mm512_fmadd_ps(mass, inverse, sum);
+        }
+    }
+
+    acceleration.m_x += Sum(ax);
+    acceleration.m_y += Sum(ay);
+    acceleration.m_z += Sum(az);
+    if (WithPotential)
+    {
+        *potential -= Sum(sum);
+    }
+}
+
+template <typename Softening, bool WithPotential, bool Quadrupole>
+GLX_TARGET static void AddCells(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    const __m512 px = _mm512_set1_ps(position.m_x);
+    const __m512 py = _mm512_set1_ps(position.m_y);
+    const __m512 pz = _mm512_set1_ps(position.m_z);
+    const __m512 soft = _mm512_set1_ps(softening);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 fiveHalves = _mm512_set1_ps(2.5f);
+
+    __m512 ax = _mm512_setzero_ps();
+    __m512 ay = _mm512_setzero_ps();
+    __m512 az = _mm512_setzero_ps();
+    __m512 sum = _mm512_setzero_ps();
+
+    const size_t count = InteractionList::GetPadded(list.cells);
+    for (size_t i = 0; i < count; i += 16)
+    {
+        const __m512 x = _mm512_sub_ps(_mm512_load_ps(list.cellX.data() + i), px);
+        const __m512 y = _mm512_sub_ps(_mm512_load_ps(list.cellY.data() + i), py);
+        const __m512 z = _mm512_sub_ps(_mm512_load_ps(list.cellZ.data() + i), pz);
+        const __m512 mass = _mm512_load_ps(list.cellMass.data() + i);
+
+        const __m512 r2 = _mm512_fmadd_ps(z, z, _mm512_fmadd_ps(y, y, _mm512_mul_ps(x, x)));
+        __m512 factor, inverse;
+        Soften<false>(Softening(), r2, soft, factor, inverse);
+        factor = _mm512_mul_ps(mass, factor);
+
+        // Without the quadrupole moments a cell acts with its softened monopole alone
+        if (!Quadrupole)
+        {
+            ax = _mm512_fmadd_ps(x, factor, ax);
+            ay = _mm512_fmadd_ps(y, factor, ay);
+            az = _mm512_fmadd_ps(z, factor, az);
+            if (WithPotential)
+            {
+                sum = _mm512_fmadd_ps(mass, inverse, sum);
+            }
+            continue;
+        }
+
+        const __m512 invR = InverseSqrt<false>(_mm512_max_ps(r2, _mm512_set1_ps(FLT_MIN)));
+
+        const __m512 qxx = _mm512_load_ps(list.cellQuadrupole[0].data() + i);
+        const __m512 qyy = _mm512_load_ps(list.cellQuadrupole[1].data() + i);
+        const __m512 qzz = _mm512_load_ps(list.cellQuadrupole[2].data() + i);
+        const __m512 qxy = _mm512_load_ps(list.cellQuadrupole[3].data() + i);
+        const __m512 qxz = _mm512_load_ps(list.cellQuadrupole[4].data() + i);
+        const __m512 qyz = _mm512_load_ps(list.cellQuadrupole[5].data() + i);
+        const __m512 qx = _mm512_fmadd_ps(qxz, z, _mm512_fmadd_ps(qxy, y, _mm512_mul_ps(qxx, x)));
+        const __m512 qy = _mm512_fmadd_ps(qyz, z, _mm512_fmadd_ps(qyy, y, _mm512_mul_ps(qxy, x)));
+        const __m512 qz = _mm512_fmadd_ps(qzz, z, _mm512_fmadd_ps(qyz, y, _mm512_mul_ps(qxz, x)));
+        const __m512 vqv = _mm512_fmadd_ps(qz, z, _mm512_fmadd_ps(qy, y, _mm512_mul_ps(qx, x)));
+
+        const __m512 invR2 = _mm512_mul_ps(invR, invR);
+        const __m512 invR5 = _mm512_mul_ps(_mm512_mul_ps(invR2, invR2), invR);
+        const __m512 radial = _mm512_fmadd_ps(_mm512_mul_ps(fiveHalves, vqv), _mm512_mul_ps(invR2, invR5), factor);
+
+        ax = _mm512_add_ps(ax, _mm512_fmsub_ps(x, radial, _mm512_mul_ps(qx, invR5)));
+        ay = _mm512_add_ps(ay, _mm512_fmsub_ps(y, radial, _mm512_mul_ps(qy, invR5)));
+        az = _mm512_add_ps(az, _mm512_fmsub_ps(z, radial, _mm512_mul_ps(qz, invR5)));
+        if (WithPotential)
+        {
+            sum = _mm512_add_ps(sum, _mm512_fmadd_ps(_mm512_mul_ps(half, vqv), invR5, _mm512_mul_ps(mass, inverse)));
+        }
+    }
+
+    acceleration.m_x += Sum(ax);
+    acceleration.m_y += Sum(ay);
+    acceleration.m_z += Sum(az);
+    if (WithPotential)
+    {
+        *potential -= Sum(sum);
+    }
+}
+
+static void AddPointsAVX512(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddPoints<SofteningPolicy, true>(list, position, softening, acceleration, potential) : AddPoints<SofteningPolicy, false>(list, position, softening, acceleration, potential);
+}
+
+static void AddMonopolesAVX512(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddCells<SofteningPolicy, true, false>(list, position, softening, acceleration, potential) : AddCells<SofteningPolicy, false, false>(list, position, softening, acceleration, potential);
+}
+
+static void AddCellsAVX512(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddCells<SofteningPolicy, true, true>(list, position, softening, acceleration, potential) : AddCells<SofteningPolicy, false, true>(list, position, softening, acceleration, potential);
+}
+
+static const GravityKernels cAVX512Kernels = { KernelIsa::AVX512, AddPointsAVX512, AddMonopolesAVX512, AddCellsAVX512 };
+
+const GravityKernels* GetAVX512GravityKernels()
+{
+    return &cAVX512Kernels;
+}
+
+#else
+
+const GravityKernels* GetAVX512GravityKernels()
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,246 @@
+#include "GravityKernels.h"
+
+#include <cfloat>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define GLX_SSE4_KERNELS
+#include <smmintrin.h>
+#endif
+
+#ifdef GLX_SSE4_KERNELS
+
+// Functions using the instructions are compiled for them, whatever the flags of the file
+#if defined(__GNUC__) || defined(__clang__)
+#define GLX_TARGET __attribute__((target("sse4.1")))
+#else
+#define GLX_TARGET
+#endif
+
+// Reciprocal square root refined by a Newton step, y (1.5 - 0.5 x y^2), about 22 bits exact
+GLX_TARGET static inline __m128 ReciprocalSqrt(__m128 x)
+{
+    const __m128 y = _mm_rsqrt_ps(x);
+    const __m128 halfX = _mm_mul_ps(_mm_set1_ps(0.5f), x);
+    return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(halfX, _mm_mul_ps(y, y))));
+}
+
+// Exact for the near field, which decides close encounters and the time symmetry, the estimate for the far one
+template <bool Exact>
+GLX_TARGET static inline __m128 InverseSqrt(__m128 x)
+{
+    return Exact ? _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(x)) : ReciprocalSqrt(x);
+}
+
+// Reciprocal refined by a Newton step, y (2 - x y)
+GLX_TARGET static inline __m128 Reciprocal(__m128 x)
+{
+    const __m128 y = _mm_rcp_ps(x);
+    return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(x, y)));
+}
+
+GLX_TARGET static inline float Sum(__m128 value)
+{
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, value);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+/*
+Softening policies of Softening.h, factor is Force and inverse is Potential of the policy at
+the squared distances r2 with the softening lengths.
+*/
+template <bool Exact>
+GLX_TARGET static inline void Soften(NoSoftening, __m128 r2, __m128 /*softening*/, __m128& factor, __m128& inverse)
+{
+    inverse = InverseSqrt<Exact>(_mm_max_ps(r2, _mm_set1_ps(FLT_MIN)));
+    factor = _mm_mul_ps(_mm_mul_ps(inverse, inverse), inverse);
+}
+
+template <bool Exact>
+GLX_TARGET static inline void Soften(PlummerSoftening, __m128 r2, __m128 softening, __m128& factor, __m128& inverse)
+{
+    inverse = InverseSqrt<Exact>(_mm_add_ps(_mm_mul_ps(softening, softening), r2));
+    factor = _mm_mul_ps(_mm_mul_ps(inverse, inverse), inverse);
+}
+
+// The pieces of the spline and the Newtonian gravity are all evaluated, every lane selects its own
+template <bool Exact>
+GLX_TARGET static inline void Soften(SplineSoftening, __m128 r2, __m128 softening, __m128& factor, __m128& inverse)
+{
+    const __m128 h = _mm_mul_ps(_mm_set1_ps(SplineSoftening::cScale), softening);
+    const __m128 invR = InverseSqrt<Exact>(_mm_max_ps(r2, _mm_set1_ps(FLT_MIN)));
+    const __m128 invH = Reciprocal(_mm_max_ps(h, _mm_set1_ps(FLT_MIN)));
+    const __m128 u = _mm_mul_ps(_mm_mul_ps(r2, invR), invH);
+    const __m128 u2 = _mm_mul_ps(u, u);
+    const __m128 invH3 = _mm_mul_ps(_mm_mul_ps(invH, invH), invH);
+    // 1 / u as h / r
+    const __m128 invU = _mm_mul_ps(h, invR);
+    const __m128 invU3 = _mm_mul_ps(_mm_mul_ps(invU, invU), invU);
+
+    // Polynomials of SplineSoftening in Horner form
+    const __m128 innerForce = _mm_add_ps(_mm_mul_ps(u2, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(32.0f), u), _mm_set1_ps(-38.4f))), _mm_set1_ps(10.666666666667f));
+    const __m128 outerForcePolynomial = _mm_add_ps(_mm_mul_ps(u, _mm_add_ps(_mm_mul_ps(u, _mm_sub_ps(_mm_set1_ps(38.4f), _mm_mul_ps(_mm_set1_ps(10.666666666667f), u))), _mm_set1_ps(-48.0f))), _mm_set1_ps(21.333333333333f));
+    const __m128 outerForce = _mm_sub_ps(outerForcePolynomial, _mm_mul_ps(_mm_set1_ps(0.066666666667f), invU3));
+    const __m128 innerPotential = _mm_sub_ps(_mm_set1_ps(2.8f), _mm_mul_ps(u2, _mm_add_ps(_mm_mul_ps(u2, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(6.4f), u), _mm_set1_ps(-9.6f))), _mm_set1_ps(5.333333333333f))));
+    const __m128 outerPotentialPolynomial = _mm_add_ps(_mm_mul_ps(u, _mm_add_ps(_mm_mul_ps(u, _mm_sub_ps(_mm_set1_ps(9.6f), _mm_mul_ps(_mm_set1_ps(2.133333333333f), u))), _mm_set1_ps(-16.0f))), _mm_set1_ps(10.666666666667f));
+    const __m128 outerPotential = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(3.2f), _mm_mul_ps(_mm_set1_ps(0.066666666667f), invU)), _mm_mul_ps(u2, outerPotentialPolynomial));
+
+    const __m128 inner = _mm_cmplt_ps(u, _mm_set1_ps(0.5f));
+    const __m128 spline = _mm_cmplt_ps(u, _mm_set1_ps(1.0f));
+    const __m128 splineFactor = _mm_mul_ps(invH3, _mm_blendv_ps(outerForce, innerForce, inner));
+    const __m128 splineInverse = _mm_mul_ps(invH, _mm_blendv_ps(outerPotential, innerPotential, inner));
+    factor = _mm_blendv_ps(_mm_mul_ps(_mm_mul_ps(invR, invR), invR), splineFactor, spline);
+    inverse = _mm_blendv_ps(invR, splineInverse, spline);
+}
+
+template <typename Softening, bool WithPotential>
+GLX_TARGET static void AddPoints(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    const __m128 px = _mm_set1_ps(position.m_x);
+    const __m128 py = _mm_set1_ps(position.m_y);
+    const __m128 pz = _mm_set1_ps(position.m_z);
+    const __m128 soft = _mm_set1_ps(softening);
+
+    __m128 ax = _mm_setzero_ps();
+    __m128 ay = _mm_setzero_ps();
+    __m128 az = _mm_setzero_ps();
+    __m128 sum = _mm_setzero_ps();
+
+    const size_t count = InteractionList::GetPadded(list.points);
+    for (size_t i = 0; i < count; i += 4)
+    {
+        const __m128 x = _mm_sub_ps(_mm_load_ps(list.pointX.data() + i), px);
+        const __m128 y = _mm_sub_ps(_mm_load_ps(list.pointY.data() + i), py);
+        const __m128 z = _mm_sub_ps(_mm_load_ps(list.pointZ.data() + i), pz);
+        const __m128 mass = _mm_load_ps(list.pointMass.data() + i);
+        const __m128 s = _mm_max_ps(soft, _mm_load_ps(list.pointSoftening.data() + i));
+
+        const __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 factor, inverse;
+        Soften<true>(Softening(), r2, s, factor, inverse);
+        factor = _mm_mul_ps(mass, factor);
+
+        ax = _mm_add_ps(ax, _mm_mul_ps(x, factor));
+        ay = _mm_add_ps(ay, _mm_mul_ps(y, factor));
+        az = _mm_add_ps(az, _mm_mul_ps(z, factor));
+        if (WithPotential)
+        {
+            sum = _mm_add_ps(_mm_mul_ps(mass, inverse), sum);
+        }
+    }
+
+    acceleration.m_x += Sum(ax);
+    acceleration.m_y += Sum(ay);
+    acceleration.m_z += Sum(az);
+    if (WithPotential)
+    {
+        *potential -= Sum(sum);
+    }
+}
+
+template <typename Softening, bool WithPotential, bool Quadrupole>
+GLX_TARGET static void AddCells(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    const __m128 px = _mm_set1_ps(position.m_x);
+    const __m128 py = _mm_set1_ps(position.m_y);
+    const __m128 pz = _mm_set1_ps(position.m_z);
+    const __m128 soft = _mm_set1_ps(softening);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 fiveHalves = _mm_set1_ps(2.5f);
+
+    __m128 ax = _mm_setzero_ps();
+    __m128 ay = _mm_setzero_ps();
+    __m128 az = _mm_setzero_ps();
+    __m128 sum = _mm_setzero_ps();
+
+    const size_t count = InteractionList::GetPadded(list.cells);
+    for (size_t i = 0; i < count; i += 4)
+    {
+        const __m128 x = _mm_sub_ps(_mm_load_ps(list.cellX.data() + i), px);
+        const __m128 y = _mm_sub_ps(_mm_load_ps(list.cellY.data() + i), py);
+        const __m128 z = _mm_sub_ps(_mm_load_ps(list.cellZ.data() + i), pz);
+        const __m128 mass = _mm_load_ps(list.cellMass.data() + i);
+
+        const __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 factor, inverse;
+        Soften<false>(Softening(), r2, soft, factor, inverse);
+        factor = _mm_mul_ps(mass, factor);
+
+        // Without the quadrupole moments a cell acts with its softened monopole alone
+        if (!Quadrupole)
+        {
+            ax = _mm_add_ps(ax, _mm_mul_ps(x, factor));
+            ay = _mm_add_ps(ay, _mm_mul_ps(y, factor));
+            az = _mm_add_ps(az, _mm_mul_ps(z, factor));
+            if (WithPotential)
+            {
+                sum = _mm_add_ps(_mm_mul_ps(mass, inverse), sum);
+            }
+            continue;
+        }
+
+        const __m128 invR = InverseSqrt<false>(_mm_max_ps(r2, _mm_set1_ps(FLT_MIN)));
+
+        const __m128 qxx = _mm_load_ps(list.cellQuadrupole[0].data() + i);
+        const __m128 qyy = _mm_load_ps(list.cellQuadrupole[1].data() + i);
+        const __m128 qzz = _mm_load_ps(list.cellQuadrupole[2].data() + i);
+        const __m128 qxy = _mm_load_ps(list.cellQuadrupole[3].data() + i);
+        const __m128 qxz = _mm_load_ps(list.cellQuadrupole[4].data() + i);
+        const __m128 qyz = _mm_load_ps(list.cellQuadrupole[5].data() + i);
+        const __m128 qx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qxx, x), _mm_mul_ps(qxy, y)), _mm_mul_ps(qxz, z));
+        const __m128 qy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qxy, x), _mm_mul_ps(qyy, y)), _mm_mul_ps(qyz, z));
+        const __m128 qz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qxz, x), _mm_mul_ps(qyz, y)), _mm_mul_ps(qzz, z));
+        const __m128 vqv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, x), _mm_mul_ps(qy, y)), _mm_mul_ps(qz, z));
+
+        const __m128 invR2 = _mm_mul_ps(invR, invR);
+        const __m128 invR5 = _mm_mul_ps(_mm_mul_ps(invR2, invR2), invR);
+        const __m128 radial = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(fiveHalves, vqv), _mm_mul_ps(invR2, invR5)), factor);
+
+        ax = _mm_add_ps(ax, _mm_sub_ps(_mm_mul_ps(x, radial), _mm_mul_ps(qx, invR5)));
+        ay = _mm_add_ps(ay, _mm_sub_ps(_mm_mul_ps(y, radial), _mm_mul_ps(qy, invR5)));
+        az = _mm_add_ps(az, _mm_sub_ps(_mm_mul_ps(z, radial), _mm_mul_ps(qz, invR5)));
+        if (WithPotential)
+        {
+            sum = _mm_add_ps(sum, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(half, vqv), invR5), _mm_mul_ps(mass, inverse)));
+        }
+    }
+
+    acceleration.m_x += Sum(ax);
+    acceleration.m_y += Sum(ay);
+    acceleration.m_z += Sum(az);
+    if (WithPotential)
+    {
+        *potential -= Sum(sum);
+    }
+}
+
+static void AddPointsSSE4(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddPoints<SofteningPolicy, true>(list, position, softening, acceleration, potential) : AddPoints<SofteningPolicy, false>(list, position, softening, acceleration, potential);
+}
+
+static void AddMonopolesSSE4(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddCells<SofteningPolicy, true, false>(list, position, softening, acceleration, potential) : AddCells<SofteningPolicy, false, false>(list, position, softening, acceleration, potential);
+}
+
+static void AddCellsSSE4(const InteractionList& list, const float3& position, float softening, float3& acceleration, float* potential)
+{
+    potential ? AddCells<SofteningPolicy, true, true>(list, position, softening, acceleration, potential) : AddCells<SofteningPolicy, false, true>(list, position, softening, acceleration, potential);
+}
+
+static const GravityKernels cSSE4Kernels = { KernelIsa::SSE4, AddPointsSSE4, AddMonopolesSSE4, AddCellsSSE4 };
+
+const GravityKernels* GetSSE4GravityKernels()
+{
+    return &cSSE4Kernels;
+}
+
+#else
+
+const GravityKernels* GetSSE4GravityKernels()
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,493 @@
+#include "Simulation.h"
+#include "GravityKernels.h"
+#include "Threading.h"
+#include "Constants.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Regression check of the long-term behavior of the integrator and the solvers. Standard test
+systems are integrated over fixed horizons, the worst relative energy drift and angular
+momentum error on the way are recorded, then the velocities are flipped and the system is
+integrated back to test the time-reversal symmetry. The results are compared with the
+baselines stored by an earlier run, a metric grown beyond its baseline times the tolerance
+is a regression.
+*/
+
+static constexpr const char* cDefaultBaselines = "Baselines/Integrators.txt";
+// Diagnostics taken over the horizon of every system
+static constexpr uint32_t cDiagnosticsPerHorizon = 200;
+// Metrics below this are roundoff, they never regress
+static constexpr double cMetricFloor = 1e-6;
+
+struct CheckOptions
+{
+    Simulation::SolverType solverType = Simulation::SolverType::BarnesHut;
+    uint32_t particles = 1000;
+    float deltaTimeScale = 1.0f;
+    float tolerance = 1.5f;
+    uint32_t threads = 0;
+    std::string baselinesFile = cDefaultBaselines;
+    bool updateBaselines = false;
+    // The roundoff of the reversal depends on the kernels, the baselines are of the scalar ones
+    KernelIsa kernels = KernelIsa::Scalar;
+};
+
+struct TestSystem
+{
+    const char* name;
+    float horizon;
+    float deltaTime;
+    // Creates the initial state
+    std::function<void(Simulation&, const CheckOptions&)> setup;
+};
+
+struct SystemResult
+{
+    std::string name;
+    uint32_t steps = 0;
+    // Largest relative errors over the horizon
+    double energyDrift = 0.0;
+    double angularMomentumError = 0.0;
+    // RMS distance from the initial positions after the round trip, relative to the RMS radius
+    double reversalError = 0.0;
+};
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: GalaxyIntegratorCheck [options]\n"
+        "\n"
+        "Integrates a Plummer sphere, a cold disk and a Kepler orbit, records the energy\n"
+        "drift, the angular momentum error and the error of integrating forward and back,\n"
+        "and compares them with the stored baselines. Exits with 1 on a regression.\n"
+        "\n"
+        "  --solver NAME          barneshut or bruteforce (barneshut)\n"
+        "  --particles N          particles of the Plummer sphere and the disk (1000)\n"
+        "  --dt-scale S           time steps of all systems times S, the horizons stay (1)\n"
+        "  --tolerance T          a metric regresses above T times its baseline (1.5)\n"
+        "  --threads N            worker threads (hardware concurrency)\n"
+        "  --kernels NAME         gravity kernels, scalar, sse4, avx2 or avx512 (scalar)\n"
+        "  --baselines F          baseline file (" << cDefaultBaselines << ")\n"
+        "  --update-baselines     write the results as the new baselines\n";
+}
+
+static bool ParseUint(const char* value, uint32_t& result)
+{
+    if (!value)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    unsigned long parsed = std::strtoul(value, &end, 10);
+    if (end == value || *end != 0)
+    {
+        return false;
+    }
+    result = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+static bool ParseFloat(const char* value, float& result)
+{
+    if (!value)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    result = std::strtof(value, &end);
+    return end != value && *end == 0;
+}
+
+static bool ParseArguments(int argc, char** argv, CheckOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool ok = true;
+
+        if (!std::strcmp(arg, "--particles"))               ok = ParseUint(value, options.particles) && options.particles >= 2;
+        else if (!std::strcmp(arg, "--dt-scale"))           ok = ParseFloat(value, options.deltaTimeScale) && options.deltaTimeScale > 0.0f;
+        else if (!std::strcmp(arg, "--kernels"))            ok = value != nullptr && ParseKernelIsa(value, options.kernels);
+        else if (!std::strcmp(arg, "--tolerance"))          ok = ParseFloat(value, options.tolerance) && options.tolerance >= 1.0f;
+        else if (!std::strcmp(arg, "--threads"))            ok = ParseUint(value, options.threads);
+        else if (!std::strcmp(arg, "--baselines"))
+        {
+            ok = value != nullptr;
+            if (ok)
+            {
+                options.baselinesFile = value;
+            }
+        }
+        else if (!std::strcmp(arg, "--solver"))
+        {
+            ok = value != nullptr;
+            if (ok && !std::strcmp(value, "barneshut"))
+            {
+                options.solverType = Simulation::SolverType::BarnesHut;
+            }
+            else if (ok && !std::strcmp(value, "bruteforce"))
+            {
+                options.solverType = Simulation::SolverType::Bruteforce;
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+        else if (!std::strcmp(arg, "--update-baselines"))
+        {
+            options.updateBaselines = true;
+            continue;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Invalid value for " << arg << std::endl;
+            return false;
+        }
+
+        ++i;
+    }
+
+    return true;
+}
+
+static void SetupPlummer(Simulation& simulation, const CheckOptions& options)
+{
+    // The disk mass ratio splits the mass, with no disk particles half of it makes the sphere
+    GalaxyParameters model;
+    model.bulgeParticlesCount = options.particles;
+    model.diskParticlesCount = 0;
+    simulation.Reset(model, cDefaultDeltaTime);
+}
+
+static void SetupColdDisk(Simulation& simulation, const CheckOptions& options)
+{
+    // Circular velocities with no dispersion
+    GalaxyParameters model;
+    model.bulgeParticlesCount = 0;
+    model.diskParticlesCount = options.particles;
+    simulation.Reset(model, cDefaultDeltaTime);
+}
+
+// Orbit of the Kepler system, G = 1
+static constexpr float cKeplerCentralMass = 1.0f;
+static constexpr float cKeplerSemiMajorAxis = 1.0f;
+static constexpr float cKeplerEccentricity = 0.5f;
+
+static void SetupKepler(Simulation& simulation, const CheckOptions&)
+{
+    GalaxyParameters model;
+    model.bulgeParticlesCount = 1;
+    model.diskParticlesCount = 1;
+    simulation.Reset(model, cDefaultDeltaTime);
+
+    // A test mass starts at the apocenter about the fixed black hole, forces are recomputed every step
+    auto& particles = simulation.GetUniverse().GetGalaxies().front().GetParticles();
+    particles[0].SetMass(cKeplerCentralMass);
+    particles[0].position = {};
+    particles[0].linearVelocity = {};
+
+    const float apocenter = cKeplerSemiMajorAxis * (1.0f + cKeplerEccentricity);
+    particles[1].SetMass(1e-6f);
+    particles[1].position = float3(apocenter, 0.0f, 0.0f);
+    particles[1].linearVelocity = float3(0.0f, std::sqrt(cKeplerCentralMass * (1.0f - cKeplerEccentricity) / apocenter), 0.0f);
+}
+
+static std::vector<TestSystem> GetTestSystems()
+{
+    const float keplerPeriod = 2.0f * 3.14159265f * std::sqrt(std::pow(cKeplerSemiMajorAxis, 3.0f) / cKeplerCentralMass);
+
+    // Close pairs near the black holes of the galaxies need short steps, so their horizons are a
+    // thousand steps, the Kepler orbit is followed for ten periods
+    return
+    {
+        { "plummer", 0.01f, 1e-5f, SetupPlummer },
+        { "disk", 0.01f, 1e-5f, SetupColdDisk },
+        { "kepler", 10.0f * keplerPeriod, 1e-3f * keplerPeriod, SetupKepler },
+    };
+}
+
+static void FlipVelocities(Universe& universe)
+{
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        for (auto& particle : galaxy.GetParticles())
+        {
+            if (particle.movable)
+            {
+                particle.linearVelocity *= -1.0f;
+            }
+        }
+        for (auto& particle : galaxy.GetHaloParticles())
+        {
+            particle.linearVelocity *= -1.0f;
+        }
+    }
+}
+
+static double GetRelativeError(float3 value, float3 reference)
+{
+    const double norm = reference.norm();
+    return norm > 0.0 ? (value - reference).norm() / norm : 0.0;
+}
+
+static SystemResult RunSystem(const TestSystem& system, const CheckOptions& options)
+{
+    SystemResult result;
+    result.name = system.name;
+
+    const float deltaTime = system.deltaTime * options.deltaTimeScale;
+    result.steps = (std::max)(static_cast<uint32_t>(std::lround(system.horizon / deltaTime)), 1u);
+
+    Simulation simulation;
+    simulation.SetSolverType(options.solverType);
+    system.setup(simulation, options);
+    simulation.GetParameters().diagnosticsInterval = (std::max)(result.steps / cDiagnosticsPerHorizon, 1u);
+
+    // By the particle ids, the simulation reorders the particles on the way
+    std::vector<float3> initial;
+    for (const auto& galaxy : simulation.GetUniverse().GetGalaxies())
+    {
+        const size_t offset = initial.size();
+        initial.resize(offset + galaxy.GetParticlesCount());
+        for (const auto& particle : galaxy.GetParticles())
+        {
+            initial[offset + particle.id] = particle.position;
+        }
+    }
+
+    bool hasInitial = false;
+    double initialEnergy = 0.0;
+    float3 initialAngularMomentum;
+
+    for (uint32_t i = 0; i < result.steps; ++i)
+    {
+        simulation.Step(deltaTime);
+
+        if (!simulation.GetSolver().HasNewDiagnostics())
+        {
+            continue;
+        }
+
+        const Diagnostics& diagnostics = simulation.GetSolver().GetDiagnostics();
+        if (!hasInitial)
+        {
+            initialEnergy = diagnostics.GetTotalEnergy();
+            initialAngularMomentum = diagnostics.angularMomentum;
+            hasInitial = true;
+        }
+        result.energyDrift = (std::max)(result.energyDrift, std::abs((diagnostics.GetTotalEnergy() - initialEnergy) / initialEnergy));
+        result.angularMomentumError = (std::max)(result.angularMomentumError, GetRelativeError(diagnostics.angularMomentum, initialAngularMomentum));
+    }
+
+    // Back to the start
+    simulation.GetParameters().diagnosticsInterval = 0;
+    FlipVelocities(simulation.GetUniverse());
+    for (uint32_t i = 0; i < result.steps; ++i)
+    {
+        simulation.Step(deltaTime);
+    }
+    FlipVelocities(simulation.GetUniverse());
+
+    double squares = 0.0;
+    double radii = 0.0;
+    size_t offset = 0;
+    for (const auto& galaxy : simulation.GetUniverse().GetGalaxies())
+    {
+        for (const auto& particle : galaxy.GetParticles())
+        {
+            if (particle.movable)
+            {
+                float3 start = initial[offset + particle.id];
+                squares += (particle.position - start).normSq();
+                radii += (start - galaxy.GetCenter()).normSq();
+            }
+        }
+        offset += galaxy.GetParticlesCount();
+    }
+    result.reversalError = radii > 0.0 ? std::sqrt(squares / radii) : 0.0;
+
+    return result;
+}
+
+/** Metrics of the systems as "system.metric" = value. */
+static std::map<std::string, double> GetMetrics(const std::vector<SystemResult>& results)
+{
+    std::map<std::string, double> metrics;
+    for (const auto& result : results)
+    {
+        metrics[result.name + ".energyDrift"] = result.energyDrift;
+        metrics[result.name + ".angularMomentumError"] = result.angularMomentumError;
+        metrics[result.name + ".reversalError"] = result.reversalError;
+    }
+    return metrics;
+}
+
+static bool ReadBaselines(const std::string& filename, std::map<std::string, double>& baselines)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        const size_t separator = line.find('=');
+        if (separator == std::string::npos)
+        {
+            return false;
+        }
+
+        std::string key = line.substr(0, separator);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        char* end = nullptr;
+        const std::string value = line.substr(separator + 1);
+        baselines[key] = std::strtod(value.c_str(), &end);
+        if (end == value.c_str())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool WriteBaselines(const std::string& filename, const CheckOptions& options, const std::map<std::string, double>& metrics)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    file << "# Baselines of GalaxyIntegratorCheck, written with --update-baselines\n";
+    file << "# " << options.particles << " particles, time step scale " << options.deltaTimeScale << ", "
+        << (options.solverType == Simulation::SolverType::BarnesHut ? "barneshut" : "bruteforce") << " solver, "
+        << GetKernelIsaName(options.kernels) << " kernels, " << SofteningPolicy::cName << " softening\n";
+
+    file.precision(6);
+    for (const auto& metric : metrics)
+    {
+        file << metric.first << " = " << metric.second << "\n";
+    }
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && (!std::strcmp(argv[1], "--help") || !std::strcmp(argv[1], "-h")))
+    {
+        PrintUsage();
+        return 0;
+    }
+
+    CheckOptions options;
+    if (!ParseArguments(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!SelectGravityKernels(options.kernels))
+    {
+        std::cerr << "The CPU doesn't run the " << GetKernelIsaName(options.kernels) << " kernels" << std::endl;
+        return 1;
+    }
+
+    ThreadPool::Create(options.threads > 0 ? options.threads : std::thread::hardware_concurrency());
+
+    std::vector<SystemResult> results;
+    for (const TestSystem& system : GetTestSystems())
+    {
+        Timer<> timer;
+        results.push_back(RunSystem(system, options));
+
+        const SystemResult& result = results.back();
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-8s %7u steps, energy drift %10.3e, angular momentum error %10.3e, reversal error %10.3e, %.1f s",
+            result.name.c_str(), result.steps, result.energyDrift, result.angularMomentumError, result.reversalError, timer.GetPassedTime());
+        std::cout << line << std::endl;
+    }
+
+    ThreadPool::Destroy();
+
+    const std::map<std::string, double> metrics = GetMetrics(results);
+
+    if (options.updateBaselines)
+    {
+        if (!WriteBaselines(options.baselinesFile, options, metrics))
+        {
+            std::cerr << "Can't write " << options.baselinesFile << std::endl;
+            return 1;
+        }
+        std::cout << "Baselines written to " << options.baselinesFile << std::endl;
+        return 0;
+    }
+
+    std::map<std::string, double> baselines;
+    if (!ReadBaselines(options.baselinesFile, baselines))
+    {
+        std::cerr << "Can't read baselines from " << options.baselinesFile << std::endl;
+        return 1;
+    }
+
+    uint32_t regressions = 0;
+    for (const auto& metric : metrics)
+    {
+        auto baseline = baselines.find(metric.first);
+        if (baseline == baselines.end())
+        {
+            std::cout << "No baseline for " << metric.first << std::endl;
+            ++regressions;
+            continue;
+        }
+
+        // Not finite fails too
+        const double limit = (std::max)(baseline->second * options.tolerance, cMetricFloor);
+        if (!(metric.second <= limit))
+        {
+            std::cout << "Regression of " << metric.first << ": " << metric.second << ", baseline " << baseline->second << std::endl;
+            ++regressions;
+        }
+    }
+
+    if (regressions > 0)
+    {
+        std::cout << regressions << " of " << metrics.size() << " metrics regressed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "All " << metrics.size() << " metrics within " << options.tolerance << " times their baselines" << std::endl;
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+/** Read-only memory mapping of a whole file. */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const char* filename);
+    void Close();
+
+    bool IsOpen() const { return data != nullptr; }
+    const uint8_t* GetData() const { return data; }
+    uint64_t GetSize() const { return size; }
+
+private:
+    const uint8_t* data = nullptr;
+    uint64_t size = 0;
+
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#else
+    int file = -1;
+#endif
+};
@@ -1,4 +1,5 @@
 ﻿#include "Math.h"
+#include "Multigrid.h"
 
 #include <cassert>
 
@@ -97,25 +98,35 @@ bool poisson2d(int numIter, float min, float max, int n, float **data, float(*f)
     if (!data)			return false;
     if (!f)				return false;
 
+    // Multigrid on a contiguous copy, numIter limits the V-cycles
+    MultigridPoisson solver(2, n, min, max);
+    std::vector<float> u(solver.GetPointCount());
+    std::vector<float> rightPart(solver.GetPointCount());
 
     float h = (max - min) / (n - 1);
-    float h2 = h * h;
-    float nu;
-    float relax = 1.3f;
 
-    for (int iter = 0; iter < numIter; iter++)
+    for (int i = 0; i < n; i++)
     {
-        for (int i = 1; i < n - 1; i++)
+        for (int j = 0; j < n; j++)
         {
-            for (int j = 1; j < n - 1; j++)
-            {
-                nu = 0.25f * (data[i - 1][j] + data[i + 1][j] + data[i][j - 1] + data[i][j + 1] - h2 * f(min + i * h, min + j * h));
-                data[i][j] += relax * (nu - data[i][j]);
-            }
+            u[j * n + i] = data[i][j];
+            rightPart[j * n + i] = f(min + i * h, min + j * h);
         }
     }
 
-    return true;
+    MultigridPoisson::Options options;
+    options.maxCycles = numIter;
+    const bool converged = solver.Solve(u, rightPart, options);
+
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            data[i][j] = u[j * n + i];
+        }
+    }
+
+    return converged;
 }
 
 bool poisson3d(int numIter, float min, float max, int n, float ***data, float(*f)(float x, float y, float z))
@@ -126,33 +137,72 @@ bool poisson3d(int numIter, float min, float max, int n, float ***data, float(*f
     if (!data)			return false;
     if (!f)				return false;
 
+    // Multigrid on a contiguous copy, numIter limits the V-cycles
+    MultigridPoisson solver(3, n, min, max);
+    std::vector<float> u(solver.GetPointCount());
+    std::vector<float> rightPart(solver.GetPointCount());
 
     float h = (max - min) / (n - 1);
-    float h2 = h * h;
-    float nu;
-    float relax = 1.3f;
-    float factor = 1.0f / 6.0f;
 
-    for (int iter = 0; iter < numIter; iter++)
+    for (int i = 0; i < n; i++)
     {
-        for (int i = 1; i < n - 1; i++)
+        for (int j = 0; j < n; j++)
         {
-            for (int j = 1; j < n - 1; j++)
+            for (int k = 0; k < n; k++)
             {
-                for (int k = 1; k < n - 1; k++)
-                {
-                    nu = data[i - 1][j][k] + data[i + 1][j][k] +
-                        data[i][j - 1][k] + data[i][j + 1][k] +
-                        data[i][j][k - 1] + data[i][j][k + 1];
-                    nu -= h2 * f(min + i * h, min + j * h, min + k * h);
-                    nu *= factor;
-                    data[i][j][k] += relax * (nu - data[i][j][k]);
-                }
+                const size_t index = (static_cast<size_t>(k) * n + j) * n + i;
+                u[index] = data[i][j][k];
+                rightPart[index] = f(min + i * h, min + j * h, min + k * h);
             }
         }
     }
 
-    return true;
+    MultigridPoisson::Options options;
+    options.maxCycles = numIter;
+    const bool converged = solver.Solve(u, rightPart, options);
+
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                data[i][j][k] = u[(static_cast<size_t>(k) * n + j) * n + i];
+            }
+        }
+    }
+
+    return converged;
+}
+
+void InverseCdfTable::Build(float xmin, float xmax, const std::vector<double>& density, uint32_t size)
+{
+    assert(size > 1 && density.size() > 1);
+
+    const size_t intervals = density.size() - 1;
+    const double h = static_cast<double>(xmax - xmin) / intervals;
+
+    std::vector<double> cdf(density.size(), 0.0);
+    for (size_t i = 1; i < cdf.size(); ++i)
+    {
+        cdf[i] = cdf[i - 1] + 0.5 * h * (density[i - 1] + density[i]);
+    }
+    assert(cdf.back() > 0.0);
+
+    // Walk both grids at once, the cdf is interpolated linearly inside an interval
+    values.resize(size);
+    size_t interval = 0;
+    for (uint32_t k = 0; k < size; ++k)
+    {
+        const double target = cdf.back() * k / (size - 1);
+        while (interval < intervals - 1 && cdf[interval + 1] < target)
+        {
+            ++interval;
+        }
+        const double width = cdf[interval + 1] - cdf[interval];
+        const double t = width > 0.0 ? std::min(std::max((target - cdf[interval]) / width, 0.0), 1.0) : 0.0;
+        values[k] = static_cast<float>(xmin + (interval + t) * h);
+    }
 }
 
 float RandomStandardDistribution()
@@ -4,8 +4,11 @@
 #include <cmath>
 #include <cstdint>
 #include <vector>
+#include <algorithm>
 
 #include "float3.h"
+#include "Random.h"
+#include "Softening.h"
 
 #define PI (static_cast<float>(M_PI))
 
@@ -57,6 +60,8 @@ float integrate_trap(float a, float b, int n, float(*f)(float));
 void Poisson1(uint32_t numIter, float min, float max, int n, float *data, const std::vector<float>& rightPart);
 
 bool poisson1d(int numIter, float min, float max, int n, float   *data, float(*f)(float));
+// 2D and 3D versions solve with MultigridPoisson, numIter is the limit of V-cycles.
+// They return false if the V-cycles didn't converge, data holds the last iterate then.
 bool poisson2d(int numIter, float min, float max, int n, float  **data, float(*f)(float, float));
 bool poisson3d(int numIter, float min, float max, int n, float ***data, float(*f)(float, float, float));
 
@@ -65,7 +70,7 @@ float RandomStandardDistribution();
 
 inline float3 SphericalToCartesian(float r, float phi, float theta)
 {
-    return { r * std::sinf(theta) * std::cosf(phi), r * std::sinf(theta) * std::sinf(phi), r * std::cosf(theta) };
+    return { r * std::sin(theta) * std::cos(phi), r * std::sin(theta) * std::sin(phi), r * std::cos(theta) };
 }
 
 inline float3 SphericalToCartesian(const float3& spherical)
@@ -75,7 +80,7 @@ inline float3 SphericalToCartesian(const float3& spherical)
 
 inline float3 CylindricalToCartesian(float r, float phi, float z)
 {
-    return { r * std::cosf(phi), r * std::sinf(phi), z };
+    return { r * std::cos(phi), r * std::sin(phi), z };
 }
 
 inline float3 CylindricalToCartesian(const float3& cylindrical)
@@ -93,24 +98,39 @@ inline float3 RandomUniformCylindrical(float rmin, float rmax, float height)
     return { RAND_RANGE(rmin, rmax), 2.0f * PI * RAND(), RAND_RANGE(-0.5f * height, 0.5f * height) };
 }
 
-inline float3 GravityAcceleration(const float3& point, float mass, float soft, float length = -1.0f)
+inline float3 RandomUniformSpherical(float rmin, float rmax, CounterRandom& random)
+{
+    return { random.Range(rmin, rmax), 2.0f * PI * random.Next(), 2.0f * PI * random.Next() };
+}
+
+inline float3 RandomUniformCylindrical(float rmin, float rmax, float height, CounterRandom& random)
+{
+    return { random.Range(rmin, rmax), 2.0f * PI * random.Next(), random.Range(-0.5f * height, 0.5f * height) };
+}
+
+/** Acceleration towards a point mass at point, softened by the policy of the build, see Softening.h. */
+inline float3 GravityAcceleration(const float3& point, float mass, float soft)
 {
     float3 acceleration = point;
-    float distance = length > 0.0f ? (length + soft) : acceleration.norm() + soft;
-    acceleration = acceleration * (mass / (distance * distance * distance));
-    return acceleration;
+    return acceleration * (mass * SofteningPolicy::Force(acceleration.normSq(), soft));
+}
+
+/** Potential of which GravityAcceleration is the gradient, so that softened runs conserve energy. */
+inline float GravityPotential(float length, float mass, float soft)
+{
+    return -mass * SofteningPolicy::Potential(length * length, soft);
 }
 
 /** Radial velocity about body with certain mass at distance r. */
 inline float RadialVelocity(float mass, float r)
 {
-    return std::sqrtf(mass / r);
+    return std::sqrt(mass / r);
 }
 
 /** Radial velocity of body with mass in force field at distance r. */
 inline float RadialVelocity(float force, float mass, float r)
 {
-    return std::sqrtf(force * r / mass);
+    return std::sqrt(force * r / mass);
 }
 
 inline float PseudoIsothermal(float r, float rho0, float radius)
@@ -121,12 +141,44 @@ inline float PseudoIsothermal(float r, float rho0, float radius)
 inline float PlummerDensity(float r, float mass, float radius)
 {
     return (3.0f * mass / (4.0f * PI * radius * radius * radius)) * 
-        (1.0f / std::sqrtf(std::pow((1.0f + (r * r) / (radius * radius)), 5.0f)));
+        (1.0f / std::sqrt(std::pow((1.0f + (r * r) / (radius * radius)), 5.0f)));
 }
 
 inline float PlummerPotential(float r, float mass, float radius)
 {
-    return -mass / (std::sqrtf(r * r + radius * radius));
+    return -mass / (std::sqrt(r * r + radius * radius));
+}
+
+// Bits per axis of a Morton key
+static constexpr uint32_t cMortonBits = 21;
+
+/** Spreads the low cMortonBits bits of value apart so that two zero bits follow each. */
+inline uint64_t SpreadMortonBits(uint64_t value)
+{
+    value &= 0x1FFFFF;
+    value = (value | value << 32) & 0x1F00000000FFFF;
+    value = (value | value << 16) & 0x1F0000FF0000FF;
+    value = (value | value << 8) & 0x100F00F00F00F00F;
+    value = (value | value << 4) & 0x10C30C30C30C30C3;
+    value = (value | value << 2) & 0x1249249249249249;
+    return value;
+}
+
+/**
+    Key of the position on the Morton curve through the cube with the corner origin. Each level
+    takes three bits ordered like the children of a BarnesHutTree node, x lowest, so particles
+    sorted by the keys come in the order the tree visits them. Positions outside are clamped.
+*/
+inline uint64_t GetMortonKey(const float3& position, const float3& origin, float size)
+{
+    const float cells = static_cast<float>(1u << cMortonBits);
+    const float scale = cells / size;
+    const auto quantize = [&](float value, float min)
+    {
+        const float cell = (std::min)((std::max)((value - min) * scale, 0.0f), cells - 1.0f);
+        return SpreadMortonBits(static_cast<uint64_t>(cell));
+    };
+    return quantize(position.m_x, origin.m_x) | quantize(position.m_y, origin.m_y) << 1 | quantize(position.m_z, origin.m_z) << 2;
 }
 
 template <typename Distribution>
@@ -143,4 +195,38 @@ inline float SampleDistribution(float xmin, float xmax, float maxDistributionVal
         }
     }
     return x;
-}
\ No newline at end of file
+}
+
+/**
+    Samples a distribution given by its density on [xmin, xmax] through the tabulated inverse
+    of its cumulative distribution: one table lookup per sample instead of rejection trials.
+*/
+class InverseCdfTable
+{
+public:
+    template <typename Distribution>
+    InverseCdfTable(float xmin, float xmax, Distribution distribution, uint32_t size = 4096)
+    {
+        // The density is integrated on a finer grid than the table
+        const uint32_t intervals = 4 * size;
+        std::vector<double> density(intervals + 1);
+        for (uint32_t i = 0; i <= intervals; ++i)
+        {
+            density[i] = distribution(xmin + (xmax - xmin) * i / intervals);
+        }
+        Build(xmin, xmax, density, size);
+    }
+
+    /** Maps u uniform in [0, 1) to x distributed with the density. */
+    float Sample(float u) const
+    {
+        const float t = u * (values.size() - 1);
+        const size_t i = (std::min)(static_cast<size_t>(t), values.size() - 2);
+        return lerp(values[i], values[i + 1], t - i);
+    }
+
+private:
+    void Build(float xmin, float xmax, const std::vector<double>& density, uint32_t size);
+
+    std::vector<float> values;
+};
\ No newline at end of file
@@ -0,0 +1,325 @@
+#include "Multigrid.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+
+// Coarsest grids are solved by plain sweeps
+static constexpr uint32_t cCoarsestSize = 5;
+static constexpr uint32_t cCoarsestSweeps = 50;
+// A cycle reducing the residual less than this has hit the float round-off floor
+static constexpr float cStallFactor = 0.5f;
+// Round-off level of the residual in units of FLT_EPSILON |u| / step^2 per neighbour
+static constexpr float cRoundOffFactor = 2.0f;
+// Points of a finer level a coarse point gathers along an axis, coarse steps are at most twice as long
+static constexpr uint32_t cTransferTaps = 4;
+
+MultigridPoisson::MultigridPoisson(uint32_t dimensions, uint32_t size, float min, float max)
+    : dimensions(dimensions)
+{
+    assert((dimensions == 2 || dimensions == 3) && size >= 3 && min < max);
+
+    while (true)
+    {
+        Level level;
+        level.size = size;
+        level.step = (max - min) / (size - 1);
+
+        size_t count = static_cast<size_t>(size) * size;
+        count *= dimensions == 3 ? size : 1;
+        level.u.resize(count, 0.0f);
+        level.f.resize(count, 0.0f);
+        level.r.resize(count, 0.0f);
+
+        if (size <= cCoarsestSize)
+        {
+            levels.push_back(std::move(level));
+            break;
+        }
+
+        // Half the intervals, rounded up
+        const uint32_t coarseSize = size / 2 + 1;
+        SetTransfer(level, coarseSize);
+        levels.push_back(std::move(level));
+        size = coarseSize;
+    }
+}
+
+void MultigridPoisson::SetTransfer(Level& fine, uint32_t coarseSize)
+{
+    const uint64_t fineIntervals = fine.size - 1;
+    const uint64_t coarseIntervals = coarseSize - 1;
+
+    fine.lower.resize(fine.size);
+    fine.upper.resize(fine.size);
+    for (uint32_t i = 0; i < fine.size; ++i)
+    {
+        // Point i is i * coarseIntervals / fineIntervals coarse steps from the first one, exact in integers
+        const uint64_t position = i * coarseIntervals;
+        uint32_t lower = static_cast<uint32_t>(position / fineIntervals);
+        float upper = static_cast<float>(position % fineIntervals) / static_cast<float>(fineIntervals);
+        if (lower == coarseIntervals)
+        {
+            lower -= 1;
+            upper = 1.0f;
+        }
+        fine.lower[i] = lower;
+        fine.upper[i] = upper;
+    }
+
+    // Scaled by the ratio of the steps, so that a smooth residual keeps its magnitude.
+    // Every other point of 2^k + 1 grids gives full weighting, (1/4, 1/2, 1/4) along every axis.
+    const float scale = static_cast<float>(coarseIntervals) / static_cast<float>(fineIntervals);
+    fine.first.assign(coarseSize, fine.size);
+    fine.weights.assign(static_cast<size_t>(coarseSize) * cTransferTaps, 0.0f);
+    for (uint32_t i = 0; i < fine.size; ++i)
+    {
+        for (uint32_t corner = 0; corner < 2; ++corner)
+        {
+            const float weight = corner ? fine.upper[i] : 1.0f - fine.upper[i];
+            if (weight == 0.0f)
+            {
+                continue;
+            }
+            const uint32_t c = fine.lower[i] + corner;
+            fine.first[c] = (std::min)(fine.first[c], i);
+            assert(i - fine.first[c] < cTransferTaps);
+            fine.weights[c * cTransferTaps + i - fine.first[c]] = weight * scale;
+        }
+    }
+}
+
+template <typename Kernel>
+void MultigridPoisson::DispatchRows(uint32_t size, const Kernel& kernel) const
+{
+    const uint32_t interior = size - 2;
+    const uint32_t rows = dimensions == 3 ? interior * interior : interior;
+
+    ThreadPool().Dispatch([&](uint32_t row)
+    {
+        kernel(1 + row % interior, dimensions == 3 ? 1 + row / interior : 0);
+    }, rows, std::max(rows / ThreadPool::GetThreadCount(), 1u));
+}
+
+void MultigridPoisson::Smooth(Level& level, uint32_t sweeps) const
+{
+    const size_t n = level.size;
+    const size_t plane = n * n;
+    const float h2 = level.step * level.step;
+    const float inverseDiagonal = 1.0f / (2.0f * dimensions);
+    float* u = level.u.data();
+    const float* f = level.f.data();
+
+    for (uint32_t sweep = 0; sweep < sweeps; ++sweep)
+    {
+        // Points of one color only have neighbours of the other color
+        for (uint32_t color = 0; color < 2; ++color)
+        {
+            DispatchRows(level.size, [&](size_t y, size_t z)
+            {
+                const size_t row = z * plane + y * n;
+                for (size_t x = 1 + (y + z + color) % 2; x < n - 1; x += 2)
+                {
+                    const size_t i = row + x;
+                    float sum = u[i - 1] + u[i + 1] + u[i - n] + u[i + n];
+                    if (dimensions == 3)
+                    {
+                        sum += u[i - plane] + u[i + plane];
+                    }
+                    u[i] = (sum - h2 * f[i]) * inverseDiagonal;
+                }
+            });
+        }
+    }
+}
+
+void MultigridPoisson::ComputeResidual(Level& level) const
+{
+    const size_t n = level.size;
+    const size_t plane = n * n;
+    const float inverseH2 = 1.0f / (level.step * level.step);
+    const float diagonal = 2.0f * dimensions;
+    const float* u = level.u.data();
+    const float* f = level.f.data();
+    float* r = level.r.data();
+
+    DispatchRows(level.size, [&](size_t y, size_t z)
+    {
+        const size_t row = z * plane + y * n;
+        for (size_t x = 1; x < n - 1; ++x)
+        {
+            const size_t i = row + x;
+            float sum = u[i - 1] + u[i + 1] + u[i - n] + u[i + n];
+            if (dimensions == 3)
+            {
+                sum += u[i - plane] + u[i + plane];
+            }
+            r[i] = f[i] - (sum - diagonal * u[i]) * inverseH2;
+        }
+    });
+}
+
+void MultigridPoisson::Restrict(const Level& fine, Level& coarse) const
+{
+    const size_t fn = fine.size;
+    const size_t fplane = fn * fn;
+    const size_t cn = coarse.size;
+    const size_t cplane = cn * cn;
+    const uint32_t ztaps = dimensions == 3 ? cTransferTaps : 1;
+    const uint32_t* first = fine.first.data();
+    const float* weights = fine.weights.data();
+    const float* r = fine.r.data();
+    float* f = coarse.f.data();
+
+    DispatchRows(coarse.size, [&](size_t y, size_t z)
+    {
+        const float* wy = weights + y * cTransferTaps;
+        for (size_t x = 1; x < cn - 1; ++x)
+        {
+            const float* wx = weights + x * cTransferTaps;
+            float sum = 0.0f;
+            for (uint32_t kz = 0; kz < ztaps; ++kz)
+            {
+                const float wz = dimensions == 3 ? weights[z * cTransferTaps + kz] : 1.0f;
+                const size_t fz = dimensions == 3 ? first[z] + kz : 0;
+                for (uint32_t ky = 0; ky < cTransferTaps; ++ky)
+                {
+                    // Taps past the last gathered point have no weight and may be past the grid
+                    if (wz == 0.0f || wy[ky] == 0.0f)
+                    {
+                        continue;
+                    }
+                    const float* row = r + fz * fplane + (first[y] + ky) * fn + first[x];
+                    for (uint32_t kx = 0; kx < cTransferTaps; ++kx)
+                    {
+                        if (wx[kx] != 0.0f)
+                        {
+                            sum += wz * wy[ky] * wx[kx] * row[kx];
+                        }
+                    }
+                }
+            }
+            f[z * cplane + y * cn + x] = sum;
+        }
+    });
+}
+
+void MultigridPoisson::ProlongateAdd(const Level& coarse, Level& fine) const
+{
+    // Multilinear interpolation between the coarse points around every fine one
+    const size_t fn = fine.size;
+    const size_t fplane = fn * fn;
+    const size_t cn = coarse.size;
+    const size_t cplane = cn * cn;
+    const uint32_t* lower = fine.lower.data();
+    const float* upper = fine.upper.data();
+    const float* e = coarse.u.data();
+    float* u = fine.u.data();
+
+    DispatchRows(fine.size, [&](size_t y, size_t z)
+    {
+        const size_t cz = dimensions == 3 ? lower[z] : 0;
+        const float wz = dimensions == 3 ? upper[z] : 0.0f;
+        const float wy = upper[y];
+        for (size_t x = 1; x < fn - 1; ++x)
+        {
+            const float wx = upper[x];
+            const float* corner = e + cz * cplane + lower[y] * cn + lower[x];
+            auto bilinear = [&](const float* p)
+            {
+                return (1.0f - wy) * ((1.0f - wx) * p[0] + wx * p[1]) + wy * ((1.0f - wx) * p[cn] + wx * p[cn + 1]);
+            };
+            float value = bilinear(corner);
+            if (dimensions == 3)
+            {
+                value = (1.0f - wz) * value + wz * bilinear(corner + cplane);
+            }
+            u[z * fplane + y * fn + x] += value;
+        }
+    });
+}
+
+void MultigridPoisson::Cycle(size_t index, const Options& options)
+{
+    Level& level = levels[index];
+
+    if (index + 1 == levels.size())
+    {
+        Smooth(level, cCoarsestSweeps);
+        return;
+    }
+
+    Smooth(level, options.preSmoothing);
+    ComputeResidual(level);
+
+    // The coarse grid solves for the error, which is zero on the boundary
+    Level& coarse = levels[index + 1];
+    Restrict(level, coarse);
+    std::fill(coarse.u.begin(), coarse.u.end(), 0.0f);
+    Cycle(index + 1, options);
+
+    ProlongateAdd(coarse, level);
+    Smooth(level, options.postSmoothing);
+}
+
+double MultigridPoisson::Norm(const Level& level, const std::vector<float>& values) const
+{
+    const size_t n = level.size;
+    const size_t depth = dimensions == 3 ? n - 1 : 1;
+    const size_t first = dimensions == 3 ? 1 : 0;
+
+    double sum = 0.0;
+    for (size_t z = first; z < depth; ++z)
+    {
+        for (size_t y = 1; y < n - 1; ++y)
+        {
+            const float* row = values.data() + (z * n + y) * n;
+            for (size_t x = 1; x < n - 1; ++x)
+            {
+                sum += static_cast<double>(row[x]) * row[x];
+            }
+        }
+    }
+
+    const size_t interior = (n - 2) * (n - 2) * (dimensions == 3 ? n - 2 : 1);
+    return std::sqrt(sum / interior);
+}
+
+bool MultigridPoisson::Solve(std::vector<float>& u, const std::vector<float>& f, const Options& options)
+{
+    Level& finest = levels.front();
+    assert(u.size() == finest.u.size() && f.size() == finest.f.size());
+
+    finest.u.swap(u);
+    finest.f = f;
+
+    // Norms are taken over the interior, boundary values of f don't enter the equations
+    const double fNorm = Norm(finest, finest.f);
+    const double scale = fNorm > 0.0 ? 1.0 / fNorm : 1.0;
+
+    // Every neighbour in the stencil adds the rounding of its value, amplified by 1 / step^2
+    const double roundOff = cRoundOffFactor * FLT_EPSILON * (2 * dimensions + 1) / (static_cast<double>(finest.step) * finest.step);
+
+    ComputeResidual(finest);
+    residual = static_cast<float>(Norm(finest, finest.r) * scale);
+    tolerance = (std::max)(options.tolerance, static_cast<float>(roundOff * Norm(finest, finest.u) * scale));
+    cycleCount = 0;
+    bool stalled = false;
+
+    while (residual > tolerance && cycleCount < options.maxCycles && !stalled)
+    {
+        const float previous = residual;
+        Cycle(0, options);
+        ComputeResidual(finest);
+        residual = static_cast<float>(Norm(finest, finest.r) * scale);
+        tolerance = (std::max)(options.tolerance, static_cast<float>(roundOff * Norm(finest, finest.u) * scale));
+        // Further cycles only shuffle the rounding errors, or the hierarchy doesn't converge
+        stalled = residual > cStallFactor * previous;
+        ++cycleCount;
+    }
+
+    finest.u.swap(u);
+    return residual <= tolerance;
+}
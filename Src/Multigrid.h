@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+    Geometric multigrid solver of the Poisson equation laplace(u) = f on a square 2D or cubic 3D
+    grid with Dirichlet boundaries.
+
+    Grids are contiguous arrays of size^dimensions points, x varies fastest. The points span
+    [min, max] on every axis, boundary points keep the values they have in u. V-cycles with
+    red-black Gauss-Seidel smoothing run until the residual drops below the tolerance, every
+    sweep is dispatched over ThreadPool. Every coarser grid has half the intervals, rounded
+    up, so grids of any size are coarsened down to a few points. Sizes of 2^k + 1 keep every
+    other point, other sizes interpolate linearly between the levels.
+*/
+class MultigridPoisson
+{
+public:
+    struct Options
+    {
+        uint32_t maxCycles = 30;
+        // Stop at this L2 norm of the residual relative to the norm of f, see Solve
+        float tolerance = 1e-5f;
+        uint32_t preSmoothing = 2;
+        uint32_t postSmoothing = 2;
+    };
+
+    MultigridPoisson(uint32_t dimensions, uint32_t size, float min, float max);
+
+    uint32_t GetDimensions() const { return dimensions; }
+    uint32_t GetSize() const { return levels.front().size; }
+    size_t GetPointCount() const { return levels.front().u.size(); }
+    uint32_t GetLevelCount() const { return static_cast<uint32_t>(levels.size()); }
+
+    /**
+        Solves for u, which holds the initial guess and the boundary values. The rounding of u
+        bounds the residual of float grids from below, by about FLT_EPSILON |u| / step^2, fine
+        grids reach that above the default tolerance. The tolerance is raised to this level,
+        see GetTolerance. Cycles stop early when the residual stalls. Returns false if the
+        residual is above the tolerance after the last cycle, u is the last iterate then.
+    */
+    bool Solve(std::vector<float>& u, const std::vector<float>& f, const Options& options);
+    bool Solve(std::vector<float>& u, const std::vector<float>& f) { return Solve(u, f, Options()); }
+
+    uint32_t GetCycleCount() const { return cycleCount; }
+    /** Relative residual after the last Solve. */
+    float GetResidual() const { return residual; }
+    /** Tolerance of the last Solve, raised to the round-off level of the grid. */
+    float GetTolerance() const { return tolerance; }
+
+private:
+    struct Level
+    {
+        uint32_t size;
+        float step;
+        std::vector<float> u;
+        std::vector<float> f;
+        std::vector<float> r;
+        // Interpolation from the next coarser level along every axis: point i lies between
+        // coarse points lower[i] and lower[i] + 1, upper[i] is the weight of the latter
+        std::vector<uint32_t> lower;
+        std::vector<float> upper;
+        // Restriction to the next coarser level along every axis, the transposed interpolation:
+        // coarse point c gathers the points from first[c] on, cTransferTaps weights per point
+        std::vector<uint32_t> first;
+        std::vector<float> weights;
+    };
+
+    static void SetTransfer(Level& fine, uint32_t coarseSize);
+
+    void Smooth(Level& level, uint32_t sweeps) const;
+    void ComputeResidual(Level& level) const;
+    void Restrict(const Level& fine, Level& coarse) const;
+    void ProlongateAdd(const Level& coarse, Level& fine) const;
+    void Cycle(size_t index, const Options& options);
+    double Norm(const Level& level, const std::vector<float>& values) const;
+
+    /** Runs kernel(y, z) for every interior row of a level in parallel. */
+    template <typename Kernel>
+    void DispatchRows(uint32_t size, const Kernel& kernel) const;
+
+    uint32_t dimensions;
+    std::vector<Level> levels;
+
+    uint32_t cycleCount = 0;
+    float residual = 0.0f;
+    float tolerance = 0.0f;
+};
@@ -0,0 +1,257 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+// Completed zones kept per thread for the trace
+static constexpr uint32_t cRingCapacity = 1 << 16;
+// Deeper zones are counted but not recorded
+static constexpr uint32_t cMaxDepth = 32;
+
+std::atomic<bool> Profiler::enabled_(false);
+
+struct ZoneEvent
+{
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Durations of one zone name, names are told apart by address on the hot path
+struct ZoneSamples
+{
+    const char* name;
+    std::vector<float> msecs;
+};
+
+struct ThreadTrack
+{
+    uint32_t id = 0;
+    std::string name;
+
+    std::vector<ZoneEvent> ring;
+    uint64_t written = 0;
+
+    const char* openNames[cMaxDepth];
+    uint64_t openBegins[cMaxDepth];
+    uint32_t depth = 0;
+
+    std::vector<ZoneSamples> samples;
+};
+
+static std::mutex tracksMutex;
+static std::vector<std::unique_ptr<ThreadTrack>> tracks;
+
+static std::mutex namesMutex;
+static std::set<std::string> names;
+
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+static thread_local ThreadTrack* currentTrack = nullptr;
+
+static uint64_t GetTimestamp()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+static ThreadTrack& GetTrack()
+{
+    if (!currentTrack)
+    {
+        auto track = std::make_unique<ThreadTrack>();
+
+        std::lock_guard<std::mutex> lock(tracksMutex);
+        track->id = static_cast<uint32_t>(tracks.size());
+        track->name = "Thread " + std::to_string(track->id);
+        currentTrack = track.get();
+        tracks.push_back(std::move(track));
+    }
+    return *currentTrack;
+}
+
+void Profiler::BeginZone(const char* name)
+{
+    ThreadTrack& track = GetTrack();
+    if (track.ring.empty())
+    {
+        track.ring.resize(cRingCapacity);
+    }
+    if (track.depth < cMaxDepth)
+    {
+        track.openNames[track.depth] = name;
+        track.openBegins[track.depth] = GetTimestamp();
+    }
+    ++track.depth;
+}
+
+void Profiler::EndZone()
+{
+    ThreadTrack& track = GetTrack();
+    if (track.depth == 0)
+    {
+        return;
+    }
+
+    --track.depth;
+    if (track.depth >= cMaxDepth)
+    {
+        return;
+    }
+
+    ZoneEvent event = { track.openNames[track.depth], track.openBegins[track.depth], GetTimestamp() };
+    track.ring[track.written % cRingCapacity] = event;
+    ++track.written;
+
+    auto samples = std::find_if(track.samples.begin(), track.samples.end(), [&](const ZoneSamples& s) { return s.name == event.name; });
+    if (samples == track.samples.end())
+    {
+        track.samples.push_back({ event.name, {} });
+        samples = track.samples.end() - 1;
+    }
+    samples->msecs.push_back((event.end - event.begin) * 1e-6f);
+}
+
+const char* Profiler::GetCurrentZone()
+{
+    const ThreadTrack* track = currentTrack;
+    if (!track || track->depth == 0)
+    {
+        return nullptr;
+    }
+    return track->openNames[(std::min)(track->depth, cMaxDepth) - 1];
+}
+
+void Profiler::SetThreadName(const std::string& name)
+{
+    ThreadTrack& track = GetTrack();
+    std::lock_guard<std::mutex> lock(tracksMutex);
+    track.name = name;
+}
+
+const char* Profiler::Intern(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(namesMutex);
+    return names.insert(name).first->c_str();
+}
+
+static void WriteJsonString(std::ostream& stream, const std::string& text)
+{
+    stream << '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            stream << '\\';
+        }
+        stream << c;
+    }
+    stream << '"';
+}
+
+bool Profiler::WriteChromeTrace(const std::string& filename)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(tracksMutex);
+
+    file << "{\"traceEvents\":[";
+    bool first = true;
+    auto separate = [&]()
+    {
+        file << (first ? "\n" : ",\n");
+        first = false;
+    };
+
+    file.setf(std::ios::fixed);
+    file.precision(3);
+
+    for (const auto& track : tracks)
+    {
+        separate();
+        file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track->id << ",\"args\":{\"name\":";
+        WriteJsonString(file, track->name);
+        file << "}}";
+
+        // Timestamps and durations are in microseconds
+        const uint64_t count = (std::min)(track->written, static_cast<uint64_t>(cRingCapacity));
+        for (uint64_t i = track->written - count; i < track->written; ++i)
+        {
+            const ZoneEvent& event = track->ring[i % cRingCapacity];
+            separate();
+            file << "{\"name\":";
+            WriteJsonString(file, event.name);
+            file << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << track->id
+                << ",\"ts\":" << event.begin * 1e-3 << ",\"dur\":" << (event.end - event.begin) * 1e-3 << "}";
+        }
+    }
+
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+}
+
+static float GetPercentile(const std::vector<float>& sorted, float percent)
+{
+    // Nearest rank
+    const size_t rank = static_cast<size_t>(std::ceil(percent * 0.01f * sorted.size()));
+    return sorted[(std::max)(rank, static_cast<size_t>(1)) - 1];
+}
+
+std::vector<Profiler::ZoneStatistics> Profiler::GetStatistics()
+{
+    std::map<std::string, std::vector<float>> durations;
+    {
+        std::lock_guard<std::mutex> lock(tracksMutex);
+        for (const auto& track : tracks)
+        {
+            for (const auto& samples : track->samples)
+            {
+                auto& msecs = durations[samples.name];
+                msecs.insert(msecs.end(), samples.msecs.begin(), samples.msecs.end());
+            }
+        }
+    }
+
+    std::vector<ZoneStatistics> result;
+    for (auto& zone : durations)
+    {
+        std::vector<float>& msecs = zone.second;
+        std::sort(msecs.begin(), msecs.end());
+
+        ZoneStatistics statistics;
+        statistics.name = zone.first;
+        statistics.count = msecs.size();
+        for (float value : msecs)
+        {
+            statistics.totalMsecs += value;
+        }
+        statistics.meanMsecs = static_cast<float>(statistics.totalMsecs / msecs.size());
+        statistics.p50Msecs = GetPercentile(msecs, 50.0f);
+        statistics.p90Msecs = GetPercentile(msecs, 90.0f);
+        statistics.p99Msecs = GetPercentile(msecs, 99.0f);
+        statistics.maxMsecs = msecs.back();
+        result.push_back(std::move(statistics));
+    }
+
+    std::sort(result.begin(), result.end(), [](const ZoneStatistics& a, const ZoneStatistics& b) { return a.totalMsecs > b.totalMsecs; });
+    return result;
+}
+
+void Profiler::Clear()
+{
+    std::lock_guard<std::mutex> lock(tracksMutex);
+    for (auto& track : tracks)
+    {
+        track->written = 0;
+        track->samples.clear();
+    }
+}
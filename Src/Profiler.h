@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+    Scoped profiler of the simulation phases.
+
+    Zones nest and are recorded per thread, ThreadPool workers get a track each and show
+    the zone of the dispatching thread with a " worker" suffix. Every thread writes completed zones into a ring
+    buffer of its own without locking, the oldest zones are overwritten. Durations of all
+    zones are also kept for the statistics, so these cover the whole run. A disabled
+    profiler costs a flag test per zone.
+
+    Recording threads must be idle while the tracks are read or cleared, e.g. between steps.
+*/
+class Profiler
+{
+public:
+    struct ZoneStatistics
+    {
+        std::string name;
+        uint64_t count = 0;
+        double totalMsecs = 0.0;
+        float meanMsecs = 0.0f;
+        float p50Msecs = 0.0f;
+        float p90Msecs = 0.0f;
+        float p99Msecs = 0.0f;
+        float maxMsecs = 0.0f;
+    };
+
+    static void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+    static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    /** Zone names must outlive the profiler, e.g. literals or names from Intern. */
+    static void BeginZone(const char* name);
+    static void EndZone();
+    /** Innermost open zone of the calling thread, null if there is none. */
+    static const char* GetCurrentZone();
+
+    /** Name of the calling thread's track. */
+    static void SetThreadName(const std::string& name);
+    /** Copy of a name that lives as long as the program. */
+    static const char* Intern(const std::string& name);
+
+    /** Writes the zones in the ring buffers in the Chrome trace event format. */
+    static bool WriteChromeTrace(const std::string& filename);
+    /** Statistics per zone name over all threads, the largest total time first. */
+    static std::vector<ZoneStatistics> GetStatistics();
+    /** Drops all recorded zones. */
+    static void Clear();
+
+private:
+    static std::atomic<bool> enabled_;
+};
+
+/** Zone from construction to destruction, nothing if the profiler is disabled at construction. */
+class ProfileZone
+{
+public:
+    explicit ProfileZone(const char* name)
+        : active(Profiler::IsEnabled())
+    {
+        if (active)
+        {
+            Profiler::BeginZone(name);
+        }
+    }
+
+    ~ProfileZone()
+    {
+        if (active)
+        {
+            Profiler::EndZone();
+        }
+    }
+
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+    bool active;
+};
+
+#define PROFILE_ZONE_CONCAT_(a, b) a##b
+#define PROFILE_ZONE_CONCAT(a, b) PROFILE_ZONE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_ZONE_CONCAT(profileZone, __LINE__)(name)
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+/** Finalizer of SplitMix64, every input bit affects every output bit. */
+inline uint64_t MixBits(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+    Counter-based random numbers: the n-th number of a generator is a hash of its key and n.
+    Generators keyed by (seed, stream, index) give the same numbers no matter in which order
+    or on which thread they are used, e.g. one generator per particle in a parallel loop.
+*/
+class CounterRandom
+{
+public:
+    CounterRandom(uint64_t seed, uint32_t stream, uint64_t index)
+        : key(MixBits(MixBits(seed ^ (static_cast<uint64_t>(stream) << 32)) + index))
+    {
+    }
+
+    uint32_t NextUint()
+    {
+        return static_cast<uint32_t>(MixBits(key + ++counter * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    /** Uniform in [0, 1). */
+    float Next()
+    {
+        return (NextUint() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    float Range(float a, float b)
+    {
+        return a + (b - a) * Next();
+    }
+
+private:
+    uint64_t key;
+    uint64_t counter = 0;
+};
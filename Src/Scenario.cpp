@@ -0,0 +1,303 @@
+#include "Scenario.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+// Legacy mass keys of a galaxy section, resolved when the section ends
+struct LegacyMass
+{
+    bool hasStarMass = false;
+    bool hasBulgeMass = false;
+    float starMass = 0.0f;
+    float bulgeMass = 0.0f;
+};
+
+static std::string Trim(const std::string& text)
+{
+    const char* whitespace = " \t\r\n";
+    const size_t begin = text.find_first_not_of(whitespace);
+    if (begin == std::string::npos)
+    {
+        return {};
+    }
+    const size_t end = text.find_last_not_of(whitespace);
+    return text.substr(begin, end - begin + 1);
+}
+
+static bool ParseFloat(const std::string& text, float& value)
+{
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    value = std::strtof(begin, &end);
+    return end != begin && Trim(end).empty();
+}
+
+static bool ParseUint(const std::string& text, uint32_t& value)
+{
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    const long parsed = std::strtol(begin, &end, 10);
+    if (end == begin || !Trim(end).empty() || parsed < 0)
+    {
+        return false;
+    }
+    value = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+static bool ParseVector(const std::string& text, float3& value)
+{
+    float components[3];
+    size_t begin = 0;
+    for (size_t i = 0; i < 3; ++i)
+    {
+        const size_t comma = text.find(',', begin);
+        if ((i < 2) == (comma == std::string::npos))
+        {
+            return false;
+        }
+        if (!ParseFloat(text.substr(begin, comma == std::string::npos ? std::string::npos : comma - begin), components[i]))
+        {
+            return false;
+        }
+        begin = comma + 1;
+    }
+    value = float3(components[0], components[1], components[2]);
+    return true;
+}
+
+static bool ResolveLegacyMass(const LegacyMass& legacy, GalaxyParameters& parameters)
+{
+    if (!legacy.hasStarMass && !legacy.hasBulgeMass)
+    {
+        return true;
+    }
+
+    const float diskMass = legacy.hasStarMass ? legacy.starMass * parameters.diskParticlesCount : parameters.diskMassRatio * parameters.mass;
+    const float bulgeMass = legacy.hasBulgeMass ? legacy.bulgeMass : (1.0f - parameters.diskMassRatio) * parameters.mass;
+
+    if (diskMass <= 0.0f || bulgeMass <= 0.0f)
+    {
+        return false;
+    }
+
+    parameters.mass = diskMass + bulgeMass;
+    parameters.diskMassRatio = diskMass / parameters.mass;
+    return true;
+}
+
+static bool ValidateGalaxy(const GalaxyDescription& galaxy, std::string& reason)
+{
+    const GalaxyParameters& parameters = galaxy.parameters;
+
+    if (parameters.diskParticlesCount == 0 && parameters.bulgeParticlesCount == 0)
+    {
+        reason = "galaxy has no particles";
+    }
+    else if (parameters.mass <= 0.0f)
+    {
+        reason = "galaxy mass must be positive";
+    }
+    else if (parameters.diskMassRatio <= 0.0f || parameters.diskMassRatio >= 1.0f)
+    {
+        reason = "disk mass ratio must be between 0 and 1";
+    }
+    else if (parameters.diskRadius <= 0.0f || parameters.bulgeRadius <= 0.0f || parameters.haloRadius <= 0.0f)
+    {
+        reason = "radii must be positive";
+    }
+    else if (parameters.haloMass < 0.0f)
+    {
+        reason = "halo mass must not be negative";
+    }
+    else if (parameters.haloParticlesCount > 0 && (parameters.haloMass <= 0.0f || GetHaloProfile(parameters.haloModel).disk))
+    {
+        reason = "a live halo needs a spherical halo model with a positive mass";
+    }
+    else
+    {
+        return true;
+    }
+    return false;
+}
+
+Scenario MakeScenario(const GalaxyParameters& model, float deltaTime, float universeSize)
+{
+    Scenario scenario;
+    scenario.deltaTime = deltaTime;
+    scenario.universeSize = universeSize;
+
+    GalaxyDescription galaxy;
+    galaxy.parameters = model;
+    scenario.galaxies.push_back(galaxy);
+
+    return scenario;
+}
+
+bool LoadScenario(const std::string& filename, Scenario& scenario, std::string& error)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        error = "Can't open " + filename;
+        return false;
+    }
+
+    Scenario result;
+    LegacyMass legacy;
+
+    enum class Section { None, General, Galaxy } section = Section::None;
+
+    uint32_t lineNumber = 0;
+    uint32_t galaxyLine = 0;
+    std::string line;
+
+    auto fail = [&](uint32_t number, const std::string& reason)
+    {
+        error = filename + "(" + std::to_string(number) + "): " + reason;
+        return false;
+    };
+
+    auto endGalaxy = [&]()
+    {
+        if (section != Section::Galaxy)
+        {
+            return true;
+        }
+
+        GalaxyDescription& galaxy = result.galaxies.back();
+        if (!ResolveLegacyMass(legacy, galaxy.parameters))
+        {
+            return fail(galaxyLine, "GLX_STAR_MASS and GLX_BULGE_MASS must give positive masses");
+        }
+
+        std::string reason;
+        if (!ValidateGalaxy(galaxy, reason))
+        {
+            return fail(galaxyLine, reason);
+        }
+        return true;
+    };
+
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+
+        // The first line may start with a UTF-8 byte order mark
+        if (lineNumber == 1 && line.compare(0, 3, "\xEF\xBB\xBF") == 0)
+        {
+            line.erase(0, 3);
+        }
+
+        line = Trim(line);
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (line[0] == '[')
+        {
+            if (!endGalaxy())
+            {
+                return false;
+            }
+
+            if (line == "[GENERAL]")
+            {
+                section = Section::General;
+            }
+            else if (line == "[GALAXY]")
+            {
+                section = Section::Galaxy;
+                galaxyLine = lineNumber;
+                legacy = {};
+                result.galaxies.emplace_back();
+            }
+            else
+            {
+                return fail(lineNumber, "unknown section " + line);
+            }
+            continue;
+        }
+
+        const size_t equals = line.find('=');
+        if (equals == std::string::npos)
+        {
+            return fail(lineNumber, "expected KEY = VALUE");
+        }
+
+        const std::string key = Trim(line.substr(0, equals));
+        const std::string value = Trim(line.substr(equals + 1));
+        bool ok = true;
+
+        if (section == Section::General)
+        {
+            float number = 0.0f;
+
+            if (key == "DT")                    ok = ParseFloat(value, result.deltaTime) && result.deltaTime > 0.0f;
+            else if (key == "UNIVERSE_SIZE")    ok = ParseFloat(value, result.universeSize) && result.universeSize > 0.0f;
+            else if (key == "SAVE_FRAMES")
+            {
+                ok = ParseFloat(value, number);
+                result.saveFrames = number != 0.0f;
+            }
+            else
+            {
+                return fail(lineNumber, "unknown key " + key + " in [GENERAL]");
+            }
+        }
+        else if (section == Section::Galaxy)
+        {
+            GalaxyDescription& galaxy = result.galaxies.back();
+            GalaxyParameters& parameters = galaxy.parameters;
+
+            if (key == "NAME")                      galaxy.name = value;
+            else if (key == "GLX_CENTER")           ok = ParseVector(value, galaxy.center);
+            else if (key == "GLX_VELOCITY")         ok = ParseVector(value, galaxy.velocity);
+            else if (key == "GLX_BULGE_NUM")        ok = ParseUint(value, parameters.bulgeParticlesCount);
+            else if (key == "GLX_DISK_NUM")         ok = ParseUint(value, parameters.diskParticlesCount);
+            else if (key == "GLX_DISK_RADIUS")      ok = ParseFloat(value, parameters.diskRadius);
+            else if (key == "GLX_BULGE_RADIUS")     ok = ParseFloat(value, parameters.bulgeRadius);
+            else if (key == "GLX_HALO_RADIUS")      ok = ParseFloat(value, parameters.haloRadius);
+            else if (key == "GLX_DISK_THICKNESS")   ok = ParseFloat(value, parameters.diskThickness);
+            else if (key == "GLX_MASS")             ok = ParseFloat(value, parameters.mass);
+            else if (key == "GLX_DISK_MASS_RATIO")  ok = ParseFloat(value, parameters.diskMassRatio);
+            else if (key == "GLX_BLACK_HOLE_MASS")  ok = ParseFloat(value, parameters.blackHoleMass);
+            else if (key == "GLX_SEED")             ok = ParseUint(value, parameters.seed);
+            else if (key == "GLX_STAR_MASS")        ok = legacy.hasStarMass = ParseFloat(value, legacy.starMass);
+            else if (key == "GLX_BULGE_MASS")       ok = legacy.hasBulgeMass = ParseFloat(value, legacy.bulgeMass);
+            else if (key == "GLX_HALO_MASS")        ok = ParseFloat(value, parameters.haloMass);
+            else if (key == "GLX_HALO_MODEL")       ok = FindHaloModel(value, parameters.haloModel);
+            else if (key == "GLX_HALO_NUM")         ok = ParseUint(value, parameters.haloParticlesCount);
+            else if (key == "GLX_TRACER_NUM")       ok = ParseUint(value, parameters.tracerParticlesCount);
+            else
+            {
+                return fail(lineNumber, "unknown key " + key + " in [GALAXY]");
+            }
+        }
+        else
+        {
+            return fail(lineNumber, key + " outside of a section");
+        }
+
+        if (!ok)
+        {
+            return fail(lineNumber, "invalid value of " + key);
+        }
+    }
+
+    if (!endGalaxy())
+    {
+        return false;
+    }
+
+    if (result.galaxies.empty())
+    {
+        error = filename + ": no [GALAXY] sections";
+        return false;
+    }
+
+    scenario = std::move(result);
+    return true;
+}
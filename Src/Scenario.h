@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "float3.h"
+#include "Galaxy.h"
+
+/*
+Scenario description from a .glx file:
+
+    # Comment
+    [GENERAL]
+    DT = 0.1
+    SAVE_FRAMES = 0
+    UNIVERSE_SIZE = 400
+
+    [GALAXY]
+    NAME = Milky Way
+    GLX_CENTER = 0, 0, 0
+    GLX_VELOCITY = 0, 0, 0
+    GLX_BULGE_NUM = 2000
+    ...
+
+Every [GALAXY] section adds a galaxy. Galaxy keys are GLX_CENTER, GLX_VELOCITY, GLX_BULGE_NUM,
+GLX_DISK_NUM, GLX_DISK_RADIUS, GLX_BULGE_RADIUS, GLX_HALO_RADIUS, GLX_DISK_THICKNESS, GLX_MASS,
+GLX_DISK_MASS_RATIO, GLX_BLACK_HOLE_MASS, GLX_HALO_MODEL (Plummer, Hernquist, NFW, Isothermal or
+Kuzmin), GLX_HALO_MASS and GLX_SEED, missing ones keep the GalaxyParameters defaults.
+The older GLX_STAR_MASS (mass of a disk star) and GLX_BULGE_MASS are converted to GLX_MASS and
+GLX_DISK_MASS_RATIO.
+*/
+
+struct GalaxyDescription
+{
+    std::string name;
+    float3 center = {};
+    float3 velocity = {};
+    GalaxyParameters parameters;
+};
+
+struct Scenario
+{
+    float deltaTime = cDefaultDeltaTime;
+    float universeSize = GLX_UNIVERSE_SIZE;
+    bool saveFrames = false;
+    std::vector<GalaxyDescription> galaxies;
+};
+
+/** One galaxy at rest at the origin. */
+Scenario MakeScenario(const GalaxyParameters& model, float deltaTime, float universeSize = GLX_UNIVERSE_SIZE);
+
+/** Reads a .glx file, on failure error tells the file line and the reason. */
+bool LoadScenario(const std::string& filename, Scenario& scenario, std::string& error);
@@ -0,0 +1,517 @@
+#include "Simulation.h"
+#include "SnapshotFile.h"
+#include "Scenario.h"
+#include "Utils.h"
+#include "Profiler.h"
+#include "GravityKernels.h"
+#include "Threading.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Changes of galaxy generation or velocity initialization must bump it to drop cached states
+static constexpr uint32_t cInitialConditionsVersion = 7;
+
+Simulation::Simulation()
+{
+}
+
+Simulation::~Simulation()
+{
+    // The tasks of the solver graph refer to the staged order checks
+    ReleaseUniverse();
+}
+
+void Simulation::Reset(const GalaxyParameters& model, float deltaTime, float universeSize)
+{
+    Reset(MakeScenario(model, deltaTime, universeSize));
+}
+
+void Simulation::Reset(const Scenario& scenario)
+{
+    PROFILE_ZONE("Reset");
+
+    ApplyRequestedParameters();
+    ReleaseUniverse();
+
+    universe = std::make_unique<Universe>(scenario.universeSize);
+
+    for (const auto& description : scenario.galaxies)
+    {
+        Galaxy& galaxy = universe->CreateGalaxy(description.center, description.parameters);
+        galaxy.SetVelocity(description.velocity);
+    }
+
+    // A lone galaxy at rest is anchored by its black hole, otherwise the black holes move as well
+    const GalaxyDescription& first = scenario.galaxies.front();
+    if (scenario.galaxies.size() > 1 || first.velocity.m_x != 0.0f || first.velocity.m_y != 0.0f || first.velocity.m_z != 0.0f)
+    {
+        for (auto& galaxy : universe->GetGalaxies())
+        {
+            galaxy.GetParticles().front().movable = true;
+        }
+    }
+
+    time = 0.0f;
+    numSteps = 0;
+    reorderCount = 0;
+
+    CreateSolvers();
+
+    solver->Inititalize(scenario.deltaTime);
+    solver->SolveForces();
+
+    for (auto& galaxy : universe->GetGalaxies())
+    {
+        galaxy.SetRadialVelocitiesFromForce();
+        galaxy.SetTracerVelocities([this](const float3& position) { return solver->ComputeFieldAcceleration(position); });
+    }
+}
+
+// Creates the directory if it doesn't exist, the parent must exist
+static void MakeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+bool Simulation::ResetCached(const Scenario& scenario, const std::string& cacheDirectory)
+{
+    std::ostringstream name;
+    name << cacheDirectory << "/ic_" << std::hex << std::setw(16) << std::setfill('0') << HashInitialConditions(scenario) << ".glxs";
+    const std::string filename = name.str();
+
+    uint64_t particleCount = 0;
+    uint64_t haloParticleCount = 0;
+    uint64_t tracerCount = 0;
+    for (const auto& description : scenario.galaxies)
+    {
+        particleCount += description.parameters.bulgeParticlesCount + description.parameters.diskParticlesCount;
+        haloParticleCount += description.parameters.haloParticlesCount;
+        tracerCount += description.parameters.tracerParticlesCount;
+    }
+
+    // The run keeps its own parameters, those the initial conditions depend on are hashed
+    ApplyRequestedParameters();
+    const SimulationParameters runParameters = parameters;
+
+    // The counts guard against hash collisions, a damaged file fails to open
+    SnapshotView snapshot;
+    if (snapshot.Open(filename) && snapshot.GetHeader().galaxyCount == scenario.galaxies.size() &&
+        snapshot.GetHeader().particleCount == particleCount && snapshot.GetHeader().haloParticleCount == haloParticleCount && 
+        snapshot.GetHeader().tracerCount == tracerCount && Restore(snapshot))
+    {
+        parameters = runParameters;
+        return true;
+    }
+    snapshot.Close();
+
+    Reset(scenario);
+
+    MakeDirectory(cacheDirectory);
+
+    // Renamed when complete, so that a concurrent run never maps a partial file
+    const std::string temporary = filename + ".tmp";
+    if (!SaveSnapshot(temporary, scenario.deltaTime) || std::rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+    }
+
+    return false;
+}
+
+bool Simulation::Restore(const SnapshotView& snapshot)
+{
+    assert(snapshot.IsOpen());
+
+    // The snapshot's own parameters override the requested ones
+    ApplyRequestedParameters();
+
+    const SnapshotHeader& header = snapshot.GetHeader();
+
+    const float* positionX = snapshot.GetBlock<float>(SnapshotBlockId::PositionX);
+    const float* positionY = snapshot.GetBlock<float>(SnapshotBlockId::PositionY);
+    const float* positionZ = snapshot.GetBlock<float>(SnapshotBlockId::PositionZ);
+    const float* velocityX = snapshot.GetBlock<float>(SnapshotBlockId::VelocityX);
+    const float* velocityY = snapshot.GetBlock<float>(SnapshotBlockId::VelocityY);
+    const float* velocityZ = snapshot.GetBlock<float>(SnapshotBlockId::VelocityZ);
+    const float* mass = snapshot.GetBlock<float>(SnapshotBlockId::Mass);
+    const uint8_t* flags = snapshot.GetBlock<uint8_t>(SnapshotBlockId::Flags);
+
+    if (!positionX || !positionY || !positionZ || !velocityX || !velocityY || !velocityZ || !mass || !flags)
+    {
+        return false;
+    }
+
+    // Appearance is optional
+    const uint8_t* type = snapshot.GetBlock<uint8_t>(SnapshotBlockId::Type);
+    const float* colorR = snapshot.GetBlock<float>(SnapshotBlockId::ColorR);
+    const float* colorG = snapshot.GetBlock<float>(SnapshotBlockId::ColorG);
+    const float* colorB = snapshot.GetBlock<float>(SnapshotBlockId::ColorB);
+    const float* size = snapshot.GetBlock<float>(SnapshotBlockId::Size);
+    const float* magnitude = snapshot.GetBlock<float>(SnapshotBlockId::Magnitude);
+    const uint32_t* id = snapshot.GetBlock<uint32_t>(SnapshotBlockId::Id);
+
+    const float* haloPositionX = snapshot.GetBlock<float>(SnapshotBlockId::HaloPositionX);
+    const float* haloPositionY = snapshot.GetBlock<float>(SnapshotBlockId::HaloPositionY);
+    const float* haloPositionZ = snapshot.GetBlock<float>(SnapshotBlockId::HaloPositionZ);
+    const float* haloVelocityX = snapshot.GetBlock<float>(SnapshotBlockId::HaloVelocityX);
+    const float* haloVelocityY = snapshot.GetBlock<float>(SnapshotBlockId::HaloVelocityY);
+    const float* haloVelocityZ = snapshot.GetBlock<float>(SnapshotBlockId::HaloVelocityZ);
+    const float* haloMass = snapshot.GetBlock<float>(SnapshotBlockId::HaloMass);
+
+    if (header.haloParticleCount > 0 && 
+        (!haloPositionX || !haloPositionY || !haloPositionZ || !haloVelocityX || !haloVelocityY || !haloVelocityZ || !haloMass))
+    {
+        return false;
+    }
+
+    const float* tracerPositionX = snapshot.GetBlock<float>(SnapshotBlockId::TracerPositionX);
+    const float* tracerPositionY = snapshot.GetBlock<float>(SnapshotBlockId::TracerPositionY);
+    const float* tracerPositionZ = snapshot.GetBlock<float>(SnapshotBlockId::TracerPositionZ);
+    const float* tracerVelocityX = snapshot.GetBlock<float>(SnapshotBlockId::TracerVelocityX);
+    const float* tracerVelocityY = snapshot.GetBlock<float>(SnapshotBlockId::TracerVelocityY);
+    const float* tracerVelocityZ = snapshot.GetBlock<float>(SnapshotBlockId::TracerVelocityZ);
+
+    if (header.tracerCount > 0 && 
+        (!tracerPositionX || !tracerPositionY || !tracerPositionZ || !tracerVelocityX || !tracerVelocityY || !tracerVelocityZ))
+    {
+        return false;
+    }
+
+    ReleaseUniverse();
+
+    universe = std::make_unique<Universe>(header.universeSize);
+
+    uint64_t firstHaloParticle = 0;
+    uint64_t firstTracer = 0;
+
+    for (uint32_t g = 0; g < header.galaxyCount; ++g)
+    {
+        const SnapshotGalaxy& entry = snapshot.GetGalaxy(g);
+
+        GalaxyParameters model;
+        model.diskParticlesCount = entry.diskParticlesCount;
+        model.bulgeParticlesCount = entry.bulgeParticlesCount;
+        model.mass = entry.mass;
+        model.diskRadius = entry.diskRadius;
+        model.diskThickness = entry.diskThickness;
+        model.diskMassRatio = entry.diskMassRatio;
+        model.bulgeRadius = entry.bulgeRadius;
+        model.haloRadius = entry.haloRadius;
+        model.blackHoleMass = entry.blackHoleMass;
+        model.haloModel = entry.haloModel < static_cast<uint32_t>(HaloModelType::Count) ? static_cast<HaloModelType>(entry.haloModel) : HaloModelType::Plummer;
+        model.haloMass = entry.haloMass;
+        model.seed = entry.seed;
+        model.haloParticlesCount = entry.haloParticleCount;
+        model.tracerParticlesCount = entry.tracerCount;
+
+        std::vector<Particle> particles(static_cast<size_t>(entry.particleCount));
+
+        for (size_t i = 0; i < particles.size(); ++i)
+        {
+            const size_t k = static_cast<size_t>(entry.firstParticle) + i;
+            Particle& particle = particles[i];
+
+            particle.position = { positionX[k], positionY[k], positionZ[k] };
+            particle.linearVelocity = { velocityX[k], velocityY[k], velocityZ[k] };
+            particle.SetMass(mass[k]);
+            particle.movable = (flags[k] & SnapshotParticleMovable) != 0;
+            particle.active = (flags[k] & SnapshotParticleActive) != 0;
+            particle.doubleDrawing = (flags[k] & SnapshotParticleDoubleDrawing) != 0;
+
+            if (type)       particle.type = static_cast<ParticleType>(type[k]);
+            if (colorR)     particle.color.m_x = colorR[k];
+            if (colorG)     particle.color.m_y = colorG[k];
+            if (colorB)     particle.color.m_z = colorB[k];
+            if (size)       particle.size = size[k];
+            if (magnitude)  particle.magnitude = magnitude[k];
+            particle.id = id ? id[k] : static_cast<uint32_t>(i);
+        }
+
+        std::vector<HaloParticle> haloParticles(entry.haloParticleCount);
+
+        for (size_t i = 0; i < haloParticles.size(); ++i)
+        {
+            const size_t k = static_cast<size_t>(firstHaloParticle) + i;
+            HaloParticle& particle = haloParticles[i];
+
+            particle.position = { haloPositionX[k], haloPositionY[k], haloPositionZ[k] };
+            particle.linearVelocity = { haloVelocityX[k], haloVelocityY[k], haloVelocityZ[k] };
+            particle.mass = haloMass[k];
+        }
+        firstHaloParticle += entry.haloParticleCount;
+
+        std::vector<TracerParticle> tracers(entry.tracerCount);
+
+        for (size_t i = 0; i < tracers.size(); ++i)
+        {
+            const size_t k = static_cast<size_t>(firstTracer) + i;
+            tracers[i].position = { tracerPositionX[k], tracerPositionY[k], tracerPositionZ[k] };
+            tracers[i].linearVelocity = { tracerVelocityX[k], tracerVelocityY[k], tracerVelocityZ[k] };
+        }
+        firstTracer += entry.tracerCount;
+
+        universe->CreateGalaxy({ entry.position[0], entry.position[1], entry.position[2] }, model, 
+            std::move(particles), std::move(haloParticles), std::move(tracers));
+    }
+
+    parameters.darkMatter = (header.flags & SnapshotDarkMatter) != 0;
+    // Older snapshots don't have the other parameters, the current ones are kept
+    if (header.version >= 6)
+    {
+        parameters.softening = header.softening;
+        parameters.haloSoftening = header.haloSoftening;
+        parameters.haloStepInterval = header.haloStepInterval;
+        parameters.treeAccuracy.openingAngle = header.openingAngle;
+        parameters.treeAccuracy.leafCapacity = (std::max)(header.leafCapacity, 1u);
+        parameters.treeAccuracy.multipoleOrder = header.multipoleOrder <= static_cast<uint32_t>(MultipoleOrder::Quadrupole) ? 
+            static_cast<MultipoleOrder>(header.multipoleOrder) : MultipoleOrder::Monopole;
+        parameters.reorderParticles = (header.flags & SnapshotReorderParticles) != 0;
+        parameters.reorderInterval = header.reorderInterval;
+    }
+    time = static_cast<float>(header.time);
+    numSteps = static_cast<int32_t>(header.stepCount);
+    reorderCount = 0;
+
+    // Halo kicks continue on the same steps
+    CreateSolvers();
+
+    return true;
+}
+
+bool Simulation::SaveSnapshot(const std::string& filename, float deltaTime) const
+{
+    assert(universe);
+    return WriteSnapshot(filename, *universe, parameters, time, numSteps, deltaTime);
+}
+
+uint64_t Simulation::HashInitialConditions(const Scenario& scenario) const
+{
+    Hasher hasher;
+    hasher.Add(cInitialConditionsVersion);
+    hasher.Add(solverType);
+    // Initial velocities come from the forces, which differ between the kernels in the last bits
+    hasher.Add(GetGravityKernels().isa);
+    hasher.Add(SofteningPolicy::cName, std::strlen(SofteningPolicy::cName));
+    hasher.Add(parameters.darkMatter);
+    hasher.Add(parameters.softening);
+    hasher.Add(parameters.haloSoftening);
+    // So do the forces of the tree the initial velocities come from
+    hasher.Add(parameters.treeAccuracy.openingAngle);
+    hasher.Add(parameters.treeAccuracy.leafCapacity);
+    hasher.Add(parameters.treeAccuracy.multipoleOrder);
+    hasher.Add(scenario.deltaTime);
+    hasher.Add(scenario.universeSize);
+
+    for (const auto& description : scenario.galaxies)
+    {
+        const GalaxyParameters& model = description.parameters;
+
+        hasher.Add(description.center);
+        hasher.Add(description.velocity);
+        hasher.Add(model.diskParticlesCount);
+        hasher.Add(model.bulgeParticlesCount);
+        hasher.Add(model.mass);
+        hasher.Add(model.diskRadius);
+        hasher.Add(model.diskThickness);
+        hasher.Add(model.diskMassRatio);
+        hasher.Add(model.bulgeRadius);
+        hasher.Add(model.haloRadius);
+        hasher.Add(model.blackHoleMass);
+        hasher.Add(model.haloModel);
+        hasher.Add(model.haloMass);
+        hasher.Add(model.seed);
+        hasher.Add(model.haloParticlesCount);
+        hasher.Add(model.tracerParticlesCount);
+    }
+
+    return hasher.GetHash();
+}
+
+void Simulation::RequestParameters(const SimulationParameters& requested)
+{
+    std::lock_guard<std::mutex> lock(requestMutex);
+    requestedParameters = requested;
+    parametersRequested = true;
+}
+
+void Simulation::ApplyRequestedParameters()
+{
+    std::lock_guard<std::mutex> lock(requestMutex);
+    if (parametersRequested)
+    {
+        parameters = requestedParameters;
+        parametersRequested = false;
+    }
+}
+
+void Simulation::ReleaseUniverse()
+{
+    // Solvers refer to the universe
+    solver = nullptr;
+    solverBruteforce.reset();
+    solverBarneshut.reset();
+    universe.reset();
+}
+
+void Simulation::CreateSolvers()
+{
+    solverBruteforce = std::make_unique<BruteforceSolver>(*universe, parameters, timings);
+    solverBarneshut = std::make_unique<BarnesHutSolver>(*universe, parameters, timings);
+
+    solver = solverType == SolverType::BarnesHut ? static_cast<Solver*>(solverBarneshut.get()) : solverBruteforce.get();
+    solver->SetStepCount(numSteps);
+
+    for (auto& check : orderChecks)
+    {
+        check.pending = false;
+    }
+
+    TaskGraph& stepGraph = solverBarneshut->GetStepGraph();
+    TaskGraph::TaskId stage = stepGraph.AddTask("StageOrderCheck", [this]() { StageOrderCheck(); });
+    TaskGraph::TaskId measure = stepGraph.AddTask("MeasureOrder", [this]() { MeasureOrder(); }, TaskGraph::Affinity::Background);
+    stepGraph.AddDependency(stage, solverBarneshut->GetStepTasks().integrate);
+    stepGraph.AddDependency(measure, stage);
+}
+
+// Steps between the checks of the particle order when the reorder interval is automatic
+static constexpr uint32_t cReorderCheckInterval = 8;
+// Fraction of the particles out of the curve order that triggers an automatic reorder, a reorder
+// costs about 1% of a step and a check much less
+static constexpr float cReorderDisorder = 0.05f;
+
+// Level of the curve cells of about one particle each
+static uint32_t GetDisorderLevel(size_t particleCount)
+{
+    const double count = static_cast<double>((std::max)(particleCount, size_t(2)));
+    return static_cast<uint32_t>(std::ceil(std::log2(count) / 3.0));
+}
+
+/**
+    Reorders the galaxies every reorder interval steps or, if the interval is automatic, those
+    of them that have mixed past cReorderDisorder. The order is measured on the curve cells
+    of about one particle each. Both depend on the step count and the state only, so a
+    restored run reorders on the same steps as the original one. The Barnes-Hut step graph
+    stages the measure before the check step, see StageOrderCheck, other steps measure here.
+*/
+void Simulation::MaintainParticleOrder()
+{
+    const uint32_t interval = parameters.reorderInterval > 0 ? parameters.reorderInterval : cReorderCheckInterval;
+    if (!parameters.reorderParticles || numSteps % interval != 0)
+    {
+        return;
+    }
+
+    PROFILE_ZONE("Reorder");
+    Timer<std::milli> timer(&timings.reorderTimeMsecs);
+
+    OrderCheck* staged = nullptr;
+    for (auto& check : orderChecks)
+    {
+        if (check.pending && check.step == numSteps)
+        {
+            staged = &check;
+        }
+    }
+    if (staged)
+    {
+        solverBarneshut->GetStepGraph().WaitStep(staged->graphStep);
+        staged->pending = false;
+    }
+
+    const float size = universe->GetSize();
+    const float3 origin(-size * 0.5f);
+    auto& galaxies = universe->GetGalaxies();
+    for (size_t i = 0; i < galaxies.size(); ++i)
+    {
+        Galaxy& galaxy = galaxies[i];
+        if (parameters.reorderInterval == 0)
+        {
+            const float disorder = staged ? staged->disorder[i] : galaxy.MeasureDisorder(origin, size, GetDisorderLevel(galaxy.GetParticlesCount()));
+            if (disorder <= cReorderDisorder)
+            {
+                continue;
+            }
+        }
+        galaxy.ReorderParticles(origin, size);
+        ++reorderCount;
+    }
+}
+
+/**
+    Foreground task after Integrate: copies the positions the automatic order check of the
+    next step measures. Nothing else reads or writes the stage until MeasureOrder is done.
+*/
+void Simulation::StageOrderCheck()
+{
+    const int32_t step = numSteps + 1;
+    if (!parameters.reorderParticles || parameters.reorderInterval > 0 || step % cReorderCheckInterval != 0)
+    {
+        return;
+    }
+
+    OrderCheck& check = orderChecks[TaskGraph::GetTaskStep() & 1];
+    const auto& galaxies = universe->GetGalaxies();
+    check.positions.resize(galaxies.size());
+    check.disorder.assign(galaxies.size(), 0.0f);
+
+    for (size_t g = 0; g < galaxies.size(); ++g)
+    {
+        const auto& particles = galaxies[g].GetParticles();
+        std::vector<float3>& positions = check.positions[g];
+        positions.resize(particles.size());
+
+        ThreadPool().Dispatch([&](uint32_t i)
+        {
+            positions[i] = particles[i].position;
+        }, static_cast<uint32_t>(particles.size()), (std::max)(static_cast<uint32_t>(particles.size() / ThreadPool::GetThreadCount()), 1u));
+    }
+
+    check.step = step;
+    check.graphStep = TaskGraph::GetTaskStep();
+    check.universeSize = universe->GetSize();
+    check.pending = true;
+}
+
+/** Background task: the disorder of the staged positions, for MaintainParticleOrder. */
+void Simulation::MeasureOrder()
+{
+    OrderCheck& check = orderChecks[TaskGraph::GetTaskStep() & 1];
+    if (!check.pending || check.graphStep != TaskGraph::GetTaskStep())
+    {
+        return;
+    }
+
+    const float3 origin(-check.universeSize * 0.5f);
+    for (size_t g = 0; g < check.positions.size(); ++g)
+    {
+        check.disorder[g] = MeasureCurveDisorder(check.positions[g], origin, check.universeSize, GetDisorderLevel(check.positions[g].size()));
+    }
+}
+
+void Simulation::Step(float deltaTime)
+{
+    assert(solver);
+
+    PROFILE_ZONE("Step");
+    // The solvers read the parameters throughout the step, they only change between the steps
+    ApplyRequestedParameters();
+    MaintainParticleOrder();
+    solver->Solve(deltaTime);
+    time += deltaTime;
+    ++numSteps;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Galaxy.h"
+#include "Solver.h"
+
+class SnapshotView;
+struct Scenario;
+
+/**
+    Simulation core: the universe, its solvers and the simulation clock.
+
+    Has no windowing or graphics dependency, both the GUI application and the batch runner
+    drive it. ThreadPool must be created by the caller.
+*/
+class Simulation
+{
+public:
+    enum class SolverType
+    {
+        BarnesHut,
+        Bruteforce
+    };
+
+    Simulation();
+    ~Simulation();
+
+    /** Creates a universe with one galaxy at the origin and sets up the initial velocities. */
+    void Reset(const GalaxyParameters& model, float deltaTime, float universeSize = GLX_UNIVERSE_SIZE);
+
+    /** Creates the galaxies of a scenario, the time step is the scenario's. */
+    void Reset(const Scenario& scenario);
+
+    /**
+        Reset through a cache of initialized universes in cacheDirectory. A repeated scenario
+        is restored from its snapshot instead of being generated and initialized again, a new
+        one is added to the cache, which is never pruned. Returns true if the universe came
+        from the cache.
+    */
+    bool ResetCached(const Scenario& scenario, const std::string& cacheDirectory);
+
+    /**
+        Continues the simulation stored in a snapshot. Initialization is skipped, so stepping
+        with the snapshot's time step reproduces the original run bit for bit.
+    */
+    bool Restore(const SnapshotView& snapshot);
+
+    /** Writes the current state, deltaTime is the step the run continues with. */
+    bool SaveSnapshot(const std::string& filename, float deltaTime) const;
+
+    /** Advances the simulation by one time step. */
+    void Step(float deltaTime);
+
+    /** Solver used from the next Reset. */
+    void SetSolverType(SolverType type) { solverType = type; }
+    SolverType GetSolverType() const { return solverType; }
+
+    Universe& GetUniverse() { return *universe; }
+    Solver& GetSolver() { return *solver; }
+    /** Barnes-Hut solver if it is the active one, otherwise null. */
+    BarnesHutSolver* GetBarnesHutSolver() { return solverType == SolverType::BarnesHut ? solverBarneshut.get() : nullptr; }
+
+    /** Parameters of the steps, only for the thread that steps, others use RequestParameters. */
+    SimulationParameters& GetParameters() { return parameters; }
+    const SimulationParameters& GetParameters() const { return parameters; }
+    /**
+        Parameters the next Step, Reset or Restore starts with, safe to call while another
+        thread steps. A step in progress keeps the values it started with.
+    */
+    void RequestParameters(const SimulationParameters& requested);
+    const Timings& GetTimings() const { return timings; }
+
+    const float& GetTime() const { return time; }
+    const int32_t& GetStepCount() const { return numSteps; }
+    /** Galaxies reordered since the last Reset or Restore. */
+    uint32_t GetReorderCount() const { return reorderCount; }
+
+private:
+    /** Key of the state Reset produces, covers everything it depends on. */
+    uint64_t HashInitialConditions(const Scenario& scenario) const;
+
+    void ApplyRequestedParameters();
+    void ReleaseUniverse();
+    void CreateSolvers();
+    void MaintainParticleOrder();
+    void StageOrderCheck();
+    void MeasureOrder();
+
+    /**
+        Positions of the particles staged by the step before an automatic order check, so that
+        the curve keys are computed in the background while the step graph goes on.
+    */
+    struct OrderCheck
+    {
+        bool pending = false;
+        // Step of the check and the step graph step that staged it
+        int32_t step = 0;
+        uint64_t graphStep = 0;
+        float universeSize = 0.0f;
+        // By galaxy
+        std::vector<std::vector<float3>> positions;
+        std::vector<float> disorder;
+    };
+
+    std::unique_ptr<Universe> universe;
+    std::unique_ptr<BruteforceSolver> solverBruteforce;
+    std::unique_ptr<BarnesHutSolver> solverBarneshut;
+
+    Solver* solver = nullptr;
+    SolverType solverType = SolverType::BarnesHut;
+
+    SimulationParameters parameters;
+    Timings timings;
+
+    // Handoff of the parameters from another thread, see RequestParameters
+    std::mutex requestMutex;
+    SimulationParameters requestedParameters;
+    bool parametersRequested = false;
+
+    float time = 0.0f;
+    int32_t numSteps = 0;
+    uint32_t reorderCount = 0;
+
+    // By step parity, see TaskGraph
+    OrderCheck orderChecks[2];
+};
@@ -0,0 +1,432 @@
+#include "SnapshotFile.h"
+#include "Constants.h"
+#include "solver.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+static uint32_t GetElementSize(SnapshotBlockId id)
+{
+    switch (id)
+    {
+    case SnapshotBlockId::Flags:
+    case SnapshotBlockId::Type:
+        return sizeof(uint8_t);
+    case SnapshotBlockId::Id:
+        return sizeof(uint32_t);
+    default:
+        return sizeof(float);
+    }
+}
+
+bool IsHaloSnapshotBlock(SnapshotBlockId id)
+{
+    return id >= SnapshotBlockId::HaloPositionX && id <= SnapshotBlockId::HaloMass;
+}
+
+bool IsTracerSnapshotBlock(SnapshotBlockId id)
+{
+    return id >= SnapshotBlockId::TracerPositionX && id <= SnapshotBlockId::TracerVelocityZ;
+}
+
+static uint64_t GetElementCount(const SnapshotHeader& header, SnapshotBlockId id)
+{
+    return IsHaloSnapshotBlock(id) ? header.haloParticleCount : IsTracerSnapshotBlock(id) ? header.tracerCount : header.particleCount;
+}
+
+static uint64_t AlignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint8_t PackFlags(const Particle& particle)
+{
+    uint8_t flags = 0;
+    flags |= particle.movable ? SnapshotParticleMovable : 0;
+    flags |= particle.active ? SnapshotParticleActive : 0;
+    flags |= particle.doubleDrawing ? SnapshotParticleDoubleDrawing : 0;
+    return flags;
+}
+
+static float GetFloatElement(const Particle& particle, SnapshotBlockId id)
+{
+    switch (id)
+    {
+    case SnapshotBlockId::PositionX: return particle.position.m_x;
+    case SnapshotBlockId::PositionY: return particle.position.m_y;
+    case SnapshotBlockId::PositionZ: return particle.position.m_z;
+    case SnapshotBlockId::VelocityX: return particle.linearVelocity.m_x;
+    case SnapshotBlockId::VelocityY: return particle.linearVelocity.m_y;
+    case SnapshotBlockId::VelocityZ: return particle.linearVelocity.m_z;
+    case SnapshotBlockId::Mass:      return particle.mass;
+    case SnapshotBlockId::ColorR:    return particle.color.m_x;
+    case SnapshotBlockId::ColorG:    return particle.color.m_y;
+    case SnapshotBlockId::ColorB:    return particle.color.m_z;
+    case SnapshotBlockId::Size:      return particle.size;
+    case SnapshotBlockId::Magnitude: return particle.magnitude;
+    default:
+        assert(!"Not a float block");
+        return 0.0f;
+    }
+}
+
+static float GetFloatElement(const HaloParticle& particle, SnapshotBlockId id)
+{
+    switch (id)
+    {
+    case SnapshotBlockId::HaloPositionX: return particle.position.m_x;
+    case SnapshotBlockId::HaloPositionY: return particle.position.m_y;
+    case SnapshotBlockId::HaloPositionZ: return particle.position.m_z;
+    case SnapshotBlockId::HaloVelocityX: return particle.linearVelocity.m_x;
+    case SnapshotBlockId::HaloVelocityY: return particle.linearVelocity.m_y;
+    case SnapshotBlockId::HaloVelocityZ: return particle.linearVelocity.m_z;
+    case SnapshotBlockId::HaloMass:      return particle.mass;
+    default:
+        assert(!"Not a halo block");
+        return 0.0f;
+    }
+}
+
+static float GetFloatElement(const TracerParticle& tracer, SnapshotBlockId id)
+{
+    switch (id)
+    {
+    case SnapshotBlockId::TracerPositionX: return tracer.position.m_x;
+    case SnapshotBlockId::TracerPositionY: return tracer.position.m_y;
+    case SnapshotBlockId::TracerPositionZ: return tracer.position.m_z;
+    case SnapshotBlockId::TracerVelocityX: return tracer.linearVelocity.m_x;
+    case SnapshotBlockId::TracerVelocityY: return tracer.linearVelocity.m_y;
+    case SnapshotBlockId::TracerVelocityZ: return tracer.linearVelocity.m_z;
+    default:
+        assert(!"Not a tracer block");
+        return 0.0f;
+    }
+}
+
+/** Packs elements [first, first + count) of a block of per galaxy arrays, e.g. the halo particles. */
+template <typename Element, typename GetElements>
+static void StoreGalaxyElements(const Universe& universe, SnapshotBlockId id, uint64_t first, uint64_t count, uint8_t* destination, const GetElements& getElements)
+{
+    uint64_t galaxyFirst = 0;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        const std::vector<Element>& elements = getElements(galaxy);
+        const uint64_t galaxyEnd = galaxyFirst + elements.size();
+
+        const uint64_t begin = std::max(first, galaxyFirst);
+        const uint64_t end = std::min(first + count, galaxyEnd);
+
+        for (uint64_t i = begin; i < end; ++i)
+        {
+            float value = GetFloatElement(elements[static_cast<size_t>(i - galaxyFirst)], id);
+            std::memcpy(destination + (i - first) * sizeof(float), &value, sizeof(float));
+        }
+
+        galaxyFirst = galaxyEnd;
+    }
+}
+
+SnapshotLayout MakeSnapshotLayout(const Universe& universe, const SimulationParameters& parameters, double time, uint64_t stepCount, float deltaTime)
+{
+    SnapshotLayout layout = {};
+
+    SnapshotHeader& header = layout.header;
+    header.magic = cSnapshotMagic;
+    header.version = cSnapshotVersion;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.galaxyCount = static_cast<uint32_t>(universe.GetGalaxies().size());
+    header.blockCount = static_cast<uint32_t>(SnapshotBlockId::Count);
+    header.flags = parameters.darkMatter ? uint32_t(SnapshotDarkMatter) : 0u;
+    if (parameters.reorderParticles)
+    {
+        header.flags |= SnapshotReorderParticles;
+    }
+    header.particleCount = universe.GetParticlesCount();
+    header.haloParticleCount = universe.GetHaloParticlesCount();
+    header.tracerCount = universe.GetTracersCount();
+    header.stepCount = stepCount;
+    header.lengthUnit = cKiloParsec;
+    header.massUnit = cMassUnit;
+    header.timeUnit = std::sqrt(cKiloParsec * cKiloParsec * cKiloParsec / (cMassUnit * cG));
+    header.time = time;
+    header.deltaTime = deltaTime;
+    header.universeSize = universe.GetSize();
+    header.softening = parameters.softening;
+    header.haloSoftening = parameters.haloSoftening;
+    header.haloStepInterval = parameters.haloStepInterval;
+    header.openingAngle = parameters.treeAccuracy.openingAngle;
+    header.leafCapacity = parameters.treeAccuracy.leafCapacity;
+    header.multipoleOrder = static_cast<uint32_t>(parameters.treeAccuracy.multipoleOrder);
+    header.reorderInterval = parameters.reorderInterval;
+
+    uint64_t firstParticle = 0;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        const GalaxyParameters& model = galaxy.GetParameters();
+
+        SnapshotGalaxy entry = {};
+        entry.diskParticlesCount = model.diskParticlesCount;
+        entry.bulgeParticlesCount = model.bulgeParticlesCount;
+        entry.mass = model.mass;
+        entry.diskRadius = model.diskRadius;
+        entry.diskThickness = model.diskThickness;
+        entry.diskMassRatio = model.diskMassRatio;
+        entry.bulgeRadius = model.bulgeRadius;
+        entry.haloRadius = model.haloRadius;
+        entry.blackHoleMass = model.blackHoleMass;
+        entry.position[0] = galaxy.GetPosition().m_x;
+        entry.position[1] = galaxy.GetPosition().m_y;
+        entry.position[2] = galaxy.GetPosition().m_z;
+        entry.firstParticle = firstParticle;
+        entry.particleCount = galaxy.GetParticlesCount();
+        entry.haloModel = static_cast<uint32_t>(model.haloModel);
+        entry.haloMass = model.haloMass;
+        entry.seed = model.seed;
+        entry.haloParticleCount = static_cast<uint32_t>(galaxy.GetHaloParticles().size());
+        entry.tracerCount = static_cast<uint32_t>(galaxy.GetTracers().size());
+        layout.galaxies.push_back(entry);
+
+        firstParticle += entry.particleCount;
+    }
+
+    uint64_t offset = AlignUp(sizeof(SnapshotHeader) +
+        layout.galaxies.size() * sizeof(SnapshotGalaxy) +
+        header.blockCount * sizeof(SnapshotBlock), cSnapshotBlockAlignment);
+
+    for (uint32_t i = 0; i < header.blockCount; ++i)
+    {
+        SnapshotBlock block = {};
+        block.id = static_cast<SnapshotBlockId>(i);
+        block.elementSize = GetElementSize(block.id);
+        block.offset = offset;
+        block.size = GetElementCount(header, block.id) * block.elementSize;
+        layout.blocks.push_back(block);
+
+        offset = AlignUp(offset + block.size, cSnapshotBlockAlignment);
+    }
+
+    layout.fileSize = offset;
+
+    return layout;
+}
+
+void StoreSnapshotPrefix(const SnapshotLayout& layout, std::vector<uint8_t>& bytes)
+{
+    const size_t galaxiesSize = layout.galaxies.size() * sizeof(SnapshotGalaxy);
+    const size_t blocksSize = layout.blocks.size() * sizeof(SnapshotBlock);
+
+    bytes.assign(layout.blocks.empty() ? sizeof(SnapshotHeader) + galaxiesSize : static_cast<size_t>(layout.blocks.front().offset), 0);
+
+    uint8_t* data = bytes.data();
+    std::memcpy(data, &layout.header, sizeof(SnapshotHeader));
+    data += sizeof(SnapshotHeader);
+    if (galaxiesSize > 0)
+    {
+        std::memcpy(data, layout.galaxies.data(), galaxiesSize);
+        data += galaxiesSize;
+    }
+    if (blocksSize > 0)
+    {
+        std::memcpy(data, layout.blocks.data(), blocksSize);
+    }
+}
+
+void StoreSnapshotBlock(const Universe& universe, SnapshotBlockId id, uint64_t first, uint64_t count, uint8_t* destination)
+{
+    const uint32_t elementSize = GetElementSize(id);
+
+    if (IsHaloSnapshotBlock(id))
+    {
+        StoreGalaxyElements<HaloParticle>(universe, id, first, count, destination, [](const Galaxy& galaxy) -> const std::vector<HaloParticle>& { return galaxy.GetHaloParticles(); });
+        return;
+    }
+    if (IsTracerSnapshotBlock(id))
+    {
+        StoreGalaxyElements<TracerParticle>(universe, id, first, count, destination, [](const Galaxy& galaxy) -> const std::vector<TracerParticle>& { return galaxy.GetTracers(); });
+        return;
+    }
+
+    uint64_t galaxyFirst = 0;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        const auto& particles = galaxy.GetParticles();
+        const uint64_t galaxyEnd = galaxyFirst + particles.size();
+
+        const uint64_t begin = std::max(first, galaxyFirst);
+        const uint64_t end = std::min(first + count, galaxyEnd);
+
+        for (uint64_t i = begin; i < end; ++i)
+        {
+            const Particle& particle = particles[static_cast<size_t>(i - galaxyFirst)];
+            uint8_t* element = destination + (i - first) * elementSize;
+
+            if (id == SnapshotBlockId::Flags)
+            {
+                *element = PackFlags(particle);
+            }
+            else if (id == SnapshotBlockId::Type)
+            {
+                *element = static_cast<uint8_t>(particle.type);
+            }
+            else if (id == SnapshotBlockId::Id)
+            {
+                std::memcpy(element, &particle.id, sizeof(uint32_t));
+            }
+            else
+            {
+                float value = GetFloatElement(particle, id);
+                std::memcpy(element, &value, sizeof(float));
+            }
+        }
+
+        galaxyFirst = galaxyEnd;
+    }
+}
+
+bool WriteSnapshot(const std::string& filename, const Universe& universe, const SimulationParameters& parameters, double time, uint64_t stepCount, float deltaTime)
+{
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+        return false;
+    }
+
+    const SnapshotLayout layout = MakeSnapshotLayout(universe, parameters, time, stepCount, deltaTime);
+
+    std::vector<uint8_t> bytes;
+    StoreSnapshotPrefix(layout, bytes);
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
+    uint64_t position = bytes.size();
+
+    for (const auto& block : layout.blocks)
+    {
+        // Padding up to the block start
+        bytes.assign(static_cast<size_t>(block.offset - position + block.size), 0);
+        StoreSnapshotBlock(universe, block.id, 0, block.size / block.elementSize, bytes.data() + (block.offset - position));
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
+        position = block.offset + block.size;
+    }
+
+    if (position < layout.fileSize)
+    {
+        bytes.assign(static_cast<size_t>(layout.fileSize - position), 0);
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+
+    file.close();
+
+    return static_cast<bool>(file);
+}
+
+bool SnapshotView::Open(const std::string& filename)
+{
+    Close();
+
+    if (!file.Open(filename.c_str()))
+    {
+        return Fail("Can't open " + filename);
+    }
+
+    const uint8_t* data = file.GetData();
+    const uint64_t size = file.GetSize();
+
+    if (size < cSnapshotHeaderSizeV4)
+    {
+        return Fail("File is too small");
+    }
+
+    // Copied, so that the fields added since the older versions read as zeros
+    std::memcpy(&header, data, cSnapshotHeaderSizeV4);
+    if (header.magic != cSnapshotMagic)
+    {
+        return Fail("Not a snapshot file");
+    }
+    const uint32_t headerSize = header.version < 6 ? cSnapshotHeaderSizeV4 : static_cast<uint32_t>(sizeof(SnapshotHeader));
+    if (header.version < cSnapshotMinVersion || header.version > cSnapshotVersion || header.headerSize != headerSize || size < headerSize)
+    {
+        return Fail("Unsupported snapshot version " + std::to_string(header.version));
+    }
+    std::memcpy(&header, data, headerSize);
+
+    const uint64_t tablesSize = headerSize +
+        static_cast<uint64_t>(header.galaxyCount) * sizeof(SnapshotGalaxy) +
+        static_cast<uint64_t>(header.blockCount) * sizeof(SnapshotBlock);
+    if (size < tablesSize)
+    {
+        return Fail("Truncated snapshot tables");
+    }
+
+    galaxies = reinterpret_cast<const SnapshotGalaxy*>(data + headerSize);
+    blocks = reinterpret_cast<const SnapshotBlock*>(galaxies + header.galaxyCount);
+
+    uint64_t particleCount = 0;
+    uint64_t haloParticleCount = 0;
+    uint64_t tracerCount = 0;
+    for (uint32_t i = 0; i < header.galaxyCount; ++i)
+    {
+        if (galaxies[i].firstParticle != particleCount)
+        {
+            return Fail("Galaxy table is inconsistent");
+        }
+        particleCount += galaxies[i].particleCount;
+        haloParticleCount += galaxies[i].haloParticleCount;
+        tracerCount += galaxies[i].tracerCount;
+    }
+    if (particleCount != header.particleCount || haloParticleCount != header.haloParticleCount || tracerCount != header.tracerCount)
+    {
+        return Fail("Galaxy table is inconsistent");
+    }
+
+    for (uint32_t i = 0; i < header.blockCount; ++i)
+    {
+        const SnapshotBlock& block = blocks[i];
+        if (block.offset % cSnapshotBlockAlignment != 0 ||
+            block.size != GetElementCount(header, block.id) * block.elementSize ||
+            block.offset + block.size > size)
+        {
+            return Fail("Block " + std::to_string(static_cast<uint32_t>(block.id)) + " is out of the file");
+        }
+    }
+
+    return true;
+}
+
+void SnapshotView::Close()
+{
+    file.Close();
+    header = SnapshotHeader();
+    galaxies = nullptr;
+    blocks = nullptr;
+    error.clear();
+}
+
+const SnapshotBlock* SnapshotView::FindBlock(SnapshotBlockId id) const
+{
+    if (!blocks)
+    {
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < header.blockCount; ++i)
+    {
+        if (blocks[i].id == id)
+        {
+            return &blocks[i];
+        }
+    }
+
+    return nullptr;
+}
+
+bool SnapshotView::Fail(const std::string& message)
+{
+    std::string text = message;
+    Close();
+    error = text;
+    return false;
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Galaxy.h"
+#include "MappedFile.h"
+
+struct SimulationParameters;
+
+/*
+Binary snapshot of the simulation state.
+
+Layout:
+    SnapshotHeader
+    SnapshotGalaxy[galaxyCount]
+    SnapshotBlock[blockCount]
+    blocks of particle data, each starting at a multiple of cSnapshotBlockAlignment
+
+Every block is a tightly packed array with one element per particle of all galaxies in galaxy
+order (structure of arrays), so a mapped file can be used in place without any parsing. Blocks
+of live halo particles and tracers have one element per halo particle or tracer instead.
+All values are little-endian.
+*/
+
+constexpr uint32_t cSnapshotMagic = 0x53584C47;  // "GLXS"
+constexpr uint32_t cSnapshotVersion = 6;
+// Oldest version that can be read, later versions only fill reserved fields, add blocks and extend the header
+constexpr uint32_t cSnapshotMinVersion = 4;
+// Header size of the versions before 6
+constexpr uint32_t cSnapshotHeaderSizeV4 = 112;
+constexpr uint64_t cSnapshotBlockAlignment = 4096;
+
+enum SnapshotFlags : uint32_t
+{
+    SnapshotDarkMatter = 1 << 0,
+    // Since version 6
+    SnapshotReorderParticles = 1 << 1
+};
+
+struct SnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t galaxyCount;
+    uint32_t blockCount;
+    uint32_t flags;
+    uint64_t particleCount;
+    uint64_t stepCount;
+    // Model units in SI: meters, kilograms and seconds per unit
+    double lengthUnit;
+    double massUnit;
+    double timeUnit;
+    // Simulation clock in model units
+    double time;
+    float deltaTime;
+    float universeSize;
+    uint64_t haloParticleCount;
+    uint64_t tracerCount;
+    uint32_t reserved[4];
+    // Since version 6, the simulation parameters the orbits depend on, see SimulationParameters
+    float softening;
+    float haloSoftening;
+    uint32_t haloStepInterval;
+    float openingAngle;
+    uint32_t leafCapacity;
+    uint32_t multipoleOrder;
+    uint32_t reorderInterval;
+    uint32_t reserved2;
+};
+
+// Galaxy model, stored field by field so GalaxyParameters can change without breaking old files
+struct SnapshotGalaxy
+{
+    uint32_t diskParticlesCount;
+    uint32_t bulgeParticlesCount;
+    float mass;
+    float diskRadius;
+    float diskThickness;
+    float diskMassRatio;
+    float bulgeRadius;
+    float haloRadius;
+    float blackHoleMass;
+    float position[3];
+    uint64_t firstParticle;
+    uint64_t particleCount;
+    // Since version 2
+    uint32_t haloModel;
+    float haloMass;
+    uint32_t seed;
+    // Halo particles and tracers of the galaxies are stored in galaxy order
+    uint32_t haloParticleCount;
+    uint32_t tracerCount;
+    uint32_t reserved[3];
+};
+
+enum class SnapshotBlockId : uint32_t
+{
+    PositionX,
+    PositionY,
+    PositionZ,
+    VelocityX,
+    VelocityY,
+    VelocityZ,
+    Mass,
+    Flags,
+    Type,
+    ColorR,
+    ColorG,
+    ColorB,
+    Size,
+    Magnitude,
+    // Live halo particles
+    HaloPositionX,
+    HaloPositionY,
+    HaloPositionZ,
+    HaloVelocityX,
+    HaloVelocityY,
+    HaloVelocityZ,
+    HaloMass,
+    // Tracers
+    TracerPositionX,
+    TracerPositionY,
+    TracerPositionZ,
+    TracerVelocityX,
+    TracerVelocityY,
+    TracerVelocityZ,
+    // Since version 5, particle ids, which are the indices without it
+    Id,
+
+    Count
+};
+
+// Bits of the Flags block
+enum SnapshotParticleFlags : uint8_t
+{
+    SnapshotParticleMovable = 1 << 0,
+    SnapshotParticleActive = 1 << 1,
+    SnapshotParticleDoubleDrawing = 1 << 2
+};
+
+struct SnapshotBlock
+{
+    SnapshotBlockId id;
+    uint32_t elementSize;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static_assert(sizeof(SnapshotHeader) == 144, "Snapshot header layout changed");
+static_assert(sizeof(SnapshotGalaxy) == 96, "Snapshot galaxy layout changed");
+static_assert(sizeof(SnapshotBlock) == 24, "Snapshot block layout changed");
+
+/** Everything of a snapshot except the particle data. */
+struct SnapshotLayout
+{
+    SnapshotHeader header;
+    std::vector<SnapshotGalaxy> galaxies;
+    std::vector<SnapshotBlock> blocks;
+    // Total file size including the padding after the last block
+    uint64_t fileSize;
+};
+
+/** Describes a snapshot of the universe at the given simulation time. */
+SnapshotLayout MakeSnapshotLayout(const Universe& universe, const SimulationParameters& parameters, double time, uint64_t stepCount, float deltaTime);
+
+/** Header, galaxy table and block directory padded up to the first block. */
+void StoreSnapshotPrefix(const SnapshotLayout& layout, std::vector<uint8_t>& bytes);
+
+/** Whether the block has an element per halo particle rather than per particle. */
+bool IsHaloSnapshotBlock(SnapshotBlockId id);
+/** Whether the block has an element per tracer rather than per particle. */
+bool IsTracerSnapshotBlock(SnapshotBlockId id);
+
+/** Packs elements [first, first + count) of a block into destination. */
+void StoreSnapshotBlock(const Universe& universe, SnapshotBlockId id, uint64_t first, uint64_t count, uint8_t* destination);
+
+/** Writes a snapshot of the universe, streaming one block at a time. */
+bool WriteSnapshot(const std::string& filename, const Universe& universe, const SimulationParameters& parameters, double time, uint64_t stepCount, float deltaTime);
+
+/** Read-only view of a memory-mapped snapshot file. */
+class SnapshotView
+{
+public:
+    bool Open(const std::string& filename);
+    void Close();
+
+    bool IsOpen() const { return file.IsOpen(); }
+    const std::string& GetError() const { return error; }
+
+    /** Headers of older versions are extended with zeros. */
+    const SnapshotHeader& GetHeader() const { return header; }
+    const SnapshotGalaxy& GetGalaxy(uint32_t index) const { return galaxies[index]; }
+
+    /** Elements of a block, null if the snapshot doesn't have it. */
+    template <typename T>
+    const T* GetBlock(SnapshotBlockId id) const
+    {
+        const SnapshotBlock* block = FindBlock(id);
+        return block && block->elementSize == sizeof(T) ? reinterpret_cast<const T*>(file.GetData() + block->offset) : nullptr;
+    }
+
+private:
+    const SnapshotBlock* FindBlock(SnapshotBlockId id) const;
+    bool Fail(const std::string& message);
+
+    MappedFile file;
+    SnapshotHeader header = {};
+    const SnapshotGalaxy* galaxies = nullptr;
+    const SnapshotBlock* blocks = nullptr;
+    std::string error;
+};
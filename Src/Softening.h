@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cmath>
+
+/*
+Softening of the gravity of point masses, so that close encounters have bounded forces. The
+policy is chosen at compile time, define GLX_SOFTENING_PLUMMER or GLX_SOFTENING_NONE to change
+it, the spline is the default. The kernels take the policy as a template parameter.
+
+A policy gives for the squared distance r2 and the softening length, the acceleration
+mass * Force * separation and the potential -mass * Potential. The softening length is the
+Plummer equivalent one of all policies, the spline of length 2.8 times it has the same
+potential depth.
+*/
+
+/** Newtonian gravity, for tests, coincident bodies have infinite forces. */
+struct NoSoftening
+{
+    static constexpr const char* cName = "none";
+
+    template <typename T>
+    static T Force(T r2, T /*softening*/)
+    {
+        return T(1) / (r2 * std::sqrt(r2));
+    }
+
+    template <typename T>
+    static T Potential(T r2, T /*softening*/)
+    {
+        return T(1) / std::sqrt(r2);
+    }
+};
+
+/** Plummer sphere of scale softening, the forces differ from the Newtonian ones at all radii. */
+struct PlummerSoftening
+{
+    static constexpr const char* cName = "plummer";
+
+    template <typename T>
+    static T Force(T r2, T softening)
+    {
+        const T inverse = T(1) / std::sqrt(r2 + softening * softening);
+        return inverse * inverse * inverse;
+    }
+
+    template <typename T>
+    static T Potential(T r2, T softening)
+    {
+        return T(1) / std::sqrt(r2 + softening * softening);
+    }
+};
+
+/**
+    Cubic spline of Monaghan and Lattanzio as in GADGET-2, the forces are exactly Newtonian
+    beyond the spline length.
+*/
+struct SplineSoftening
+{
+    static constexpr const char* cName = "spline";
+    // Spline length in softening lengths
+    static constexpr float cScale = 2.8f;
+
+    template <typename T>
+    static T Force(T r2, T softening)
+    {
+        const T h = T(cScale) * softening;
+        const T r = std::sqrt(r2);
+        if (r >= h)
+        {
+            return T(1) / (r2 * r);
+        }
+
+        const T u = r / h;
+        const T u2 = u * u;
+        const T invH3 = T(1) / (h * h * h);
+        if (u < T(0.5))
+        {
+            return invH3 * (T(10.666666666667) + u2 * (T(32) * u - T(38.4)));
+        }
+        return invH3 * (T(21.333333333333) - T(48) * u + T(38.4) * u2 - T(10.666666666667) * u2 * u - T(0.066666666667) / (u2 * u));
+    }
+
+    template <typename T>
+    static T Potential(T r2, T softening)
+    {
+        const T h = T(cScale) * softening;
+        const T r = std::sqrt(r2);
+        if (r >= h)
+        {
+            return T(1) / r;
+        }
+
+        const T u = r / h;
+        const T u2 = u * u;
+        if (u < T(0.5))
+        {
+            return (T(2.8) - u2 * (T(5.333333333333) + u2 * (T(6.4) * u - T(9.6)))) / h;
+        }
+        return (T(3.2) - T(0.066666666667) / u - u2 * (T(10.666666666667) + u * (T(-16) + u * (T(9.6) - T(2.133333333333) * u)))) / h;
+    }
+};
+
+#if defined(GLX_SOFTENING_NONE)
+using SofteningPolicy = NoSoftening;
+#elif defined(GLX_SOFTENING_PLUMMER)
+using SofteningPolicy = PlummerSoftening;
+#else
+using SofteningPolicy = SplineSoftening;
+#endif
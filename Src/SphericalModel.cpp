@@ -1,197 +1,381 @@
 #include "SphericalModel.h"
 
 #include <algorithm>
+#include <cctype>
 
-#include <gl\glut.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GLX_SSE2
+#include <emmintrin.h>
+#endif
 
-static constexpr uint32_t N = 1000;
+// Tables cover 64 scale radii, farther points use the analytic profile
+static constexpr double cTableRange = 64.0;
+static constexpr uint32_t cTableIntervals = 4096;
 
-SphericalModel::SphericalModel(float gridXMin, float gridXMax, float radius)
-	: rmin(gridXMin),
-	  rmax(gridXMax),
-	  radius(radius)
-{
-    rvec.resize(N);
-    rho.resize(N, 0.0f);
-    rightPartPoisson.resize(N);
-    potential.resize(N, 0.0f);
-    field.resize(N, 0.0f);
+// Points processed at once by the batched functions, their temporaries stay in L1
+static constexpr size_t cBatchSize = 256;
 
-    h = (rmax - rmin) / (N - 1);
-    for (size_t i = 0; i < rvec.size(); ++i)
-    {
-        rvec[i] = rmin + i * h;
-    }
+// Below it the profiles use series expansions instead of cancelling terms
+static constexpr double cSeriesLimit = 1e-4;
+
+static double PlummerAcceleration(double x)
+{
+    return x / std::pow(1.0 + x * x, 1.5);
+}
 
-    CalculatePotential();
-    CalculateGravityField();
+static double PlummerPotential(double x)
+{
+    return -1.0 / std::sqrt(1.0 + x * x);
 }
 
-void SphericalModel::CalculatePotential()
+static double HernquistAcceleration(double x)
 {
-    float rho0 = 10.0;
+    return 1.0 / ((1.0 + x) * (1.0 + x));
+}
 
-    // Plummer
-    float M = 10.0f;
+static double HernquistPotential(double x)
+{
+    return -1.0 / (1.0 + x);
+}
 
-    for (size_t i = 0; i < rvec.size(); ++i)
+static double NFWAcceleration(double x)
+{
+    if (x < cSeriesLimit)
     {
-        //rho[i] = PseudoIsothermal(r[i], rho0, radius);
-        rho[i] = PlummerDensity(rvec[i], M, radius);
-        potential[i] = PlummerPotential(rvec[i], M, radius);
-        rightPartPoisson[i] = 4.0f * PI * rho[i];
+        return 0.5 - 2.0 * x / 3.0;
     }
+    return (std::log(1.0 + x) - x / (1.0 + x)) / (x * x);
+}
 
+static double NFWPotential(double x)
+{
+    if (x < cSeriesLimit)
+    {
+        return -1.0 + 0.5 * x;
+    }
+    return -std::log(1.0 + x) / x;
+}
 
-	// Решаем уравнение Пуассона для нахождения потенциала
-    //Poisson1(100, rmin, rmax, N, potential.data(), rightPartPoisson);
+// Pseudo-isothermal sphere, rho = rho0 / (1 + x^2)
+static double IsothermalAcceleration(double x)
+{
+    if (x < cSeriesLimit)
+    {
+        return x / 3.0;
+    }
+    return (x - std::atan(x)) / (x * x);
+}
 
-	// Isothermal
-	/*float M = 100.0f;
-	float r0 = 20.0;
-	float rho0 = M / (4.0f * PI * r0 * r0 * r0 * radius);
-	vc = sqrtf(4.0f * PI * r0 * r0 * r0 * rho0);
+static double IsothermalPotential(double x)
+{
+    if (x < cSeriesLimit)
+    {
+        return x * x / 6.0;
+    }
+    return std::atan(x) / x + 0.5 * std::log(1.0 + x * x) - 1.0;
+}
 
-	for (int i = 0; i < N; i++)
-	{
-		float r = rmin + i * h;
-		potential[i] = 4.0f * PI * rho0 * r0 * r0 * r0 * log(r / r0);
-	}*/
+// Kuzmin disk, x is the distance from the point mass below or above the plane
+static double KuzminAcceleration(double x)
+{
+    x = (std::max)(x, 1.0);
+    return 1.0 / (x * x);
+}
 
-	//potential[0] = 4 * potential[1];
+static double KuzminPotential(double x)
+{
+    return -1.0 / (std::max)(x, 1.0);
+}
 
-	// Uniform
-	/*float M = 100.0f;
-	float a = m_radius;
-	float rho0 = 3.0f * M / (4.0f * PI * powf(a, 3.0f));
-	coeff = sqrtf(4.0f * PI * rho0 / 3.0f);
+static const HaloProfile cHaloProfiles[] =
+{
+    { "Plummer", PlummerAcceleration, PlummerPotential, false },
+    { "Hernquist", HernquistAcceleration, HernquistPotential, false },
+    { "NFW", NFWAcceleration, NFWPotential, false },
+    { "Isothermal", IsothermalAcceleration, IsothermalPotential, false },
+    { "Kuzmin", KuzminAcceleration, KuzminPotential, true },
+};
 
-	for (int i = 0; i < m_N; i++)
-	{
-		float r = m_gridXMin + i * m_h;
+static_assert(sizeof(cHaloProfiles) / sizeof(cHaloProfiles[0]) == static_cast<size_t>(HaloModelType::Count), "Every halo model needs a profile");
 
-		if (r < a)
-		{
-			m_potential[i] = -2.0f * PI * rho0 * (a * a - r * r / 3.0f);
-		}
-		else
-		{
-			m_potential[i] = -M / r;
-		}
+struct HaloTables
+{
+    CubicTable acceleration;
+    CubicTable potential;
+};
 
-		
-	}*/
+static const HaloTables& GetHaloTables(HaloModelType type)
+{
+    // Built on first use, thread-safe as a function local static
+    static const std::vector<HaloTables> tables = []()
+    {
+        std::vector<HaloTables> result(static_cast<size_t>(HaloModelType::Count));
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            result[i].acceleration.Build(cHaloProfiles[i].acceleration, cTableRange, cTableIntervals);
+            result[i].potential.Build(cHaloProfiles[i].potential, cTableRange, cTableIntervals);
+        }
+        return result;
+    }();
+
+    return tables[static_cast<size_t>(type)];
 }
 
-void SphericalModel::CalculateGravityField()
+const HaloProfile& GetHaloProfile(HaloModelType type)
 {
-	for (int i = 1; i < N - 1; i++)
-	{
-		field[i] = (potential[i + 1] - potential[i - 1]) / (2.0f * h);
-	}
+    assert(type < HaloModelType::Count);
+    return cHaloProfiles[static_cast<size_t>(type)];
+}
 
-	field[0    ] = (potential[1    ] - potential[0    ]) / h;
-	field[N - 1] = (potential[N - 1] - potential[N - 2]) / h;
+bool FindHaloModel(const std::string& name, HaloModelType& type)
+{
+    for (size_t i = 0; i < static_cast<size_t>(HaloModelType::Count); ++i)
+    {
+        const std::string candidate = cHaloProfiles[i].name;
+        const bool equal = std::equal(name.begin(), name.end(), candidate.begin(), candidate.end(), [](char a, char b)
+        {
+            return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+        });
+
+        if (equal)
+        {
+            type = static_cast<HaloModelType>(i);
+            return true;
+        }
+    }
+    return false;
 }
 
-float SphericalModel::GetForce(float r) const
+void CubicTable::Build(double (*function)(double), double xmax, uint32_t intervals)
 {
-    float force = 0.0f;
+    assert(intervals > 0 && xmax > 0.0);
+
+    const double step = xmax / intervals;
+    // Derivatives are one-sided from inside the interval, so a kink at a knot stays exact
+    const double delta = 1e-3 * step;
 
-	int index = (int)((r - rmin) / h);
+    this->xmax = static_cast<float>(xmax);
+    inverseStep = static_cast<float>(1.0 / step);
+    coefficients.resize(intervals);
 
-	if (index >= 0 && index < N - 1)
-	{
-		float g1 = field[index    ];
-		float g2 = field[index + 1];
-		float alpha = (r - rvec[index]) / h;
-        force = lerp(g1, g2, alpha);
-	}
-	
-	return force;
+    for (uint32_t i = 0; i < intervals; ++i)
+    {
+        const double x0 = i * step;
+        const double x1 = x0 + step;
+
+        const double y0 = function(x0);
+        const double y1 = function(x1);
+        const double d0 = (-3.0 * y0 + 4.0 * function(x0 + delta) - function(x0 + 2.0 * delta)) / (2.0 * delta);
+        const double d1 = (3.0 * y1 - 4.0 * function(x1 - delta) + function(x1 - 2.0 * delta)) / (2.0 * delta);
+
+        // Hermite basis in t = (x - x0) / step, the slopes scale with the step
+        const double m0 = d0 * step;
+        const double m1 = d1 * step;
+
+        Coefficients& c = coefficients[i];
+        c.c0 = static_cast<float>(y0);
+        c.c1 = static_cast<float>(m0);
+        c.c2 = static_cast<float>(3.0 * (y1 - y0) - 2.0 * m0 - m1);
+        c.c3 = static_cast<float>(2.0 * (y0 - y1) + m0 + m1);
+    }
 }
 
-float SphericalModel::GetCircularVelocity(float r) const
+void CubicTable::Evaluate(const float* x, float* result, size_t count) const
 {
-	//float r2 = r * r;
-	//return sqrtf(100.0f * (r2 - 1.0f) / sqrtf(r2 * r2 * r2));
+    size_t i = 0;
 
-	//return coeff * r;
+#ifdef GLX_SSE2
+    const __m128 scale = _mm_set1_ps(inverseStep);
+    const __m128 zero = _mm_setzero_ps();
+    // Clamped just below the end, so the last interval is used for xmax
+    const __m128 last = _mm_set1_ps(std::nextafter(static_cast<float>(coefficients.size()), 0.0f));
 
-	return vc;
-}
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 position = _mm_mul_ps(_mm_loadu_ps(x + i), scale);
+        position = _mm_min_ps(_mm_max_ps(position, zero), last);
 
-static float DensityDistribution(float r)
-{
-	//if (r > 30.0f) return 0.0f;
+        const __m128i index = _mm_cvttps_epi32(position);
+        const __m128 t = _mm_sub_ps(position, _mm_cvtepi32_ps(index));
 
-	//return 100.0f * exp(-r * 1e-3f);
+        alignas(16) int32_t indices[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(indices), index);
 
+        // Four coefficient rows, transposed into one register per power of t
+        __m128 c0 = _mm_loadu_ps(&coefficients[indices[0]].c0);
+        __m128 c1 = _mm_loadu_ps(&coefficients[indices[1]].c0);
+        __m128 c2 = _mm_loadu_ps(&coefficients[indices[2]].c0);
+        __m128 c3 = _mm_loadu_ps(&coefficients[indices[3]].c0);
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
 
-	//float rho = 3.0f * 1e+12/(4.0f * PI * 100000.0f * 100000.0f * 100000.0f);
-	//return 0.00024f;// * exp(-r * 0.000005);	
+        __m128 value = _mm_add_ps(_mm_mul_ps(c3, t), c2);
+        value = _mm_add_ps(_mm_mul_ps(value, t), c1);
+        value = _mm_add_ps(_mm_mul_ps(value, t), c0);
 
-	return 10000.0f;
-	return 3.0f * 100.0f / (4.0f * PI * 30.0f * 30.0f * 30.0f);
-	float a = 16.0f;
-	return 3.0f * 1000.0f/(4.0f * PI * a * a * a) / sqrtf( pow(1.0f + pow(r / a, 2), 5) );
+        _mm_storeu_ps(result + i, value);
+    }
+#endif
 
+    for (; i < count; ++i)
+    {
+        result[i] = Evaluate((std::min)((std::max)(x[i], 0.0f), xmax));
+    }
 }
 
-static float RightPartPoisson(float r)
+Halo::Halo(HaloModelType type, float mass, float radius)
+    : type(type)
+    , mass(mass)
+    , radius(radius)
+    , inverseRadius(1.0f / radius)
+    , accelerationScale(mass / (radius * radius))
+    , potentialScale(mass / radius)
+    , profile(&GetHaloProfile(type))
 {
-	return 4.0f * PI * DensityDistribution(r);
+    const HaloTables& tables = GetHaloTables(type);
+    accelerationTable = &tables.acceleration;
+    potentialTable = &tables.potential;
 }
 
-static void Plot(const std::vector<float> x, const std::vector<float> y, float xscale, float yscale)
+float3 Halo::GetAcceleration(const float3& relative) const
 {
-    assert(x.size() == y.size());
-
-    float minValue = std::numeric_limits<float>::max();
-    float maxValue = std::numeric_limits<float>::min();
-
-    for (const auto& value : y)
+    float3 point = GetProfilePoint(relative);
+    const float r = point.norm();
+    if (r <= 0.0f)
     {
-        minValue = std::min(value, minValue);
-        maxValue = std::max(value, maxValue);
+        return {};
     }
+    return point * (-GetAcceleration(r) / r);
+}
+
+float Halo::GetAcceleration(float r) const
+{
+    const float x = r * inverseRadius;
+    const float value = x <= accelerationTable->GetMax() ? accelerationTable->Evaluate(x) : static_cast<float>(profile->acceleration(x));
+    return accelerationScale * value;
+}
 
-    glDisable(GL_BLEND);
-    glDisable(GL_TEXTURE_2D);
-    glBegin(GL_LINE_STRIP);
-    glColor3f(1.0f, 1.0f, 1.0f);
-    for (size_t i = 0; i < x.size(); ++i)
+void Halo::GetAccelerations(const float* r, float* result, size_t count) const
+{
+    const float xmax = accelerationTable->GetMax();
+
+    // In chunks, so that r may be overwritten by the results
+    float x[cBatchSize];
+    for (size_t first = 0; first < count; first += cBatchSize)
     {
-        float color = (y[i] - minValue) / (maxValue - minValue);
-        color = 0.2f * (1.0f - color) + color;
-        glColor3f(color, color, color);
-        glVertex3f(x[i] * xscale, y[i] * yscale, 0.0f);
+        const size_t n = (std::min)(count - first, cBatchSize);
+        for (size_t i = 0; i < n; ++i)
+        {
+            x[i] = r[first + i] * inverseRadius;
+        }
+
+        accelerationTable->Evaluate(x, result + first, n);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            const float value = x[i] <= xmax ? result[first + i] : static_cast<float>(profile->acceleration(x[i]));
+            result[first + i] = accelerationScale * value;
+        }
     }
-
-    glEnd();
 }
 
-void SphericalModel::PlotPotential() const
+void Halo::AddAccelerations(const float* x, const float* y, const float* z, float* ax, float* ay, float* az, size_t count) const
 {
-    //Plot(r, rho, 1.0f, 1000.0f);
-    Plot(rvec, field, 1.0f, 10.0f);
-    Plot(rvec, potential, 1.0f, 10.0f);
+    const float xmax = accelerationTable->GetMax();
 
-	/*float x = rmin;
+    alignas(16) float pz[cBatchSize];
+    alignas(16) float r[cBatchSize];
+    alignas(16) float g[cBatchSize];
 
-	glDisable(GL_BLEND);
-	glDisable(GL_TEXTURE_2D);
+    for (size_t first = 0; first < count; first += cBatchSize)
+    {
+        const size_t n = (std::min)(count - first, cBatchSize);
+        const float* inX = x + first;
+        const float* inY = y + first;
+        const float* inZ = z + first;
+
+        // Distances in profile coordinates, the table argument goes to g
+        size_t i = 0;
+#ifdef GLX_SSE2
+        const __m128 offset = _mm_set1_ps(profile->disk ? radius : 0.0f);
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        const __m128 scale = _mm_set1_ps(inverseRadius);
+        for (; i + 4 <= n; i += 4)
+        {
+            const __m128 vx = _mm_loadu_ps(inX + i);
+            const __m128 vy = _mm_loadu_ps(inY + i);
+            __m128 vz = _mm_loadu_ps(inZ + i);
+            vz = _mm_add_ps(vz, _mm_or_ps(offset, _mm_and_ps(vz, signMask)));
+
+            const __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+            _mm_store_ps(pz + i, vz);
+            _mm_store_ps(r + i, distance);
+            _mm_store_ps(g + i, _mm_mul_ps(distance, scale));
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            const float3 point = GetProfilePoint(float3(inX[i], inY[i], inZ[i]));
+            pz[i] = point.m_z;
+            r[i] = std::sqrt(inX[i] * inX[i] + inY[i] * inY[i] + pz[i] * pz[i]);
+            g[i] = r[i] * inverseRadius;
+        }
+
+        accelerationTable->Evaluate(g, g, n);
+
+        // Points beyond the table, rare for a galaxy in its own halo
+        for (i = 0; i < n; ++i)
+        {
+            const float argument = r[i] * inverseRadius;
+            if (argument > xmax)
+            {
+                g[i] = static_cast<float>(profile->acceleration(argument));
+            }
+        }
+
+        // Towards the center by g, the center itself gets nothing
+        float* outX = ax + first;
+        float* outY = ay + first;
+        float* outZ = az + first;
+        i = 0;
+#ifdef GLX_SSE2
+        const __m128 factorScale = _mm_set1_ps(-accelerationScale);
+        const __m128 zero = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4)
+        {
+            const __m128 distance = _mm_load_ps(r + i);
+            __m128 factor = _mm_div_ps(_mm_mul_ps(_mm_load_ps(g + i), factorScale), distance);
+            factor = _mm_and_ps(factor, _mm_cmpgt_ps(distance, zero));
+
+            _mm_storeu_ps(outX + i, _mm_add_ps(_mm_loadu_ps(outX + i), _mm_mul_ps(_mm_loadu_ps(inX + i), factor)));
+            _mm_storeu_ps(outY + i, _mm_add_ps(_mm_loadu_ps(outY + i), _mm_mul_ps(_mm_loadu_ps(inY + i), factor)));
+            _mm_storeu_ps(outZ + i, _mm_add_ps(_mm_loadu_ps(outZ + i), _mm_mul_ps(_mm_load_ps(pz + i), factor)));
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            const float factor = r[i] > 0.0f ? -accelerationScale * g[i] / r[i] : 0.0f;
+            outX[i] += inX[i] * factor;
+            outY[i] += inY[i] * factor;
+            outZ[i] += pz[i] * factor;
+        }
+    }
+}
 
-	glBegin(GL_LINE_STRIP);
+float Halo::GetPotential(float r) const
+{
+    const float x = r * inverseRadius;
+    const float value = x <= potentialTable->GetMax() ? potentialTable->Evaluate(x) : static_cast<float>(profile->potential(x));
+    return potentialScale * value;
+}
 
-	float scale = 10.0f / potentialMin;
-	for (int i = 0; i < N; i++)
-	{
-		float p = potential[i];
-		float ps = scale * p;
-		float dpi = 1.0f / (potentialMax - potentialMin);
-		glColor3f((0.5f*p - potentialMin) * dpi, 1.0f - (p - potentialMin) * dpi, 0.0f);
-		glVertex3f(x + i * h, -ps, 0.0f);
-	}
-	glEnd();*/
+float Halo::GetCircularVelocity(float r) const
+{
+    // In the plane a Kuzmin disk pulls from the distance sqrt(r^2 + a^2) at an angle
+    const float distance = profile->disk ? std::sqrt(r * r + radius * radius) : r;
+    if (distance <= 0.0f)
+    {
+        return 0.0f;
+    }
+    const float radial = GetAcceleration(distance) * r / distance;
+    return std::sqrt(radial * r);
 }
@@ -3,6 +3,8 @@
 #include "float3.h"
 #include "Math.h"
 
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <cassert>
 
@@ -12,7 +14,7 @@ public:
     SphericalDistribution(float mass = 1.0f, float radius = 1.0f) : mass(mass), radius(radius) { }
     virtual ~SphericalDistribution() = default;
     virtual float GetDensity(float r) const = 0;
-    virtual float GetPotential(float r) const { assert(!"Not implemented"); return 0.0f; }
+    virtual float GetPotential(float /*r*/) const { assert(!"Not implemented"); return 0.0f; }
 
     float GetMass() const { return mass; }
     float GetRadius() const { return radius; }
@@ -30,34 +32,125 @@ public:
     float GetPotential(float r) const override { return PlummerPotential(r, mass, radius); }
 };
 
-// Dark matter halo spherical model
-class SphericalModel
+/** Registered halo density profiles, see GetHaloProfile. */
+enum class HaloModelType : uint32_t
 {
-public:
-	float	  rmin;
-	float	  rmax;
-	float	  h;
+    Plummer,
+    Hernquist,
+    NFW,
+    Isothermal,
+    Kuzmin,
+    Count
+};
+
+/**
+    Halo profile with unit mass and unit scale radius (G = 1). The mass is the total mass for
+    Plummer, Hernquist and Kuzmin and the mass scale 4 pi rho0 a^3 for NFW and the pseudo-
+    isothermal sphere, whose total masses diverge. The isothermal potential is zero at the
+    center, the others at infinity.
+*/
+struct HaloProfile
+{
+    const char* name;
+    // Magnitude of the acceleration towards the center and the potential at radius x
+    double (*acceleration)(double x);
+    double (*potential)(double x);
+    // Kuzmin disk in the galaxy plane: a point mass seen from |z| + a, so only x >= 1 occur
+    bool disk;
+};
 
-	float     radius;
+const HaloProfile& GetHaloProfile(HaloModelType type);
+/** Finds a profile by its name, ignoring case. */
+bool FindHaloModel(const std::string& name, HaloModelType& type);
 
-    std::vector<float> rvec;
-    std::vector<float> rho;
-    std::vector<float> rightPartPoisson;
-	std::vector<float> potential;
-    std::vector<float> field;
+/** Function of x in [0, xmax] tabulated at uniform knots with cubic Hermite interpolation. */
+class CubicTable
+{
+public:
+    void Build(double (*function)(double), double xmax, uint32_t intervals);
 
-	float	  vc;
+    float GetMax() const { return xmax; }
 
-	SphericalModel(float gridXMin, float gridXMax, float radius);
+    /** x must be in [0, GetMax()]. */
+    float Evaluate(float x) const
+    {
+        const float position = x * inverseStep;
+        const size_t i = (std::min)(static_cast<size_t>(position), coefficients.size() - 1);
+        const float t = position - i;
+        const Coefficients& c = coefficients[i];
+        return ((c.c3 * t + c.c2) * t + c.c1) * t + c.c0;
+    }
 
-	// Расчет гравитационного потенциала
-	void CalculatePotential();
-	// Расчет напряженности
-	void CalculateGravityField();
+    /** Evaluates count values at once, four at a time with SSE. Values of x above GetMax() are clamped. */
+    void Evaluate(const float* x, float* result, size_t count) const;
 
-	float GetForce(float r) const;
-	float GetCircularVelocity(float r) const;
+private:
+    // Polynomial of an interval in its local coordinate t in [0, 1]
+    struct Coefficients
+    {
+        float c0, c1, c2, c3;
+    };
 
-	void PlotPotential() const;
+    float xmax = 0.0f;
+    float inverseStep = 0.0f;
+    std::vector<Coefficients> coefficients;
 };
 
+/**
+    Dark matter halo of a galaxy: a registered profile scaled by mass and radius. The tables of
+    the unit profiles are built once and shared by all halos.
+*/
+class Halo
+{
+public:
+    Halo(HaloModelType type, float mass, float radius);
+
+    HaloModelType GetType() const { return type; }
+    float GetMass() const { return mass; }
+    float GetRadius() const { return radius; }
+
+    /**
+        Point relative to the center in the coordinates in which the profile is spherical,
+        the acceleration at relative is towards this point at the distance of its norm.
+    */
+    float3 GetProfilePoint(const float3& relative) const
+    {
+        float3 point = relative;
+        if (profile->disk)
+        {
+            point.m_z += std::copysign(radius, point.m_z);
+        }
+        return point;
+    }
+
+    /** Acceleration at a point relative to the center. */
+    float3 GetAcceleration(const float3& relative) const;
+
+    /** Magnitude of the acceleration at a distance from the center in profile coordinates. */
+    float GetAcceleration(float r) const;
+    /** The same for count distances at once, r and result may be the same array. */
+    void GetAccelerations(const float* r, float* result, size_t count) const;
+
+    /**
+        Adds the accelerations at count points relative to the center, given as coordinate
+        arrays, to the acceleration arrays. Vectorized from the distances to the accumulation.
+    */
+    void AddAccelerations(const float* x, const float* y, const float* z, float* ax, float* ay, float* az, size_t count) const;
+
+    float GetPotential(float r) const;
+    /** Velocity of a circular orbit in the galaxy plane at distance r from the center. */
+    float GetCircularVelocity(float r) const;
+
+private:
+    HaloModelType type;
+    float mass;
+    float radius;
+
+    float inverseRadius;
+    float accelerationScale;
+    float potentialScale;
+
+    const HaloProfile* profile;
+    const CubicTable* accelerationTable;
+    const CubicTable* potentialTable;
+};
@@ -0,0 +1,214 @@
+#include "TaskGraph.h"
+#include "Profiler.h"
+
+#include <cassert>
+
+// Step of the task the thread runs
+static thread_local std::uint64_t taskStep = 0;
+
+// Runs a task function as part of a step
+static void RunTask(const TaskGraph::Function& function, const char* zone, std::uint64_t step)
+{
+    ProfileZone profileZone(zone);
+    taskStep = step;
+    function();
+    taskStep = 0;
+}
+
+TaskGraph::TaskGraph()
+{
+    worker = std::thread([this]() 
+    { 
+        Profiler::SetThreadName("Task graph");
+        Worker(); 
+    });
+}
+
+TaskGraph::~TaskGraph()
+{
+    Wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminate = true;
+    }
+    signal.notify_all();
+    worker.join();
+}
+
+TaskGraph::TaskId TaskGraph::AddTask(const char* name, const Function& function, Affinity affinity)
+{
+    assert(function);
+    assert(!outstanding[0] && !outstanding[1]);
+
+    Task task;
+    task.name = name ? name : "";
+    task.zone = Profiler::Intern(task.name);
+    task.function = function;
+    task.affinity = affinity;
+    task.completedStep = currentStep;
+    tasks.push_back(std::move(task));
+
+    return static_cast<TaskId>(tasks.size() - 1);
+}
+
+void TaskGraph::AddDependency(TaskId task, TaskId dependency)
+{
+    assert(task < tasks.size() && dependency < tasks.size());
+    assert(task != dependency);
+    assert(!outstanding[0] && !outstanding[1]);
+
+    tasks[dependency].dependents.push_back(task);
+    ++tasks[task].dependencyCount;
+}
+
+void TaskGraph::Execute()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    const std::uint64_t step = ++currentStep;
+    const size_t parity = step & 1;
+
+    // The counters of this parity still belong to the step before last
+    wake.wait(lock, [&]() { return outstanding[parity] == 0; });
+
+    foregroundLeft = 0;
+    outstanding[parity] = static_cast<std::uint32_t>(tasks.size());
+    if (tasks.empty())
+    {
+        finishedStep[parity] = step;
+    }
+
+    for (auto& task : tasks)
+    {
+        task.remaining[parity] = task.dependencyCount;
+        if (task.affinity == Affinity::Foreground)
+        {
+            ++foregroundLeft;
+        }
+    }
+
+    for (TaskId id = 0; id < tasks.size(); ++id)
+    {
+        if (tasks[id].dependencyCount == 0)
+        {
+            TryStart(id, step);
+        }
+    }
+
+    while (foregroundLeft > 0)
+    {
+        if (foregroundQueue.empty())
+        {
+            wake.wait(lock);
+            continue;
+        }
+
+        Job job = foregroundQueue.front();
+        foregroundQueue.pop_front();
+
+        lock.unlock();
+        RunTask(tasks[job.first].function, tasks[job.first].zone, job.second);
+        lock.lock();
+
+        --foregroundLeft;
+        Complete(job.first, job.second);
+    }
+}
+
+void TaskGraph::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [&]() { return outstanding[0] == 0 && outstanding[1] == 0; });
+}
+
+void TaskGraph::WaitStep(std::uint64_t step)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    assert(step <= currentStep);
+    wake.wait(lock, [&]() { return finishedStep[step & 1] >= step; });
+}
+
+std::uint64_t TaskGraph::GetTaskStep()
+{
+    return taskStep;
+}
+
+void TaskGraph::TryStart(TaskId id, std::uint64_t step)
+{
+    Task& task = tasks[id];
+    if (task.completedStep + 1 < step)
+    {
+        // Previous run is still in flight, start when it completes
+        task.deferredStep = step;
+        return;
+    }
+    Enqueue(id, step);
+}
+
+void TaskGraph::Enqueue(TaskId id, std::uint64_t step)
+{
+    if (tasks[id].affinity == Affinity::Foreground)
+    {
+        foregroundQueue.emplace_back(id, step);
+        wake.notify_all();
+    }
+    else
+    {
+        backgroundQueue.emplace_back(id, step);
+        signal.notify_one();
+    }
+}
+
+void TaskGraph::Complete(TaskId id, std::uint64_t step)
+{
+    Task& task = tasks[id];
+    const size_t parity = step & 1;
+
+    task.completedStep = step;
+
+    for (TaskId dependent : task.dependents)
+    {
+        assert(tasks[dependent].remaining[parity] > 0);
+        if (--tasks[dependent].remaining[parity] == 0)
+        {
+            TryStart(dependent, step);
+        }
+    }
+
+    if (task.deferredStep == step + 1)
+    {
+        task.deferredStep = 0;
+        Enqueue(id, step + 1);
+    }
+
+    assert(outstanding[parity] > 0);
+    if (--outstanding[parity] == 0)
+    {
+        finishedStep[parity] = step;
+    }
+
+    wake.notify_all();
+}
+
+void TaskGraph::Worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        signal.wait(lock, [&]() { return terminate || !backgroundQueue.empty(); });
+
+        if (backgroundQueue.empty())
+        {
+            break;  // terminating and nothing left to run
+        }
+
+        Job job = backgroundQueue.front();
+        backgroundQueue.pop_front();
+
+        lock.unlock();
+        RunTask(tasks[job.first].function, tasks[job.first].zone, job.second);
+        lock.lock();
+
+        Complete(job.first, job.second);
+    }
+}
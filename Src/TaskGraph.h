@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+    Dependency graph of the tasks making up one simulation step.
+
+    Foreground tasks run on the thread calling Execute() and may go wide through ThreadPool.
+    Background tasks run on the graph's own worker thread and must not use ThreadPool, which
+    serves a single dispatch at a time. Execute() returns once all foreground tasks of the step
+    have completed, so background work overlaps the next step; a task never starts again before
+    its previous run has finished.
+
+    A background task may still run while the next step changes the state it was scheduled
+    for, so it reads copies a foreground task has staged. Stages are double buffered by the
+    parity of GetTaskStep(): Execute() starts a step only when the step before last has
+    completed, the last reader of the buffer it refills.
+*/
+class TaskGraph
+{
+public:
+    using TaskId = std::uint32_t;
+    using Function = std::function<void()>;
+
+    enum class Affinity
+    {
+        Foreground,
+        Background
+    };
+
+    TaskGraph();
+    ~TaskGraph();
+
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    /** Adds a task. The graph must be idle. */
+    TaskId AddTask(const char* name, const Function& function, Affinity affinity = Affinity::Foreground);
+    /** Makes task wait for dependency within a step. The graph must be idle. */
+    void AddDependency(TaskId task, TaskId dependency);
+
+    /** Runs one step of the graph. Returns when all foreground tasks have completed. */
+    void Execute();
+    /** Waits until background tasks of all previous steps have completed. */
+    void Wait();
+    /** Waits until all tasks of the step have completed, and with them those of the earlier steps. */
+    void WaitStep(std::uint64_t step);
+
+    /** Step of the task running on the calling thread, 0 outside tasks. Steps count from 1. */
+    static std::uint64_t GetTaskStep();
+
+    const std::string& GetTaskName(TaskId task) const { return tasks[task].name; }
+    size_t GetTaskCount() const { return tasks.size(); }
+
+private:
+    struct Task
+    {
+        std::string name;
+        // Name of the profiler zone of the task
+        const char* zone = nullptr;
+        Function function;
+        Affinity affinity = Affinity::Foreground;
+        std::vector<TaskId> dependents;
+        std::uint32_t dependencyCount = 0;
+        // Unfinished dependencies, double buffered by step parity.
+        std::uint32_t remaining[2] = {};
+        // Last step this task has finished.
+        std::uint64_t completedStep = 0;
+        // Step that became ready while the previous run was still in flight.
+        std::uint64_t deferredStep = 0;
+    };
+
+    using Job = std::pair<TaskId, std::uint64_t>;
+
+    void TryStart(TaskId task, std::uint64_t step);
+    void Enqueue(TaskId task, std::uint64_t step);
+    void Complete(TaskId task, std::uint64_t step);
+    void Worker();
+
+    std::vector<Task> tasks;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable signal;
+
+    std::deque<Job> foregroundQueue;
+    std::deque<Job> backgroundQueue;
+
+    std::uint64_t currentStep = 0;
+    std::uint32_t foregroundLeft = 0;
+    // Tasks not yet finished, by step parity.
+    std::uint32_t outstanding[2] = {};
+    // Last step whose tasks have all finished, by step parity.
+    std::uint64_t finishedStep[2] = {};
+
+    bool terminate = false;
+    std::thread worker;
+};
@@ -1,6 +1,8 @@
 #include "Threading.h"
+#include "Profiler.h"
 
 #include <cassert>
+#include <string>
 
 bool                                    ThreadPool::terminate_;
 std::mutex                              ThreadPool::mutex_;
@@ -13,6 +15,7 @@ std::atomic<std::uint32_t>              ThreadPool::block_index_;
 std::vector<std::thread>                ThreadPool::threads_;
 std::uint32_t                           ThreadPool::thread_count_;
 ThreadPool::Kernel                      ThreadPool::kernel_;
+const char*                             ThreadPool::zone_;
 
 /**
     Constructor.
@@ -75,7 +78,10 @@ bool ThreadPool::Create(std::uint32_t thread_count)
 */
 void ThreadPool::Destroy()
 {
-    terminate_ = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        terminate_ = true;
+    }
 
     // Wait for all threads to have completed
     if (threads_.size() > 0)
@@ -98,6 +104,9 @@ void ThreadPool::Destroy()
 */
 void ThreadPool::Worker()
 {
+    static std::atomic<std::uint32_t> worker_index(0);
+    Profiler::SetThreadName("Worker " + std::to_string(worker_index++));
+
     while (true)
     {
         // Put the thread to sleep until some blocks need processing
@@ -133,6 +142,7 @@ void ThreadPool::Worker()
         // Process all the available blocks
         {
             assert(kernel_);
+            ProfileZone zone(zone_ ? zone_ : "Dispatch");
 
             while (true)
             {
@@ -144,9 +154,9 @@ void ThreadPool::Worker()
                 }
 
                 auto const begin = block_index * block_size_;
-                auto const end = std::min((block_index + 1) * block_size_, count_ - 1);
+                auto const end = std::min((block_index + 1) * block_size_, count_);
 
-                for (auto index = begin; index <= end; ++index)
+                for (auto index = begin; index < end; ++index)
                 {
                     kernel_(index); // run the kernel
                 }
@@ -172,26 +182,25 @@ void ThreadPool::Dispatch(const Kernel& kernel, std::uint32_t count, std::uint32
     }
     else
     {
-        // Install the kernel
+        // Worker zones are told apart from the phase itself in the statistics
+        const char* zone = Profiler::GetCurrentZone();
+        const char* worker_zone = zone ? Profiler::Intern(std::string(zone) + " worker") : nullptr;
+
+        // Install the kernel under the lock, the workers take it again when they wake up
+        std::unique_lock<std::mutex> lock(mutex_);
         block_index_ = 0u;
         kernel_ = kernel;
+        zone_ = worker_zone;
 
         // And dispatch
         thread_count_ = 0;  // consume all threads from the pool
         signal_.notify_all();
 
         // Wait until all threads have returned to the pool
-        while (true)
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            if (thread_count_ == threads_.size())
-            {
-                break;  // all threads have completed
-            }
-            sync_.wait(lock);
-        }
+        sync_.wait(lock, []() { return thread_count_ == threads_.size(); });
 
         // Release kernel
         kernel_ = nullptr;
+        zone_ = nullptr;
     }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <atomic>
 #include <algorithm>
+#include <condition_variable>
 #include <cstdint>
 #include <memory>
 #include <mutex>
@@ -55,4 +56,6 @@ private:
     static std::uint32_t thread_count_;
     // Current kernel
     static Kernel kernel_;
+    // Profiler zone of the dispatching thread, the workers show it on their tracks
+    static const char* zone_;
 };
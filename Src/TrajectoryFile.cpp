@@ -0,0 +1,467 @@
+#include "TrajectoryFile.h"
+#include "Compression.h"
+#include "Constants.h"
+#include "Galaxy.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+// Grid coordinates are clamped to this range when particles leave the keyframe bounds
+static constexpr float cMaxCoordinate = 536870912.0f;
+
+static inline uint32_t ZigZag(int32_t value)
+{
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static inline int32_t UnZigZag(uint32_t value)
+{
+    return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+static inline uint32_t GetByteWidth(uint32_t value)
+{
+    return value == 0 ? 0 : value < 0x100 ? 1 : value < 0x10000 ? 2 : value < 0x1000000 ? 3 : 4;
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    if (IsOpen())
+    {
+        Close();
+    }
+}
+
+bool TrajectoryWriter::Open(const std::string& filename, uint64_t particleCount, const Options& options)
+{
+    assert(options.positionBits > 0 && options.positionBits <= 24);
+    assert(options.particlesPerBlock > 0 && options.keyframeInterval > 0);
+
+    if (IsOpen())
+    {
+        Close();
+    }
+
+    file.open(filename, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+        return false;
+    }
+
+    header = {};
+    header.magic = cTrajectoryMagic;
+    header.version = cTrajectoryVersion;
+    header.headerSize = sizeof(TrajectoryHeader);
+    header.positionBits = options.positionBits;
+    header.particleCount = particleCount;
+    header.particlesPerBlock = options.particlesPerBlock;
+    header.keyframeInterval = options.keyframeInterval;
+    header.lengthUnit = cKiloParsec;
+    header.timeUnit = std::sqrt(cKiloParsec * cKiloParsec * cKiloParsec / (cMassUnit * cG));
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    offset = sizeof(header);
+
+    index.clear();
+    blocks.resize(static_cast<size_t>((particleCount + options.particlesPerBlock - 1) / options.particlesPerBlock));
+    coordinates.assign(static_cast<size_t>(particleCount * 3), 0);
+
+    return static_cast<bool>(file);
+}
+
+bool TrajectoryWriter::Close()
+{
+    assert(IsOpen());
+
+    TrajectoryFooter footer = {};
+    footer.indexOffset = offset;
+    footer.frameCount = index.size();
+    footer.magic = cTrajectoryIndexMagic;
+
+    if (!index.empty())
+    {
+        file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TrajectoryIndexEntry));
+    }
+    file.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+    file.close();
+
+    const bool ok = static_cast<bool>(file);
+    file.clear();
+
+    blocks.clear();
+    coordinates.clear();
+
+    return ok;
+}
+
+bool TrajectoryWriter::WriteFrame(const Universe& universe, uint64_t step, double time)
+{
+    assert(universe.GetParticlesCount() == header.particleCount);
+
+    gathered.resize(static_cast<size_t>(header.particleCount));
+
+    size_t first = 0;
+    for (const auto& galaxy : universe.GetGalaxies())
+    {
+        const auto& particles = galaxy.GetParticles();
+        float3* positions = gathered.data() + first;
+
+        // Frames are in the order of the ids, which the reorders of the particles keep
+        ThreadPool().Dispatch([&](uint32_t i)
+        {
+            assert(particles[i].id < particles.size());
+            positions[particles[i].id] = particles[i].position;
+        }, static_cast<uint32_t>(particles.size()), static_cast<uint32_t>(particles.size() / ThreadPool::GetThreadCount()));
+
+        first += particles.size();
+    }
+
+    return WriteFrame(gathered.data(), step, time);
+}
+
+bool TrajectoryWriter::WriteFrame(const float3* positions, uint64_t step, double time)
+{
+    assert(IsOpen());
+
+    const bool keyframe = index.size() % header.keyframeInterval == 0;
+
+    ThreadPool().Dispatch([&](uint32_t i)
+    {
+        EncodeBlock(positions, i, keyframe);
+    }, static_cast<uint32_t>(blocks.size()), 1);
+
+    TrajectoryFrameHeader frame = {};
+    frame.magic = cTrajectoryFrameMagic;
+    frame.blockCount = static_cast<uint32_t>(blocks.size());
+    frame.step = step;
+    frame.time = time;
+    frame.keyframe = keyframe ? 1 : 0;
+
+    uint64_t payloadOffset = sizeof(TrajectoryFrameHeader) + blocks.size() * sizeof(TrajectoryBlockEntry);
+    for (auto& block : blocks)
+    {
+        block.entry.offset = payloadOffset;
+        payloadOffset += block.entry.compressedSize;
+    }
+    frame.size = payloadOffset;
+
+    file.write(reinterpret_cast<const char*>(&frame), sizeof(frame));
+    for (const auto& block : blocks)
+    {
+        file.write(reinterpret_cast<const char*>(&block.entry), sizeof(block.entry));
+    }
+    for (const auto& block : blocks)
+    {
+        const auto& payload = block.entry.compressedSize == block.entry.rawSize ? block.raw : block.compressed;
+        file.write(reinterpret_cast<const char*>(payload.data()), block.entry.compressedSize);
+    }
+
+    TrajectoryIndexEntry entry = {};
+    entry.step = step;
+    entry.time = time;
+    entry.offset = offset;
+    entry.keyframe = frame.keyframe;
+    index.push_back(entry);
+
+    offset += frame.size;
+
+    return static_cast<bool>(file);
+}
+
+void TrajectoryWriter::EncodeBlock(const float3* positions, uint32_t blockIndex, bool keyframe)
+{
+    Block& block = blocks[blockIndex];
+    TrajectoryBlockEntry& entry = block.entry;
+
+    const uint64_t first = static_cast<uint64_t>(blockIndex) * header.particlesPerBlock;
+    const size_t count = static_cast<size_t>(std::min<uint64_t>(header.particlesPerBlock, header.particleCount - first));
+    const float levels = static_cast<float>((1u << header.positionBits) - 1);
+
+    std::vector<uint32_t> values(count);
+    std::vector<uint8_t> planes(count * sizeof(uint32_t));
+
+    block.raw.clear();
+
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        if (keyframe)
+        {
+            float minimum = (&positions[first].m_x)[axis];
+            float maximum = minimum;
+            for (size_t i = 0; i < count; ++i)
+            {
+                const float value = (&positions[first + i].m_x)[axis];
+                minimum = std::min(minimum, value);
+                maximum = std::max(maximum, value);
+            }
+            entry.origin[axis] = minimum;
+            entry.scale[axis] = maximum > minimum ? (maximum - minimum) / levels : 1.0f;
+        }
+
+        const float origin = entry.origin[axis];
+        const float inverseScale = 1.0f / entry.scale[axis];
+
+        uint32_t maximum = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const float value = (&positions[first + i].m_x)[axis];
+            const float grid = std::floor((value - origin) * inverseScale + 0.5f);
+            const int32_t coordinate = static_cast<int32_t>(std::max(-cMaxCoordinate, std::min(cMaxCoordinate, grid)));
+
+            int32_t& previous = coordinates[static_cast<size_t>((first + i) * 3 + axis)];
+            values[i] = ZigZag(keyframe ? coordinate : coordinate - previous);
+            previous = coordinate;
+
+            maximum = std::max(maximum, values[i]);
+        }
+
+        // Only the planes of the significant bytes are stored
+        const uint32_t width = GetByteWidth(maximum);
+        ShuffleBytes(reinterpret_cast<const uint8_t*>(values.data()), count, sizeof(uint32_t), planes.data());
+
+        block.raw.push_back(static_cast<uint8_t>(width));
+        block.raw.insert(block.raw.end(), planes.begin(), planes.begin() + width * count);
+    }
+
+    block.compressed.clear();
+    CompressLZ(block.raw.data(), block.raw.size(), block.compressed);
+
+    entry.rawSize = static_cast<uint32_t>(block.raw.size());
+    entry.compressedSize = static_cast<uint32_t>(std::min(block.compressed.size(), block.raw.size()));
+}
+
+bool TrajectoryReader::Open(const std::string& filename)
+{
+    Close();
+
+    if (!file.Open(filename.c_str()))
+    {
+        return Fail("Can't open " + filename);
+    }
+
+    if (file.GetSize() < sizeof(TrajectoryHeader))
+    {
+        return Fail("File is too small");
+    }
+
+    header = reinterpret_cast<const TrajectoryHeader*>(file.GetData());
+    if (header->magic != cTrajectoryMagic)
+    {
+        return Fail("Not a trajectory file");
+    }
+    if (header->version != cTrajectoryVersion || header->headerSize != sizeof(TrajectoryHeader))
+    {
+        return Fail("Unsupported trajectory version " + std::to_string(header->version));
+    }
+    if (header->particlesPerBlock == 0 || header->keyframeInterval == 0)
+    {
+        return Fail("Invalid trajectory header");
+    }
+
+    const uint64_t size = file.GetSize();
+
+    TrajectoryFooter footer = {};
+    if (size >= sizeof(TrajectoryHeader) + sizeof(TrajectoryFooter))
+    {
+        std::memcpy(&footer, file.GetData() + size - sizeof(TrajectoryFooter), sizeof(TrajectoryFooter));
+    }
+
+    const bool indexed = footer.magic == cTrajectoryIndexMagic &&
+        footer.indexOffset + footer.frameCount * sizeof(TrajectoryIndexEntry) + sizeof(TrajectoryFooter) == size;
+
+    if (indexed)
+    {
+        const auto* entries = reinterpret_cast<const TrajectoryIndexEntry*>(file.GetData() + footer.indexOffset);
+        index.assign(entries, entries + footer.frameCount);
+    }
+    else if (!ScanFrames())
+    {
+        return false;
+    }
+
+    coordinates.assign(static_cast<size_t>(header->particleCount * 3), 0);
+
+    return true;
+}
+
+void TrajectoryReader::Close()
+{
+    file.Close();
+    header = nullptr;
+    index.clear();
+    coordinates.clear();
+    decodedFrame = UINT64_MAX;
+    error.clear();
+}
+
+bool TrajectoryReader::ScanFrames()
+{
+    // No index, the writer didn't finish. Frames up to the first incomplete one are usable.
+    uint64_t position = sizeof(TrajectoryHeader);
+    while (position + sizeof(TrajectoryFrameHeader) <= file.GetSize())
+    {
+        TrajectoryFrameHeader frame;
+        std::memcpy(&frame, file.GetData() + position, sizeof(frame));
+
+        if (frame.magic != cTrajectoryFrameMagic || frame.size < sizeof(frame) || frame.size > file.GetSize() - position)
+        {
+            break;
+        }
+
+        TrajectoryIndexEntry entry = {};
+        entry.step = frame.step;
+        entry.time = frame.time;
+        entry.offset = position;
+        entry.keyframe = frame.keyframe;
+        index.push_back(entry);
+
+        position += frame.size;
+    }
+
+    if (!index.empty() && !index.front().keyframe)
+    {
+        return Fail("First frame is not a keyframe");
+    }
+
+    return true;
+}
+
+bool TrajectoryReader::ReadFrame(uint64_t frame, std::vector<float3>& positions)
+{
+    if (frame >= index.size())
+    {
+        error = "Frame " + std::to_string(frame) + " is out of range";
+        return false;
+    }
+
+    uint64_t keyframe = frame;
+    while (keyframe > 0 && !index[keyframe].keyframe)
+    {
+        --keyframe;
+    }
+
+    // Continue from the last decoded frame when it is on the way
+    uint64_t start = keyframe;
+    if (decodedFrame != UINT64_MAX && decodedFrame >= keyframe && decodedFrame <= frame)
+    {
+        start = decodedFrame + 1;
+    }
+
+    for (uint64_t i = start; i <= frame; ++i)
+    {
+        if (!DecodeFrame(i))
+        {
+            decodedFrame = UINT64_MAX;
+            return false;
+        }
+        decodedFrame = i;
+    }
+
+    const uint8_t* data = file.GetData() + index[frame].offset;
+    const auto* entries = reinterpret_cast<const TrajectoryBlockEntry*>(data + sizeof(TrajectoryFrameHeader));
+
+    positions.resize(static_cast<size_t>(header->particleCount));
+
+    for (uint64_t i = 0; i < header->particleCount; ++i)
+    {
+        const TrajectoryBlockEntry& entry = entries[i / header->particlesPerBlock];
+        const int32_t* coordinate = &coordinates[static_cast<size_t>(i * 3)];
+
+        positions[static_cast<size_t>(i)] = float3(
+            entry.origin[0] + coordinate[0] * entry.scale[0],
+            entry.origin[1] + coordinate[1] * entry.scale[1],
+            entry.origin[2] + coordinate[2] * entry.scale[2]);
+    }
+
+    return true;
+}
+
+bool TrajectoryReader::DecodeFrame(uint64_t frameIndex)
+{
+    const uint64_t frameOffset = index[frameIndex].offset;
+    if (frameOffset + sizeof(TrajectoryFrameHeader) > file.GetSize())
+    {
+        return Fail("Frame is out of the file");
+    }
+
+    const uint8_t* data = file.GetData() + frameOffset;
+
+    TrajectoryFrameHeader frame;
+    std::memcpy(&frame, data, sizeof(frame));
+
+    const uint64_t blockCount = (header->particleCount + header->particlesPerBlock - 1) / header->particlesPerBlock;
+
+    if (frame.magic != cTrajectoryFrameMagic || frame.blockCount != blockCount ||
+        frame.size > file.GetSize() - frameOffset ||
+        frame.size < sizeof(TrajectoryFrameHeader) + blockCount * sizeof(TrajectoryBlockEntry))
+    {
+        return Fail("Frame " + std::to_string(frameIndex) + " is corrupt");
+    }
+
+    const auto* entries = reinterpret_cast<const TrajectoryBlockEntry*>(data + sizeof(TrajectoryFrameHeader));
+
+    for (uint32_t b = 0; b < frame.blockCount; ++b)
+    {
+        const TrajectoryBlockEntry& entry = entries[b];
+        if (entry.offset + entry.compressedSize > frame.size)
+        {
+            return Fail("Block " + std::to_string(b) + " is out of the frame");
+        }
+
+        const uint8_t* payload = data + entry.offset;
+        if (entry.compressedSize != entry.rawSize)
+        {
+            raw.resize(entry.rawSize);
+            if (!DecompressLZ(payload, entry.compressedSize, raw.data(), raw.size()))
+            {
+                return Fail("Block " + std::to_string(b) + " can't be decompressed");
+            }
+            payload = raw.data();
+        }
+
+        const uint64_t first = static_cast<uint64_t>(b) * header->particlesPerBlock;
+        const size_t count = static_cast<size_t>(std::min<uint64_t>(header->particlesPerBlock, header->particleCount - first));
+
+        size_t position = 0;
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            if (position >= entry.rawSize)
+            {
+                return Fail("Block " + std::to_string(b) + " is truncated");
+            }
+
+            const uint32_t width = payload[position++];
+            if (width > sizeof(uint32_t) || position + width * count > entry.rawSize)
+            {
+                return Fail("Block " + std::to_string(b) + " is truncated");
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32_t value = 0;
+                for (uint32_t k = 0; k < width; ++k)
+                {
+                    value |= static_cast<uint32_t>(payload[position + k * count + i]) << (8 * k);
+                }
+
+                int32_t& coordinate = coordinates[static_cast<size_t>((first + i) * 3 + axis)];
+                coordinate = frame.keyframe ? UnZigZag(value) : coordinate + UnZigZag(value);
+            }
+
+            position += width * count;
+        }
+    }
+
+    return true;
+}
+
+bool TrajectoryReader::Fail(const std::string& message)
+{
+    std::string text = message;
+    Close();
+    error = text;
+    return false;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "float3.h"
+#include "MappedFile.h"
+
+class Universe;
+
+/*
+Compressed stream of particle positions over time.
+
+Layout:
+    TrajectoryHeader
+    frames, each TrajectoryFrameHeader + TrajectoryBlockEntry[blockCount] + block payloads
+    TrajectoryIndexEntry[frameCount]
+    TrajectoryFooter
+
+Particles are split into blocks of particlesPerBlock. On a keyframe every block gets a grid
+spanning its bounds with 2^positionBits levels per axis and the positions are stored as grid
+coordinates. Frames between keyframes reuse that grid and store the change of the coordinates
+since the previous frame, which is small for short output intervals. The error is half a grid
+step and doesn't accumulate.
+
+Block payload, before LZ compression, for every axis: one byte with the width W of the values
+in bytes, then W byte planes of the zigzag coded values.
+
+The index at the end allows seeking to any frame, a file without one (e.g. after a crash) is
+read by scanning the frame headers.
+*/
+
+constexpr uint32_t cTrajectoryMagic = 0x54584C47;  // "GLXT"
+constexpr uint32_t cTrajectoryFrameMagic = 0x4D415246;  // "FRAM"
+constexpr uint32_t cTrajectoryIndexMagic = 0x58444E49;  // "INDX"
+constexpr uint32_t cTrajectoryVersion = 1;
+
+struct TrajectoryHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t positionBits;
+    uint64_t particleCount;
+    uint32_t particlesPerBlock;
+    uint32_t keyframeInterval;
+    // Model units in SI, as in snapshots
+    double lengthUnit;
+    double timeUnit;
+};
+
+struct TrajectoryFrameHeader
+{
+    uint32_t magic;
+    uint32_t blockCount;
+    uint64_t step;
+    double time;
+    // Size of the frame including this header
+    uint64_t size;
+    uint32_t keyframe;
+    uint32_t reserved;
+};
+
+struct TrajectoryBlockEntry
+{
+    // From the start of the frame
+    uint64_t offset;
+    uint32_t compressedSize;
+    // Payload stored without compression if equal to compressedSize
+    uint32_t rawSize;
+    float origin[3];
+    float scale[3];
+};
+
+struct TrajectoryIndexEntry
+{
+    uint64_t step;
+    double time;
+    uint64_t offset;
+    uint32_t keyframe;
+    uint32_t reserved;
+};
+
+struct TrajectoryFooter
+{
+    uint64_t indexOffset;
+    uint64_t frameCount;
+    uint32_t magic;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(TrajectoryHeader) == 48, "Trajectory header layout changed");
+static_assert(sizeof(TrajectoryFrameHeader) == 40, "Trajectory frame layout changed");
+static_assert(sizeof(TrajectoryBlockEntry) == 40, "Trajectory block layout changed");
+static_assert(sizeof(TrajectoryIndexEntry) == 32, "Trajectory index layout changed");
+static_assert(sizeof(TrajectoryFooter) == 24, "Trajectory footer layout changed");
+
+/** Appends frames to a trajectory file. Blocks are encoded in parallel with ThreadPool. */
+class TrajectoryWriter
+{
+public:
+    struct Options
+    {
+        // 16 bits give 1/65535 of the block extent, 21 bits pack a position into 64 bits
+        uint32_t positionBits = 16;
+        uint32_t particlesPerBlock = 16384;
+        // Every Nth frame is stored without reference to the previous one
+        uint32_t keyframeInterval = 32;
+    };
+
+    ~TrajectoryWriter();
+
+    bool Open(const std::string& filename, uint64_t particleCount, const Options& options);
+    /** Writes the index, the file is readable without it but seeking is slower. */
+    bool Close();
+
+    bool IsOpen() const { return file.is_open(); }
+
+    bool WriteFrame(const Universe& universe, uint64_t step, double time);
+    bool WriteFrame(const float3* positions, uint64_t step, double time);
+
+    /** Bytes written so far. */
+    uint64_t GetSize() const { return offset; }
+    uint64_t GetFrameCount() const { return index.size(); }
+
+private:
+    struct Block
+    {
+        TrajectoryBlockEntry entry;
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> compressed;
+    };
+
+    void EncodeBlock(const float3* positions, uint32_t blockIndex, bool keyframe);
+
+    std::ofstream file;
+    TrajectoryHeader header = {};
+    uint64_t offset = 0;
+
+    std::vector<TrajectoryIndexEntry> index;
+    std::vector<Block> blocks;
+    // Grid coordinates of the previous frame
+    std::vector<int32_t> coordinates;
+    std::vector<float3> gathered;
+};
+
+/** Random access reader of a memory-mapped trajectory file. */
+class TrajectoryReader
+{
+public:
+    bool Open(const std::string& filename);
+    void Close();
+
+    const std::string& GetError() const { return error; }
+
+    const TrajectoryHeader& GetHeader() const { return *header; }
+    uint64_t GetFrameCount() const { return index.size(); }
+    uint64_t GetFrameStep(uint64_t frame) const { return index[frame].step; }
+    double GetFrameTime(uint64_t frame) const { return index[frame].time; }
+
+    /** Decodes positions of a frame, sequential reads continue from the previous frame. */
+    bool ReadFrame(uint64_t frame, std::vector<float3>& positions);
+
+private:
+    bool ScanFrames();
+    bool DecodeFrame(uint64_t frame);
+    bool Fail(const std::string& message);
+
+    MappedFile file;
+    const TrajectoryHeader* header = nullptr;
+    std::vector<TrajectoryIndexEntry> index;
+
+    // Grid coordinates of the last decoded frame
+    std::vector<int32_t> coordinates;
+    uint64_t decodedFrame = UINT64_MAX;
+    std::vector<uint8_t> raw;
+    std::string error;
+};
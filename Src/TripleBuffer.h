@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+    Lock-free handoff of values from one producer thread to one consumer thread.
+
+    The producer fills GetWriteBuffer() and calls Publish(), the consumer calls Acquire() and
+    reads the returned buffer until its next Acquire(). Neither side ever waits for the other,
+    the consumer always sees the latest complete value and never a partially written one.
+*/
+template <typename T>
+class TripleBuffer
+{
+public:
+    /** Buffer owned by the producer. */
+    T& GetWriteBuffer() { return buffers[writeIndex]; }
+
+    /** Makes the write buffer visible to the consumer and takes over a free one. */
+    void Publish()
+    {
+        std::uint32_t previous = middle.exchange(writeIndex | cFreshBit, std::memory_order_acq_rel);
+        writeIndex = previous & cIndexMask;
+    }
+
+    /** Returns the latest published buffer. */
+    const T& Acquire()
+    {
+        if (middle.load(std::memory_order_relaxed) & cFreshBit)
+        {
+            std::uint32_t previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+            readIndex = previous & cIndexMask;
+        }
+        return buffers[readIndex];
+    }
+
+private:
+    static constexpr std::uint32_t cFreshBit = 4;
+    static constexpr std::uint32_t cIndexMask = 3;
+
+    T buffers[3];
+
+    std::uint32_t writeIndex = 0;
+    std::uint32_t readIndex = 2;
+    std::atomic<std::uint32_t> middle{ 1 };
+};
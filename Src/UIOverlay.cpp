@@ -83,12 +83,33 @@ void UIOverlay::Checkbox(const char* name, bool* value, const char* key)
     TwAddVarRW(impl->bar, name, TW_TYPE_BOOLCPP, value, def.c_str());
 }
 
+void UIOverlay::Checkbox(const char* name, std::atomic<bool>* value, const char* key)
+{
+    std::string def;
+    if (key)
+    {
+        def = " key=" + std::string(key);
+    }
+    def += " " + currentGroup;
+    TwAddVarCB(impl->bar, name, TW_TYPE_BOOLCPP, 
+        [](const void* input, void* flag) { static_cast<std::atomic<bool>*>(flag)->store(*static_cast<const bool*>(input)); },
+        [](void* output, void* flag) { *static_cast<bool*>(output) = static_cast<std::atomic<bool>*>(flag)->load(); },
+        value, def.c_str());
+}
+
 void UIOverlay::SliderUint(const char* name, uint32_t* value)
 {
     std::string def = currentGroup;
     TwAddVarRW(impl->bar, name, TW_TYPE_UINT32, value, def.c_str());
 }
 
+void UIOverlay::Combo(const char* name, uint32_t* value, const char* items)
+{
+    std::string def = currentGroup;
+    TwType type = TwDefineEnumFromString(name, items);
+    TwAddVarRW(impl->bar, name, type, value, def.c_str());
+}
+
 void UIOverlay::SliderFloat(const char* name, float* value)
 {
     std::string def = currentGroup;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -21,7 +22,11 @@ public:
     void ReadonlyInt(const char* name, const int32_t* value);
     void ReadonlyFloat(const char* name, const float* value, uint8_t precision = 2);
     void Checkbox(const char* name, bool* value, const char* key = nullptr);
+    /** Checkbox of a flag that another thread reads. */
+    void Checkbox(const char* name, std::atomic<bool>* value, const char* key = nullptr);
     void SliderUint(const char* name, uint32_t* value);
+    /** Drop-down list, items are comma separated and value is the index of the selected one. */
+    void Combo(const char* name, uint32_t* value, const char* items);
     void SliderFloat(const char* name, float* value);
     void SliderFloat(const char* name, float* value, float min, float max, float step = 0.1f);
     void Separator();
@@ -1,8 +1,13 @@
 #pragma once
 
-#include "Image.h"
-
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 /* Time utility class for measurements. */
 template <typename Period = std::ratio<1>>
@@ -31,4 +36,72 @@ public:
 private:
     std::chrono::high_resolution_clock::time_point lastTime = std::chrono::high_resolution_clock::now();
     float* value = nullptr;
+};
+
+/* 64-bit FNV-1a hash of a sequence of values. */
+class Hasher {
+public:
+    void Add(const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+        }
+    }
+
+    /* Adds the bytes of a value, which must have no padding. */
+    template <typename T>
+    void Add(const T& value) { Add(&value, sizeof(value)); }
+
+    uint64_t GetHash() const { return hash; }
+
+private:
+    uint64_t hash = 0xCBF29CE484222325ull;
+};
+
+/* Allocator of memory aligned to Alignment bytes, e.g. to cache lines. */
+template <typename T, size_t Alignment>
+class AlignedAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+    T* allocate(size_t count)
+    {
+        void* data = nullptr;
+#ifdef _WIN32
+        data = _aligned_malloc(count * sizeof(T), Alignment);
+#else
+        if (posix_memalign(&data, Alignment, count * sizeof(T)) != 0)
+        {
+            data = nullptr;
+        }
+#endif
+        if (!data)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(data);
+    }
+
+    void deallocate(T* data, size_t)
+    {
+#ifdef _WIN32
+        _aligned_free(data);
+#else
+        std::free(data);
+#endif
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
 };
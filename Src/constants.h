@@ -3,7 +3,7 @@
 constexpr uint32_t cWindowWidth = 1400;
 constexpr uint32_t cWindowHeight = 800;
 
-constexpr char* cWindowCaption = "Galaxy Model 0.1";
+constexpr const char* cWindowCaption = "Galaxy Model 0.1";
 
 /* 
 Measure units:
@@ -19,7 +19,10 @@ constexpr double cKiloParsec = 1000 * cParsec;    // m
 constexpr double cSolarMass = 1.9885e+30;         // kg
 constexpr double cMassUnit = 1e+10 * cSolarMass;  // kg
 
-constexpr float cSoftFactor = 0.0001f;
+// Plummer equivalent softening length of the stars, kpc, see Softening.h
+constexpr float cDefaultSoftening = 0.0005f;
+
+constexpr float cDefaultDeltaTime = 0.00000005f;
 
 constexpr float cRenderFps = 30;
 constexpr float cFrameTime = 1.0f / cRenderFps;
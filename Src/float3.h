@@ -2,70 +2,495 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <cmath>
+#include <cstddef>
+
+/*
+Vector math of the physics and the rendering, header only so the hot loops inline it. The
+float3 and double3 operations don't depend on the target and are constexpr but for the square
+roots. float4 is the padded 4-wide layout float3 already has, backed by SSE where the target
+has it, define GLX_NO_SSE_VECTORS to keep it scalar. float3xN holds batches in structure of
+arrays for the vectorized kernels.
+*/
+
+#if !defined(GLX_NO_SSE_VECTORS) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define GLX_SSE_VECTORS
+#include <xmmintrin.h>
+// Intrinsics aren't constant expressions
+#define GLX_FLOAT4_CONSTEXPR
+#else
+#define GLX_FLOAT4_CONSTEXPR constexpr
+#endif
 
 // Вектор в трехмерном пространстве
 class float3
 {
 public:
 
-	// x-компонента вектора
-	float m_x;
+    // x-компонента вектора
+    float m_x;
+
+    // y-компонента вектора
+    float m_y;
+
+    // z-компонента вектора
+    float m_z;
+
+    // Fourth lane of the SSE layout, zero unless a float4 stores something else in it
+    float m_pad;
+
+    constexpr float3() : m_x(0.0f), m_y(0.0f), m_z(0.0f), m_pad(0.0f) {}
+    constexpr float3(float x, float y, float z) : m_x(x), m_y(y), m_z(z), m_pad(0.0f) {}
+    constexpr float3(float s) : m_x(s), m_y(s), m_z(s), m_pad(0.0f) {}
+    constexpr float3(const float* v) : m_x(v[0]), m_y(v[1]), m_z(v[2]), m_pad(0.0f) {}
+
+    constexpr void clear()
+    {
+        m_x = 0.0f;
+        m_y = 0.0f;
+        m_z = 0.0f;
+        m_pad = 0.0f;
+    }
 
-	// y-компонента вектора
-	float m_y;
+    constexpr void setTo(float x, float y, float z)
+    {
+        m_x = x;
+        m_y = y;
+        m_z = z;
+    }
 
-	// z-компонента вектора
-	float m_z;
+    constexpr void add(const float3& other)
+    {
+        m_x += other.m_x;
+        m_y += other.m_y;
+        m_z += other.m_z;
+    }
 
-	float m_pad;
+    constexpr float3 addR(const float3& other) const
+    {
+        return float3(m_x + other.m_x, m_y + other.m_y, m_z + other.m_z);
+    }
 
+    constexpr void sub(const float3& other)
+    {
+        m_x -= other.m_x;
+        m_y -= other.m_y;
+        m_z -= other.m_z;
+    }
 
-	float3();
-	float3(float x, float y, float z);
-	float3(float s);
-	float3(float *v);
+    constexpr float3 subR(const float3& other) const
+    {
+        return float3(m_x - other.m_x, m_y - other.m_y, m_z - other.m_z);
+    }
 
-	void		clear();
-	void		setTo(float x, float y, float z);
+    constexpr void scale(float s)
+    {
+        m_x *= s;
+        m_y *= s;
+        m_z *= s;
+    }
 
-	void		add(const float3 &other);
-	float3		addR(const float3 &other) const;
-	void		sub(const float3 &other);
-	float3		subR(const float3 &other) const;
-	void 		scale(float s);
-	float3		scaleR(float s) const;
-	void		addScaled(const float3 &other, float s);
-	float3		addScaledR(const float3 &other, float s) const;
+    constexpr float3 scaleR(float s) const
+    {
+        return float3(s * m_x, s * m_y, s * m_z);
+    }
 
-	float		dot(const float3 &other);
-	void		cross(const float3 &other);
-	float3		crossR(const float3 &other) const;
+    constexpr void addScaled(const float3& other, float s)
+    {
+        m_x += s * other.m_x;
+        m_y += s * other.m_y;
+        m_z += s * other.m_z;
+    }
 
-	float		norm();
-	float		normSq();
-	float		normalize();
+    constexpr float3 addScaledR(const float3& other, float s) const
+    {
+        return float3(m_x + s * other.m_x, m_y + s * other.m_y, m_z + s * other.m_z);
+    }
 
-	float3	operator+(const float3 &other);
-	void	operator+=(const float3 &other);
+    constexpr float dot(const float3& other) const
+    {
+        return m_x * other.m_x + m_y * other.m_y + m_z * other.m_z;
+    }
 
-	float3	operator-(const float3 &other);
-	void	operator-=(const float3 &other);
+    constexpr void cross(const float3& other)
+    {
+        *this = crossR(other);
+    }
 
-	float   operator*(const float3 &other);
-	float3  operator*(float s);
-	void	operator*=(float s);
+    constexpr float3 crossR(const float3& other) const
+    {
+        return float3(m_y * other.m_z - m_z * other.m_y, m_z * other.m_x - m_x * other.m_z, m_x * other.m_y - m_y * other.m_x);
+    }
 
-	float3	operator%(const float3 &other);
-	void	operator%=(const float3 &other);
+    float norm() const
+    {
+        return std::sqrt(normSq());
+    }
 
+    constexpr float normSq() const
+    {
+        return m_x * m_x + m_y * m_y + m_z * m_z;
+    }
+
+    /** Scales the vector to unit length unless it's zero, the length before. */
+    float normalize()
+    {
+        const float length = norm();
+        if (length > 0)
+        {
+            m_x /= length;
+            m_y /= length;
+            m_z /= length;
+        }
+        return length;
+    }
+
+    constexpr float3& operator+=(const float3& other)
+    {
+        add(other);
+        return *this;
+    }
+
+    constexpr float3& operator-=(const float3& other)
+    {
+        sub(other);
+        return *this;
+    }
+
+    constexpr float3& operator*=(float s)
+    {
+        scale(s);
+        return *this;
+    }
+
+    constexpr float3& operator%=(const float3& other)
+    {
+        cross(other);
+        return *this;
+    }
 };
 
-inline float3 operator+(const float3& lhs, const float3& rhs)
+constexpr float3 operator+(const float3& lhs, const float3& rhs)
+{
+    return lhs.addR(rhs);
+}
+
+constexpr float3 operator-(const float3& lhs, const float3& rhs)
 {
-    return {lhs.m_x + rhs.m_x, lhs.m_y + rhs.m_y, lhs.m_z + rhs.m_z};
+    return lhs.subR(rhs);
 }
 
-inline float3 operator-(const float3& lhs, const float3& rhs)
+constexpr float3 operator-(const float3& v)
+{
+    return float3(-v.m_x, -v.m_y, -v.m_z);
+}
+
+/** Dot product. */
+constexpr float operator*(const float3& lhs, const float3& rhs)
+{
+    return lhs.dot(rhs);
+}
+
+constexpr float3 operator*(const float3& v, float s)
+{
+    return v.scaleR(s);
+}
+
+constexpr float3 operator*(float s, const float3& v)
+{
+    return v.scaleR(s);
+}
+
+/** Cross product. */
+constexpr float3 operator%(const float3& lhs, const float3& rhs)
+{
+    return lhs.crossR(rhs);
+}
+
+/** float3 in double precision, for sums over many bodies. */
+class double3
+{
+public:
+
+    double m_x;
+    double m_y;
+    double m_z;
+
+    constexpr double3() : m_x(0.0), m_y(0.0), m_z(0.0) {}
+    constexpr double3(double x, double y, double z) : m_x(x), m_y(y), m_z(z) {}
+    constexpr explicit double3(const float3& v) : m_x(v.m_x), m_y(v.m_y), m_z(v.m_z) {}
+
+    /** Rounded to single precision. */
+    constexpr float3 toFloat3() const
+    {
+        return float3(static_cast<float>(m_x), static_cast<float>(m_y), static_cast<float>(m_z));
+    }
+
+    constexpr void add(const double3& other)
+    {
+        m_x += other.m_x;
+        m_y += other.m_y;
+        m_z += other.m_z;
+    }
+
+    constexpr double3 addR(const double3& other) const
+    {
+        return double3(m_x + other.m_x, m_y + other.m_y, m_z + other.m_z);
+    }
+
+    constexpr void sub(const double3& other)
+    {
+        m_x -= other.m_x;
+        m_y -= other.m_y;
+        m_z -= other.m_z;
+    }
+
+    constexpr double3 subR(const double3& other) const
+    {
+        return double3(m_x - other.m_x, m_y - other.m_y, m_z - other.m_z);
+    }
+
+    constexpr void scale(double s)
+    {
+        m_x *= s;
+        m_y *= s;
+        m_z *= s;
+    }
+
+    constexpr double3 scaleR(double s) const
+    {
+        return double3(s * m_x, s * m_y, s * m_z);
+    }
+
+    constexpr void addScaled(const double3& other, double s)
+    {
+        m_x += s * other.m_x;
+        m_y += s * other.m_y;
+        m_z += s * other.m_z;
+    }
+
+    constexpr double dot(const double3& other) const
+    {
+        return m_x * other.m_x + m_y * other.m_y + m_z * other.m_z;
+    }
+
+    constexpr double3 crossR(const double3& other) const
+    {
+        return double3(m_y * other.m_z - m_z * other.m_y, m_z * other.m_x - m_x * other.m_z, m_x * other.m_y - m_y * other.m_x);
+    }
+
+    double norm() const
+    {
+        return std::sqrt(normSq());
+    }
+
+    constexpr double normSq() const
+    {
+        return m_x * m_x + m_y * m_y + m_z * m_z;
+    }
+
+    constexpr double3& operator+=(const double3& other)
+    {
+        add(other);
+        return *this;
+    }
+
+    constexpr double3& operator-=(const double3& other)
+    {
+        sub(other);
+        return *this;
+    }
+
+    constexpr double3& operator*=(double s)
+    {
+        scale(s);
+        return *this;
+    }
+};
+
+constexpr double3 operator+(const double3& lhs, const double3& rhs)
 {
-    return {lhs.m_x - rhs.m_x, lhs.m_y - rhs.m_y, lhs.m_z - rhs.m_z};
+    return lhs.addR(rhs);
 }
+
+constexpr double3 operator-(const double3& lhs, const double3& rhs)
+{
+    return lhs.subR(rhs);
+}
+
+/** Dot product. */
+constexpr double operator*(const double3& lhs, const double3& rhs)
+{
+    return lhs.dot(rhs);
+}
+
+constexpr double3 operator*(const double3& v, double s)
+{
+    return v.scaleR(s);
+}
+
+constexpr double3 operator*(double s, const double3& v)
+{
+    return v.scaleR(s);
+}
+
+/** Cross product. */
+constexpr double3 operator%(const double3& lhs, const double3& rhs)
+{
+    return lhs.crossR(rhs);
+}
+
+/**
+    Four packed floats, one SSE register. A float3 converts with its padding lane, so the
+    updates of whole vectors take one instruction each. The lanes are rounded as the scalar
+    operations round them, results don't depend on the backing.
+*/
+struct alignas(16) float4
+{
+    float m_x;
+    float m_y;
+    float m_z;
+    float m_w;
+
+    constexpr float4() : m_x(0.0f), m_y(0.0f), m_z(0.0f), m_w(0.0f) {}
+    constexpr float4(float x, float y, float z, float w) : m_x(x), m_y(y), m_z(z), m_w(w) {}
+    constexpr explicit float4(float s) : m_x(s), m_y(s), m_z(s), m_w(s) {}
+
+#ifdef GLX_SSE_VECTORS
+    explicit float4(__m128 v) { _mm_store_ps(&m_x, v); }
+    explicit float4(const float3& v) { _mm_store_ps(&m_x, _mm_loadu_ps(&v.m_x)); }
+
+    __m128 load() const { return _mm_load_ps(&m_x); }
+
+    float3 toFloat3() const
+    {
+        float3 result;
+        _mm_storeu_ps(&result.m_x, load());
+        return result;
+    }
+
+    float4& operator+=(const float4& other)
+    {
+        _mm_store_ps(&m_x, _mm_add_ps(load(), other.load()));
+        return *this;
+    }
+
+    float4& operator-=(const float4& other)
+    {
+        _mm_store_ps(&m_x, _mm_sub_ps(load(), other.load()));
+        return *this;
+    }
+
+    float4& operator*=(float s)
+    {
+        _mm_store_ps(&m_x, _mm_mul_ps(load(), _mm_set1_ps(s)));
+        return *this;
+    }
+
+    void addScaled(const float4& other, float s)
+    {
+        _mm_store_ps(&m_x, _mm_add_ps(load(), _mm_mul_ps(_mm_set1_ps(s), other.load())));
+    }
+#else
+    constexpr explicit float4(const float3& v) : m_x(v.m_x), m_y(v.m_y), m_z(v.m_z), m_w(v.m_pad) {}
+
+    constexpr float3 toFloat3() const
+    {
+        float3 result(m_x, m_y, m_z);
+        result.m_pad = m_w;
+        return result;
+    }
+
+    constexpr float4& operator+=(const float4& other)
+    {
+        m_x += other.m_x;
+        m_y += other.m_y;
+        m_z += other.m_z;
+        m_w += other.m_w;
+        return *this;
+    }
+
+    constexpr float4& operator-=(const float4& other)
+    {
+        m_x -= other.m_x;
+        m_y -= other.m_y;
+        m_z -= other.m_z;
+        m_w -= other.m_w;
+        return *this;
+    }
+
+    constexpr float4& operator*=(float s)
+    {
+        m_x *= s;
+        m_y *= s;
+        m_z *= s;
+        m_w *= s;
+        return *this;
+    }
+
+    constexpr void addScaled(const float4& other, float s)
+    {
+        m_x += s * other.m_x;
+        m_y += s * other.m_y;
+        m_z += s * other.m_z;
+        m_w += s * other.m_w;
+    }
+#endif
+};
+
+inline GLX_FLOAT4_CONSTEXPR float4 operator+(float4 lhs, const float4& rhs)
+{
+    return lhs += rhs;
+}
+
+inline GLX_FLOAT4_CONSTEXPR float4 operator-(float4 lhs, const float4& rhs)
+{
+    return lhs -= rhs;
+}
+
+inline GLX_FLOAT4_CONSTEXPR float4 operator*(float4 v, float s)
+{
+    return v *= s;
+}
+
+inline GLX_FLOAT4_CONSTEXPR float4 operator*(float s, float4 v)
+{
+    return v *= s;
+}
+
+/**
+    N vectors in structure of arrays, each coordinate array aligned for the widest loads, for
+    the kernels that take x, y and z apart.
+*/
+template <size_t N>
+struct float3xN
+{
+    static constexpr size_t cSize = N;
+
+    alignas(64) float x[N];
+    alignas(64) float y[N];
+    alignas(64) float z[N];
+
+    constexpr float3 get(size_t i) const
+    {
+        return float3(x[i], y[i], z[i]);
+    }
+
+    constexpr void set(size_t i, const float3& v)
+    {
+        x[i] = v.m_x;
+        y[i] = v.m_y;
+        z[i] = v.m_z;
+    }
+
+    /** Zeroes the first count vectors. */
+    constexpr void clear(size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            x[i] = 0.0f;
+            y[i] = 0.0f;
+            z[i] = 0.0f;
+        }
+    }
+};
@@ -5,193 +5,757 @@
 #include "BarnesHutTree.h"
 #include "Constants.h"
 #include "Utils.h"
-#include "Application.h"
+#include "Profiler.h"
 
 #include <cassert>
+#include <vector>
 
 static inline void IntegrateMotionEquation(Particle& particle, float time)
 {
-    // Euler-Cromer
-    particle.acceleration.addScaled(particle.force, particle.inverseMass);
-    particle.linearVelocity.addScaled(particle.acceleration, time);
-    particle.position.addScaled(particle.linearVelocity, time);
+    // Euler-Cromer on the padded vectors, one packed operation per update
+    float4 acceleration(particle.acceleration);
+    float4 velocity(particle.linearVelocity);
+    float4 position(particle.position);
+    acceleration.addScaled(float4(particle.force), particle.inverseMass);
+    velocity.addScaled(acceleration, time);
+    position.addScaled(velocity, time);
+    particle.acceleration = acceleration.toFloat3();
+    particle.linearVelocity = velocity.toFloat3();
+    particle.position = position.toFloat3();
 }
 
-static void IntegrateMotionEquationSIMD(Particle& particle, float time)
+static inline void ComputeForce(Particle& particle, const BarnesHutTree& tree, float softening, bool withPotential)
 {
-    float *force = &particle.force.m_x;
-    float *linVel = &particle.linearVelocity.m_x;
-    float *pos = &particle.position.m_x;
-    float imdt = particle.inverseMass * time;
+    particle.acceleration = withPotential ? 
+        tree.ComputeAcceleration(particle.position, &particle, softening, particle.potential) : 
+        tree.ComputeAcceleration(particle, softening);
+    particle.force.clear();
+}
+
+// Particles of one external field batch
+static constexpr uint32_t cExternalBatchSize = 256;
+
+/**
+    Adds the accelerations of the dark matter halos, a pass of its own after the gravity of the
+    particles. Batches of particles are copied into coordinate arrays for the vectorized halo
+    evaluation. The halo of every galaxy moves with its black hole.
+*/
+static void ComputeExternalForces(Universe& universe, const SimulationParameters& parameters, Timings& timings)
+{
+    Timer<std::milli> timer(&timings.externalTimeMsecs);
 
-    //__asm
-    //{
-    //	mov			eax, force
-    //	movups		xmm0, [eax]		// xmm0 - force
-    //	mov			ebx, linVel
-    //	movups		xmm1, [ebx]		// xmm1 - velocity
-    //	mov			ecx, pos
-    //	movups		xmm2, [ecx]		// xmm2 - pos
-    //	
-    //	movss		xmm3, imdt
-    //	movss		xmm4, dt
-    //	shufps		xmm3, xmm3, 0	// xmm3 - imdt imdt imdt imdt
-    //	shufps		xmm4, xmm4, 0	// xmm4 - dt dt dt dt
+    if (!parameters.darkMatter)
+    {
+        return;
+    }
+
+    const auto& galaxies = universe.GetGalaxies();
 
-    //	mulps		xmm0, xmm3		// (dv) force *= imdt
-    //	addps		xmm1, xmm0		// velocity += dv
-    //	movups		xmm5, xmm1		// xmm5 - vel
-    //	mulps		xmm1, xmm4		// (dp) velocity *= dt
-    //	addps		xmm2, xmm1		// pos += dp
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        auto& particles = galaxy.GetParticles();
+        const uint32_t batchCount = static_cast<uint32_t>((particles.size() + cExternalBatchSize - 1) / cExternalBatchSize);
 
-    //	xorps		xmm0, xmm0		// force = 0
+        ThreadPool().Dispatch([&](uint32_t batch)
+        {
+            const size_t first = static_cast<size_t>(batch) * cExternalBatchSize;
+            const size_t count = (std::min)(particles.size() - first, static_cast<size_t>(cExternalBatchSize));
+
+            float3xN<cExternalBatchSize> positions;
+            float3xN<cExternalBatchSize> accelerations;
+            accelerations.clear(count);
+
+            for (const auto& source : galaxies)
+            {
+                // A live halo acts through the tree
+                if (source.HasLiveHalo())
+                {
+                    continue;
+                }
+
+                const float3& center = source.GetCenter();
+                for (size_t i = 0; i < count; ++i)
+                {
+                    positions.set(i, particles[first + i].position - center);
+                }
+
+                source.GetHalo().AddAccelerations(positions.x, positions.y, positions.z, accelerations.x, accelerations.y, accelerations.z, count);
+            }
 
-    //	movups		[eax], xmm0
-    //	movups		[ebx], xmm5
-    //	movups		[ecx], xmm2
-    //}
+            for (size_t i = 0; i < count; ++i)
+            {
+                Particle& particle = particles[first + i];
+                if (particle.movable)
+                {
+                    particle.acceleration += accelerations.get(i);
+                }
+            }
+        }, batchCount, (std::max)(batchCount / ThreadPool::GetThreadCount(), 1u));
+    }
 }
 
-void BruteforceSolver::Solve(float time)
+/** Acceleration by the analytic halos at a point, used for the few live halo particles. */
+static float3 ComputeAnalyticHaloAcceleration(const Universe& universe, const SimulationParameters& parameters, const float3& position)
+{
+    float3 acceleration = {};
+
+    if (parameters.darkMatter)
+    {
+        for (const auto& source : universe.GetGalaxies())
+        {
+            if (!source.HasLiveHalo())
+            {
+                acceleration += source.GetHalo().GetAcceleration(position - source.GetCenter());
+            }
+        }
+    }
+
+    return acceleration;
+}
+
+/** Potential of the analytic halos at a point, galaxies with a live halo have none. */
+static float ComputeAnalyticHaloPotential(const Universe& universe, const SimulationParameters& parameters, const float3& position)
 {
-    // Bruteforce
+    float potential = 0.0f;
 
-    size_t ig = 0;
-    for (auto &galaxy1 : universe.GetGalaxies()) 
+    if (parameters.darkMatter)
     {
-        size_t ip = 0;
+        for (const auto& source : universe.GetGalaxies())
+        {
+            if (!source.HasLiveHalo())
+            {
+                float3 point = source.GetHalo().GetProfilePoint(position - source.GetCenter());
+                potential += source.GetHalo().GetPotential(point.norm());
+            }
+        }
+    }
+
+    return potential;
+}
+
+/**
+    Kicks the live halo particles on halo steps. Halo particles move on a longer time step than
+    the galaxy particles: a kick with the time of haloStepInterval steps, then a drift with every
+    step. Kicks change only velocities, so they don't disturb the tree.
+*/
+template <typename Acceleration>
+static void KickHaloParticles(Universe& universe, const SimulationParameters& parameters, float time, const Acceleration& acceleration)
+{
+    const float kick = time * (std::max)(parameters.haloStepInterval, 1u);
+
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        auto& particles = galaxy.GetHaloParticles();
+
+        ThreadPool().Dispatch([&](uint32_t i)
+        {
+            HaloParticle& particle = particles[i];
+            float3 total = acceleration(particle) + ComputeAnalyticHaloAcceleration(universe, parameters, particle.position);
+            particle.linearVelocity.addScaled(total, kick);
+        }, static_cast<uint32_t>(particles.size()), (std::max)(static_cast<uint32_t>(particles.size()) / ThreadPool::GetThreadCount(), 1u));
+    }
+}
+
+static void DriftHaloParticles(Universe& universe, float time)
+{
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        auto& particles = galaxy.GetHaloParticles();
+
+        ThreadPool().Dispatch([&](uint32_t i)
+        {
+            particles[i].position.addScaled(particles[i].linearVelocity, time);
+        }, static_cast<uint32_t>(particles.size()), (std::max)(static_cast<uint32_t>(particles.size()) / ThreadPool::GetThreadCount(), 1u));
+    }
+}
+
+/**
+    Moves the tracers by a whole step: the acceleration by the particles, then the analytic
+    halos vectorized over batches as in ComputeExternalForces, then the Euler-Cromer update.
+    Tracers have no mass and store no forces, so one pass does it all.
+*/
+template <typename Acceleration>
+static void MoveTracers(Universe& universe, const SimulationParameters& parameters, float time, const Acceleration& acceleration)
+{
+    const auto& galaxies = universe.GetGalaxies();
+
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        auto& tracers = galaxy.GetTracers();
+        const uint32_t batchCount = static_cast<uint32_t>((tracers.size() + cExternalBatchSize - 1) / cExternalBatchSize);
+
+        ThreadPool().Dispatch([&](uint32_t batch)
+        {
+            const size_t first = static_cast<size_t>(batch) * cExternalBatchSize;
+            const size_t count = (std::min)(tracers.size() - first, static_cast<size_t>(cExternalBatchSize));
+
+            float3xN<cExternalBatchSize> positions;
+            float3xN<cExternalBatchSize> accelerations;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                accelerations.set(i, acceleration(tracers[first + i].position));
+            }
+
+            for (const auto& source : galaxies)
+            {
+                if (!parameters.darkMatter || source.HasLiveHalo())
+                {
+                    continue;
+                }
+
+                const float3& center = source.GetCenter();
+                for (size_t i = 0; i < count; ++i)
+                {
+                    positions.set(i, tracers[first + i].position - center);
+                }
+
+                source.GetHalo().AddAccelerations(positions.x, positions.y, positions.z, accelerations.x, accelerations.y, accelerations.z, count);
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                TracerParticle& tracer = tracers[first + i];
+                tracer.linearVelocity.addScaled(accelerations.get(i), time);
+                tracer.position.addScaled(tracer.linearVelocity, time);
+            }
+        }, batchCount, (std::max)(batchCount / ThreadPool::GetThreadCount(), 1u));
+    }
+}
+
+float3 Solver::ComputeFieldAcceleration(const float3& position) const
+{
+    return ComputeAcceleration(position, nullptr, parameters.softening) + ComputeAnalyticHaloAcceleration(universe, parameters, position);
+}
+
+// Particles of one block of the counted force walks
+static constexpr uint32_t cWalkStatisticsBlockSize = 256;
+
+// Bodies of one block of the diagnostics reduction
+static constexpr uint32_t cDiagnosticsBlockSize = 4096;
+
+/** Runs kernel(sums, first, end) for blocks of count bodies, every block has its own sums. */
+template <typename Kernel>
+static void DispatchDiagnosticsBlocks(std::vector<DiagnosticsSums>& sums, size_t count, const Kernel& kernel)
+{
+    const size_t offset = sums.size();
+    const uint32_t blockCount = static_cast<uint32_t>((count + cDiagnosticsBlockSize - 1) / cDiagnosticsBlockSize);
+    sums.resize(offset + blockCount);
+
+    ThreadPool().Dispatch([&](uint32_t block)
+    {
+        const size_t first = static_cast<size_t>(block) * cDiagnosticsBlockSize;
+        kernel(sums[offset + block], first, (std::min)(first + cDiagnosticsBlockSize, count));
+    }, blockCount, 1);
+}
+
+/**
+    Movable particles take the potentials of their force walk, the others and the halo particles
+    get a walk of their own here.
+*/
+template <typename Potential>
+void Solver::StageDiagnostics(const Potential& potential, DiagnosticsStage& stage)
+{
+    Timer<std::milli> timer(&timings.diagnosticsTimeMsecs);
+
+    stage.blockSums.clear();
+
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        const auto& particles = galaxy.GetParticles();
+        DispatchDiagnosticsBlocks(stage.blockSums, particles.size(), [&](DiagnosticsSums& sum, size_t first, size_t end)
+        {
+            for (size_t i = first; i < end; ++i)
+            {
+                const Particle& particle = particles[i];
+                if (!particle.movable)
+                {
+                    sum.potentialEnergy += 0.5 * particle.mass * potential(particle.position, &particle, parameters.softening);
+                    continue;
+                }
+                sum.potentialEnergy += 0.5 * particle.mass * particle.potential;
+                sum.externalEnergy += particle.mass * ComputeAnalyticHaloPotential(universe, parameters, particle.position);
+                sum.AddMotion(particle.position, particle.linearVelocity, particle.mass);
+            }
+        });
+
+        const auto& haloParticles = galaxy.GetHaloParticles();
+        DispatchDiagnosticsBlocks(stage.blockSums, haloParticles.size(), [&](DiagnosticsSums& sum, size_t first, size_t end)
+        {
+            for (size_t i = first; i < end; ++i)
+            {
+                const HaloParticle& particle = haloParticles[i];
+                sum.potentialEnergy += 0.5 * particle.mass * potential(particle.position, &particle, parameters.haloSoftening);
+                sum.externalEnergy += particle.mass * ComputeAnalyticHaloPotential(universe, parameters, particle.position);
+                sum.AddMotion(particle.position, particle.linearVelocity, particle.mass);
+            }
+        });
+    }
+
+    stage.step = stepCount;
+    stage.pending = true;
+    diagnosticsStep = stepCount;
+    hasDiagnostics = true;
+}
+
+/**
+    The reduction: the block sums are added up in block order, so the results don't depend on
+    the thread count of the step or on where the reduction runs.
+*/
+void Solver::ReduceDiagnostics(DiagnosticsStage& stage)
+{
+    if (!stage.pending)
+    {
+        return;
+    }
+
+    DiagnosticsSums total;
+    for (const auto& sum : stage.blockSums)
+    {
+        total.kineticEnergy += sum.kineticEnergy;
+        total.potentialEnergy += sum.potentialEnergy;
+        total.externalEnergy += sum.externalEnergy;
+        total.linearMomentum += sum.linearMomentum;
+        total.angularMomentum += sum.angularMomentum;
+    }
+
+    diagnostics.step = stage.step;
+    diagnostics.kineticEnergy = total.kineticEnergy;
+    diagnostics.potentialEnergy = total.potentialEnergy;
+    diagnostics.externalEnergy = total.externalEnergy;
+    diagnostics.linearMomentum = total.linearMomentum.toFloat3();
+    diagnostics.angularMomentum = total.angularMomentum.toFloat3();
+    stage.pending = false;
+}
+
+static uint32_t GetHistogramBin(uint32_t count)
+{
+    uint32_t bin = 0;
+    for (uint64_t value = static_cast<uint64_t>(count) + 1; value > 1; value >>= 1)
+    {
+        ++bin;
+    }
+    return (std::min)(bin, WalkStatistics::cHistogramBins - 1);
+}
+
+void WalkStatistics::Add(uint32_t walkNodes, uint32_t walkCells, uint32_t walkBodies)
+{
+    ++walks;
+    nodes += walkNodes;
+    cells += walkCells;
+    bodies += walkBodies;
+    maxInteractions = (std::max)(maxInteractions, walkCells + walkBodies);
+    ++nodesHistogram[GetHistogramBin(walkNodes)];
+    ++interactionsHistogram[GetHistogramBin(walkCells + walkBodies)];
+}
+
+void WalkStatistics::Add(const WalkStatistics& other)
+{
+    walks += other.walks;
+    nodes += other.nodes;
+    cells += other.cells;
+    bodies += other.bodies;
+    maxInteractions = (std::max)(maxInteractions, other.maxInteractions);
+    for (uint32_t i = 0; i < cHistogramBins; ++i)
+    {
+        nodesHistogram[i] += other.nodesHistogram[i];
+        interactionsHistogram[i] += other.interactionsHistogram[i];
+    }
+}
+
+/** Runs kernel for every particle of every galaxy. */
+template <typename Kernel>
+static void DispatchParticles(Universe& universe, const Kernel& kernel)
+{
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        auto& particles = galaxy.GetParticles();
+
+        ThreadPool().Dispatch([&](uint32_t i) 
+        { 
+            kernel(particles[i]);
+        }, static_cast<uint32_t>(particles.size()), static_cast<uint32_t>(particles.size() / ThreadPool::GetThreadCount()));
+    }
+}
+
+static float3 ComputeDirectAcceleration(const float3& position, const void* body, float softening, const Universe& universe, const SimulationParameters& parameters)
+{
+    float3 acceleration = {};
+
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        for (const auto& other : galaxy.GetParticles())
+        {
+            if (&other != body)
+            {
+                acceleration += GravityAcceleration(other.position - position, other.mass, softening);
+            }
+        }
 
-        for (auto &particle1 : galaxy1.GetParticles()) 
+        const float haloSoftening = (std::max)(softening, parameters.haloSoftening);
+        for (const auto& other : galaxy.GetHaloParticles())
         {
-            for (size_t jp = ip + 1; jp < galaxy1.GetParticles().size(); ++jp) 
+            if (&other != body)
             {
-                /*Particle& particle2 = galaxy1.GetParticles()[jp];
-                lpVec3 force = GravityAcceleration(particle2.position - particle1.position,  );
-                lpVec3 force = GravityAcceleration(particle2.position - particle1.position,  );
+                acceleration += GravityAcceleration(other.position - position, other.mass, haloSoftening);
+            }
+        }
+    }
 
-                particle1.acceleration += force;
-                particle2.acceleration -= force;*/
+    return acceleration;
+}
+
+static float ComputeDirectPotential(const float3& position, const void* body, float softening, const Universe& universe, const SimulationParameters& parameters)
+{
+    float potential = 0.0f;
+
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        for (const auto& other : galaxy.GetParticles())
+        {
+            if (&other != body)
+            {
+                float3 vec = other.position - position;
+                potential += GravityPotential(vec.norm(), other.mass, softening);
             }
+        }
 
-            /*for (size_t gj = ig + 1; gj < galaxies.size(); ++gj) {
-                for (auto &p2 : galaxies[gj].particles()) {
-                    auto force = p1.caclGravityForce(p2);
+        const float haloSoftening = (std::max)(softening, parameters.haloSoftening);
+        for (const auto& other : galaxy.GetHaloParticles())
+        {
+            if (&other != body)
+            {
+                float3 vec = other.position - position;
+                potential += GravityPotential(vec.norm(), other.mass, haloSoftening);
+            }
+        }
+    }
 
-                    p1.m_forceAccum += force;
-                    p2.m_forceAccum -= force;
+    return potential;
+}
+
+void BruteforceSolver::ComputeForces()
+{
+    Timer<std::milli> timer(&timings.solvingTimeMsecs);
+
+    const bool withPotential = IsDiagnosticsStep();
+
+    DispatchParticles(universe, [&](Particle& particle) 
+    { 
+        if (particle.movable)
+        {
+            particle.acceleration = ComputeDirectAcceleration(particle.position, &particle, parameters.softening, universe, parameters);
+            particle.force.clear();
+            if (withPotential)
+            {
+                particle.potential = ComputeDirectPotential(particle.position, &particle, parameters.softening, universe, parameters);
+            }
+        }
+    });
+
+    // Every particle interacts with all the others
+    walkStatistics = {};
+    if (parameters.countInteractions)
+    {
+        const uint64_t bodyCount = universe.GetParticlesCount() + universe.GetHaloParticlesCount();
+        for (auto& galaxy : universe.GetGalaxies())
+        {
+            for (const auto& particle : galaxy.GetParticles())
+            {
+                if (particle.movable)
+                {
+                    walkStatistics.Add(0, 0, static_cast<uint32_t>(bodyCount - 1));
                 }
-            }*/
-            ++ip;
+            }
         }
-        ++ig;
     }
 
+    ComputeExternalForces(universe, parameters, timings);
+}
+
+float3 BruteforceSolver::ComputeAcceleration(const float3& position, const void* body, float softening) const
+{
+    return ComputeDirectAcceleration(position, body, softening, universe, parameters);
+}
+
+void BruteforceSolver::Solve(float time)
+{
+    {
+        PROFILE_ZONE("ComputeForces");
+        ComputeForces();
+    }
+
+    if (IsDiagnosticsStep())
+    {
+        PROFILE_ZONE("Diagnostics");
+        StageDiagnostics([&](const float3& position, const void* body, float softening)
+        {
+            return ComputeDirectPotential(position, body, softening, universe, parameters);
+        }, diagnosticsStage);
+        ReduceDiagnostics(diagnosticsStage);
+    }
+
+    {
+        PROFILE_ZONE("Tracers");
+        Timer<std::milli> timer(&timings.tracersTimeMsecs);
+        MoveTracers(universe, parameters, time, [&](const float3& position)
+        {
+            return ComputeDirectAcceleration(position, nullptr, parameters.softening, universe, parameters);
+        });
+    }
+
+    if (IsHaloStep())
+    {
+        PROFILE_ZONE("HaloForces");
+        Timer<std::milli> timer(&timings.liveHaloTimeMsecs);
+        KickHaloParticles(universe, parameters, time, [&](const HaloParticle& particle)
+        {
+            return ComputeDirectAcceleration(particle.position, &particle, parameters.haloSoftening, universe, parameters);
+        });
+    }
+
+    PROFILE_ZONE("Integrate");
+    Timer<std::milli> timer(&timings.integrationTimeMsecs);
     for (auto& galaxy : universe.GetGalaxies())
     {
         for (auto& particle : galaxy.GetParticles())
         {
-            IntegrateMotionEquation(particle, time);
+            if (particle.movable)
+            {
+                IntegrateMotionEquation(particle, time);
+            }
         }
     }
+    DriftHaloParticles(universe, time);
+
+    ++stepCount;
 }
 
-static inline void ComputeForce(Particle& particle, const Galaxy& galaxy, const BarnesHutTree& tree)
+void BruteforceSolver::SolveForces()
 {
-    particle.acceleration.clear();
-    particle.acceleration = tree.ComputeAcceleration(particle, cSoftFactor);
-
-    particle.force.clear();
+    ComputeForces();
 
-    if (Application::GetInstance().GetSimulationParamaters().darkMatter)
-    {    
-        float darkMatterForce = galaxy.GetHalo().GetForce(particle.position.norm());
-        float3 forceDir = particle.position;
-        forceDir.normalize();
-        particle.force += forceDir * -darkMatterForce;
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        for (auto& particle : galaxy.GetParticles())
+        {
+            if (particle.movable)
+            {
+                particle.force += particle.acceleration * particle.mass;
+                particle.acceleration.clear();
+            }
+        }
     }
 }
 
+BarnesHutSolver::BarnesHutSolver(Universe& universe, const SimulationParameters& parameters, Timings& timings)
+    : Solver(universe, parameters, timings)
+    , barnesHutTree(std::make_unique<BarnesHutTree>(float3(-universe.GetSize() * 0.5f), universe.GetSize()))
+{
+    stepTasks.buildTree = stepGraph.AddTask("BuildTree", [this]() { BuildTree(); });
+    stepTasks.computeForces = stepGraph.AddTask("ComputeForces", [this]() { ComputeForces(); });
+    stepTasks.externalForces = stepGraph.AddTask("ExternalForces", [this]() { ComputeExternalForces(this->universe, this->parameters, this->timings); });
+    stepTasks.haloForces = stepGraph.AddTask("HaloForces", [this]() { KickHaloParticles(stepTime); });
+    stepTasks.tracers = stepGraph.AddTask("Tracers", [this]() { MoveTracers(stepTime); });
+    stepTasks.diagnostics = stepGraph.AddTask("Diagnostics", [this]() { CollectDiagnostics(); });
+    stepTasks.reduceDiagnostics = stepGraph.AddTask("ReduceDiagnostics", [this]() 
+    { 
+        ReduceDiagnostics(diagnosticsStages[TaskGraph::GetTaskStep() & 1]); 
+    }, TaskGraph::Affinity::Background);
+    stepTasks.integrate = stepGraph.AddTask("Integrate", [this]() { Integrate(stepTime); });
+
+    stepGraph.AddDependency(stepTasks.computeForces, stepTasks.buildTree);
+    stepGraph.AddDependency(stepTasks.externalForces, stepTasks.computeForces);
+    stepGraph.AddDependency(stepTasks.tracers, stepTasks.buildTree);
+    // Diagnostics see the velocities before any kick of the step
+    stepGraph.AddDependency(stepTasks.diagnostics, stepTasks.computeForces);
+    stepGraph.AddDependency(stepTasks.haloForces, stepTasks.diagnostics);
+    stepGraph.AddDependency(stepTasks.reduceDiagnostics, stepTasks.diagnostics);
+    stepGraph.AddDependency(stepTasks.integrate, stepTasks.externalForces);
+    stepGraph.AddDependency(stepTasks.integrate, stepTasks.haloForces);
+    stepGraph.AddDependency(stepTasks.integrate, stepTasks.tracers);
+}
+
+BarnesHutSolver::~BarnesHutSolver()
+{
+    stepGraph.Wait();
+}
+
 void BarnesHutSolver::Solve(float time)
 {
-    BuildTree();
+    stepTime = time;
+    stepGraph.Execute();
+    ++stepCount;
+}
 
-    Timer<std::milli> timer(&Application::GetInstance().GetTimings().solvingTimeMsecs);
-    // TODO: All galaxies
-    ThreadPool().Dispatch([&](uint32_t i) 
-    { 
-        assert(i >= 0 && i < universe.GetGalaxies().front().GetParticles().size());
+void BarnesHutSolver::ComputeForces()
+{
+    Timer<std::milli> timer(&timings.solvingTimeMsecs);
+
+    const bool withPotential = IsDiagnosticsStep();
+
+    walkStatistics = {};
+    if (!parameters.countInteractions)
+    {
+        DispatchParticles(universe, [&](Particle& particle) 
+        { 
+            if (particle.movable)
+            {
+                ComputeForce(particle, *barnesHutTree, parameters.softening, withPotential);
+            }
+        });
+        return;
+    }
+
+    // Counters of fixed blocks of particles are added up in block order after the dispatch
+    for (auto& galaxy : universe.GetGalaxies())
+    {
+        auto& particles = galaxy.GetParticles();
+        const uint32_t blockCount = static_cast<uint32_t>((particles.size() + cWalkStatisticsBlockSize - 1) / cWalkStatisticsBlockSize);
+        std::vector<WalkStatistics> blocks(blockCount);
+
+        ThreadPool().Dispatch([&](uint32_t block)
+        {
+            const size_t first = static_cast<size_t>(block) * cWalkStatisticsBlockSize;
+            const size_t end = (std::min)(first + cWalkStatisticsBlockSize, particles.size());
+
+            for (size_t i = first; i < end; ++i)
+            {
+                Particle& particle = particles[i];
+                if (particle.movable)
+                {
+                    WalkCounters counters;
+                    particle.acceleration = barnesHutTree->ComputeAcceleration(particle.position, &particle, parameters.softening, 
+                        withPotential ? &particle.potential : nullptr, &counters);
+                    particle.force.clear();
+                    blocks[block].Add(counters.nodes, counters.cells, counters.bodies);
+                }
+            }
+        }, blockCount, 1);
+
+        for (const auto& block : blocks)
+        {
+            walkStatistics.Add(block);
+        }
+    }
+}
+
+void BarnesHutSolver::CollectDiagnostics()
+{
+    if (!IsDiagnosticsStep())
+    {
+        return;
+    }
+
+    StageDiagnostics([&](const float3& position, const void* body, float softening)
+    {
+        float potential = 0.0f;
+        barnesHutTree->ComputeAcceleration(position, body, softening, potential);
+        return potential;
+    }, diagnosticsStages[TaskGraph::GetTaskStep() & 1]);
+}
+
+void BarnesHutSolver::KickHaloParticles(float time)
+{
+    if (!IsHaloStep())
+    {
+        return;
+    }
+
+    Timer<std::milli> timer(&timings.liveHaloTimeMsecs);
+    ::KickHaloParticles(universe, parameters, time, [&](const HaloParticle& particle)
+    {
+        return barnesHutTree->ComputeAcceleration(particle.position, &particle, parameters.haloSoftening);
+    });
+}
+
+void BarnesHutSolver::MoveTracers(float time)
+{
+    Timer<std::milli> timer(&timings.tracersTimeMsecs);
+    ::MoveTracers(universe, parameters, time, [&](const float3& position)
+    {
+        return barnesHutTree->ComputeAcceleration(position, nullptr, parameters.softening);
+    });
+}
 
-        Particle& particle = universe.GetGalaxies().front().GetParticles()[i];
+float3 BarnesHutSolver::ComputeAcceleration(const float3& position, const void* body, float softening) const
+{
+    return barnesHutTree->ComputeAcceleration(position, body, softening);
+}
 
+void BarnesHutSolver::Integrate(float time)
+{
+    Timer<std::milli> timer(&timings.integrationTimeMsecs);
+    // Positions change only after all forces are known, the tree refers to the particles
+    DispatchParticles(universe, [&](Particle& particle) 
+    { 
         if (particle.movable)
         {
-            ComputeForce(particle, universe.GetGalaxies().front(), *barnesHutTree);
             IntegrateMotionEquation(particle, time);
         }
-
-    }, static_cast<uint32_t>(universe.GetGalaxies().front().GetParticles().size()), 
-        static_cast<uint32_t>(universe.GetGalaxies().front().GetParticles().size() / ThreadPool::GetThreadCount()));
+    });
+    DriftHaloParticles(universe, time);
 }
 
 void BarnesHutSolver::SolveForces()
 {
     BuildTree();
-    ThreadPool().Dispatch([&](uint32_t i) 
-    { 
-        assert(i >= 0 && i < universe.GetGalaxies().front().GetParticles().size());
-
-        Particle& particle = universe.GetGalaxies().front().GetParticles()[i];
+    ComputeForces();
+    ComputeExternalForces(universe, parameters, timings);
 
+    DispatchParticles(universe, [&](Particle& particle) 
+    { 
         if (particle.movable)
         {
-            ComputeForce(particle, universe.GetGalaxies().front(), *barnesHutTree);
             particle.force += particle.acceleration * particle.mass;
             particle.acceleration.clear();
         }
-
-    }, static_cast<uint32_t>(universe.GetGalaxies().front().GetParticles().size()), 
-        static_cast<uint32_t>(universe.GetGalaxies().front().GetParticles().size() / ThreadPool::GetThreadCount()));
+    });
 }
 
 void BarnesHutSolver::Inititalize(float time)
 {
-    barnesHutTree = std::make_unique<BarnesHutTree>(float3(-universe.GetSize() * 0.5f), universe.GetSize());
-
     BuildTree();
+    ComputeForces();
+    ComputeExternalForces(universe, parameters, timings);
 
     float half = 0.5f * time;
 
-    ThreadPool().Dispatch([&](uint32_t i) 
+    DispatchParticles(universe, [&](Particle& particle) 
     { 
-        assert(i >= 0 && i < universe.GetGalaxies().front().GetParticles().size());
-
-        Particle& particle = universe.GetGalaxies().front().GetParticles()[i];
         if (particle.movable)
         {
-            ComputeForce(particle, universe.GetGalaxies().front(), *barnesHutTree);
             particle.acceleration.addScaled(particle.force, particle.inverseMass);
             // Half step by velocity
             particle.linearVelocity += particle.acceleration * half;
-            // Full step by position using half stepped velocity
-            particle.position += particle.linearVelocity * time;
         }
+    });
 
-    }, static_cast<uint32_t>(universe.GetGalaxies().front().GetParticles().size()), 
-        static_cast<uint32_t>(universe.GetGalaxies().front().GetParticles().size() / ThreadPool::GetThreadCount()));
+    // Full step by position using half stepped velocity, once the tree is no longer read
+    DispatchParticles(universe, [&](Particle& particle) 
+    { 
+        if (particle.movable)
+        {
+            particle.position += particle.linearVelocity * time;
+        }
+    });
 }
 
 void BarnesHutSolver::BuildTree()
 {
-    std::lock_guard<std::mutex> lock(mu);
+    Timer<std::milli> timer(&timings.buildTreeTimeMsecs);
+    barnesHutTree->SetAccuracy(parameters.treeAccuracy);
+    barnesHutTree->Reset();
+    for (auto& galaxy : universe.GetGalaxies())
     {
-        Timer<std::milli> timer(&Application::GetInstance().GetTimings().buildTreeTimeMsecs);
-        barnesHutTree->Reset();
-        for (auto& galaxy : universe.GetGalaxies())
+        for (const auto& particle : galaxy.GetParticles())
         {
-            for (const auto& particle : galaxy.GetParticles())
-            {
-                barnesHutTree->Insert(particle);
-            }
+            barnesHutTree->Insert(particle, parameters.softening);
+        }
+        for (const auto& particle : galaxy.GetHaloParticles())
+        {
+            barnesHutTree->Insert(particle.position, particle.mass, parameters.haloSoftening, &particle);
         }
     }
+    barnesHutTree->Pack();
 }
@@ -1,15 +1,141 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <memory>
-#include <mutex>
+#include <vector>
+
+#include "TaskGraph.h"
+#include "BarnesHutTree.h"
+#include "Constants.h"
+#include "float3.h"
 
 class Universe;
-class BarnesHutTree;
+
+struct SimulationParameters
+{
+    bool darkMatter = false;
+    // Softening length of the interactions of the stars and tracers, kpc
+    float softening = cDefaultSoftening;
+    // Softening of the interactions with live halo particles, kpc
+    float haloSoftening = 0.1f;
+    // Live halo particles get a kick every so many steps with the time of all of them
+    uint32_t haloStepInterval = 4;
+    // Diagnostics are computed every so many steps, 0 - never
+    uint32_t diagnosticsInterval = 0;
+    // Count the work of the tree walks of the particles, see WalkStatistics
+    bool countInteractions = false;
+    TreeAccuracy treeAccuracy;
+    // Sort the particles along a Morton curve, so that the tree walks of neighbors in memory share the nodes in cache
+    bool reorderParticles = true;
+    // Steps between the reorders, 0 - automatic, when the particles have mixed, see Simulation::Step
+    uint32_t reorderInterval = 0;
+};
+
+struct Timings
+{
+    float buildTreeTimeMsecs = 0.0f;
+    float solvingTimeMsecs = 0.0f;
+    float externalTimeMsecs = 0.0f;
+    float liveHaloTimeMsecs = 0.0f;
+    float tracersTimeMsecs = 0.0f;
+    float diagnosticsTimeMsecs = 0.0f;
+    float integrationTimeMsecs = 0.0f;
+    // Of the last step that checked the particle order, with the reorder if it took place
+    float reorderTimeMsecs = 0.0f;
+};
+
+/**
+    Work of the tree walks of the particles in one step, which doesn't depend on the hardware.
+    Histograms count particles by the binary order of magnitude of their per-walk numbers,
+    bin k holds the counts in [2^k - 1, 2^(k+1) - 1).
+*/
+struct WalkStatistics
+{
+    static constexpr uint32_t cHistogramBins = 24;
+
+    uint64_t walks = 0;
+    uint64_t nodes = 0;
+    uint64_t cells = 0;
+    uint64_t bodies = 0;
+    uint32_t maxInteractions = 0;
+
+    std::array<uint64_t, cHistogramBins> nodesHistogram = {};
+    // Interactions are with cells and with bodies
+    std::array<uint64_t, cHistogramBins> interactionsHistogram = {};
+
+    void Add(uint32_t walkNodes, uint32_t walkCells, uint32_t walkBodies);
+    void Add(const WalkStatistics& other);
+
+    uint64_t GetInteractions() const { return cells + bodies; }
+};
+
+/**
+    Conserved quantities of the particles and live halo particles at the start of a step, the
+    acceptance test for faster settings. Potential energies are those of the softened forces
+    from the same tree walk, momenta are about the origin. Immovable particles only contribute
+    to the potential energy.
+*/
+struct Diagnostics
+{
+    // Step at which the diagnostics were taken
+    uint64_t step = 0;
+    double kineticEnergy = 0.0;
+    // Mutual energy of the particles and live halo particles
+    double potentialEnergy = 0.0;
+    // Energy in the analytic halos
+    double externalEnergy = 0.0;
+    float3 linearMomentum;
+    float3 angularMomentum;
+
+    double GetTotalEnergy() const { return kineticEnergy + potentialEnergy + externalEnergy; }
+    /** 2K / |W|, 1 in virial equilibrium. */
+    double GetVirialRatio() const 
+    { 
+        const double potential = std::abs(potentialEnergy + externalEnergy);
+        return potential > 0.0 ? 2.0 * kineticEnergy / potential : 0.0; 
+    }
+};
+
+/** Partial sums of diagnostics of one block of bodies, in double as energies of many bodies nearly cancel. */
+struct DiagnosticsSums
+{
+    double kineticEnergy = 0.0;
+    double potentialEnergy = 0.0;
+    double externalEnergy = 0.0;
+    double3 linearMomentum;
+    double3 angularMomentum;
+
+    void AddMotion(const float3& position, const float3& velocity, float mass)
+    {
+        const double3 momentum = double3(velocity) * static_cast<double>(mass);
+
+        kineticEnergy += 0.5 * momentum.dot(double3(velocity));
+        linearMomentum += momentum;
+        angularMomentum += double3(position) % momentum;
+    }
+};
+
+/**
+    Block sums of a diagnostics step, added up while the next step runs. Blocks start anew at
+    the particles and at the live halo particles of every galaxy.
+*/
+struct DiagnosticsStage
+{
+    bool pending = false;
+    uint64_t step = 0;
+
+    std::vector<DiagnosticsSums> blockSums;
+};
 
 class Solver {
 public:
-    Solver(Universe& universe) 
+    Solver(Universe& universe, const SimulationParameters& parameters, Timings& timings) 
         : universe(universe)
+        , parameters(parameters)
+        , timings(timings)
     {
     }
 
@@ -19,39 +145,129 @@ public:
     virtual void SolveForces() { }
     virtual void Inititalize(float time) { }
 
+    /** Steps done so far, decides which steps kick live halos. */
+    void SetStepCount(uint64_t count) { stepCount = count; }
+
+    /** Waits until the background phases of the steps done so far have completed. */
+    virtual void Synchronize() { }
+
+    /**
+        Acceleration by the particles at a point, body is excluded from the sources. Valid between
+        steps, the Barnes-Hut tree is that of the last step.
+    */
+    virtual float3 ComputeAcceleration(const float3& position, const void* body, float softening) const = 0;
+    /** Acceleration of a tracer at a point: the particles and the analytic halos. */
+    float3 ComputeFieldAcceleration(const float3& position) const;
+
+    /**
+        Diagnostics of the last diagnostics step, see SimulationParameters::diagnosticsInterval.
+        Waits for their reduction, which may run in the background.
+    */
+    const Diagnostics& GetDiagnostics() 
+    { 
+        Synchronize();
+        return diagnostics; 
+    }
+    /** Whether diagnostics were taken by the last step. */
+    bool HasNewDiagnostics() const { return hasDiagnostics && diagnosticsStep + 1 == stepCount; }
+
+    /** Tree walk work of the last step, empty unless SimulationParameters::countInteractions is set. */
+    const WalkStatistics& GetWalkStatistics() const { return walkStatistics; }
+
 protected:
+    /** Whether live halos get a kick in the current step. */
+    bool IsHaloStep() const { return stepCount % (std::max)(parameters.haloStepInterval, 1u) == 0; }
+    /** Whether the current step computes potentials and diagnostics. */
+    bool IsDiagnosticsStep() const { return parameters.diagnosticsInterval > 0 && stepCount % parameters.diagnosticsInterval == 0; }
+
+    /**
+        Sums the bodies of the current step in blocks over ThreadPool once the particle potentials
+        are known. potential(position, body, softening) gives the potential at the other bodies.
+    */
+    template <typename Potential>
+    void StageDiagnostics(const Potential& potential, DiagnosticsStage& stage);
+    /** Adds up the block sums of a staged step on the calling thread, does nothing unless one is pending. */
+    void ReduceDiagnostics(DiagnosticsStage& stage);
+
     Universe& universe;
+    const SimulationParameters& parameters;
+    Timings& timings;
+
+    uint64_t stepCount = 0;
+
+    Diagnostics diagnostics;
+    // Set when the bodies are staged, the reduction may still be running
+    bool hasDiagnostics = false;
+    uint64_t diagnosticsStep = 0;
+
+    WalkStatistics walkStatistics;
 };
 
 class BruteforceSolver : public Solver {
 public:
-    BruteforceSolver(Universe& universe) 
-        : Solver(universe)
+    BruteforceSolver(Universe& universe, const SimulationParameters& parameters, Timings& timings) 
+        : Solver(universe, parameters, timings)
     {
     }
 
     void Solve(float time) override;
+    void SolveForces() override;
+    float3 ComputeAcceleration(const float3& position, const void* body, float softening) const override;
+
+private:
+    void ComputeForces();
+
+    DiagnosticsStage diagnosticsStage;
 };
 
 class BarnesHutSolver : public Solver
 {
 public:
-    BarnesHutSolver(Universe& universe) 
-        : Solver(universe)
+    /** Tasks of one step in the step graph. */
+    struct StepTasks
     {
-    }
+        TaskGraph::TaskId buildTree;
+        TaskGraph::TaskId computeForces;
+        TaskGraph::TaskId externalForces;
+        TaskGraph::TaskId haloForces;
+        TaskGraph::TaskId tracers;
+        // Stages the bodies, the reduction runs in the background
+        TaskGraph::TaskId diagnostics;
+        TaskGraph::TaskId reduceDiagnostics;
+        TaskGraph::TaskId integrate;
+    };
+
+    BarnesHutSolver(Universe& universe, const SimulationParameters& parameters, Timings& timings);
+    ~BarnesHutSolver();
 
     void Solve(float time) override;
     void SolveForces() override;
+    void Synchronize() override { stepGraph.Wait(); }
+    float3 ComputeAcceleration(const float3& position, const void* body, float softening) const override;
 
+    /** Tree of the current step. Valid only on the solver thread, e.g. inside step graph tasks. */
     const BarnesHutTree& GetBarnesHutTree() const { return *barnesHutTree; }
-    std::mutex& GetTreeMutex() { return mu; }
+
+    /** Graph executed by Solve. Additional phases can be attached to the step tasks. */
+    TaskGraph& GetStepGraph() { return stepGraph; }
+    const StepTasks& GetStepTasks() const { return stepTasks; }
 
     void Inititalize(float time) override;
 
 private:
     void BuildTree();
+    void ComputeForces();
+    void KickHaloParticles(float time);
+    void MoveTracers(float time);
+    void CollectDiagnostics();
+    void Integrate(float time);
 
     std::unique_ptr<BarnesHutTree> barnesHutTree;
-    std::mutex mu;
+
+    // By step parity, see TaskGraph
+    DiagnosticsStage diagnosticsStages[2];
+
+    TaskGraph stepGraph;
+    StepTasks stepTasks;
+    float stepTime = 0.0f;
 };
\ No newline at end of file